@@ -1,5 +1,6 @@
 local function setup(shlib_name)
     local ffi = require "ffi"
+    local bit = require "bit"
     local C = ffi.C
     local S = ffi.load(shlib_name)
 
@@ -43,85 +44,112 @@ local function setup(shlib_name)
     local MPS_SHDICT_TBOOLEAN = 1
     local MPS_SHDICT_TNUMBER = 3
     local MPS_SHDICT_TSTRING = 4
+    local MPS_SHDICT_TINT64 = 6
 
     ffi.cdef[[
         void free(void *ptr);
 
-        typedef struct pthread_mutex_t {
-            union {
-                char __size[40];
-                long int __align;
-            };
-        } pthread_mutex_t;
-
         typedef int       mps_err_t;
         typedef uintptr_t mps_ptroff_t;
-        typedef int ngx_int_t;
-        typedef unsigned int ngx_uint_t;
+        typedef intptr_t ngx_int_t;
+        typedef uintptr_t ngx_uint_t;
         typedef uint64_t size_t;
         typedef unsigned char u_char;
         typedef unsigned int mode_t;
 
-        typedef struct mps_slab_page_s  mps_slab_page_t;
+        /* only used through pointers, so the fields are not declared */
+        typedef struct mps_slab_pool_s mps_slab_pool_t;
 
-        struct mps_slab_page_s {
-            uintptr_t         slab;
-            mps_ptroff_t      next;
-            mps_ptroff_t      prev;
-        };
+        typedef struct {
+            size_t      len;
+            u_char     *data;
+        } ngx_str_t;
+            
+        typedef struct {
+            mps_slab_pool_t  *pool;
+            ngx_str_t         name;
+        } mps_shdict_t;
 
-        typedef unsigned long               ngx_atomic_uint_t;
-        typedef volatile ngx_atomic_uint_t  ngx_atomic_t;
+        typedef struct {
+            size_t            min_shift;
+            ngx_uint_t        flags;
+            ngx_uint_t        shards;
+            ngx_uint_t        size_classes;
+            size_t            max_size;
+        } mps_shdict_opts_t;
 
         typedef struct {
-            ngx_atomic_t   lock;
-            ngx_atomic_t   wait;
-        } ngx_shmtx_sh_t;
+            ngx_uint_t        acquires;
+            ngx_uint_t        contended;
+
+            ngx_uint_t        wait_total;
+            ngx_uint_t        wait_max;
+            ngx_uint_t        hold_total;
+            ngx_uint_t        hold_max;
+
+            ngx_uint_t        wait_hist[32];
+            ngx_uint_t        hold_hist[32];
+        } mps_slab_lock_stat_t;
 
         typedef struct {
             ngx_uint_t        total;
             ngx_uint_t        used;
-        
+
             ngx_uint_t        reqs;
             ngx_uint_t        fails;
         } mps_slab_stat_t;
-        
+
         typedef struct {
-            pthread_mutex_t   mutex;
-            mps_ptroff_t      data;
-        
-            size_t            min_size;
-            size_t            min_shift;
-        
-            mps_ptroff_t      pages;
-            mps_ptroff_t      last;
-            mps_slab_page_t   free;
-        
-            mps_ptroff_t      stats;
-            ngx_uint_t        pfree;
-        
-            mps_ptroff_t      start;
-            mps_ptroff_t      end;
-        
-            u_char           *log_ctx;
-            u_char            zero;
-        
-            unsigned          log_nomem:1;
-        } mps_slab_pool_t;    
+            size_t            size;
+            mps_slab_stat_t   stat;
+        } mps_slab_slot_stat_t;
 
         typedef struct {
-            size_t      len;
-            u_char     *data;
-        } ngx_str_t;
-            
+            ngx_uint_t        pages;
+            ngx_uint_t        free_pages;
+            ngx_uint_t        max_free_run;
+            ngx_uint_t        nslots;
+        } mps_slab_pool_stat_t;
+
         typedef struct {
-            mps_slab_pool_t  *pool;
-            ngx_str_t         name;
-        } mps_shdict_t;
+            int               value_type;
+            int               user_flags;
+            double            num_value;
+            u_char           *str_value;
+            size_t            str_value_len;
+        } mps_shdict_mget_result_t;
+
+        typedef struct {
+            const u_char     *key;
+            size_t            key_len;
+            int               value_type;
+            const u_char     *str_value_buf;
+            size_t            str_value_len;
+            double            num_value;
+            long              exptime;
+            int               user_flags;
+            int               rc;
+            char             *err;
+            int               forcible;
+        } mps_shdict_mset_item_t;
+
+        typedef struct {
+            ngx_uint_t        shard;
+            uint64_t          next;
+            uint32_t          gen;
+        } mps_shdict_scan_cursor_t;
+
+        typedef struct {
+            u_char           *key;
+            size_t            key_len;
+        } mps_shdict_scan_key_t;
 
         mps_shdict_t *mps_shdict_open_or_create(const char *pathname,
             size_t shm_size, size_t min_shift, mode_t mode);
 
+        mps_shdict_t *mps_shdict_open_or_create_opts(const char *pathname,
+            size_t shm_size, mode_t mode, const mps_shdict_opts_t *opts);
+
         void mps_shdict_close(mps_shdict_t *dict);
 
         int mps_shdict_store(mps_shdict_t *dict, int op, const u_char *key,
@@ -135,12 +163,60 @@ local function setup(shlib_name)
             size_t *str_value_len, double *num_value, int *user_flags,
             int get_stale, int *is_stale, char **errmsg);
 
+        int mps_shdict_get_versioned(mps_shdict_t *dict, const u_char *key,
+            size_t key_len, int *value_type, u_char **str_value_buf,
+            size_t *str_value_len, double *num_value, int *user_flags,
+            int get_stale, int *is_stale, uint64_t *version, char **errmsg);
+
+        int mps_shdict_get_if_modified(mps_shdict_t *dict, const u_char *key,
+            size_t key_len, int *value_type, u_char **str_value_buf,
+            size_t *str_value_len, double *num_value, int *user_flags,
+            int get_stale, int *is_stale, uint64_t *version, char **errmsg);
+
+        int mps_shdict_cas(mps_shdict_t *dict, const u_char *key,
+            size_t key_len, uint64_t *version, int value_type,
+            const u_char *str_value_buf, size_t str_value_len,
+            double num_value, long exptime, int user_flags,
+            char **errmsg, int *forcible);
+
+        int mps_shdict_mget(mps_shdict_t *dict, const u_char **keys,
+            const size_t *key_lens, ngx_uint_t n,
+            mps_shdict_mget_result_t *results, u_char *arena,
+            size_t arena_size);
+
+        int mps_shdict_flush_expired(mps_shdict_t *dict, ngx_uint_t max_count);
+
+        int mps_shdict_sweep(mps_shdict_t *dict,
+            mps_shdict_scan_cursor_t *cursor, ngx_uint_t max_count,
+            ngx_uint_t *freed);
+
+        int mps_shdict_compact(mps_shdict_t *dict,
+            mps_shdict_scan_cursor_t *cursor, ngx_uint_t max_count,
+            ngx_uint_t *moved);
+
+        int mps_shdict_mset(mps_shdict_t *dict, mps_shdict_mset_item_t *items,
+            ngx_uint_t n);
+
+        int mps_shdict_mdelete(mps_shdict_t *dict,
+            mps_shdict_mset_item_t *items, ngx_uint_t n);
+
         int mps_shdict_incr(mps_shdict_t *dict, const u_char *key,
             size_t key_len, double *value, char **err, int has_init, double init,
             long init_ttl, int *forcible);
 
+        int mps_shdict_incr_int64(mps_shdict_t *dict, const u_char *key,
+            size_t key_len, int64_t *value, char **err, int has_init,
+            int64_t init, long init_ttl, int *forcible);
+
         int mps_shdict_flush_all(mps_shdict_t *dict);
 
+        uint64_t mps_shdict_version(mps_shdict_t *dict);
+
+        int mps_shdict_scan(mps_shdict_t *dict,
+            mps_shdict_scan_cursor_t *cursor, mps_shdict_scan_key_t *keys,
+            ngx_uint_t max_count, ngx_uint_t *n, u_char *arena,
+            size_t arena_size);
+
         long mps_shdict_get_ttl(mps_shdict_t *dict, const u_char *key,
             size_t key_len);
 
@@ -166,9 +242,23 @@ local function setup(shlib_name)
         int mps_shdict_llen(mps_shdict_t *dict, const u_char *key, size_t key_len,
             char **errmsg);
 
+        int mps_shdict_migrate_start(mps_shdict_t *dict, const char *pathname,
+            size_t shm_size, mode_t mode, const mps_shdict_opts_t *opts);
+
+        int mps_shdict_migrate_step(mps_shdict_t *dict, ngx_uint_t n);
+
         size_t mps_shdict_capacity(mps_shdict_t *dict);
 
+        int mps_shdict_grow(mps_shdict_t *dict, size_t size);
+
         size_t mps_shdict_free_space(mps_shdict_t *dict);
+
+        int mps_shdict_lock_stats(mps_shdict_t *dict,
+            mps_slab_lock_stat_t *stats);
+
+        int mps_shdict_slab_stats(mps_shdict_t *dict,
+            mps_slab_pool_stat_t *stats, mps_slab_slot_stat_t *slots,
+            ngx_uint_t n);
     ]]
 
     local value_type = ffi.new("int[1]")
@@ -178,6 +268,9 @@ local function setup(shlib_name)
     local forcible = ffi.new("int[1]")
     local str_value_buf = ffi.new("unsigned char *[1]")
     local errmsg = ffi.new("char *[1]")
+    local int64_value = ffi.new("int64_t[1]")
+    local version_value = ffi.new("uint64_t[1]")
+    local int64_ct = ffi.typeof("int64_t")
 
     local function validate_key(key)
         if key == nil then
@@ -199,7 +292,9 @@ local function setup(shlib_name)
         return nil
     end
 
-    local function shdict_store(dict, op, key, value, exptime, flags)
+    -- Sets version_value to the new or the current version if version is
+    -- not nil, which is 0 for a missing key.
+    local function shdict_store(dict, op, key, value, exptime, flags, version)
         if not exptime then
             exptime = 0
         elseif exptime < 0 then
@@ -241,15 +336,30 @@ local function setup(shlib_name)
             valtyp = MPS_SHDICT_TBOOLEAN
             num_val = value and 1 or 0
 
+        elseif ffi.istype(int64_ct, value) then
+            valtyp = MPS_SHDICT_TINT64
+            int64_value[0] = value
+            str_val_buf = ffi.cast("const unsigned char *", int64_value)
+            str_val_len = 8
+
         else
             return nil, "bad value type"
         end
 
-        local rc = S.mps_shdict_store(dict, op, key, key_len,
+        local rc
+        if version ~= nil then
+            version_value[0] = version
+            rc = S.mps_shdict_cas(dict, key, key_len, version_value,
+                                  valtyp, str_val_buf, str_val_len,
+                                  num_val, exptime * 1000, flags,
+                                  errmsg, forcible)
+        else
+            rc = S.mps_shdict_store(dict, op, key, key_len,
                                     valtyp, str_val_buf,
                                     str_val_len, num_val,
                                     exptime * 1000, flags, errmsg,
                                     forcible)
+        end
 
         -- print("rc == ", rc)
 
@@ -257,6 +367,10 @@ local function setup(shlib_name)
             return true, nil, forcible[0] == 1
         end
 
+        if rc == NGX_DECLINED and version ~= nil then
+            return false, "version mismatch", false
+        end
+
         -- NGX_DECLINED or NGX_ERROR
         return false, ffi.string(errmsg[0]), forcible[0] == 1
     end
@@ -353,10 +467,103 @@ local function setup(shlib_name)
         return val
     end
 
+    local MPS_SLAB_DEFAULT_MIN_SHIFT = 3
+
+    local MPS_SHDICT_FLAG_LOCKFREE_GET = 0x0001
+    local MPS_SHDICT_FLAG_HASH_INDEX = 0x0002
+    local MPS_SHDICT_FLAG_LOCK_STATS = 0x0004
+    local MPS_SHDICT_FLAG_FUTEX_LOCK = 0x0008
+    local MPS_SHDICT_FLAG_ATOMIC_INCR = 0x0010
+    local MPS_SHDICT_FLAG_EXPIRY_INDEX = 0x0020
+    local MPS_SHDICT_FLAG_EXPIRY_WHEEL = 0x0040
+    local MPS_SHDICT_FLAG_FLUSH_GEN = 0x0080
+    local MPS_SHDICT_FLAG_ADMISSION = 0x0800
+
+    local eviction_flags = {
+        lru = 0,
+        clock = 0x0100,
+        sieve = 0x0200,
+        s3fifo = 0x0400,
+    }
+
+    -- opts is used only when the dict is created, and may have the
+    -- following fields:
+    --   min_shift: the slab min shift (default 3).
+    --   lockfree_get: get does not take the lock if true.
+    --   hash_index: index keys by a hash table instead of a rbtree if true.
+    --   shards: the count of independently locked sub-pools (default 1).
+    --   lock_stats: measure lock wait and hold times if true.
+    --   futex_lock: spin on the pool mutex before sleeping in its futex
+    --               wait if true.
+    --   atomic_incr: incr updates an existing number without the lock if true.
+    --   expiry_index: free expired entries in the order of deadlines if true.
+    --   expiry_wheel: same as expiry_index with a timing wheel if true.
+    --   flush_gen: flush_all does not walk the entries, which are freed
+    --              lazily, if true.
+    --   eviction: the policy which chooses entries to free when the dict is
+    --             full, "lru" (default), "clock", "sieve" or "s3fifo".
+    --   admission: a set which must free entries by force fails with
+    --              "not admitted" if its key is read or set less often
+    --              than the entry to be freed, if true.
+    --   size_classes: the growth factor in percent of slab size classes used
+    --                 instead of powers of two, e.g. 125 (default 0, none).
+    --   max_size: the size up to which dict:grow can grow a dict without
+    --             shards (default 0, no growth). Unlike other fields, it is
+    --             used when the dict is opened too and must be the same in
+    --             every process.
+    local function new_c_opts(opts)
+        local c_opts = ffi.new("mps_shdict_opts_t")
+        c_opts.min_shift = opts.min_shift or MPS_SLAB_DEFAULT_MIN_SHIFT
+
+        local flags = 0
+        if opts.lockfree_get then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_LOCKFREE_GET)
+        end
+        if opts.hash_index then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_HASH_INDEX)
+        end
+        if opts.lock_stats then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_LOCK_STATS)
+        end
+        if opts.futex_lock then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_FUTEX_LOCK)
+        end
+        if opts.atomic_incr then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_ATOMIC_INCR)
+        end
+        if opts.expiry_index then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_EXPIRY_INDEX)
+        end
+        if opts.expiry_wheel then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_EXPIRY_WHEEL)
+        end
+        if opts.flush_gen then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_FLUSH_GEN)
+        end
+        if opts.admission then
+            flags = bit.bor(flags, MPS_SHDICT_FLAG_ADMISSION)
+        end
+        if opts.eviction then
+            local f = eviction_flags[opts.eviction]
+            if not f then
+                error("unknown eviction policy: " .. tostring(opts.eviction))
+            end
+            flags = bit.bor(flags, f)
+        end
+        c_opts.flags = flags
+        c_opts.shards = opts.shards or 1
+        c_opts.size_classes = opts.size_classes or 0
+        c_opts.max_size = opts.max_size or 0
+
+        return c_opts
+    end
+
     local metatable = {}
     metatable.__index = metatable
 
-    function metatable:get(key)
+    -- Sets version_value to the version of the value if version is not nil.
+    -- Returns nil and "not modified" if the version is still version.
+    local function shdict_get(dict, key, version)
         local err = validate_key(key)
         if err ~= nil then
             return nil, err
@@ -369,10 +576,23 @@ local function setup(shlib_name)
         local value_len = get_size_ptr()
         value_len[0] = size
 
-        local rc = S.mps_shdict_get(self, key, key_len, value_type,
-                                    str_value_buf, value_len,
-                                    num_value, user_flags, 0,
-                                    is_stale, errmsg)
+        local rc
+        if version ~= nil then
+            version_value[0] = version
+            rc = S.mps_shdict_get_if_modified(dict, key, key_len, value_type,
+                                              str_value_buf, value_len,
+                                              num_value, user_flags, 0,
+                                              is_stale, version_value,
+                                              errmsg)
+            if rc == NGX_DECLINED then
+                return nil, "not modified"
+            end
+        else
+            rc = S.mps_shdict_get(dict, key, key_len, value_type,
+                                  str_value_buf, value_len,
+                                  num_value, user_flags, 0,
+                                  is_stale, errmsg)
+        end
         if rc ~= NGX_OK then
             if errmsg[0] ~= nil then
                 return nil, ffi.string(errmsg[0])
@@ -407,6 +627,13 @@ local function setup(shlib_name)
         elseif typ == MPS_SHDICT_TBOOLEAN then
             val = (tonumber(buf[0]) ~= 0)
 
+        elseif typ == MPS_SHDICT_TINT64 then
+            -- returned as int64 cdata to keep all 64 bits
+            val = ffi.cast("int64_t *", str_value_buf[0])[0]
+            if str_value_buf[0] ~= buf then
+                C.free(str_value_buf[0])
+            end
+
         else
             error("unknown value type: " .. typ)
         end
@@ -418,6 +645,200 @@ local function setup(shlib_name)
         return val
     end
 
+    function metatable:get(key)
+        return shdict_get(self, key, nil)
+    end
+
+    -- Returns the value, its user flags and its version for cas. The version
+    -- is a uint64_t cdata, which compares by value with == but not as a
+    -- table key, and the version of a missing key is 0.
+    function metatable:get_version(key)
+        return self:get_if_modified(key, 0)
+    end
+
+    -- Same as get_version, but returns nil and "not modified" without
+    -- copying the value if its version is still version.
+    function metatable:get_if_modified(key, version)
+        local val, flags = shdict_get(self, key, version or 0)
+        if val == nil and flags ~= nil then
+            return nil, flags
+        end
+
+        return val, flags, version_value[0]
+    end
+
+    local mget_keys_type = ffi.typeof("const unsigned char *[?]")
+    local mget_lens_type = ffi.typeof("size_t[?]")
+    local mget_results_type = ffi.typeof("mps_shdict_mget_result_t[?]")
+
+    -- Returns a table of the values of the keys at the same indexes, and a
+    -- table of their user flags. A value which did not fit in the string
+    -- buffer is got again by get.
+    function metatable:mget(keys)
+        local n = #keys
+        local c_keys = ffi.new(mget_keys_type, n)
+        local key_lens = ffi.new(mget_lens_type, n)
+        local results = ffi.new(mget_results_type, n)
+
+        for i = 1, n do
+            local key = keys[i]
+            local err = validate_key(key)
+            if err ~= nil then
+                return nil, err
+            end
+            c_keys[i - 1] = key
+            key_lens[i - 1] = #key
+        end
+
+        local size = get_string_buf_size()
+        local buf = get_string_buf(size)
+
+        S.mps_shdict_mget(self, c_keys, key_lens, n, results, buf, size)
+
+        local vals = {}
+        local flags = {}
+
+        for i = 1, n do
+            local res = results[i - 1]
+            local typ = res.value_type
+
+            if typ == MPS_SHDICT_TSTRING then
+                if res.str_value ~= nil then
+                    vals[i] = ffi.string(res.str_value, res.str_value_len)
+                else
+                    vals[i] = self:get(keys[i])
+                end
+
+            elseif typ == MPS_SHDICT_TNUMBER then
+                vals[i] = tonumber(res.num_value)
+
+            elseif typ == MPS_SHDICT_TBOOLEAN then
+                vals[i] = res.num_value ~= 0
+
+            elseif typ == MPS_SHDICT_TINT64 then
+                if res.str_value ~= nil then
+                    vals[i] = ffi.cast("int64_t *", res.str_value)[0]
+                else
+                    vals[i] = self:get(keys[i])
+                end
+
+            elseif typ ~= MPS_SHDICT_TNIL then
+                return nil, "value is a list"
+            end
+
+            if res.user_flags ~= 0 then
+                flags[i] = tonumber(res.user_flags)
+            end
+        end
+
+        return vals, flags
+    end
+
+    local mset_items_type = ffi.typeof("mps_shdict_mset_item_t[?]")
+    local mset_int64s_type = ffi.typeof("int64_t[?]")
+
+    -- Sets the values of the keys in tbl in one lock hold per shard. Returns
+    -- true, or false and a table of the error messages by keys which failed.
+    -- The third value is true if valid items were removed forcibly.
+    function metatable:mset(tbl, exptime)
+        if not exptime then
+            exptime = 0
+        elseif exptime < 0 then
+            error('bad "exptime" argument', 2)
+        end
+
+        local n = 0
+        for _ in pairs(tbl) do
+            n = n + 1
+        end
+
+        local items = ffi.new(mset_items_type, n)
+        local int64s = ffi.new(mset_int64s_type, n)
+        local keys = {}
+        local i = 0
+
+        for key, value in pairs(tbl) do
+            local err = validate_key(key)
+            if err ~= nil then
+                return nil, err
+            end
+
+            local item = items[i]
+            item.key = key
+            item.key_len = #key
+            item.exptime = exptime * 1000
+
+            local valtyp_str = type(value)
+            if valtyp_str == "string" then
+                item.value_type = MPS_SHDICT_TSTRING
+                item.str_value_buf = value
+                item.str_value_len = #value
+
+            elseif valtyp_str == "number" then
+                item.value_type = MPS_SHDICT_TNUMBER
+                item.num_value = value
+
+            elseif valtyp_str == "boolean" then
+                item.value_type = MPS_SHDICT_TBOOLEAN
+                item.num_value = value and 1 or 0
+
+            elseif ffi.istype(int64_ct, value) then
+                item.value_type = MPS_SHDICT_TINT64
+                int64s[i] = value
+                item.str_value_buf = ffi.cast("const unsigned char *",
+                                              int64s + i)
+                item.str_value_len = 8
+
+            else
+                return nil, "bad value type"
+            end
+
+            keys[i] = key
+            i = i + 1
+        end
+
+        local rc = S.mps_shdict_mset(self, items, n)
+
+        local forced = false
+        local errs
+        for j = 0, n - 1 do
+            local item = items[j]
+            if item.forcible == 1 then
+                forced = true
+            end
+            if item.rc ~= NGX_OK then
+                errs = errs or {}
+                errs[keys[j]] = ffi.string(item.err)
+            end
+        end
+
+        if rc == NGX_OK then
+            return true, nil, forced
+        end
+
+        return false, errs, forced
+    end
+
+    -- Deletes the keys in one lock hold per shard.
+    function metatable:mdelete(keys)
+        local n = #keys
+        local items = ffi.new(mset_items_type, n)
+
+        for i = 1, n do
+            local key = keys[i]
+            local err = validate_key(key)
+            if err ~= nil then
+                return nil, err
+            end
+            items[i - 1].key = key
+            items[i - 1].key_len = #key
+        end
+
+        S.mps_shdict_mdelete(self, items, n)
+
+        return true
+    end
+
     function metatable:close()
         S.mps_shdict_close(self)
     end
@@ -446,6 +867,19 @@ local function setup(shlib_name)
         return self:set(key, nil)
     end
 
+    -- Sets the value only if its version is still version, or deletes the
+    -- key if value is nil. Returns the new version, or the current one with
+    -- the "version mismatch" error, as a cdata like get_version.
+    function metatable:cas(key, version, value, exptime, flags)
+        local ok, err, forcible = shdict_store(self, 0, key, value, exptime,
+                                               flags, version or 0)
+        if ok == nil then
+            return nil, err
+        end
+
+        return ok, err, forcible, version_value[0]
+    end
+
     function metatable:incr(key, value, init, init_ttl)
         local err = validate_key(key)
         if err ~= nil then
@@ -453,6 +887,10 @@ local function setup(shlib_name)
         end
         local key_len = #key
 
+        if ffi.istype(int64_ct, value) or ffi.istype(int64_ct, init) then
+            return self:incr_int64(key, value, init, init_ttl)
+        end
+
         if type(value) ~= "number" then
             value = tonumber(value)
         end
@@ -506,10 +944,146 @@ local function setup(shlib_name)
         return tonumber(num_value[0]), nil, forcible[0] == 1
     end
 
+    -- Same as incr but adds exactly as int64 and returns int64 cdata. It is
+    -- also used by incr when value or init is int64 cdata.
+    function metatable:incr_int64(key, value, init, init_ttl)
+        local err = validate_key(key)
+        if err ~= nil then
+            return nil, err
+        end
+        local key_len = #key
+
+        int64_value[0] = value
+
+        if init_ttl ~= nil then
+            if type(init_ttl) ~= "number" then
+                init_ttl = tonumber(init_ttl)
+            end
+
+            if not init_ttl or init_ttl < 0 then
+                error('bad "init_ttl" argument', 2)
+            end
+
+            if not init then
+                error('must provide "init" when providing "init_ttl"', 2)
+            end
+
+        else
+            init_ttl = 0
+        end
+
+        local rc = S.mps_shdict_incr_int64(self, key, key_len, int64_value,
+                                    errmsg, init and 1 or 0,
+                                    init or 0, init_ttl * 1000,
+                                    forcible)
+        if rc ~= 0 then  -- ~= NGX_OK
+            return nil, ffi.string(errmsg[0])
+        end
+
+        if not init then
+            return int64_value[0]
+        end
+
+        return int64_value[0], nil, forcible[0] == 1
+    end
+
     function metatable:flush_all()
         S.mps_shdict_flush_all(self)
     end
 
+    local scan_keys_type = ffi.typeof("mps_shdict_scan_key_t[?]")
+
+    -- Returns an iterator of the keys, which are got up to batch ones at a
+    -- time without holding the lock between batches. A key may be returned
+    -- more than once.
+    function metatable:scan(batch)
+        batch = batch or 100
+        if batch < 1 then
+            error('bad "batch" argument', 2)
+        end
+
+        local cursor = ffi.new("mps_shdict_scan_cursor_t")
+        local keys = ffi.new(scan_keys_type, batch)
+        local n_ptr = ffi.new("ngx_uint_t[1]")
+        local size = get_string_buf_size()
+        local buf = get_string_buf(size, true)
+        local i, n = 0, 0
+        local done = false
+
+        return function()
+            while i == n do
+                if done then
+                    return nil
+                end
+
+                local rc = S.mps_shdict_scan(self, cursor, keys, batch, n_ptr,
+                                             buf, size)
+                if rc == NGX_OK then
+                    done = true
+
+                elseif rc == NGX_DECLINED then
+                    -- a key is at most 65535 bytes
+                    size = 65536
+                    buf = get_string_buf(size, true)
+                end
+
+                i = 0
+                n = tonumber(n_ptr[0])
+            end
+
+            local key = keys[i]
+            i = i + 1
+            return ffi.string(key.key, key.key_len)
+        end
+    end
+
+    function metatable:flush_expired(max_count)
+        max_count = max_count or 0
+        if max_count < 0 then
+            error('bad "max_count" argument', 2)
+        end
+
+        return tonumber(S.mps_shdict_flush_expired(self, max_count))
+    end
+
+    -- Returns a function which frees up to max_count expired entries of one
+    -- shard per call, and returns the count freed and whether a pass over
+    -- all the shards is done. It is meant to be run periodically by one
+    -- process, e.g. from ngx.timer.every in the privileged agent.
+    function metatable:sweeper(max_count)
+        max_count = max_count or 64
+        if max_count < 1 then
+            error('bad "max_count" argument', 2)
+        end
+
+        local cursor = ffi.new("mps_shdict_scan_cursor_t")
+        local freed_ptr = ffi.new("ngx_uint_t[1]")
+
+        return function()
+            local rc = S.mps_shdict_sweep(self, cursor, max_count, freed_ptr)
+            return tonumber(freed_ptr[0]), rc == NGX_OK
+        end
+    end
+
+    -- Returns a function which moves up to max_count entries of one shard
+    -- per call out of sparse pages, so that they return to the free pages,
+    -- and returns the count moved and whether a pass over all the shards is
+    -- done. Like the sweeper, it is meant to be run off-peak by one process.
+    function metatable:compactor(max_count)
+        max_count = max_count or 64
+        if max_count < 1 then
+            error('bad "max_count" argument', 2)
+        end
+
+        local cursor = ffi.new("mps_shdict_scan_cursor_t")
+        local moved_ptr = ffi.new("ngx_uint_t[1]")
+
+        return function()
+            local rc = S.mps_shdict_compact(self, cursor, max_count, moved_ptr)
+            return tonumber(moved_ptr[0]), rc == NGX_OK
+        end
+    end
+
     function metatable:ttl(key)
         local err = validate_key(key)
         if err ~= nil then
@@ -587,17 +1161,213 @@ local function setup(shlib_name)
         return tonumber(S.mps_shdict_capacity(self))
     end
 
+    function metatable:grow(size)
+        local rc = S.mps_shdict_grow(self, size)
+        if rc == NGX_DECLINED then
+            return nil, "cannot grow"
+        end
+        if rc ~= NGX_OK then
+            return nil, "failed to grow"
+        end
+        return true
+    end
+
     function metatable:free_space()
         return tonumber(S.mps_shdict_free_space(self))
     end
 
+    local lock_stat = ffi.new("mps_slab_lock_stat_t")
+
+    local function lock_hist(hist)
+        local t = {}
+        for i = 0, 31 do
+            t[i + 1] = tonumber(hist[i])
+        end
+        return t
+    end
+
+    -- Returns the lock statistics summed over the shards. Times are in
+    -- nanoseconds, and hist[i] counts durations in [2^(i-2), 2^(i-1)).
+    function metatable:lock_stats()
+        local rc = S.mps_shdict_lock_stats(self, lock_stat)
+        if rc ~= NGX_OK then
+            return nil, "lock stats disabled"
+        end
+        return {
+            acquires = tonumber(lock_stat.acquires),
+            contended = tonumber(lock_stat.contended),
+            wait_total = tonumber(lock_stat.wait_total),
+            wait_max = tonumber(lock_stat.wait_max),
+            hold_total = tonumber(lock_stat.hold_total),
+            hold_max = tonumber(lock_stat.hold_max),
+            wait_hist = lock_hist(lock_stat.wait_hist),
+            hold_hist = lock_hist(lock_stat.hold_hist),
+        }
+    end
+
+    local SLAB_STAT_SLOTS = 256
+    local slab_stat = ffi.new("mps_slab_pool_stat_t")
+    local slot_stats = ffi.new("mps_slab_slot_stat_t[?]", SLAB_STAT_SLOTS)
+
+    -- Returns the page counts of the pools which hold the entries, and
+    -- slots, the counters of each chunk size from the smallest one.
+    function metatable:slab_stats()
+        S.mps_shdict_slab_stats(self, slab_stat, slot_stats, SLAB_STAT_SLOTS)
+
+        local slots = {}
+        for i = 0, math.min(tonumber(slab_stat.nslots), SLAB_STAT_SLOTS) - 1 do
+            local slot = slot_stats[i]
+            slots[i + 1] = {
+                size = tonumber(slot.size),
+                total = tonumber(slot.stat.total),
+                used = tonumber(slot.stat.used),
+                reqs = tonumber(slot.stat.reqs),
+                fails = tonumber(slot.stat.fails),
+            }
+        end
+
+        return {
+            pages = tonumber(slab_stat.pages),
+            free_pages = tonumber(slab_stat.free_pages),
+            max_free_run = tonumber(slab_stat.max_free_run),
+            slots = slots,
+        }
+    end
+
+    -- Starts copying the dict to a new dict at pathname, created with opts
+    -- like open_or_create. Call migrate_step until it returns true.
+    function metatable:migrate_start(pathname, shm_size, mode, opts)
+        local rc = S.mps_shdict_migrate_start(self, pathname, shm_size, mode,
+            new_c_opts(opts or {}))
+        if rc == NGX_DECLINED then
+            return nil, "already migrating"
+        end
+        if rc ~= NGX_OK then
+            return nil, "failed to start migration"
+        end
+        return true
+    end
+
+    -- Copies at most about n entries. Returns true after the dict has
+    -- switched to the new dict, and false while entries remain.
+    function metatable:migrate_step(n)
+        local rc = S.mps_shdict_migrate_step(self, n or 100)
+        if rc == NGX_OK then
+            return true
+        end
+        if rc == NGX_DECLINED then
+            return nil, "not migrating"
+        end
+        return false
+    end
+
+    local l1_metatable = {}
+    l1_metatable.__index = l1_metatable
+
+    local function l1_unlink(item)
+        item.prev.next = item.next
+        item.next.prev = item.prev
+    end
+
+    local function l1_link(head, item)
+        item.prev = head
+        item.next = head.next
+        head.next.prev = item
+        head.next = item
+    end
+
+    -- Returns a process-local LRU cache of up to size (default 1000) values
+    -- of the dict. The cache is emptied when the version of the dict
+    -- changes, so a hit neither locks the dict nor copies the value. Keys
+    -- with an exptime are not cached and are read from the dict every time.
+    function metatable:l1_cache(size)
+        if size ~= nil and size < 1 then
+            error('bad "size" argument', 2)
+        end
+
+        local l1 = setmetatable({
+            dict = self,
+            size = size or 1000,
+        }, l1_metatable)
+        l1:purge()
+        return l1
+    end
+
+    function l1_metatable:purge()
+        local head = {}
+        head.prev = head
+        head.next = head
+
+        self.head = head
+        self.items = {}
+        self.count = 0
+        self.version = nil
+    end
+
+    -- Same as get of the dict.
+    function l1_metatable:get(key)
+        -- read before the value, so that a store in between empties the cache,
+        -- and kept as a uint64_t cdata, since a double loses bits above 2^53
+        local version = S.mps_shdict_version(self.dict)
+        if version ~= self.version then
+            self:purge()
+            self.version = version
+        end
+
+        local item = self.items[key]
+        if item ~= nil then
+            if item.expiring then
+                return self.dict:get(key)
+            end
+
+            l1_unlink(item)
+            l1_link(self.head, item)
+            return item.value, item.flags
+        end
+
+        local value, flags = self.dict:get(key)
+        if value == nil and flags ~= nil then
+            return nil, flags
+        end
+
+        item = { key = key, value = value, flags = flags }
+        if value ~= nil then
+            local ttl = self.dict:ttl(key)
+            if ttl == nil then
+                -- removed after the get
+                return value, flags
+            end
+            if ttl ~= 0 then
+                item.value = nil
+                item.flags = nil
+                item.expiring = true
+            end
+        end
+
+        if self.count >= self.size then
+            local tail = self.head.prev
+            l1_unlink(tail)
+            self.items[tail.key] = nil
+            self.count = self.count - 1
+        end
+
+        l1_link(self.head, item)
+        self.items[key] = item
+        self.count = self.count + 1
+
+        return value, flags
+    end
+
     ffi.metatype('mps_shdict_t', metatable)
 
-    local MPS_SLAB_DEFAULT_MIN_SHIFT = 3
+    local function open_or_create(pathname, shm_size, mode, opts)
+        if not opts then
+            return S.mps_shdict_open_or_create(pathname, shm_size,
+                MPS_SLAB_DEFAULT_MIN_SHIFT, mode)
+        end
 
-    local function open_or_create(pathname, shm_size, mode)
-        return S.mps_shdict_open_or_create(pathname, shm_size,
-            MPS_SLAB_DEFAULT_MIN_SHIFT, mode)
+        return S.mps_shdict_open_or_create_opts(pathname, shm_size, mode,
+            new_c_opts(opts))
     end
 
     return {
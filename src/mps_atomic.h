@@ -0,0 +1,42 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+#ifndef _MPS_ATOMIC_H_INCLUDED_
+#define _MPS_ATOMIC_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/* GCC 4.1 builtin atomic operations, same as ngx_atomic.h */
+
+typedef long mps_atomic_int_t;
+typedef unsigned long mps_atomic_uint_t;
+typedef volatile mps_atomic_uint_t mps_atomic_t;
+
+#define mps_atomic_cmp_set(lock, old, set)                                     \
+    __sync_bool_compare_and_swap(lock, old, set)
+
+#define mps_atomic_fetch_add(value, add) __sync_fetch_and_add(value, add)
+
+#define mps_atomic_fetch_or(value, bits) __sync_fetch_and_or(value, bits)
+
+#define mps_atomic_fetch_and(value, bits) __sync_fetch_and_and(value, bits)
+
+#define mps_memory_barrier() __sync_synchronize()
+
+/* barriers for seqlock style readers and writers */
+
+#define mps_read_barrier() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+#define mps_write_barrier() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+#if (__i386__ || __i386 || __amd64__ || __amd64)
+#define mps_cpu_pause() __asm__("pause")
+#else
+#define mps_cpu_pause()
+#endif
+
+#endif /* _MPS_ATOMIC_H_INCLUDED_ */
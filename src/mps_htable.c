@@ -0,0 +1,243 @@
+#include "mps_htable.h"
+#include "mps_log.h"
+
+#if (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* keep the load factor of used and deleted slots at most 7/8 */
+#define mps_htable_limit(ht) ((ht)->mask + 1 - ((ht)->mask + 1) / 8)
+
+#define mps_htable_group_mask(ht) (((ht)->mask + 1) / MPS_HTABLE_GROUP - 1)
+
+/* Returns the bitmap of control bytes in the group which are equal to c. */
+static ngx_inline uint32_t mps_htable_match(const u_char *group, u_char c)
+{
+#if (__SSE2__)
+    __m128i g;
+
+    g = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    uint32_t m;
+    ngx_uint_t i;
+
+    m = 0;
+    for (i = 0; i < MPS_HTABLE_GROUP; i++) {
+        if (group[i] == c) {
+            m |= (uint32_t)1 << i;
+        }
+    }
+
+    return m;
+#endif
+}
+
+/* Returns the bitmap of empty or deleted slots in the group. */
+static ngx_inline uint32_t mps_htable_match_free(const u_char *group)
+{
+#if (__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t m;
+    ngx_uint_t i;
+
+    m = 0;
+    for (i = 0; i < MPS_HTABLE_GROUP; i++) {
+        if (group[i] & 0x80) {
+            m |= (uint32_t)1 << i;
+        }
+    }
+
+    return m;
+#endif
+}
+
+mps_htable_t *mps_htable_create(mps_slab_pool_t *pool, ngx_uint_t n,
+                                ngx_uint_t shift)
+{
+    mps_htable_t *ht;
+    ngx_uint_t slots;
+    size_t size;
+
+    if ((pool->max_end >> shift) > NGX_MAX_UINT32_VALUE) {
+        mps_log_error("mps_htable_create: pool is too large for shift=%lu",
+                      shift);
+        return NULL;
+    }
+
+    for (slots = MPS_HTABLE_GROUP; slots - slots / 8 < n; slots <<= 1) {
+        /* void */
+    }
+
+    size = ngx_align(sizeof(mps_htable_t), MPS_HTABLE_GROUP) + slots +
+           slots * sizeof(uint32_t);
+
+    /*
+     * the control bytes are not 16-byte aligned in chunks of size classes,
+     * so the groups are loaded unaligned
+     */
+    ht = mps_slab_alloc(pool, size);
+    if (ht == NULL) {
+        return NULL;
+    }
+
+    ht->mask = (uint32_t)(slots - 1);
+    ht->shift = (uint32_t)shift;
+    ht->gen = 0;
+    mps_htable_clear(ht);
+
+    return ht;
+}
+
+void mps_htable_clear(mps_htable_t *ht)
+{
+    ngx_memset(mps_htable_ctrl(ht), MPS_HTABLE_EMPTY, ht->mask + 1);
+    ht->used = 0;
+    ht->deleted = 0;
+    ht->gen++;
+}
+
+/*
+ * Returns NGX_AGAIN when there are too many deleted slots. The caller must
+ * clear the table and insert all entries again.
+ */
+ngx_int_t mps_htable_insert(mps_slab_pool_t *pool, mps_htable_t *ht,
+                            uint32_t hash, mps_ptroff_t off)
+{
+    u_char *ctrl;
+    uint32_t m, group, gmask, probes, slot;
+
+    if (ht->used + ht->deleted >= mps_htable_limit(ht)) {
+        return NGX_AGAIN;
+    }
+
+    ctrl = mps_htable_ctrl(ht);
+    gmask = mps_htable_group_mask(ht);
+    group = (hash >> 7) & gmask;
+
+    for (probes = 0; probes <= gmask; probes++) {
+        m = mps_htable_match_free(ctrl + group * MPS_HTABLE_GROUP);
+
+        if (m) {
+            slot = group * MPS_HTABLE_GROUP + __builtin_ctz(m);
+
+            if (ctrl[slot] == MPS_HTABLE_DELETED) {
+                ht->deleted--;
+            }
+
+            mps_htable_values(ht)[slot] = (uint32_t)(off >> ht->shift);
+            ctrl[slot] = (u_char)(hash & 0x7f);
+            ht->used++;
+
+            return NGX_OK;
+        }
+
+        group = (group + probes + 1) & gmask;
+    }
+
+    mps_log_error("mps_htable_insert: pool=%p: no free slot", pool);
+    return NGX_ERROR;
+}
+
+ngx_int_t mps_htable_delete(mps_slab_pool_t *pool, mps_htable_t *ht,
+                            uint32_t hash, mps_ptroff_t off)
+{
+    u_char *ctrl;
+    mps_htable_iter_t it;
+    mps_ptroff_t o;
+
+    for (o = mps_htable_first(ht, hash, &it); o != mps_nulloff;
+         o = mps_htable_next(ht, &it)) {
+
+        if (o != off) {
+            continue;
+        }
+
+        ctrl = mps_htable_ctrl(ht);
+
+        /*
+         * A lookup stops at a group with an empty slot, so no probe sequence
+         * goes through this group and the slot can be empty again.
+         */
+        if (it.last) {
+            ctrl[it.slot] = MPS_HTABLE_EMPTY;
+
+        } else {
+            ctrl[it.slot] = MPS_HTABLE_DELETED;
+            ht->deleted++;
+        }
+
+        ht->used--;
+
+        return NGX_OK;
+    }
+
+    mps_log_error("mps_htable_delete: pool=%p: offset not found", pool);
+    return NGX_DECLINED;
+}
+
+ngx_int_t mps_htable_replace(mps_slab_pool_t *pool, mps_htable_t *ht,
+                             uint32_t hash, mps_ptroff_t off,
+                             mps_ptroff_t new_off)
+{
+    mps_htable_iter_t it;
+    mps_ptroff_t o;
+
+    for (o = mps_htable_first(ht, hash, &it); o != mps_nulloff;
+         o = mps_htable_next(ht, &it)) {
+
+        if (o == off) {
+            mps_htable_values(ht)[it.slot] = (uint32_t)(new_off >> ht->shift);
+            return NGX_OK;
+        }
+    }
+
+    mps_log_error("mps_htable_replace: pool=%p: offset not found", pool);
+    return NGX_DECLINED;
+}
+
+static ngx_inline void mps_htable_load(mps_htable_t *ht, mps_htable_iter_t *it)
+{
+    u_char *group;
+
+    group = mps_htable_ctrl(ht) + it->group * MPS_HTABLE_GROUP;
+    it->match = mps_htable_match(group, (u_char)it->tag);
+    it->last = mps_htable_match(group, MPS_HTABLE_EMPTY) != 0;
+}
+
+mps_ptroff_t mps_htable_first(mps_htable_t *ht, uint32_t hash,
+                              mps_htable_iter_t *it)
+{
+    it->tag = hash & 0x7f;
+    it->group = (hash >> 7) & mps_htable_group_mask(ht);
+    it->probes = 0;
+    mps_htable_load(ht, it);
+
+    return mps_htable_next(ht, it);
+}
+
+mps_ptroff_t mps_htable_next(mps_htable_t *ht, mps_htable_iter_t *it)
+{
+    uint32_t gmask;
+
+    gmask = mps_htable_group_mask(ht);
+
+    for (;;) {
+        if (it->match) {
+            it->slot = it->group * MPS_HTABLE_GROUP + __builtin_ctz(it->match);
+            it->match &= it->match - 1;
+
+            return (mps_ptroff_t)mps_htable_values(ht)[it->slot] << ht->shift;
+        }
+
+        /* triangular probing visits every group once */
+        if (it->last || ++it->probes > gmask) {
+            return mps_nulloff;
+        }
+
+        it->group = (it->group + it->probes) & gmask;
+        mps_htable_load(ht, it);
+    }
+}
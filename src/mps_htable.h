@@ -0,0 +1,83 @@
+#ifndef _MPS_HTABLE_H_INCLUDED_
+#define _MPS_HTABLE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "mps_slab.h"
+
+/*
+ * An open addressing hash table of offsets in a pool.
+ *
+ * Slots are probed by groups of MPS_HTABLE_GROUP control bytes like
+ * Swiss tables. A control byte holds the low 7 bits of the hash of a used
+ * slot, or MPS_HTABLE_EMPTY or MPS_HTABLE_DELETED. Values are offsets
+ * aligned to 1 << shift, stored as 32 bit integers.
+ *
+ * The table does not grow, so it must be created with room for all entries
+ * which can exist at the same time.
+ */
+
+#define MPS_HTABLE_GROUP 16
+
+#define MPS_HTABLE_EMPTY 0x80
+#define MPS_HTABLE_DELETED 0xfe
+
+typedef struct {
+    uint32_t mask; /* count of slots - 1 */
+    uint32_t used;
+    uint32_t deleted;
+    uint32_t shift;
+    uint32_t gen; /* incremented when the table is cleared */
+    /* u_char ctrl[mask + 1] and uint32_t values[mask + 1] follow */
+} mps_htable_t;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t group;
+    uint32_t probes;
+    uint32_t match;
+    uint32_t slot;
+    unsigned last : 1;
+} mps_htable_iter_t;
+
+#define mps_htable_ctrl(ht)                                                    \
+    ((u_char *)(ht) + ngx_align(sizeof(mps_htable_t), MPS_HTABLE_GROUP))
+
+#define mps_htable_values(ht)                                                  \
+    ((uint32_t *)(mps_htable_ctrl(ht) + (ht)->mask + 1))
+
+/* Prefetch the first group and values probed for hash. */
+static ngx_inline void mps_htable_prefetch(mps_htable_t *ht, uint32_t hash)
+{
+    uint32_t slot;
+
+    slot = ((hash >> 7) & ((ht->mask + 1) / MPS_HTABLE_GROUP - 1)) *
+           MPS_HTABLE_GROUP;
+
+    __builtin_prefetch(mps_htable_ctrl(ht) + slot);
+    __builtin_prefetch(mps_htable_values(ht) + slot);
+}
+
+mps_htable_t *mps_htable_create(mps_slab_pool_t *pool, ngx_uint_t n,
+                                ngx_uint_t shift);
+void mps_htable_clear(mps_htable_t *ht);
+ngx_int_t mps_htable_insert(mps_slab_pool_t *pool, mps_htable_t *ht,
+                            uint32_t hash, mps_ptroff_t off);
+ngx_int_t mps_htable_delete(mps_slab_pool_t *pool, mps_htable_t *ht,
+                            uint32_t hash, mps_ptroff_t off);
+
+/* Replace off by new_off in the same slot, so that iterations are kept. */
+ngx_int_t mps_htable_replace(mps_slab_pool_t *pool, mps_htable_t *ht,
+                             uint32_t hash, mps_ptroff_t off,
+                             mps_ptroff_t new_off);
+
+/*
+ * Iterate offsets whose hash may be equal to hash. These do not modify the
+ * table, so they can be used without the lock if the caller validates the
+ * returned offsets.
+ */
+mps_ptroff_t mps_htable_first(mps_htable_t *ht, uint32_t hash,
+                              mps_htable_iter_t *it);
+mps_ptroff_t mps_htable_next(mps_htable_t *ht, mps_htable_iter_t *it);
+
+#endif /* _MPS_HTABLE_H_INCLUDED_ */
@@ -470,3 +470,34 @@ mps_rbtree_node_t *mps_rbtree_next(mps_slab_pool_t *pool, mps_rbtree_t *tree,
         node = parent;
     }
 }
+
+void mps_rbtree_replace(mps_slab_pool_t *pool, mps_rbtree_t *tree,
+                        mps_rbtree_node_t *node, mps_rbtree_node_t *copy)
+{
+    mps_rbtree_node_t *parent;
+    mps_ptroff_t off;
+
+    off = mps_offset(pool, copy);
+
+    if (tree->root == mps_offset(pool, node)) {
+        tree->root = off;
+
+    } else {
+        parent = mps_rbtree_node(pool, node->parent);
+
+        if (parent->left == mps_offset(pool, node)) {
+            parent->left = off;
+
+        } else {
+            parent->right = off;
+        }
+    }
+
+    if (node->left != tree->sentinel) {
+        mps_rbtree_node(pool, node->left)->parent = off;
+    }
+
+    if (node->right != tree->sentinel) {
+        mps_rbtree_node(pool, node->right)->parent = off;
+    }
+}
@@ -76,6 +76,10 @@ void mps_shdict_rbtree_insert_value(mps_slab_pool_t *pool,
 mps_rbtree_node_t *mps_rbtree_next(mps_slab_pool_t *pool, mps_rbtree_t *tree,
                                    mps_rbtree_node_t *node);
 
+/* Link copy, a copy of node, in the place of node in the tree. */
+void mps_rbtree_replace(mps_slab_pool_t *pool, mps_rbtree_t *tree,
+                        mps_rbtree_node_t *node, mps_rbtree_node_t *copy);
+
 #define ngx_rbt_red(node) ((node)->color = 1)
 #define ngx_rbt_black(node) ((node)->color = 0)
 #define ngx_rbt_is_red(node) ((node)->color)
@@ -19,6 +19,10 @@ static pthread_mutex_t dicts_lock;
 static int dicts_count = 0;
 static mps_shdict_t *dicts = NULL;
 
+/* Options of the dict being created. mps_slab_on_init_pt has no argument
+ * for them, so they are passed here while dicts_lock is held. */
+static const mps_shdict_opts_t *creating_opts = NULL;
+
 #define MPS_SHDICT_LEFT 0x0001
 #define MPS_SHDICT_RIGHT 0x0002
 
@@ -32,6 +36,14 @@ static int mps_shdict_pop_helper(mps_shdict_t *dict, int direction,
                                  int *value_type, u_char **str_value_buf,
                                  size_t *str_value_len, double *num_value,
                                  char **errmsg);
+static void mps_shdict_migrate_update(mps_shdict_t *dict);
+static ngx_int_t mps_shdict_migrate_attach(mps_shdict_t *dict);
+static void mps_shdict_sync_key(mps_shdict_t *dict, mps_slab_pool_t *pool,
+                                uint32_t hash, const u_char *key,
+                                size_t key_len);
+static void mps_shdict_unlock_key(mps_shdict_t *dict, mps_slab_pool_t *pool,
+                                  uint32_t hash, const u_char *key,
+                                  size_t key_len);
 
 static void mps_shdict_init_dicts_lock()
 {
@@ -109,6 +121,9 @@ static int index_of_dict(mps_shdict_t *dict)
 
 static int mps_shdict_expire(mps_slab_pool_t *pool, mps_shdict_tree_t *tree,
                              ngx_uint_t n);
+static void mps_shdict_remove_node(mps_slab_pool_t *pool,
+                                   mps_shdict_tree_t *tree,
+                                   mps_shdict_node_t *sd);
 
 /* Store op flags */
 
@@ -116,6 +131,117 @@ static int mps_shdict_expire(mps_slab_pool_t *pool, mps_shdict_tree_t *tree,
 #define MPS_SHDICT_REPLACE 0x0002
 #define MPS_SHDICT_SAFE_STORE 0x0004
 
+/* Internal tree flag set on all trees of a dict being migrated */
+
+#define MPS_SHDICT_MIGRATING 0x8000
+
+/* Migration states */
+
+#define MPS_SHDICT_MIGRATE_COPYING 1
+#define MPS_SHDICT_MIGRATE_DONE 2
+
+typedef struct {
+    ngx_uint_t state;
+    ngx_uint_t shard; /* cursor: the shard being copied */
+    uint64_t next;    /* cursor: the next hash, or slot of the hash index */
+    uint32_t gen;     /* generation of the hash index for the cursor */
+    mode_t mode;
+    size_t size;
+    size_t max_size; /* mapped by every process, at least size */
+    u_char name[1];
+} mps_shdict_migrate_t;
+
+/* the value of MPS_SHDICT_TNUMBER or MPS_SHDICT_TINT64 */
+typedef union {
+    double num;
+    int64_t i64;
+} mps_shdict_number_t;
+
+/*
+ * A node takes at least offsetof(mps_rbtree_node_t, color) +
+ * offsetof(mps_shdict_node_t, data) + 1 = 77 bytes, so it is always placed in
+ * a chunk of 128 bytes or more. So one access bit per 128 bytes is enough and
+ * node offsets fit in 32 bits in the hash index.
+ */
+#define MPS_SHDICT_NODE_SHIFT 7
+
+/*
+ * With size classes a node takes an aligned chunk of at least 80 bytes, so one
+ * access bit per 64 bytes is enough and the hash index keeps aligned offsets.
+ */
+#define MPS_SHDICT_CLASS_NODE_SHIFT 6
+#define MPS_SHDICT_CLASS_INDEX_SHIFT 3
+
+#define mps_shdict_node_shift(pool)                                            \
+    ((pool)->nclasses ? MPS_SHDICT_CLASS_NODE_SHIFT : MPS_SHDICT_NODE_SHIFT)
+
+/* max count of expired entries freed from the expiry tree per store */
+#define MPS_SHDICT_EXPIRE_TIMERS 2
+
+/* max count of accessed nodes moved back to the LRU head per expire call */
+#define MPS_SHDICT_EXPIRE_ROTATE 16
+
+/* max count of entries from the LRU tail looked at for one of a chunk size */
+#define MPS_SHDICT_EVICT_SCAN 128
+
+/* lock-free get falls back to locking after this many failed tries */
+#define MPS_SHDICT_LOCKFREE_TRIES 8
+
+/* the depth of a red-black tree of 2^64 nodes is at most 128 */
+#define MPS_SHDICT_LOCKFREE_DEPTH 128
+
+#define MPS_SHDICT_NODE_HEADER_SIZE                                            \
+    (offsetof(mps_rbtree_node_t, color) + offsetof(mps_shdict_node_t, data))
+
+/* the generation of mps_shdict_flush_all, which follows the tree if used */
+#define mps_shdict_tree_gen(tree) ((uint32_t *)((tree) + 1))
+
+#define MPS_SHDICT_EVICT_POLICIES                                              \
+    (MPS_SHDICT_FLAG_EVICT_CLOCK | MPS_SHDICT_FLAG_EVICT_SIEVE |               \
+     MPS_SHDICT_FLAG_EVICT_S3FIFO)
+
+/* the flags which need mps_shdict_evict_t */
+#define MPS_SHDICT_EVICT_STATE                                                 \
+    (MPS_SHDICT_FLAG_EVICT_SIEVE | MPS_SHDICT_FLAG_EVICT_S3FIFO |              \
+     MPS_SHDICT_FLAG_ADMISSION)
+
+/* the state of SIEVE, S3-FIFO or TinyLFU, which follows the flush generation */
+#define mps_shdict_tree_evict(tree)                                            \
+    ((mps_shdict_evict_t *)((u_char *)((tree) + 1) + NGX_ALIGNMENT))
+
+/*
+ * one hash in the ghost table of S3-FIFO, or one counter per row of the
+ * admission sketch, per this many smallest nodes
+ */
+#define MPS_SHDICT_GHOST_RATIO 4
+
+/*
+ * Returns the size of a node, including the timer of the expiry index and the
+ * flush generation.
+ */
+static ngx_inline size_t mps_shdict_node_size(mps_shdict_tree_t *tree,
+                                              size_t n)
+{
+    if (tree->expiry == mps_nulloff &&
+        !(tree->flags & MPS_SHDICT_FLAG_FLUSH_GEN)) {
+        return n;
+    }
+
+    n = ngx_align(n, NGX_ALIGNMENT);
+
+    if (tree->expiry != mps_nulloff) {
+        n += (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL)
+                 ? sizeof(mps_shdict_wheel_timer_t)
+                 : sizeof(mps_shdict_timer_t);
+    }
+
+    if (tree->flags & MPS_SHDICT_FLAG_FLUSH_GEN) {
+        n += sizeof(uint32_t);
+    }
+
+    return n;
+}
+
 static inline uint64_t msec_from_timespec(const struct timespec *ts)
 {
     return (uint64_t)ts->tv_sec * 1000 + (uint64_t)ts->tv_nsec / 1000000;
@@ -140,6 +266,58 @@ static ngx_inline mps_queue_t *mps_shdict_get_list_head(mps_shdict_node_t *sd,
                                         NGX_ALIGNMENT);
 }
 
+/*
+ * Returns the word of the bitmap at map, with one bit per node, which holds
+ * the bit of the node, and sets m to the bit.
+ */
+static ngx_inline uintptr_t *mps_shdict_bitmap(mps_slab_pool_t *pool,
+                                               mps_ptroff_t map,
+                                               mps_shdict_node_t *sd,
+                                               uintptr_t *m)
+{
+    ngx_uint_t n;
+
+    n = (mps_offset(pool, sd) - pool->start) >> mps_shdict_node_shift(pool);
+    *m = (uintptr_t)1 << (n % (8 * sizeof(uintptr_t)));
+
+    return (uintptr_t *)mps_ptr(pool, map) + n / (8 * sizeof(uintptr_t));
+}
+
+static ngx_inline void mps_shdict_mark_accessed(mps_slab_pool_t *pool,
+                                                mps_shdict_tree_t *tree,
+                                                mps_shdict_node_t *sd)
+{
+    uintptr_t *word, m;
+
+    word = mps_shdict_bitmap(pool, tree->access, sd, &m);
+
+    /* avoid bouncing the cache line when the bit is already set */
+    if (!(*word & m)) {
+        mps_atomic_fetch_or(word, m);
+    }
+}
+
+static ngx_inline ngx_uint_t mps_shdict_clear_accessed(mps_slab_pool_t *pool,
+                                                       mps_shdict_tree_t *tree,
+                                                       mps_shdict_node_t *sd)
+{
+    uintptr_t *word, m;
+
+    if (tree->access == mps_nulloff) {
+        return 0;
+    }
+
+    word = mps_shdict_bitmap(pool, tree->access, sd, &m);
+
+    if (!(*word & m)) {
+        return 0;
+    }
+
+    mps_atomic_fetch_and(word, ~m);
+
+    return 1;
+}
+
 void mps_shdict_rbtree_insert_value(mps_slab_pool_t *pool,
                                     mps_rbtree_node_t *temp,
                                     mps_rbtree_node_t *node,
@@ -184,14 +362,153 @@ void mps_shdict_rbtree_insert_value(mps_slab_pool_t *pool,
     ngx_rbt_red(node);
 }
 
-static mps_err_t mps_shdict_on_init(mps_slab_pool_t *pool)
+static void mps_shdict_wheel_init(mps_slab_pool_t *pool, mps_shdict_wheel_t *w)
+{
+    ngx_uint_t i, j;
+
+    w->now = mps_clock_time_ms();
+
+    for (i = 0; i < MPS_SHDICT_WHEEL_LEVELS; i++) {
+        w->occupied[i] = 0;
+
+        for (j = 0; j < MPS_SHDICT_WHEEL_SLOTS; j++) {
+            mps_queue_init(pool, &w->slots[i][j]);
+        }
+    }
+
+    mps_queue_init(pool, &w->overflow);
+}
+
+/* Returns a power of two of at least 64 and nodes / MPS_SHDICT_GHOST_RATIO. */
+static ngx_inline size_t mps_shdict_evict_slots(size_t nodes)
+{
+    size_t n;
+
+    for (n = 64; n * MPS_SHDICT_GHOST_RATIO < nodes; n <<= 1) {
+        /* void */
+    }
+
+    return n;
+}
+
+/*
+ * Initialize the sketch of the admission filter with a counter per row for
+ * about every MPS_SHDICT_GHOST_RATIO smallest nodes.
+ */
+static mps_err_t mps_shdict_init_sketch(mps_slab_pool_t *pool,
+                                        mps_shdict_evict_t *ev, size_t nodes)
+{
+    mps_shdict_sketch_t *sk;
+    size_t n;
+
+    n = mps_shdict_evict_slots(nodes);
+
+    sk = mps_slab_calloc(pool, sizeof(mps_shdict_sketch_t) +
+                                   MPS_SHDICT_SKETCH_DEPTH * n);
+    if (!sk) {
+        mps_log_error("mps_shdict_init_sketch: mps_slab_calloc failed");
+        return ENOMEM;
+    }
+
+    sk->mask = (uint32_t)(n - 1);
+    sk->sample = (uint32_t)(10 * n);
+
+    ev->sketch = mps_offset(pool, sk);
+
+    return 0;
+}
+
+/* Initialize the state of SIEVE, S3-FIFO or the admission filter. */
+static mps_err_t mps_shdict_init_evict(mps_slab_pool_t *pool,
+                                       mps_shdict_tree_t *tree)
+{
+    mps_shdict_evict_t *ev;
+    mps_err_t err;
+    uintptr_t *smap;
+    uint32_t *ghost;
+    size_t n, nodes, map;
+
+    ev = mps_shdict_tree_evict(tree);
+    ev->hand = mps_nulloff;
+    mps_queue_init(pool, &ev->small);
+    ev->nsmall = 0;
+    ev->count = 0;
+    ev->smap = mps_nulloff;
+    ev->ghost = mps_nulloff;
+    ev->ghost_mask = 0;
+    ev->sketch = mps_nulloff;
+
+    nodes = (pool->max_end - pool->start) >> mps_shdict_node_shift(pool);
+
+    if (tree->flags & MPS_SHDICT_FLAG_ADMISSION) {
+        err = mps_shdict_init_sketch(pool, ev, nodes);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    if (!(tree->flags & MPS_SHDICT_FLAG_EVICT_S3FIFO)) {
+        return 0;
+    }
+
+    map = (nodes + 8 * sizeof(uintptr_t) - 1) / (8 * sizeof(uintptr_t));
+
+    smap = mps_slab_calloc(pool, map * sizeof(uintptr_t));
+    if (!smap) {
+        mps_log_error("mps_shdict_init_evict: mps_slab_calloc for small "
+                      "queue bitmap failed");
+        return ENOMEM;
+    }
+
+    ev->smap = mps_offset(pool, smap);
+
+    n = mps_shdict_evict_slots(nodes);
+
+    ghost = mps_slab_calloc(pool, n * sizeof(uint32_t));
+    if (!ghost) {
+        mps_log_error("mps_shdict_init_evict: mps_slab_calloc for ghost "
+                      "table failed");
+        return ENOMEM;
+    }
+
+    ev->ghost = mps_offset(pool, ghost);
+    ev->ghost_mask = (uint32_t)(n - 1);
+
+    return 0;
+}
+
+static mps_err_t mps_shdict_init_tree(mps_slab_pool_t *pool, uint32_t flags,
+                                      ngx_uint_t nshards)
 {
     mps_shdict_tree_t *dict;
     mps_err_t err;
+    mps_shdict_expiry_t *expiry;
+    mps_shdict_wheel_t *wheel;
+    uintptr_t *bitmap;
+    mps_htable_t *ht;
+    size_t n;
+
+    if ((flags & MPS_SHDICT_EVICT_POLICIES) &
+        ((flags & MPS_SHDICT_EVICT_POLICIES) - 1)) {
+        mps_log_error("mps_shdict_init_tree: eviction policies are "
+                      "exclusive");
+        return EINVAL;
+    }
+
+    n = sizeof(mps_shdict_tree_t);
+    if (flags & MPS_SHDICT_EVICT_STATE) {
+        n += NGX_ALIGNMENT + sizeof(mps_shdict_evict_t);
+
+    } else if (nshards > 1) {
+        n += NGX_ALIGNMENT + nshards * sizeof(mps_ptroff_t);
+
+    } else if (flags & MPS_SHDICT_FLAG_FLUSH_GEN) {
+        n += sizeof(uint32_t);
+    }
 
-    dict = mps_slab_alloc(pool, sizeof(mps_shdict_tree_t));
+    dict = mps_slab_alloc(pool, n);
     if (!dict) {
-        mps_log_error("mps_shdict_on_init: mps_slab_alloc failed");
+        mps_log_error("mps_shdict_init_tree: mps_slab_alloc failed");
         return ENOMEM;
     }
 
@@ -203,17 +520,266 @@ static mps_err_t mps_shdict_on_init(mps_slab_pool_t *pool)
     }
     mps_queue_init(pool, &dict->lru_queue);
 
+    dict->flags = flags;
+    dict->access = mps_nulloff;
+    dict->nshards = (uint32_t)nshards;
+    dict->index = mps_nulloff;
+    dict->migrate = mps_nulloff;
+    dict->expiry = mps_nulloff;
+    dict->version = 0;
+
+    if (dict->flags & MPS_SHDICT_FLAG_FLUSH_GEN) {
+        *mps_shdict_tree_gen(dict) = 0;
+    }
+
+    if (dict->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL) {
+        if (dict->flags & MPS_SHDICT_FLAG_EXPIRY_INDEX) {
+            mps_log_error("mps_shdict_init_tree: expiry index and wheel are "
+                          "exclusive");
+            return EINVAL;
+        }
+
+        wheel = mps_slab_alloc(pool, sizeof(mps_shdict_wheel_t));
+        if (!wheel) {
+            mps_log_error("mps_shdict_init_tree: mps_slab_alloc for expiry "
+                          "wheel failed");
+            return ENOMEM;
+        }
+
+        mps_shdict_wheel_init(pool, wheel);
+        dict->expiry = mps_offset(pool, wheel);
+
+    } else if (dict->flags & MPS_SHDICT_FLAG_EXPIRY_INDEX) {
+        expiry = mps_slab_alloc(pool, sizeof(mps_shdict_expiry_t));
+        if (!expiry) {
+            mps_log_error("mps_shdict_init_tree: mps_slab_alloc for expiry "
+                          "tree failed");
+            return ENOMEM;
+        }
+
+        err = mps_rbtree_init(pool, &expiry->rbtree, &expiry->sentinel,
+                              MPS_RBTREE_INSERT_TYPE_ID_TIMER);
+        if (err != 0) {
+            return err;
+        }
+
+        dict->expiry = mps_offset(pool, expiry);
+    }
+
+    if (dict->flags & MPS_SHDICT_FLAG_HASH_INDEX) {
+        /* at most one node per chunk of the smallest node size */
+        n = (pool->max_end - pool->start) /
+            mps_slab_alloc_size(pool, MPS_SHDICT_NODE_HEADER_SIZE + 1);
+
+        ht = mps_htable_create(pool, n,
+                               pool->nclasses ? MPS_SHDICT_CLASS_INDEX_SHIFT
+                                              : MPS_SHDICT_NODE_SHIFT);
+        if (!ht) {
+            mps_log_error("mps_shdict_init_tree: mps_htable_create failed");
+            return ENOMEM;
+        }
+
+        dict->index = mps_offset(pool, ht);
+    }
+
+    if (dict->flags & (MPS_SHDICT_FLAG_LOCKFREE_GET |
+                       MPS_SHDICT_FLAG_ATOMIC_INCR |
+                       MPS_SHDICT_EVICT_POLICIES)) {
+        n = (pool->max_end - pool->start) >> mps_shdict_node_shift(pool);
+        n = (n + 8 * sizeof(uintptr_t) - 1) / (8 * sizeof(uintptr_t));
+
+        bitmap = mps_slab_calloc(pool, n * sizeof(uintptr_t));
+        if (!bitmap) {
+            mps_log_error("mps_shdict_init_tree: mps_slab_calloc for access "
+                          "bitmap failed");
+            return ENOMEM;
+        }
+
+        dict->access = mps_offset(pool, bitmap);
+    }
+
+    if (dict->flags & MPS_SHDICT_EVICT_STATE) {
+        err = mps_shdict_init_evict(pool, dict);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    if (flags & MPS_SHDICT_FLAG_LOCK_STATS) {
+        pool->lock_stats = 1;
+    }
+
+    if (flags & MPS_SHDICT_FLAG_FUTEX_LOCK) {
+        pool->spin_lock = 1;
+    }
+
+    if (flags & MPS_SHDICT_FLAG_ATOMIC_INCR) {
+        pool->inplace = 1;
+    }
+
     pool->log_nomem = 0;
     return 0;
 }
 
+/*
+ * The main pool holds only the tree and the shard table, and the rest of it is
+ * split into nshards pools of equal size, each with its own mutex, rbtree and
+ * LRU queue.
+ */
+static mps_err_t mps_shdict_init_shards(mps_slab_pool_t *pool, uint32_t flags,
+                                        ngx_uint_t nshards,
+                                        ngx_uint_t size_classes)
+{
+    mps_shdict_tree_t *dict;
+    mps_slab_pool_t *shard;
+    mps_ptroff_t *shards;
+    mps_err_t err;
+    ngx_uint_t i, pages;
+
+    /* the tree has room for the generation, though only shards use it */
+    err = mps_shdict_init_tree(pool,
+                               flags & (MPS_SHDICT_FLAG_LOCK_STATS |
+                                        MPS_SHDICT_FLAG_FUTEX_LOCK |
+                                        MPS_SHDICT_FLAG_FLUSH_GEN),
+                               nshards);
+    if (err != 0) {
+        return err;
+    }
+
+    dict = mps_shdict_tree(pool);
+    shards = mps_shdict_tree_shards(dict);
+
+    /*
+     * A shard needs one page for its header and at least one for data.
+     * One page is left in the main pool for a migration record.
+     */
+    pages = pool->pfree > nshards ? (pool->pfree - 1) / nshards : 0;
+    if (pages < 2) {
+        mps_log_error("mps_shdict_init_shards: too many shards for pool size, "
+                      "shards=%lu",
+                      nshards);
+        return EINVAL;
+    }
+
+    for (i = 0; i < nshards; i++) {
+        shard = mps_slab_alloc(pool, pages * mps_pagesize);
+        if (!shard) {
+            mps_log_error("mps_shdict_init_shards: mps_slab_alloc for shard "
+                          "failed");
+            return ENOMEM;
+        }
+
+        err = mps_slab_init(shard, (u_char *)shard, pages * mps_pagesize,
+                            pool->min_shift);
+        if (err != 0) {
+            return err;
+        }
+
+        if (size_classes) {
+            err = mps_slab_init_classes(shard, size_classes);
+            if (err != 0) {
+                return err;
+            }
+        }
+
+        err = mps_shdict_init_tree(shard, flags, 1);
+        if (err != 0) {
+            return err;
+        }
+
+        shards[i] = mps_offset(pool, shard);
+    }
+
+    dict->flags = flags;
+
+    return 0;
+}
+
+static mps_err_t mps_shdict_on_init(mps_slab_pool_t *pool)
+{
+    mps_err_t err;
+    uint32_t flags;
+    ngx_uint_t nshards, size_classes;
+
+    flags = creating_opts ? (uint32_t)creating_opts->flags : 0;
+    nshards = creating_opts ? creating_opts->shards : 1;
+    size_classes = creating_opts ? creating_opts->size_classes : 0;
+
+    if (nshards > 1) {
+        if (pool->max_end != pool->end) {
+            mps_log_error("mps_shdict_on_init: a dict with shards cannot "
+                          "grow");
+            return EINVAL;
+        }
+
+        return mps_shdict_init_shards(pool, flags, nshards, size_classes);
+    }
+
+    if (size_classes) {
+        err = mps_slab_init_classes(pool, size_classes);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    return mps_shdict_init_tree(pool, flags, 1);
+}
+
+/* Returns the i-th pool which holds keys in the dict of the main pool. */
+static ngx_inline mps_slab_pool_t *mps_shdict_shard_at(mps_slab_pool_t *pool,
+                                                       ngx_uint_t i)
+{
+    mps_shdict_tree_t *tree;
+
+    tree = mps_shdict_tree(pool);
+    if (tree->nshards <= 1) {
+        return pool;
+    }
+
+    return (mps_slab_pool_t *)mps_ptr(pool, mps_shdict_tree_shards(tree)[i]);
+}
+
+/* Returns the main pool, switching to the migration target when the migration
+ * has been done. */
+static ngx_inline mps_slab_pool_t *mps_shdict_main(mps_shdict_t *dict)
+{
+    if (mps_shdict_tree(dict->pool)->migrate != mps_nulloff) {
+        mps_shdict_migrate_update(dict);
+    }
+
+    return dict->pool;
+}
+
+/* Returns the pool which holds the key of the hash. */
+static ngx_inline mps_slab_pool_t *mps_shdict_shard(mps_shdict_t *dict,
+                                                    uint32_t hash)
+{
+    mps_slab_pool_t *pool;
+
+    pool = mps_shdict_main(dict);
+    return mps_shdict_shard_at(pool, hash % mps_shdict_tree(pool)->nshards);
+}
+
 mps_shdict_t *mps_shdict_open_or_create(const char *pathname, size_t shm_size,
                                         size_t min_shift, mode_t mode)
+{
+    mps_shdict_opts_t opts;
+
+    ngx_memzero(&opts, sizeof(mps_shdict_opts_t));
+    opts.min_shift = min_shift;
+
+    return mps_shdict_open_or_create_opts(pathname, shm_size, mode, &opts);
+}
+
+mps_shdict_t *mps_shdict_open_or_create_opts(const char *pathname,
+                                             size_t shm_size, mode_t mode,
+                                             const mps_shdict_opts_t *opts)
 {
     int rc;
     mps_shdict_t *dict, *new_dicts;
     char *pathname_copy;
     mps_slab_pool_t *pool;
+    size_t size;
 
     rc = pthread_once(&dicts_lock_initialized, mps_shdict_init_dicts_lock);
     if (rc != 0) {
@@ -231,13 +797,27 @@ mps_shdict_t *mps_shdict_open_or_create(const char *pathname, size_t shm_size,
         return dict;
     }
 
-    pool = mps_slab_open_or_create(pathname, shm_size, min_shift, mode,
-                                   mps_shdict_on_init);
+    size = ngx_max(shm_size, opts->max_size);
+
+    creating_opts = opts;
+    pool = mps_slab_open_or_create_max(pathname, shm_size, size,
+                                       opts->min_shift, mode,
+                                       mps_shdict_on_init);
+    creating_opts = NULL;
     if (pool == NULL) {
         pthread_mutex_unlock(&dicts_lock);
         return NULL;
     }
 
+    if (pool->max_end > size) {
+        mps_log_error("mps_shdict_open_or_create: dict was created with "
+                      "max_size=%lu, but opened with %lu",
+                      (size_t)pool->max_end, size);
+        mps_slab_close(pool, size);
+        pthread_mutex_unlock(&dicts_lock);
+        return NULL;
+    }
+
     pathname_copy = strdup(pathname);
     if (pathname_copy == NULL) {
         pthread_mutex_unlock(&dicts_lock);
@@ -258,7 +838,11 @@ mps_shdict_t *mps_shdict_open_or_create(const char *pathname, size_t shm_size,
     dict->pool = pool;
     dict->name.len = strlen(pathname);
     dict->name.data = (u_char *)pathname_copy;
-    dict->size = shm_size;
+    dict->size = size;
+    dict->target = NULL;
+    dict->target_size = 0;
+    dict->source = NULL;
+    dict->source_size = 0;
 
     pthread_mutex_unlock(&dicts_lock);
 
@@ -287,6 +871,14 @@ void mps_shdict_close(mps_shdict_t *dict)
         return;
     }
 
+    if (dict->target != NULL && dict->target != dict->pool) {
+        mps_slab_close(dict->target, dict->target_size);
+    }
+
+    if (dict->source != NULL) {
+        mps_slab_close(dict->source, dict->source_size);
+    }
+
     mps_slab_close(dict->pool, dict->size);
 
     dict_name_data = dict->name.data;
@@ -314,1382 +906,4564 @@ void mps_shdict_close(mps_shdict_t *dict)
     pthread_mutex_unlock(&dicts_lock);
 }
 
-static ngx_int_t mps_shdict_lookup(mps_slab_pool_t *pool, ngx_uint_t hash,
-                                   const u_char *kdata, size_t klen,
-                                   mps_shdict_node_t **sdp)
+#define mps_shdict_index(pool, tree)                                           \
+    ((mps_htable_t *)mps_ptr((pool), (tree)->index))
+
+static ngx_int_t mps_shdict_peek(mps_slab_pool_t *pool, ngx_uint_t hash,
+                                 const u_char *kdata, size_t klen,
+                                 mps_shdict_node_t **sdp);
+
+#define mps_shdict_expiry(pool, tree)                                          \
+    ((mps_shdict_expiry_t *)mps_ptr((pool), (tree)->expiry))
+
+/* Returns the timer which follows the value of the node. */
+static ngx_inline mps_shdict_timer_t *mps_shdict_timer(mps_shdict_node_t *sd)
 {
-    mps_shdict_tree_t *tree;
-    ngx_int_t rc;
-    uint64_t now;
-    int64_t ms;
-    mps_rbtree_node_t *node, *sentinel;
-    mps_shdict_node_t *sd;
+    size_t n;
 
-    tree = mps_shdict_tree(pool);
+    n = sd->value_type == MPS_SHDICT_TLIST ? sizeof(mps_queue_t)
+                                           : sd->value_len;
 
-    node = mps_rbtree_node(pool, tree->rbtree.root);
-    sentinel = mps_rbtree_node(pool, tree->rbtree.sentinel);
+    return (mps_shdict_timer_t *)ngx_align_ptr(sd->data + sd->key_len + n,
+                                               NGX_ALIGNMENT);
+}
 
-    while (node != sentinel) {
+#define mps_shdict_wheel(pool, tree)                                           \
+    ((mps_shdict_wheel_t *)mps_ptr((pool), (tree)->expiry))
 
-        if (hash < node->key) {
-            node = mps_rbtree_node(pool, node->left);
-            continue;
-        }
+#define mps_shdict_wheel_timer(sd)                                             \
+    ((mps_shdict_wheel_timer_t *)mps_shdict_timer(sd))
 
-        if (hash > node->key) {
-            node = mps_rbtree_node(pool, node->right);
-            continue;
-        }
+#define mps_shdict_wheel_mask(level)                                           \
+    (((uint64_t)1 << ((level)*MPS_SHDICT_WHEEL_BITS)) - 1)
 
-        /* hash == node->key */
+/* Returns the flush generation of the node, which follows its timer. */
+static ngx_inline uint32_t *mps_shdict_gen(mps_shdict_tree_t *tree,
+                                           mps_shdict_node_t *sd)
+{
+    u_char *p;
 
-        sd = (mps_shdict_node_t *)&node->color;
+    p = (u_char *)mps_shdict_timer(sd);
 
-        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t)sd->key_len);
+    if (tree->expiry != mps_nulloff) {
+        p += (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL)
+                 ? sizeof(mps_shdict_wheel_timer_t)
+                 : sizeof(mps_shdict_timer_t);
+    }
 
-        if (rc == 0) {
-            mps_queue_remove(pool, &sd->queue);
-            mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    return (uint32_t *)p;
+}
 
-            *sdp = sd;
+/* Mark the node as stored after the last mps_shdict_flush_all. */
+static ngx_inline void mps_shdict_gen_update(mps_shdict_tree_t *tree,
+                                             mps_shdict_node_t *sd)
+{
+    if (tree->flags & MPS_SHDICT_FLAG_FLUSH_GEN) {
+        *mps_shdict_gen(tree, sd) = *mps_shdict_tree_gen(tree);
+    }
+}
+
+/* Give a new version to the value of the node, which is locked. */
+static ngx_inline void mps_shdict_version_update(mps_shdict_tree_t *tree,
+                                                 mps_shdict_node_t *sd)
+{
+    sd->version = ++tree->version;
+}
 
-            dd("node expires: %lld", (long long)sd->expires);
+/* Returns non-zero if the node was stored before the last flush_all. */
+static ngx_inline ngx_uint_t mps_shdict_flushed(mps_shdict_tree_t *tree,
+                                                mps_shdict_node_t *sd)
+{
+    return (tree->flags & MPS_SHDICT_FLAG_FLUSH_GEN) &&
+           *mps_shdict_gen(tree, sd) != *mps_shdict_tree_gen(tree);
+}
 
-            if (sd->expires != 0) {
-                now = mps_clock_time_ms();
-                ms = sd->expires - now;
+/* Link the timer to the slot of its expires, or of now if it has passed. */
+static void mps_shdict_wheel_add(mps_slab_pool_t *pool, mps_shdict_wheel_t *w,
+                                 mps_shdict_wheel_timer_t *t)
+{
+    uint64_t e;
+    ngx_uint_t level, slot;
 
-                dd("time to live: %lld", (long long)ms);
+    e = (int64_t)(t->expires - w->now) < 0 ? w->now : t->expires;
 
-                if (ms < 0) {
-                    dd("node already expired");
-                    return NGX_DONE;
-                }
-            }
+    for (level = 0; level < MPS_SHDICT_WHEEL_LEVELS; level++) {
+        if (((e ^ w->now) & ~mps_shdict_wheel_mask(level + 1)) == 0) {
+            slot = (e >> (level * MPS_SHDICT_WHEEL_BITS)) &
+                   (MPS_SHDICT_WHEEL_SLOTS - 1);
 
-            return NGX_OK;
+            w->occupied[level] |= (uint64_t)1 << slot;
+            mps_queue_insert_tail(pool, &w->slots[level][slot], &t->queue);
+            return;
         }
-
-        node = mps_rbtree_node(pool, (rc < 0) ? node->left : node->right);
     }
 
-    *sdp = NULL;
-
-    return NGX_DECLINED;
+    mps_queue_insert_tail(pool, &w->overflow, &t->queue);
 }
 
-static int mps_shdict_expire(mps_slab_pool_t *pool, mps_shdict_tree_t *tree,
-                             ngx_uint_t n)
+/*
+ * Set next to the first time after now when a slot of level 0 is due or a
+ * slot of an upper level is moved down. Returns NGX_DECLINED if the wheel is
+ * empty.
+ */
+static ngx_int_t mps_shdict_wheel_next(mps_slab_pool_t *pool,
+                                       mps_shdict_wheel_t *w, uint64_t *next)
 {
-    uint64_t now;
-    mps_queue_t *q, *list_queue, *lq;
-    int64_t ms;
-    mps_rbtree_node_t *node;
-    mps_shdict_node_t *sd;
-    int freed = 0;
-    mps_shdict_list_node_t *lnode;
+    ngx_uint_t level, shift, cur;
+    uint64_t m, t;
+    ngx_int_t rc;
 
-    now = mps_clock_time_ms();
+    rc = NGX_DECLINED;
+    *next = 0;
 
-    /*
-     * n == 1 deletes one or two expired entries
-     * n == 0 deletes oldest entry by force
-     *        and one or two zero rate entries
-     */
+    for (level = 0; level < MPS_SHDICT_WHEEL_LEVELS; level++) {
+        shift = level * MPS_SHDICT_WHEEL_BITS;
+        cur = (w->now >> shift) & (MPS_SHDICT_WHEEL_SLOTS - 1);
+
+        /* slots up to the current one are empty or have been handled */
+        m = w->occupied[level] & ~(((uint64_t)2 << cur) - 1);
+        if (m == 0) {
+            continue;
+        }
 
-    while (n < 3) {
+        t = (w->now & ~mps_shdict_wheel_mask(level + 1)) |
+            ((uint64_t)__builtin_ctzll(m) << shift);
 
-        if (mps_queue_empty(pool, &tree->lru_queue)) {
-            return freed;
+        if (rc == NGX_DECLINED || t < *next) {
+            *next = t;
+            rc = NGX_OK;
         }
+    }
 
-        q = mps_queue_last(pool, &tree->lru_queue);
+    if (!mps_queue_empty(pool, &w->overflow)) {
+        t = (w->now | mps_shdict_wheel_mask(MPS_SHDICT_WHEEL_LEVELS)) + 1;
 
-        sd = mps_queue_data(q, mps_shdict_node_t, queue);
+        if (rc == NGX_DECLINED || t < *next) {
+            *next = t;
+            rc = NGX_OK;
+        }
+    }
 
-        if (n++ != 0) {
+    return rc;
+}
 
-            if (sd->expires == 0) {
-                return freed;
-            }
+/* Move down the timers of the slots whose ranges start at now. */
+static void mps_shdict_wheel_cascade(mps_slab_pool_t *pool,
+                                     mps_shdict_wheel_t *w)
+{
+    mps_queue_t *head, *q;
+    ngx_uint_t level, slot, n;
+
+    if ((w->now & mps_shdict_wheel_mask(MPS_SHDICT_WHEEL_LEVELS)) == 0) {
+        /* timers still beyond the top level are linked to it again */
+        n = 0;
+        for (q = mps_queue_head(pool, &w->overflow);
+             q != mps_queue_sentinel(pool, &w->overflow);
+             q = mps_queue_next(pool, q)) {
+            n++;
+        }
 
-            ms = sd->expires - now;
-            if (ms > 0) {
-                return freed;
-            }
+        while (n--) {
+            q = mps_queue_head(pool, &w->overflow);
+            mps_queue_remove(pool, q);
+            mps_shdict_wheel_add(
+                pool, w, mps_queue_data(q, mps_shdict_wheel_timer_t, queue));
         }
+    }
 
-        if (sd->value_type == MPS_SHDICT_TLIST) {
-            list_queue = mps_shdict_get_list_head(sd, sd->key_len);
+    for (level = MPS_SHDICT_WHEEL_LEVELS - 1; level > 0; level--) {
+        if ((w->now & mps_shdict_wheel_mask(level)) != 0) {
+            continue;
+        }
 
-            for (lq = mps_queue_head(pool, list_queue);
-                 lq != mps_queue_sentinel(pool, list_queue);
-                 lq = mps_queue_next(pool, lq)) {
-                lnode = mps_queue_data(lq, mps_shdict_list_node_t, queue);
+        slot = (w->now >> (level * MPS_SHDICT_WHEEL_BITS)) &
+               (MPS_SHDICT_WHEEL_SLOTS - 1);
 
-                mps_slab_free_locked(pool, lnode);
-            }
+        if (!(w->occupied[level] & ((uint64_t)1 << slot))) {
+            continue;
         }
 
-        mps_queue_remove(pool, q);
+        w->occupied[level] &= ~((uint64_t)1 << slot);
+        head = &w->slots[level][slot];
 
-        node = (mps_rbtree_node_t *)((u_char *)sd -
-                                     offsetof(mps_rbtree_node_t, color));
+        /* the timers go to lower levels */
+        while (!mps_queue_empty(pool, head)) {
+            q = mps_queue_head(pool, head);
+            mps_queue_remove(pool, q);
+            mps_shdict_wheel_add(
+                pool, w, mps_queue_data(q, mps_shdict_wheel_timer_t, queue));
+        }
+    }
+}
 
-        mps_rbtree_delete(pool, &tree->rbtree, node);
+/* Free up to n entries which expired before now, advancing the wheel. */
+static ngx_uint_t mps_shdict_wheel_expire(mps_slab_pool_t *pool,
+                                          mps_shdict_tree_t *tree,
+                                          uint64_t now, ngx_uint_t n)
+{
+    mps_shdict_wheel_t *w;
+    mps_shdict_wheel_timer_t *t;
+    mps_queue_t *head;
+    ngx_uint_t freed, slot;
+    uint64_t next;
 
-        mps_slab_free_locked(pool, node);
+    w = mps_shdict_wheel(pool, tree);
+    freed = 0;
 
-        freed++;
+    while ((int64_t)(now - w->now) > 0) {
+        slot = w->now & (MPS_SHDICT_WHEEL_SLOTS - 1);
+        head = &w->slots[0][slot];
+
+        while (!mps_queue_empty(pool, head)) {
+            if (freed == n) {
+                return freed;
+            }
+
+            t = mps_queue_data(mps_queue_head(pool, head),
+                               mps_shdict_wheel_timer_t, queue);
+            mps_shdict_remove_node(
+                pool, tree,
+                (mps_shdict_node_t *)&mps_rbtree_node(pool, t->entry)->color);
+            freed++;
+        }
+
+        w->occupied[0] &= ~((uint64_t)1 << slot);
+
+        if (mps_shdict_wheel_next(pool, w, &next) != NGX_OK ||
+            (int64_t)(next - now) > 0) {
+            w->now = now;
+            break;
+        }
+
+        w->now = next;
+        mps_shdict_wheel_cascade(pool, w);
     }
 
     return freed;
 }
 
-/* This function is exported for Lua. */
-
-int mps_shdict_store(mps_shdict_t *dict, int op, const u_char *key,
-                     size_t key_len, int value_type,
-                     const u_char *str_value_buf, size_t str_value_len,
-                     double num_value, long exptime, int user_flags,
-                     char **errmsg, int *forcible)
+/* Move the timer of the node to its expires. */
+static void mps_shdict_timer_update(mps_slab_pool_t *pool,
+                                    mps_shdict_tree_t *tree,
+                                    mps_shdict_node_t *sd)
 {
-    mps_slab_pool_t *pool;
-    mps_shdict_tree_t *tree;
-    int i, n;
-    uint32_t hash;
-    ngx_int_t rc;
-    mps_queue_t *queue, *q;
-    mps_rbtree_node_t *node;
-    mps_shdict_node_t *sd;
-    u_char c, *p;
-    uint64_t now;
+    mps_shdict_timer_t *t;
+    mps_shdict_wheel_timer_t *wt;
 
-    pool = dict->pool;
-    tree = mps_shdict_tree(pool);
+    if (tree->expiry == mps_nulloff) {
+        return;
+    }
 
-    *forcible = 0;
+    if (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL) {
+        wt = mps_shdict_wheel_timer(sd);
 
-    hash = ngx_murmur_hash2(key, key_len);
+        if (wt->expires == sd->expires) {
+            return;
+        }
 
-    switch (value_type) {
+        if (wt->expires != 0) {
+            mps_queue_remove(pool, &wt->queue);
+        }
 
-    case MPS_SHDICT_TSTRING:
-        /* do nothing */
-        break;
+        wt->expires = sd->expires;
 
-    case MPS_SHDICT_TNUMBER:
-        dd("num value: %lf", num_value);
-        str_value_buf = (u_char *)&num_value;
-        str_value_len = sizeof(double);
-        break;
+        if (sd->expires != 0) {
+            mps_shdict_wheel_add(pool, mps_shdict_wheel(pool, tree), wt);
+        }
 
-    case MPS_SHDICT_TBOOLEAN:
-        c = num_value ? 1 : 0;
-        str_value_buf = &c;
-        str_value_len = sizeof(u_char);
-        break;
+        return;
+    }
 
-    case MPS_SHDICT_TNIL:
-        if (op & (MPS_SHDICT_ADD | MPS_SHDICT_REPLACE)) {
-            *errmsg = "attempt to add or replace nil values";
-            return NGX_ERROR;
-        }
+    t = mps_shdict_timer(sd);
 
-        str_value_buf = NULL;
-        str_value_len = 0;
-        break;
+    if (t->node.key == sd->expires) {
+        return;
+    }
 
-    default:
-        *errmsg = "unsupported value type";
-        return NGX_ERROR;
+    if (t->node.key != 0) {
+        mps_rbtree_delete(pool, &mps_shdict_expiry(pool, tree)->rbtree,
+                          &t->node);
     }
 
-    mps_slab_lock(pool);
+    t->node.key = sd->expires;
 
-#if 1
-    mps_shdict_expire(pool, tree, 1);
-#endif
+    if (sd->expires != 0) {
+        mps_rbtree_insert(pool, &mps_shdict_expiry(pool, tree)->rbtree,
+                          &t->node);
+    }
+}
 
-    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
-    dd("lookup returns %d", (int)rc);
+/* Free up to n expired entries in the order of their deadlines. */
+static ngx_uint_t mps_shdict_expire_timers(mps_slab_pool_t *pool,
+                                           mps_shdict_tree_t *tree,
+                                           uint64_t now, ngx_uint_t n)
+{
+    mps_rbtree_t *rbtree;
+    mps_rbtree_node_t *node;
+    mps_shdict_timer_t *t;
+    ngx_uint_t freed;
 
-    if (op & MPS_SHDICT_REPLACE) {
+    rbtree = &mps_shdict_expiry(pool, tree)->rbtree;
 
-        if (rc == NGX_DECLINED || rc == NGX_DONE) {
-            mps_slab_unlock(pool);
-            *errmsg = "not found";
-            return NGX_DECLINED;
+    for (freed = 0; freed < n; freed++) {
+        if (rbtree->root == rbtree->sentinel) {
+            break;
         }
 
-        /* rc == NGX_OK */
+        node = mps_rbtree_min(pool, mps_rbtree_node(pool, rbtree->root),
+                              rbtree->sentinel);
+        if ((int64_t)(node->key - now) >= 0) {
+            break;
+        }
 
-        goto replace;
+        t = (mps_shdict_timer_t *)node;
+        mps_shdict_remove_node(
+            pool, tree,
+            (mps_shdict_node_t *)&mps_rbtree_node(pool, t->entry)->color);
     }
 
-    if (op & MPS_SHDICT_ADD) {
-
-        if (rc == NGX_OK) {
-            mps_slab_unlock(pool);
-            *errmsg = "exists";
-            return NGX_DECLINED;
-        }
+    return freed;
+}
 
-        if (rc == NGX_DONE) {
-            /* exists but expired */
+/* Sets queues to the queues of the entries, and returns their count. */
+static ngx_inline ngx_uint_t mps_shdict_queues(mps_shdict_tree_t *tree,
+                                               mps_queue_t **queues)
+{
+    queues[0] = &tree->lru_queue;
 
-            dd("go to replace");
-            goto replace;
-        }
+    if (!(tree->flags & MPS_SHDICT_FLAG_EVICT_S3FIFO)) {
+        return 1;
+    }
 
-        /* rc == NGX_DECLINED */
+    queues[1] = &mps_shdict_tree_evict(tree)->small;
 
-        dd("go to insert");
-        goto insert;
-    }
+    return 2;
+}
 
-    if (rc == NGX_OK || rc == NGX_DONE) {
+/* Link a new entry to a queue of the eviction policy. */
+static void mps_shdict_queue_insert(mps_slab_pool_t *pool,
+                                    mps_shdict_tree_t *tree,
+                                    mps_shdict_node_t *sd)
+{
+    mps_shdict_evict_t *ev;
+    uintptr_t *word, m;
+    uint32_t hash, *ghost;
 
-        if (value_type == MPS_SHDICT_TNIL) {
-            goto remove;
-        }
+    /* the bit may be left by a freed node */
+    (void)mps_shdict_clear_accessed(pool, tree, sd);
 
-    replace:
+    if (!(tree->flags & MPS_SHDICT_FLAG_EVICT_S3FIFO)) {
+        mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+        return;
+    }
 
-        if (str_value_buf && str_value_len == (size_t)sd->value_len &&
-            sd->value_type != MPS_SHDICT_TLIST) {
+    ev = mps_shdict_tree_evict(tree);
+    ev->count++;
 
-            mps_log_debug(MPS_LOG_TAG,
-                          "lua shared tree set in dict \"%.*s\": "
-                          "found old entry and value size matched, reusing it",
-                          (int)dict->name.len, dict->name.data);
+    hash = (uint32_t)((mps_rbtree_node_t *)((u_char *)sd -
+                                            offsetof(mps_rbtree_node_t,
+                                                     color)))
+               ->key;
+    ghost = (uint32_t *)mps_ptr(pool, ev->ghost) + (hash & ev->ghost_mask);
 
-            mps_queue_remove(pool, &sd->queue);
-            mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    /* evicted from the small queue not long ago */
+    if (*ghost == (hash | 1)) {
+        *ghost = 0;
+        mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+        return;
+    }
 
-            if (exptime > 0) {
-                sd->expires = mps_clock_time_ms() + (uint64_t)exptime;
+    mps_queue_insert_head(pool, &ev->small, &sd->queue);
+    ev->nsmall++;
 
-            } else {
-                sd->expires = 0;
-            }
+    word = mps_shdict_bitmap(pool, ev->smap, sd, &m);
+    *word |= m;
+}
 
-            sd->user_flags = user_flags;
+/* Unlink an entry which is freed or moved from its queue. */
+static void mps_shdict_queue_remove(mps_slab_pool_t *pool,
+                                    mps_shdict_tree_t *tree,
+                                    mps_shdict_node_t *sd)
+{
+    mps_shdict_evict_t *ev;
+    uintptr_t *word, m;
 
-            dd("setting value type to %d", value_type);
+    if (tree->flags & MPS_SHDICT_FLAG_EVICT_SIEVE) {
+        ev = mps_shdict_tree_evict(tree);
 
-            sd->value_type = (uint8_t)value_type;
+        /* the hand goes on to the next entry towards the head */
+        if (ev->hand == mps_offset(pool, &sd->queue)) {
+            ev->hand = sd->queue.prev == mps_offset(pool, &tree->lru_queue)
+                           ? mps_nulloff
+                           : sd->queue.prev;
+        }
 
-            ngx_memcpy(sd->data + key_len, str_value_buf, str_value_len);
+    } else if (tree->flags & MPS_SHDICT_FLAG_EVICT_S3FIFO) {
+        ev = mps_shdict_tree_evict(tree);
+        ev->count--;
 
-            mps_slab_unlock(pool);
+        word = mps_shdict_bitmap(pool, ev->smap, sd, &m);
 
-            return NGX_OK;
+        if (*word & m) {
+            *word &= ~m;
+            ev->nsmall--;
         }
+    }
 
-        mps_log_debug(
-            MPS_LOG_TAG,
-            "lua shared dict set in dict \"%.*s\": "
-            "found old entry but value size NOT matched, removing it first",
-            (int)dict->name.len, dict->name.data);
+    mps_queue_remove(pool, &sd->queue);
+}
 
-    remove:
+/*
+ * Record a hit of the entry. LRU moves it to the head of the queue, and other
+ * policies only set its access bit.
+ */
+static ngx_inline void mps_shdict_queue_touch(mps_slab_pool_t *pool,
+                                              mps_shdict_tree_t *tree,
+                                              mps_shdict_node_t *sd)
+{
+    if (tree->flags & MPS_SHDICT_EVICT_POLICIES) {
+        mps_shdict_mark_accessed(pool, tree, sd);
+        return;
+    }
 
-        if (sd->value_type == MPS_SHDICT_TLIST) {
-            queue = mps_shdict_get_list_head(sd, key_len);
+    mps_queue_remove(pool, &sd->queue);
+    mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+}
 
-            for (q = mps_queue_head(pool, queue);
-                 q != mps_queue_sentinel(pool, queue);
-                 q = mps_queue_next(pool, q)) {
-                p = (u_char *)mps_queue_data(q, mps_shdict_list_node_t, queue);
+/*
+ * Returns the entry to be freed by force to make room for a chunk of size
+ * chunk, or NULL if there is none. LRU and CLOCK take the first entry near the
+ * tail of the chunk size, or of any size if chunk is 0, since freeing an entry
+ * of another chunk size does not help unless its page becomes free. SIEVE and
+ * S3-FIFO go by their own order. The entries passed over are aged as the policy
+ * does, so the same entry is returned again until it is freed or read.
+ */
+static mps_shdict_node_t *mps_shdict_victim(mps_slab_pool_t *pool,
+                                            mps_shdict_tree_t *tree,
+                                            size_t chunk)
+{
+    mps_shdict_evict_t *ev;
+    mps_shdict_node_t *sd, *first;
+    mps_rbtree_node_t *node;
+    mps_queue_t *q, *prev;
+    uintptr_t *word, m;
+    ngx_uint_t i;
 
-                mps_slab_free_locked(pool, p);
-            }
+    if (!(tree->flags &
+          (MPS_SHDICT_FLAG_EVICT_SIEVE | MPS_SHDICT_FLAG_EVICT_S3FIFO))) {
+        if (mps_queue_empty(pool, &tree->lru_queue)) {
+            return NULL;
         }
 
-        mps_queue_remove(pool, &sd->queue);
-
-        node = (mps_rbtree_node_t *)((u_char *)sd -
-                                     offsetof(mps_rbtree_node_t, color));
+        first = NULL;
+        q = mps_queue_last(pool, &tree->lru_queue);
 
-        mps_rbtree_delete(pool, &tree->rbtree, node);
+        for (i = 0; i < MPS_SHDICT_EVICT_SCAN; i++) {
+            if (q == mps_queue_sentinel(pool, &tree->lru_queue)) {
+                break;
+            }
 
-        mps_slab_free_locked(pool, node);
-    }
+            sd = mps_queue_data(q, mps_shdict_node_t, queue);
+            prev = mps_queue_prev(pool, q);
 
-insert:
+            /* read by a lock-free get since the last sweep */
+            if (mps_shdict_clear_accessed(pool, tree, sd)) {
+                mps_queue_remove(pool, q);
+                mps_queue_insert_head(pool, &tree->lru_queue, q);
+                q = prev;
+                continue;
+            }
 
-    /* rc == NGX_DECLINED or value size unmatch */
+            node = (mps_rbtree_node_t *)((u_char *)sd -
+                                         offsetof(mps_rbtree_node_t, color));
 
-    if (str_value_buf == NULL) {
-        mps_slab_unlock(pool);
-        return NGX_OK;
-    }
+            if (chunk == 0 || mps_slab_chunk_size(pool, node) == chunk) {
+                return sd;
+            }
 
-    mps_log_debug(MPS_LOG_TAG,
-                  "lua shared dict set in dict \"%.*s\": creating a new entry",
-                  (int)dict->name.len, dict->name.data);
+            if (first == NULL) {
+                first = sd;
+            }
 
-    n = offsetof(mps_rbtree_node_t, color) + offsetof(mps_shdict_node_t, data) +
-        key_len + str_value_len;
+            q = prev;
+        }
 
-    node = mps_slab_alloc_locked(pool, n);
+        if (first != NULL) {
+            return first;
+        }
 
-    if (node == NULL) {
+        return mps_queue_data(mps_queue_last(pool, &tree->lru_queue),
+                              mps_shdict_node_t, queue);
+    }
 
-        if (op & MPS_SHDICT_SAFE_STORE) {
-            mps_slab_unlock(pool);
+    ev = mps_shdict_tree_evict(tree);
 
-            *errmsg = "no memory";
-            return NGX_ERROR;
+    if (tree->flags & MPS_SHDICT_FLAG_EVICT_SIEVE) {
+        if (mps_queue_empty(pool, &tree->lru_queue)) {
+            return NULL;
         }
 
-        mps_log_debug(MPS_LOG_TAG,
-                      "lua shared dict set: overriding non-expired items "
-                      "due to memory shortage for entry \"%.*s\"",
-                      (int)key_len, key);
+        q = ev->hand != mps_nulloff ? mps_queue(pool, ev->hand)
+                                    : mps_queue_last(pool, &tree->lru_queue);
 
-        for (i = 0; i < 30; i++) {
-            if (mps_shdict_expire(pool, tree, 0) == 0) {
+        for (;;) {
+            sd = mps_queue_data(q, mps_shdict_node_t, queue);
+
+            if (!mps_shdict_clear_accessed(pool, tree, sd)) {
                 break;
             }
 
-            *forcible = 1;
+            q = mps_queue_prev(pool, q);
 
-            node = mps_slab_alloc_locked(pool, n);
-            if (node != NULL) {
-                goto allocated;
+            if (q == mps_queue_sentinel(pool, &tree->lru_queue)) {
+                q = mps_queue_last(pool, &tree->lru_queue);
             }
         }
 
-        mps_slab_unlock(pool);
+        /* freeing the entry moves the hand past it */
+        ev->hand = mps_offset(pool, q);
 
-        *errmsg = "no memory";
-        return NGX_ERROR;
+        return sd;
     }
 
-allocated:
+    for (;;) {
+        if (ev->nsmall != 0 &&
+            (ev->nsmall * 10 >= ev->count ||
+             mps_queue_empty(pool, &tree->lru_queue))) {
+            q = mps_queue_last(pool, &ev->small);
+            sd = mps_queue_data(q, mps_shdict_node_t, queue);
+
+            if (!mps_shdict_clear_accessed(pool, tree, sd)) {
+                return sd;
+            }
 
-    sd = (mps_shdict_node_t *)&node->color;
+            /* hit in the small queue, so it goes to the main one */
 
-    node->key = hash;
-    sd->key_len = (u_short)key_len;
+            mps_queue_remove(pool, q);
+            mps_queue_insert_head(pool, &tree->lru_queue, q);
+            ev->nsmall--;
 
-    if (exptime > 0) {
-        now = mps_clock_time_ms();
-        sd->expires = now + (uint64_t)exptime;
+            word = mps_shdict_bitmap(pool, ev->smap, sd, &m);
+            *word &= ~m;
 
-    } else {
-        sd->expires = 0;
-    }
+            continue;
+        }
 
-    sd->user_flags = user_flags;
-    sd->value_len = (uint32_t)str_value_len;
-    dd("setting value type to %d", value_type);
-    sd->value_type = (uint8_t)value_type;
+        if (mps_queue_empty(pool, &tree->lru_queue)) {
+            return NULL;
+        }
 
-    p = ngx_copy(sd->data, key, key_len);
-    ngx_memcpy(p, str_value_buf, str_value_len);
+        q = mps_queue_last(pool, &tree->lru_queue);
+        sd = mps_queue_data(q, mps_shdict_node_t, queue);
 
-    mps_rbtree_insert(pool, &tree->rbtree, node);
-    mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
-    mps_slab_unlock(pool);
+        if (!mps_shdict_clear_accessed(pool, tree, sd)) {
+            return sd;
+        }
 
-    return NGX_OK;
+        mps_queue_remove(pool, q);
+        mps_queue_insert_head(pool, &tree->lru_queue, q);
+    }
 }
 
-int mps_shdict_set(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                   int value_type, const u_char *str_value_buf,
-                   size_t str_value_len, double num_value, long exptime,
-                   int user_flags, char **errmsg, int *forcible)
+/*
+ * Free the entry chosen by mps_shdict_victim(). An entry freed from the small
+ * queue of S3-FIFO is remembered, so that it goes to the main queue if it is
+ * stored again soon.
+ */
+static void mps_shdict_free_victim(mps_slab_pool_t *pool,
+                                   mps_shdict_tree_t *tree,
+                                   mps_shdict_node_t *sd)
 {
-    return mps_shdict_store(dict, 0, key, key_len, value_type, str_value_buf,
-                            str_value_len, num_value, exptime, user_flags,
-                            errmsg, forcible);
-}
+    mps_shdict_evict_t *ev;
+    mps_rbtree_node_t *node;
+    uintptr_t *word, m;
 
-int mps_shdict_safe_set(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                        int value_type, const u_char *str_value_buf,
-                        size_t str_value_len, double num_value, long exptime,
-                        int user_flags, char **errmsg, int *forcible)
-{
-    return mps_shdict_store(dict, MPS_SHDICT_SAFE_STORE, key, key_len,
-                            value_type, str_value_buf, str_value_len, num_value,
-                            exptime, user_flags, errmsg, forcible);
+    if (tree->flags & MPS_SHDICT_FLAG_EVICT_S3FIFO) {
+        ev = mps_shdict_tree_evict(tree);
+        word = mps_shdict_bitmap(pool, ev->smap, sd, &m);
+
+        if (*word & m) {
+            node = (mps_rbtree_node_t *)((u_char *)sd -
+                                         offsetof(mps_rbtree_node_t, color));
+            ((uint32_t *)mps_ptr(pool, ev->ghost))[node->key &
+                                                   ev->ghost_mask] =
+                (uint32_t)node->key | 1;
+        }
+    }
+
+    mps_shdict_remove_node(pool, tree, sd);
 }
 
-int mps_shdict_add(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                   int value_type, const u_char *str_value_buf,
-                   size_t str_value_len, double num_value, long exptime,
-                   int user_flags, char **errmsg, int *forcible)
+/* Returns the counter of the hash in the row i of the sketch. */
+static ngx_inline u_char *mps_shdict_sketch_counter(mps_shdict_sketch_t *sk,
+                                                    uint32_t hash, ngx_uint_t i)
 {
-    return mps_shdict_store(dict, MPS_SHDICT_ADD, key, key_len, value_type,
-                            str_value_buf, str_value_len, num_value, exptime,
-                            user_flags, errmsg, forcible);
+    static const uint32_t seeds[MPS_SHDICT_SKETCH_DEPTH] = {
+        0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f};
+    uint32_t h;
+
+    h = hash * seeds[i];
+    h ^= h >> 17;
+
+    return (u_char *)(sk + 1) + i * (sk->mask + 1) + (h & sk->mask);
 }
 
-int mps_shdict_safe_add(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                        int value_type, const u_char *str_value_buf,
-                        size_t str_value_len, double num_value, long exptime,
-                        int user_flags, char **errmsg, int *forcible)
+/* Count an access to the key of hash if the dict has an admission filter. */
+static void mps_shdict_sketch_add(mps_slab_pool_t *pool,
+                                  mps_shdict_tree_t *tree, uint32_t hash)
 {
-    return mps_shdict_store(dict, MPS_SHDICT_ADD | MPS_SHDICT_SAFE_STORE, key,
-                            key_len, value_type, str_value_buf, str_value_len,
-                            num_value, exptime, user_flags, errmsg, forcible);
+    mps_shdict_sketch_t *sk;
+    u_char *c;
+    size_t i, n;
+
+    if (!(tree->flags & MPS_SHDICT_FLAG_ADMISSION)) {
+        return;
+    }
+
+    sk = (mps_shdict_sketch_t *)mps_ptr(pool,
+                                        mps_shdict_tree_evict(tree)->sketch);
+
+    for (i = 0; i < MPS_SHDICT_SKETCH_DEPTH; i++) {
+        c = mps_shdict_sketch_counter(sk, hash, i);
+
+        if (*c < MPS_SHDICT_SKETCH_MAX) {
+            (*c)++;
+        }
+    }
+
+    if (++sk->additions < sk->sample) {
+        return;
+    }
+
+    /* age the counters, so that keys which are not hit any more are not kept */
+
+    c = (u_char *)(sk + 1);
+    n = MPS_SHDICT_SKETCH_DEPTH * ((size_t)sk->mask + 1);
+
+    for (i = 0; i < n; i++) {
+        c[i] >>= 1;
+    }
+
+    sk->additions /= 2;
+    sk->agings++;
 }
 
-int mps_shdict_replace(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                       int value_type, const u_char *str_value_buf,
-                       size_t str_value_len, double num_value, long exptime,
-                       int user_flags, char **errmsg, int *forcible)
+static ngx_uint_t mps_shdict_sketch_estimate(mps_shdict_sketch_t *sk,
+                                             uint32_t hash)
 {
-    return mps_shdict_store(dict, MPS_SHDICT_REPLACE, key, key_len, value_type,
-                            str_value_buf, str_value_len, num_value, exptime,
-                            user_flags, errmsg, forcible);
+    ngx_uint_t i, min;
+    u_char c;
+
+    min = MPS_SHDICT_SKETCH_MAX;
+
+    for (i = 0; i < MPS_SHDICT_SKETCH_DEPTH; i++) {
+        c = *mps_shdict_sketch_counter(sk, hash, i);
+        min = ngx_min(min, c);
+    }
+
+    return min;
 }
 
-int mps_shdict_delete(mps_shdict_t *dict, const u_char *key, size_t key_len)
+/*
+ * Returns 0 if a new entry of hash and size must not be stored by freeing
+ * entries by force, because its key is less frequent than the entry which
+ * would be freed first.
+ */
+static ngx_uint_t mps_shdict_admit(mps_slab_pool_t *pool,
+                                   mps_shdict_tree_t *tree, uint32_t hash,
+                                   size_t size)
 {
-    int forcible = 0;
-    return mps_shdict_store(dict, 0, key, key_len, MPS_SHDICT_TNIL, NULL, 0, 0,
-                            0, 0, NULL, &forcible);
+    mps_shdict_sketch_t *sk;
+    mps_shdict_node_t *sd;
+    mps_rbtree_node_t *node;
+
+    if (!(tree->flags & MPS_SHDICT_FLAG_ADMISSION)) {
+        return 1;
+    }
+
+    sd = mps_shdict_victim(pool, tree, mps_slab_alloc_size(pool, size));
+    if (sd == NULL) {
+        return 1;
+    }
+
+    node = (mps_rbtree_node_t *)((u_char *)sd -
+                                 offsetof(mps_rbtree_node_t, color));
+
+    sk = (mps_shdict_sketch_t *)mps_ptr(pool,
+                                        mps_shdict_tree_evict(tree)->sketch);
+
+    return mps_shdict_sketch_estimate(sk, hash) >=
+           mps_shdict_sketch_estimate(sk, (uint32_t)node->key);
 }
 
-int mps_shdict_get(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                   int *value_type, u_char **str_value_buf,
-                   size_t *str_value_len, double *num_value, int *user_flags,
-                   int get_stale, int *is_stale, char **err)
+/*
+ * Insert the node to the index of keys, and to the expiry tree if needed. The
+ * key, value and expires of the node must have been set.
+ */
+static void mps_shdict_index_insert(mps_slab_pool_t *pool,
+                                    mps_shdict_tree_t *tree,
+                                    mps_rbtree_node_t *node)
 {
-    mps_slab_pool_t *pool;
-    uint32_t hash;
-    ngx_int_t rc;
+    mps_htable_t *ht;
+    mps_queue_t *q, *queues[2];
     mps_shdict_node_t *sd;
-    ngx_str_t value;
+    mps_shdict_timer_t *t;
+    mps_shdict_wheel_timer_t *wt;
+    mps_rbtree_node_t *n;
+    ngx_uint_t i, nqueues;
 
-    hash = ngx_murmur_hash2(key, key_len);
+    mps_shdict_gen_update(tree, (mps_shdict_node_t *)&node->color);
+    mps_shdict_version_update(tree, (mps_shdict_node_t *)&node->color);
 
-    pool = dict->pool;
-    mps_slab_lock(pool);
+    if (tree->expiry != mps_nulloff) {
+        sd = (mps_shdict_node_t *)&node->color;
 
-    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+        if (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL) {
+            wt = mps_shdict_wheel_timer(sd);
+            wt->expires = 0;
+            wt->entry = mps_offset(pool, node);
 
-    if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
-        mps_slab_unlock(pool);
-        *value_type = MPS_SHDICT_TNIL;
-        return NGX_OK;
+        } else {
+            t = mps_shdict_timer(sd);
+            t->node.key = 0;
+            t->entry = mps_offset(pool, node);
+        }
+
+        mps_shdict_timer_update(pool, tree, sd);
     }
 
-    *value_type = sd->value_type;
+    if (tree->index == mps_nulloff) {
+        mps_rbtree_insert(pool, &tree->rbtree, node);
+        return;
+    }
 
-    dd("data: %p", sd->data);
-    dd("key len: %d", (int)sd->key_len);
+    ht = mps_shdict_index(pool, tree);
 
-    value.data = sd->data + sd->key_len;
-    value.len = (size_t)sd->value_len;
+    if (mps_htable_insert(pool, ht, (uint32_t)node->key,
+                          mps_offset(pool, node)) != NGX_AGAIN) {
+        return;
+    }
 
-    if (*str_value_len < (size_t)value.len) {
-        if (*value_type == MPS_SHDICT_TBOOLEAN) {
-            mps_slab_unlock(pool);
-            return NGX_ERROR;
-        }
+    /* too many deleted slots, the node is not in a queue yet */
 
-        if (*value_type == MPS_SHDICT_TSTRING) {
-            *str_value_buf = malloc(value.len);
-            if (*str_value_buf == NULL) {
-                mps_slab_unlock(pool);
-                return NGX_ERROR;
-            }
+    mps_htable_clear(ht);
+
+    nqueues = mps_shdict_queues(tree, queues);
+
+    for (i = 0; i < nqueues; i++) {
+        for (q = mps_queue_head(pool, queues[i]);
+             q != mps_queue_sentinel(pool, queues[i]);
+             q = mps_queue_next(pool, q)) {
+            sd = mps_queue_data(q, mps_shdict_node_t, queue);
+            n = (mps_rbtree_node_t *)((u_char *)sd -
+                                      offsetof(mps_rbtree_node_t, color));
+
+            (void)mps_htable_insert(pool, ht, (uint32_t)n->key,
+                                    mps_offset(pool, n));
         }
     }
 
-    switch (*value_type) {
+    (void)mps_htable_insert(pool, ht, (uint32_t)node->key,
+                            mps_offset(pool, node));
+}
 
-    case MPS_SHDICT_TSTRING:
-        *str_value_len = value.len;
-        ngx_memcpy(*str_value_buf, value.data, value.len);
-        break;
+static void mps_shdict_index_delete(mps_slab_pool_t *pool,
+                                    mps_shdict_tree_t *tree,
+                                    mps_rbtree_node_t *node)
+{
+    mps_shdict_timer_t *t;
+    mps_shdict_wheel_timer_t *wt;
 
-    case MPS_SHDICT_TNUMBER:
+    tree->version++;
 
-        if (value.len != sizeof(double)) {
-            mps_slab_unlock(pool);
-            mps_log_error("bad lua number value size found for key %.*s"
-                          "in dict \"%.*s\": %lu",
-                          (int)key_len, key, (int)dict->name.len,
-                          dict->name.data, value.len);
-            return NGX_ERROR;
-        }
+    if (tree->expiry != mps_nulloff &&
+        (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL)) {
+        wt = mps_shdict_wheel_timer((mps_shdict_node_t *)&node->color);
 
-        *str_value_len = value.len;
-        ngx_memcpy(num_value, value.data, sizeof(double));
-        break;
+        if (wt->expires != 0) {
+            mps_queue_remove(pool, &wt->queue);
+        }
 
-    case MPS_SHDICT_TBOOLEAN:
+    } else if (tree->expiry != mps_nulloff) {
+        t = mps_shdict_timer((mps_shdict_node_t *)&node->color);
 
-        if (value.len != sizeof(u_char)) {
-            mps_slab_unlock(pool);
-            mps_log_error("bad lua boolean value size found for key %.*s"
-                          "in dict \"%.*s\": %lu",
-                          (int)key_len, key, (int)dict->name.len,
-                          dict->name.data, value.len);
-            return NGX_ERROR;
+        if (t->node.key != 0) {
+            mps_rbtree_delete(pool, &mps_shdict_expiry(pool, tree)->rbtree,
+                              &t->node);
         }
+    }
 
-        ngx_memcpy(*str_value_buf, value.data, value.len);
-        break;
+    if (tree->index == mps_nulloff) {
+        mps_rbtree_delete(pool, &tree->rbtree, node);
+        return;
+    }
 
-    case MPS_SHDICT_TLIST:
+    (void)mps_htable_delete(pool, mps_shdict_index(pool, tree),
+                            (uint32_t)node->key, mps_offset(pool, node));
+}
 
-        mps_slab_unlock(pool);
+static ngx_int_t mps_shdict_lookup(mps_slab_pool_t *pool, ngx_uint_t hash,
+                                   const u_char *kdata, size_t klen,
+                                   mps_shdict_node_t **sdp)
+{
+    mps_shdict_tree_t *tree;
+    uint64_t now;
+    int64_t ms;
+    mps_shdict_node_t *sd;
 
-        *err = "value is a list";
-        return NGX_ERROR;
+    tree = mps_shdict_tree(pool);
 
-    default:
+    mps_shdict_sketch_add(pool, tree, (uint32_t)hash);
 
-        mps_slab_unlock(pool);
-        mps_log_error("bad value type found for key %.*s"
-                      " in dict \"%.*s\": %d",
-                      (int)key_len, key, (int)dict->name.len, dict->name.data,
-                      *value_type);
-        return NGX_ERROR;
+    if (mps_shdict_peek(pool, hash, kdata, klen, &sd) == NGX_DECLINED) {
+        *sdp = NULL;
+        return NGX_DECLINED;
     }
 
-    *user_flags = sd->user_flags;
-    dd("user flags: %d", *user_flags);
+    mps_shdict_queue_touch(pool, tree, sd);
 
-    mps_slab_unlock(pool);
+    *sdp = sd;
 
-    if (get_stale) {
+    dd("node expires: %lld", (long long)sd->expires);
 
-        /* always return value, flags, stale */
+    if (mps_shdict_flushed(tree, sd)) {
+        return NGX_DONE;
+    }
 
-        *is_stale = (rc == NGX_DONE);
-        return NGX_OK;
+    if (sd->expires != 0) {
+        now = mps_clock_time_ms();
+        ms = sd->expires - now;
+
+        dd("time to live: %lld", (long long)ms);
+
+        if (ms < 0) {
+            dd("node already expired");
+            return NGX_DONE;
+        }
     }
 
     return NGX_OK;
 }
 
-int mps_shdict_incr(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                    double *value, char **err, int has_init, double init,
-                    long init_ttl, int *forcible)
+static int mps_shdict_expire(mps_slab_pool_t *pool, mps_shdict_tree_t *tree,
+                             ngx_uint_t n)
 {
-    mps_slab_pool_t *pool;
-    int i, n;
-    uint32_t hash;
-    ngx_int_t rc;
-    uint64_t now = 0;
-    mps_shdict_tree_t *tree;
-    mps_shdict_node_t *sd;
-    double num;
+    uint64_t now;
+    mps_queue_t *q, *list_queue, *lq, *queues[2];
+    int64_t ms;
     mps_rbtree_node_t *node;
-    u_char *p;
-    mps_queue_t *queue, *q;
+    mps_shdict_node_t *sd;
+    int freed = 0;
+    ngx_uint_t i, k, nqueues, rotated = 0;
+    mps_shdict_list_node_t *lnode;
 
-    if (init_ttl > 0) {
-        now = mps_clock_time_ms();
+    now = mps_clock_time_ms();
+
+    if (tree->expiry != mps_nulloff) {
+        freed = (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL)
+                    ? (int)mps_shdict_wheel_expire(pool, tree, now,
+                                                   MPS_SHDICT_EXPIRE_TIMERS)
+                    : (int)mps_shdict_expire_timers(pool, tree, now,
+                                                    MPS_SHDICT_EXPIRE_TIMERS);
+
+        /* freeing expired entries is enough to make room */
+        if (n == 0 && freed) {
+            return freed;
+        }
     }
 
-    pool = dict->pool;
-    tree = mps_shdict_tree(pool);
+    if (n == 0) {
+        sd = mps_shdict_victim(pool, tree, 0);
+        if (sd == NULL) {
+            return freed;
+        }
 
-    *forcible = 0;
+        mps_shdict_free_victim(pool, tree, sd);
+        freed++;
+        n = 1;
+    }
 
-    hash = ngx_murmur_hash2(key, key_len);
+    /*
+     * n == 1 deletes one or two expired entries of each queue
+     * n == 0 deletes the victim of the eviction policy by force
+     *        and one or two zero rate entries
+     */
 
-    // dd("looking up key %.*s in shared dict %.*s", (int) key_len, key,
-    //    (int) ctx->name.len, ctx->name.data);
+    nqueues = mps_shdict_queues(tree, queues);
 
-    mps_slab_lock(pool);
-#if 1
-    mps_shdict_expire(pool, tree, 1);
-#endif
+    for (i = 0; i < nqueues; i++) {
+
+        k = n;
+
+        while (k < 3) {
+
+            if (mps_queue_empty(pool, queues[i])) {
+                break;
+            }
+
+            q = mps_queue_last(pool, queues[i]);
+
+            sd = mps_queue_data(q, mps_shdict_node_t, queue);
+
+            if ((sd->expires == 0 || (int64_t)(sd->expires - now) > 0) &&
+                !mps_shdict_flushed(tree, sd) &&
+                rotated < MPS_SHDICT_EXPIRE_ROTATE &&
+                !(tree->flags & (MPS_SHDICT_FLAG_EVICT_SIEVE |
+                                 MPS_SHDICT_FLAG_EVICT_S3FIFO)) &&
+                mps_shdict_clear_accessed(pool, tree, sd)) {
+
+                /* read since the last sweep */
+
+                mps_queue_remove(pool, q);
+                mps_queue_insert_head(pool, queues[i], q);
+                rotated++;
+                continue;
+            }
+
+            if (k++ != 0 && !mps_shdict_flushed(tree, sd)) {
+
+                if (sd->expires == 0) {
+                    break;
+                }
+
+                ms = sd->expires - now;
+                if (ms > 0) {
+                    break;
+                }
+            }
+
+            if (sd->value_type == MPS_SHDICT_TLIST) {
+                list_queue = mps_shdict_get_list_head(sd, sd->key_len);
+
+                for (lq = mps_queue_head(pool, list_queue);
+                     lq != mps_queue_sentinel(pool, list_queue);
+                     lq = mps_queue_next(pool, lq)) {
+                    lnode = mps_queue_data(lq, mps_shdict_list_node_t, queue);
+
+                    mps_slab_free_locked(pool, lnode);
+                }
+            }
+
+            mps_shdict_queue_remove(pool, tree, sd);
+
+            node = (mps_rbtree_node_t *)((u_char *)sd -
+                                         offsetof(mps_rbtree_node_t, color));
+
+            mps_shdict_index_delete(pool, tree, node);
+
+            mps_slab_free_locked(pool, node);
+
+            freed++;
+        }
+    }
+
+    return freed;
+}
+
+/*
+ * Free an entry by force to make room for an allocation of size. Returns the
+ * count of entries freed.
+ */
+static int mps_shdict_evict(mps_slab_pool_t *pool, mps_shdict_tree_t *tree,
+                            size_t size)
+{
+    mps_shdict_node_t *sd;
+
+    sd = mps_shdict_victim(pool, tree, mps_slab_alloc_size(pool, size));
+    if (sd == NULL) {
+        return 0;
+    }
+
+    mps_shdict_free_victim(pool, tree, sd);
+
+    return 1;
+}
+
+/*
+ * Set str_value_buf and str_value_len to the bytes stored for the value. c is
+ * the storage for a boolean.
+ */
+static ngx_int_t mps_shdict_store_value(int op, int value_type,
+                                        const u_char **str_value_buf,
+                                        size_t *str_value_len,
+                                        double *num_value, u_char *c,
+                                        char **errmsg)
+{
+    switch (value_type) {
+
+    case MPS_SHDICT_TSTRING:
+        /* do nothing */
+        break;
+
+    case MPS_SHDICT_TNUMBER:
+        dd("num value: %lf", *num_value);
+        *str_value_buf = (u_char *)num_value;
+        *str_value_len = sizeof(double);
+        break;
+
+    case MPS_SHDICT_TBOOLEAN:
+        *c = *num_value ? 1 : 0;
+        *str_value_buf = c;
+        *str_value_len = sizeof(u_char);
+        break;
+
+    case MPS_SHDICT_TINT64:
+        if (*str_value_len != sizeof(int64_t)) {
+            *errmsg = "bad int64 value size";
+            return NGX_ERROR;
+        }
+        break;
+
+    case MPS_SHDICT_TNIL:
+        if (op & (MPS_SHDICT_ADD | MPS_SHDICT_REPLACE)) {
+            *errmsg = "attempt to add or replace nil values";
+            return NGX_ERROR;
+        }
+
+        *str_value_buf = NULL;
+        *str_value_len = 0;
+        break;
+
+    default:
+        *errmsg = "unsupported value type";
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* Store the value in the locked pool. The caller syncs the key if needed. */
+static int mps_shdict_store_locked(mps_shdict_t *dict, mps_slab_pool_t *pool,
+                                   int op, uint32_t hash, const u_char *key,
+                                   size_t key_len, int value_type,
+                                   const u_char *str_value_buf,
+                                   size_t str_value_len, long exptime,
+                                   int user_flags, char **errmsg,
+                                   int *forcible)
+{
+    mps_shdict_tree_t *tree;
+    int i, n;
+    ngx_int_t rc;
+    mps_queue_t *queue, *q;
+    mps_rbtree_node_t *node;
+    mps_shdict_node_t *sd;
+    u_char *p;
+    uint64_t now;
+
+    tree = mps_shdict_tree(pool);
+
+    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+    dd("lookup returns %d", (int)rc);
+
+    if (op & MPS_SHDICT_REPLACE) {
+
+        if (rc == NGX_DECLINED || rc == NGX_DONE) {
+            *errmsg = "not found";
+            return NGX_DECLINED;
+        }
+
+        /* rc == NGX_OK */
+
+        goto replace;
+    }
+
+    if (op & MPS_SHDICT_ADD) {
+
+        if (rc == NGX_OK) {
+            *errmsg = "exists";
+            return NGX_DECLINED;
+        }
+
+        if (rc == NGX_DONE) {
+            /* exists but expired */
+
+            dd("go to replace");
+            goto replace;
+        }
+
+        /* rc == NGX_DECLINED */
+
+        dd("go to insert");
+        goto insert;
+    }
+
+    if (rc == NGX_OK || rc == NGX_DONE) {
+
+        if (value_type == MPS_SHDICT_TNIL) {
+            goto remove;
+        }
+
+    replace:
+
+        if (str_value_buf && str_value_len == (size_t)sd->value_len &&
+            sd->value_type != MPS_SHDICT_TLIST) {
+
+            mps_log_debug(MPS_LOG_TAG,
+                          "lua shared tree set in dict \"%.*s\": "
+                          "found old entry and value size matched, reusing it",
+                          (int)dict->name.len, dict->name.data);
+
+            mps_shdict_queue_touch(pool, tree, sd);
+
+            if (exptime > 0) {
+                sd->expires = mps_clock_time_ms() + (uint64_t)exptime;
+
+            } else {
+                sd->expires = 0;
+            }
+
+            mps_shdict_timer_update(pool, tree, sd);
+            mps_shdict_gen_update(tree, sd);
+            mps_shdict_version_update(tree, sd);
+
+            sd->user_flags = user_flags;
+
+            dd("setting value type to %d", value_type);
+
+            sd->value_type = (uint8_t)value_type;
+
+            ngx_memcpy(sd->data + key_len, str_value_buf, str_value_len);
+
+            return NGX_OK;
+        }
+
+        mps_log_debug(
+            MPS_LOG_TAG,
+            "lua shared dict set in dict \"%.*s\": "
+            "found old entry but value size NOT matched, removing it first",
+            (int)dict->name.len, dict->name.data);
+
+    remove:
+
+        if (sd->value_type == MPS_SHDICT_TLIST) {
+            queue = mps_shdict_get_list_head(sd, key_len);
+
+            for (q = mps_queue_head(pool, queue);
+                 q != mps_queue_sentinel(pool, queue);
+                 q = mps_queue_next(pool, q)) {
+                p = (u_char *)mps_queue_data(q, mps_shdict_list_node_t, queue);
+
+                mps_slab_free_locked(pool, p);
+            }
+        }
+
+        mps_shdict_queue_remove(pool, tree, sd);
+
+        node = (mps_rbtree_node_t *)((u_char *)sd -
+                                     offsetof(mps_rbtree_node_t, color));
+
+        mps_shdict_index_delete(pool, tree, node);
+
+        mps_slab_free_locked(pool, node);
+    }
+
+insert:
+
+    /* rc == NGX_DECLINED or value size unmatch */
+
+    if (str_value_buf == NULL) {
+        return NGX_OK;
+    }
+
+    mps_log_debug(MPS_LOG_TAG,
+                  "lua shared dict set in dict \"%.*s\": creating a new entry",
+                  (int)dict->name.len, dict->name.data);
+
+    n = mps_shdict_node_size(tree, offsetof(mps_rbtree_node_t, color) +
+                                       offsetof(mps_shdict_node_t, data) +
+                                       key_len + str_value_len);
+
+    node = mps_slab_alloc_locked(pool, n);
+
+    if (node == NULL) {
+
+        if (op & MPS_SHDICT_SAFE_STORE) {
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+
+        /* an existing key already held space, so it is not filtered */
+
+        if (rc == NGX_DECLINED && !mps_shdict_admit(pool, tree, hash, n)) {
+            mps_log_debug(MPS_LOG_TAG,
+                          "lua shared dict set: entry \"%.*s\" is less "
+                          "frequent than the entries to be overridden",
+                          (int)key_len, key);
+
+            *errmsg = "not admitted";
+            return NGX_ERROR;
+        }
+
+        mps_log_debug(MPS_LOG_TAG,
+                      "lua shared dict set: overriding non-expired items "
+                      "due to memory shortage for entry \"%.*s\"",
+                      (int)key_len, key);
+
+        for (i = 0; i < 30; i++) {
+            if (mps_shdict_evict(pool, tree, n) == 0) {
+                break;
+            }
+
+            *forcible = 1;
+
+            node = mps_slab_alloc_locked(pool, n);
+            if (node != NULL) {
+                goto allocated;
+            }
+        }
+
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+allocated:
+
+    sd = (mps_shdict_node_t *)&node->color;
+
+    node->key = hash;
+    sd->key_len = (u_short)key_len;
+
+    if (exptime > 0) {
+        now = mps_clock_time_ms();
+        sd->expires = now + (uint64_t)exptime;
+
+    } else {
+        sd->expires = 0;
+    }
+
+    sd->user_flags = user_flags;
+    sd->value_len = (uint32_t)str_value_len;
+    dd("setting value type to %d", value_type);
+    sd->value_type = (uint8_t)value_type;
+
+    p = ngx_copy(sd->data, key, key_len);
+    ngx_memcpy(p, str_value_buf, str_value_len);
+
+    mps_shdict_index_insert(pool, tree, node);
+    mps_shdict_queue_insert(pool, tree, sd);
+
+    return NGX_OK;
+}
+
+/* This function is exported for Lua. */
+
+int mps_shdict_store(mps_shdict_t *dict, int op, const u_char *key,
+                     size_t key_len, int value_type,
+                     const u_char *str_value_buf, size_t str_value_len,
+                     double num_value, long exptime, int user_flags,
+                     char **errmsg, int *forcible)
+{
+    mps_slab_pool_t *pool;
+    uint32_t hash;
+    u_char c;
+    int rc;
+
+    *forcible = 0;
+
+    if (mps_shdict_store_value(op, value_type, &str_value_buf, &str_value_len,
+                               &num_value, &c, errmsg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
+
+    mps_slab_lock(pool);
+
+#if 1
+    mps_shdict_expire(pool, mps_shdict_tree(pool), 1);
+#endif
+
+    rc = mps_shdict_store_locked(dict, pool, op, hash, key, key_len,
+                                 value_type, str_value_buf, str_value_len,
+                                 exptime, user_flags, errmsg, forcible);
+
+    mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+    return rc;
+}
+
+int mps_shdict_cas(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                   uint64_t *version, int value_type,
+                   const u_char *str_value_buf, size_t str_value_len,
+                   double num_value, long exptime, int user_flags,
+                   char **errmsg, int *forcible)
+{
+    mps_slab_pool_t *pool;
+    mps_shdict_node_t *sd;
+    uint64_t current;
+    uint32_t hash;
+    u_char c;
+    int rc;
+
+    *forcible = 0;
+
+    if (mps_shdict_store_value(0, value_type, &str_value_buf, &str_value_len,
+                               &num_value, &c, errmsg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
+
+    mps_slab_lock(pool);
+
+    mps_shdict_expire(pool, mps_shdict_tree(pool), 1);
+
+    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+    current = (rc == NGX_OK) ? sd->version : 0;
+
+    if (current != *version) {
+        mps_slab_unlock(pool);
+        *version = current;
+        return NGX_DECLINED;
+    }
+
+    rc = mps_shdict_store_locked(dict, pool, 0, hash, key, key_len,
+                                 value_type, str_value_buf, str_value_len,
+                                 exptime, user_flags, errmsg, forcible);
+
+    if (rc == NGX_OK) {
+        *version = (mps_shdict_peek(pool, hash, key, key_len, &sd) == NGX_OK)
+                       ? sd->version
+                       : 0;
+    }
+
+    mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+    return rc;
+}
+
+/* Set or delete the items, taking the lock of each shard once. */
+static int mps_shdict_mstore(mps_shdict_t *dict,
+                             mps_shdict_mset_item_t *items, ngx_uint_t n,
+                             ngx_uint_t delete)
+{
+    mps_slab_pool_t *main, *pool;
+    mps_shdict_mset_item_t *it;
+    const u_char *buf;
+    uint32_t *hashes;
+    ngx_uint_t i, s, nshards, failed;
+    size_t len;
+    double num;
+    u_char c;
+
+    hashes = malloc(n * sizeof(uint32_t));
+    if (hashes == NULL && n > 0) {
+        return NGX_ERROR;
+    }
+
+    failed = 0;
+
+    for (i = 0; i < n; i++) {
+        it = &items[i];
+        it->err = NULL;
+        it->forcible = 0;
+
+        if (delete) {
+            it->value_type = MPS_SHDICT_TNIL;
+        }
+
+        hashes[i] = ngx_murmur_hash2(it->key, it->key_len);
+    }
+
+    main = mps_shdict_main(dict);
+    nshards = mps_shdict_tree(main)->nshards;
+
+    for (s = 0; s < nshards; s++) {
+        pool = mps_shdict_shard_at(main, s);
+
+        mps_slab_lock(pool);
+
+        mps_shdict_expire(pool, mps_shdict_tree(pool), 1);
+
+        for (i = 0; i < n; i++) {
+            if (hashes[i] % nshards != s) {
+                continue;
+            }
+
+            it = &items[i];
+            buf = it->str_value_buf;
+            len = it->str_value_len;
+            num = it->num_value;
+
+            it->rc = mps_shdict_store_value(0, it->value_type, &buf, &len,
+                                            &num, &c, &it->err);
+            if (it->rc == NGX_OK) {
+                it->rc = mps_shdict_store_locked(
+                    dict, pool, 0, hashes[i], it->key, it->key_len,
+                    it->value_type, buf, len, it->exptime, it->user_flags,
+                    &it->err, &it->forcible);
+
+                mps_shdict_sync_key(dict, pool, hashes[i], it->key,
+                                    it->key_len);
+            }
+
+            if (it->rc != NGX_OK) {
+                failed++;
+            }
+        }
+
+        mps_slab_unlock(pool);
+    }
+
+    free(hashes);
+
+    return failed ? NGX_DECLINED : NGX_OK;
+}
+
+int mps_shdict_mset(mps_shdict_t *dict, mps_shdict_mset_item_t *items,
+                    ngx_uint_t n)
+{
+    return mps_shdict_mstore(dict, items, n, 0);
+}
+
+int mps_shdict_mdelete(mps_shdict_t *dict, mps_shdict_mset_item_t *items,
+                       ngx_uint_t n)
+{
+    return mps_shdict_mstore(dict, items, n, 1);
+}
+
+int mps_shdict_set(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                   int value_type, const u_char *str_value_buf,
+                   size_t str_value_len, double num_value, long exptime,
+                   int user_flags, char **errmsg, int *forcible)
+{
+    return mps_shdict_store(dict, 0, key, key_len, value_type, str_value_buf,
+                            str_value_len, num_value, exptime, user_flags,
+                            errmsg, forcible);
+}
+
+int mps_shdict_safe_set(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                        int value_type, const u_char *str_value_buf,
+                        size_t str_value_len, double num_value, long exptime,
+                        int user_flags, char **errmsg, int *forcible)
+{
+    return mps_shdict_store(dict, MPS_SHDICT_SAFE_STORE, key, key_len,
+                            value_type, str_value_buf, str_value_len, num_value,
+                            exptime, user_flags, errmsg, forcible);
+}
+
+int mps_shdict_add(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                   int value_type, const u_char *str_value_buf,
+                   size_t str_value_len, double num_value, long exptime,
+                   int user_flags, char **errmsg, int *forcible)
+{
+    return mps_shdict_store(dict, MPS_SHDICT_ADD, key, key_len, value_type,
+                            str_value_buf, str_value_len, num_value, exptime,
+                            user_flags, errmsg, forcible);
+}
+
+int mps_shdict_safe_add(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                        int value_type, const u_char *str_value_buf,
+                        size_t str_value_len, double num_value, long exptime,
+                        int user_flags, char **errmsg, int *forcible)
+{
+    return mps_shdict_store(dict, MPS_SHDICT_ADD | MPS_SHDICT_SAFE_STORE, key,
+                            key_len, value_type, str_value_buf, str_value_len,
+                            num_value, exptime, user_flags, errmsg, forcible);
+}
+
+int mps_shdict_replace(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                       int value_type, const u_char *str_value_buf,
+                       size_t str_value_len, double num_value, long exptime,
+                       int user_flags, char **errmsg, int *forcible)
+{
+    return mps_shdict_store(dict, MPS_SHDICT_REPLACE, key, key_len, value_type,
+                            str_value_buf, str_value_len, num_value, exptime,
+                            user_flags, errmsg, forcible);
+}
+
+int mps_shdict_delete(mps_shdict_t *dict, const u_char *key, size_t key_len)
+{
+    int forcible = 0;
+    return mps_shdict_store(dict, 0, key, key_len, MPS_SHDICT_TNIL, NULL, 0, 0,
+                            0, 0, NULL, &forcible);
+}
+
+/*
+ * Nodes may be relinked or freed by a writer while a lock-free reader walks
+ * the tree, so every offset is checked to stay inside the pool before it is
+ * dereferenced. What was read is used only if pool->seq did not change.
+ */
+
+#define mps_shdict_valid_off(pool, off, size)                                  \
+    ((off) >= (pool)->start && (off) <= (pool)->end - (size))
+
+static ngx_int_t mps_shdict_lookup_lockfree(mps_slab_pool_t *pool,
+                                            ngx_uint_t hash,
+                                            const u_char *kdata, size_t klen,
+                                            mps_shdict_node_t **sdp)
+{
+    mps_shdict_tree_t *tree;
+    mps_ptroff_t off, sentinel;
+    mps_rbtree_node_t *node;
+    mps_shdict_node_t *sd;
+    mps_htable_iter_t it;
+    ngx_uint_t depth;
+    ngx_int_t rc;
+    size_t len;
+    uint64_t expires;
+
+    tree = mps_shdict_tree(pool);
+
+    if (tree->index != mps_nulloff) {
+        for (off = mps_htable_first(mps_shdict_index(pool, tree), hash, &it);
+             off != mps_nulloff;
+             off = mps_htable_next(mps_shdict_index(pool, tree), &it)) {
+
+            if (!mps_shdict_valid_off(pool, off,
+                                      MPS_SHDICT_NODE_HEADER_SIZE)) {
+                return NGX_AGAIN;
+            }
+
+            node = mps_rbtree_node(pool, off);
+            if (node->key != hash) {
+                continue;
+            }
+
+            sd = (mps_shdict_node_t *)&node->color;
+
+            len = sd->key_len;
+            if (!mps_shdict_valid_off(pool, mps_offset(pool, sd->data), len)) {
+                return NGX_AGAIN;
+            }
+
+            if (ngx_memn2cmp(kdata, sd->data, klen, len) == 0) {
+                goto found;
+            }
+        }
+
+        *sdp = NULL;
+
+        return NGX_DECLINED;
+    }
+
+    off = tree->rbtree.root;
+    sentinel = tree->rbtree.sentinel;
+
+    for (depth = 0; off != sentinel; depth++) {
+
+        if (depth == MPS_SHDICT_LOCKFREE_DEPTH ||
+            !mps_shdict_valid_off(pool, off, MPS_SHDICT_NODE_HEADER_SIZE)) {
+            return NGX_AGAIN;
+        }
+
+        node = mps_rbtree_node(pool, off);
+
+        if (hash < node->key) {
+            off = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            off = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sd = (mps_shdict_node_t *)&node->color;
+
+        len = sd->key_len;
+        if (!mps_shdict_valid_off(pool, mps_offset(pool, sd->data), len)) {
+            return NGX_AGAIN;
+        }
+
+        rc = ngx_memn2cmp(kdata, sd->data, klen, len);
+
+        if (rc == 0) {
+            goto found;
+        }
+
+        off = (rc < 0) ? node->left : node->right;
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+
+found:
+
+    *sdp = sd;
+
+    expires = sd->expires;
+    if (expires != 0 && (int64_t)(expires - mps_clock_time_ms()) < 0) {
+        return NGX_DONE;
+    }
+
+    if (mps_shdict_flushed(tree, sd)) {
+        return NGX_DONE;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Returns NGX_AGAIN when the value could not be read consistently or it
+ * needs an error report, then the caller retries with the lock held.
+ */
+static int mps_shdict_get_lockfree(mps_slab_pool_t *pool, uint32_t hash,
+                                   const u_char *key, size_t key_len,
+                                   int *value_type, u_char **str_value_buf,
+                                   size_t *str_value_len, double *num_value,
+                                   int *user_flags, int get_stale,
+                                   int *is_stale, uint64_t known,
+                                   uint64_t *version)
+{
+    mps_atomic_uint_t seq;
+    ngx_int_t rc;
+    ngx_uint_t i;
+    mps_shdict_node_t *sd;
+    u_char *data, *buf, *dst, c;
+    size_t len, buf_len;
+    int type, flags;
+    double num;
+    int64_t i64;
+    uint64_t ver;
+
+    buf = NULL;
+    buf_len = 0;
+    num = 0;
+    i64 = 0;
+    c = 0;
+
+    for (i = 0; i < MPS_SHDICT_LOCKFREE_TRIES; i++) {
+
+        seq = pool->seq;
+        mps_read_barrier();
+
+        if (seq & 1) {
+            mps_cpu_pause();
+            continue;
+        }
+
+        rc = mps_shdict_lookup_lockfree(pool, hash, key, key_len, &sd);
+
+        if (rc == NGX_AGAIN) {
+            continue;
+        }
+
+        if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
+            mps_read_barrier();
+            if (pool->seq != seq) {
+                continue;
+            }
+
+            free(buf);
+            *value_type = MPS_SHDICT_TNIL;
+            *version = 0;
+            return NGX_OK;
+        }
+
+        type = sd->value_type;
+        flags = sd->user_flags;
+        len = sd->value_len;
+        data = sd->data + sd->key_len;
+
+        /* an in-place incr changes the version after the value */
+        ver = sd->version;
+        mps_read_barrier();
+
+        if (ver == known) {
+            mps_read_barrier();
+            if (pool->seq != seq) {
+                continue;
+            }
+
+            free(buf);
+            mps_shdict_mark_accessed(pool, mps_shdict_tree(pool), sd);
+            return NGX_DECLINED;
+        }
+
+        if (!mps_shdict_valid_off(pool, mps_offset(pool, data), len)) {
+            continue;
+        }
+
+        dst = NULL;
+
+        switch (type) {
+
+        case MPS_SHDICT_TSTRING:
+            if (*str_value_len >= len) {
+                dst = *str_value_buf;
+
+            } else {
+                if (buf_len < len) {
+                    free(buf);
+                    buf = malloc(len);
+                    if (buf == NULL) {
+                        return NGX_ERROR;
+                    }
+                    buf_len = len;
+                }
+
+                dst = buf;
+            }
+
+            ngx_memcpy(dst, data, len);
+            break;
+
+        case MPS_SHDICT_TNUMBER:
+            if (len != sizeof(double)) {
+                goto locked;
+            }
+
+            ngx_memcpy(&num, data, sizeof(double));
+            break;
+
+        case MPS_SHDICT_TINT64:
+            if (len != sizeof(int64_t) || *str_value_len < len) {
+                goto locked;
+            }
+
+            /* a single load, since incr may update it without the lock */
+            ngx_memcpy(&i64, data, sizeof(int64_t));
+            break;
+
+        case MPS_SHDICT_TBOOLEAN:
+            if (len != sizeof(u_char) || *str_value_len < len) {
+                goto locked;
+            }
+
+            c = *data;
+            break;
+
+        default:
+            /* errors are reported by the locked get */
+            goto locked;
+        }
+
+        mps_read_barrier();
+        if (pool->seq != seq) {
+            continue;
+        }
+
+        mps_shdict_mark_accessed(pool, mps_shdict_tree(pool), sd);
+
+        *value_type = type;
+        *version = ver;
+
+        switch (type) {
+
+        case MPS_SHDICT_TSTRING:
+            if (dst == buf) {
+                *str_value_buf = buf;
+                buf = NULL;
+            }
+            *str_value_len = len;
+            break;
+
+        case MPS_SHDICT_TNUMBER:
+            *str_value_len = len;
+            *num_value = num;
+            break;
+
+        case MPS_SHDICT_TINT64:
+            *str_value_len = len;
+            ngx_memcpy(*str_value_buf, &i64, sizeof(int64_t));
+            break;
+
+        default: /* MPS_SHDICT_TBOOLEAN */
+            (*str_value_buf)[0] = c;
+        }
+
+        free(buf);
+
+        *user_flags = flags;
+
+        if (get_stale) {
+            *is_stale = (rc == NGX_DONE);
+        }
+
+        return NGX_OK;
+    }
+
+locked:
+
+    free(buf);
+
+    return NGX_AGAIN;
+}
+
+/*
+ * Returns NGX_DECLINED without copying the value if its version is known,
+ * which is never the case for 0.
+ */
+static int mps_shdict_get_helper(mps_shdict_t *dict, const u_char *key,
+                                 size_t key_len, int *value_type,
+                                 u_char **str_value_buf,
+                                 size_t *str_value_len, double *num_value,
+                                 int *user_flags, int get_stale,
+                                 int *is_stale, uint64_t known,
+                                 uint64_t *version, char **err)
+{
+    mps_slab_pool_t *pool;
+    uint32_t hash;
+    ngx_int_t rc;
+    mps_shdict_node_t *sd;
+    ngx_str_t value;
+
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
+
+    if (mps_shdict_tree(pool)->flags & MPS_SHDICT_FLAG_LOCKFREE_GET) {
+        rc = mps_shdict_get_lockfree(pool, hash, key, key_len, value_type,
+                                     str_value_buf, str_value_len, num_value,
+                                     user_flags, get_stale, is_stale, known,
+                                     version);
+        if (rc != NGX_AGAIN) {
+            return rc;
+        }
+    }
+
+    mps_slab_lock(pool);
+
+    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
+        mps_slab_unlock(pool);
+        *value_type = MPS_SHDICT_TNIL;
+        *version = 0;
+        return NGX_OK;
+    }
+
+    if (sd->version == known) {
+        mps_slab_unlock(pool);
+        return NGX_DECLINED;
+    }
+
+    *value_type = sd->value_type;
+    *version = sd->version;
+
+    dd("data: %p", sd->data);
+    dd("key len: %d", (int)sd->key_len);
+
+    value.data = sd->data + sd->key_len;
+    value.len = (size_t)sd->value_len;
+
+    if (*str_value_len < (size_t)value.len) {
+        if (*value_type == MPS_SHDICT_TBOOLEAN) {
+            mps_slab_unlock(pool);
+            return NGX_ERROR;
+        }
+
+        if (*value_type == MPS_SHDICT_TSTRING ||
+            *value_type == MPS_SHDICT_TINT64) {
+            *str_value_buf = malloc(value.len);
+            if (*str_value_buf == NULL) {
+                mps_slab_unlock(pool);
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    switch (*value_type) {
+
+    case MPS_SHDICT_TSTRING:
+        *str_value_len = value.len;
+        ngx_memcpy(*str_value_buf, value.data, value.len);
+        break;
+
+    case MPS_SHDICT_TNUMBER:
+
+        if (value.len != sizeof(double)) {
+            mps_slab_unlock(pool);
+            mps_log_error("bad lua number value size found for key %.*s"
+                          "in dict \"%.*s\": %lu",
+                          (int)key_len, key, (int)dict->name.len,
+                          dict->name.data, value.len);
+            return NGX_ERROR;
+        }
+
+        *str_value_len = value.len;
+        ngx_memcpy(num_value, value.data, sizeof(double));
+        break;
+
+    case MPS_SHDICT_TINT64:
+
+        if (value.len != sizeof(int64_t)) {
+            mps_slab_unlock(pool);
+            mps_log_error("bad int64 value size found for key %.*s"
+                          "in dict \"%.*s\": %lu",
+                          (int)key_len, key, (int)dict->name.len,
+                          dict->name.data, value.len);
+            return NGX_ERROR;
+        }
+
+        *str_value_len = value.len;
+        ngx_memcpy(*str_value_buf, value.data, value.len);
+        break;
+
+    case MPS_SHDICT_TBOOLEAN:
+
+        if (value.len != sizeof(u_char)) {
+            mps_slab_unlock(pool);
+            mps_log_error("bad lua boolean value size found for key %.*s"
+                          "in dict \"%.*s\": %lu",
+                          (int)key_len, key, (int)dict->name.len,
+                          dict->name.data, value.len);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(*str_value_buf, value.data, value.len);
+        break;
+
+    case MPS_SHDICT_TLIST:
+
+        mps_slab_unlock(pool);
+
+        *err = "value is a list";
+        return NGX_ERROR;
+
+    default:
+
+        mps_slab_unlock(pool);
+        mps_log_error("bad value type found for key %.*s"
+                      " in dict \"%.*s\": %d",
+                      (int)key_len, key, (int)dict->name.len, dict->name.data,
+                      *value_type);
+        return NGX_ERROR;
+    }
+
+    *user_flags = sd->user_flags;
+    dd("user flags: %d", *user_flags);
+
+    mps_slab_unlock(pool);
+
+    if (get_stale) {
+
+        /* always return value, flags, stale */
+
+        *is_stale = (rc == NGX_DONE);
+        return NGX_OK;
+    }
+
+    return NGX_OK;
+}
+
+int mps_shdict_get(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                   int *value_type, u_char **str_value_buf,
+                   size_t *str_value_len, double *num_value, int *user_flags,
+                   int get_stale, int *is_stale, char **err)
+{
+    uint64_t version;
+
+    return mps_shdict_get_helper(dict, key, key_len, value_type, str_value_buf,
+                                 str_value_len, num_value, user_flags,
+                                 get_stale, is_stale, 0, &version, err);
+}
+
+int mps_shdict_get_versioned(mps_shdict_t *dict, const u_char *key,
+                             size_t key_len, int *value_type,
+                             u_char **str_value_buf, size_t *str_value_len,
+                             double *num_value, int *user_flags, int get_stale,
+                             int *is_stale, uint64_t *version, char **err)
+{
+    return mps_shdict_get_helper(dict, key, key_len, value_type, str_value_buf,
+                                 str_value_len, num_value, user_flags,
+                                 get_stale, is_stale, 0, version, err);
+}
+
+int mps_shdict_get_if_modified(mps_shdict_t *dict, const u_char *key,
+                               size_t key_len, int *value_type,
+                               u_char **str_value_buf, size_t *str_value_len,
+                               double *num_value, int *user_flags,
+                               int get_stale, int *is_stale, uint64_t *version,
+                               char **err)
+{
+    return mps_shdict_get_helper(dict, key, key_len, value_type, str_value_buf,
+                                 str_value_len, num_value, user_flags,
+                                 get_stale, is_stale, *version, version, err);
+}
+
+/*
+ * Look up n keys in the locked pool. The rbtree is descended for all keys
+ * one level at a time, prefetching the next nodes, so that the cache misses
+ * of the keys overlap.
+ */
+static void mps_shdict_peek_batch(mps_slab_pool_t *pool, ngx_uint_t n,
+                                  const uint32_t *hashes, const u_char **keys,
+                                  const size_t *key_lens,
+                                  mps_shdict_node_t **sds)
+{
+    mps_shdict_tree_t *tree;
+    mps_rbtree_node_t *node;
+    mps_shdict_node_t *sd;
+    mps_ptroff_t off[MPS_SHDICT_MGET_BATCH], sentinel;
+    ngx_uint_t i, active;
+    ngx_int_t rc;
+
+    tree = mps_shdict_tree(pool);
+
+    if (tree->index != mps_nulloff) {
+        for (i = 0; i < n; i++) {
+            mps_htable_prefetch(mps_shdict_index(pool, tree), hashes[i]);
+        }
+
+        for (i = 0; i < n; i++) {
+            (void)mps_shdict_peek(pool, hashes[i], keys[i], key_lens[i],
+                                  &sds[i]);
+        }
+
+        return;
+    }
+
+    sentinel = tree->rbtree.sentinel;
+
+    for (i = 0; i < n; i++) {
+        off[i] = tree->rbtree.root;
+        sds[i] = NULL;
+    }
+
+    do {
+        active = 0;
+
+        for (i = 0; i < n; i++) {
+            if (off[i] == sentinel) {
+                continue;
+            }
+
+            node = mps_rbtree_node(pool, off[i]);
+
+            if (hashes[i] != node->key) {
+                off[i] = hashes[i] < node->key ? node->left : node->right;
+
+            } else {
+                sd = (mps_shdict_node_t *)&node->color;
+
+                rc = ngx_memn2cmp(keys[i], sd->data, key_lens[i],
+                                  (size_t)sd->key_len);
+                if (rc == 0) {
+                    sds[i] = sd;
+                    off[i] = sentinel;
+                    continue;
+                }
+
+                off[i] = rc < 0 ? node->left : node->right;
+            }
+
+            if (off[i] != sentinel) {
+                __builtin_prefetch(mps_ptr(pool, off[i]));
+                active++;
+            }
+        }
+    } while (active);
+}
+
+/* Returns NGX_AGAIN if the value did not fit in the arena. */
+static ngx_int_t mps_shdict_mget_value(mps_slab_pool_t *pool,
+                                       mps_shdict_node_t *sd, uint64_t now,
+                                       mps_shdict_mget_result_t *res,
+                                       u_char **arena, u_char *end)
+{
+    mps_shdict_tree_t *tree;
+    u_char *data;
+    size_t len;
+
+    res->value_type = MPS_SHDICT_TNIL;
+    res->user_flags = 0;
+    res->num_value = 0;
+    res->str_value = NULL;
+    res->str_value_len = 0;
+
+    if (sd == NULL) {
+        return NGX_OK;
+    }
+
+    tree = mps_shdict_tree(pool);
+
+    mps_shdict_queue_touch(pool, tree, sd);
+
+    if ((sd->expires != 0 && (int64_t)(sd->expires - now) < 0) ||
+        mps_shdict_flushed(tree, sd)) {
+        return NGX_OK;
+    }
+
+    data = sd->data + sd->key_len;
+    len = sd->value_len;
+
+    switch (sd->value_type) {
+
+    case MPS_SHDICT_TNUMBER:
+        if (len != sizeof(double)) {
+            goto bad;
+        }
+
+        ngx_memcpy(&res->num_value, data, sizeof(double));
+        break;
+
+    case MPS_SHDICT_TBOOLEAN:
+        if (len != sizeof(u_char)) {
+            goto bad;
+        }
+
+        res->num_value = *data ? 1 : 0;
+        break;
+
+    case MPS_SHDICT_TINT64:
+        if (len != sizeof(int64_t)) {
+            goto bad;
+        }
+
+        /* fall through */
+
+    case MPS_SHDICT_TSTRING:
+        res->str_value_len = len;
+
+        if ((size_t)(end - *arena) < len) {
+            res->value_type = sd->value_type;
+            res->user_flags = sd->user_flags;
+            return NGX_AGAIN;
+        }
+
+        res->str_value = *arena;
+        *arena = ngx_cpymem(*arena, data, len);
+        break;
+
+    case MPS_SHDICT_TLIST:
+        break;
+
+    default:
+        goto bad;
+    }
+
+    res->value_type = sd->value_type;
+    res->user_flags = sd->user_flags;
+
+    return NGX_OK;
+
+bad:
+
+    mps_log_error("bad value found in mget: type=%d, len=%lu",
+                  (int)sd->value_type, len);
+    return NGX_OK;
+}
+
+int mps_shdict_mget(mps_shdict_t *dict, const u_char **keys,
+                    const size_t *key_lens, ngx_uint_t n,
+                    mps_shdict_mget_result_t *results, u_char *arena,
+                    size_t arena_size)
+{
+    mps_slab_pool_t *pool, *pools[MPS_SHDICT_MGET_BATCH];
+    mps_shdict_node_t *sds[MPS_SHDICT_MGET_BATCH];
+    uint32_t hashes[MPS_SHDICT_MGET_BATCH], hs[MPS_SHDICT_MGET_BATCH];
+    const u_char *ks[MPS_SHDICT_MGET_BATCH];
+    size_t ls[MPS_SHDICT_MGET_BATCH];
+    ngx_uint_t idx[MPS_SHDICT_MGET_BATCH];
+    ngx_uint_t b, i, j, m, k;
+    uint32_t done;
+    u_char *end;
+    uint64_t now;
+    int rc;
+
+    rc = NGX_OK;
+    end = arena + arena_size;
+    now = mps_clock_time_ms();
+
+    for (b = 0; b < n; b += m) {
+        m = ngx_min(n - b, MPS_SHDICT_MGET_BATCH);
+
+        for (i = 0; i < m; i++) {
+            hashes[i] = ngx_murmur_hash2(keys[b + i], key_lens[b + i]);
+            pools[i] = mps_shdict_shard(dict, hashes[i]);
+        }
+
+        done = 0;
+
+        for (i = 0; i < m; i++) {
+            if (done & (1u << i)) {
+                continue;
+            }
+
+            pool = pools[i];
+
+            for (j = i, k = 0; j < m; j++) {
+                if (pools[j] == pool) {
+                    idx[k] = b + j;
+                    hs[k] = hashes[j];
+                    ks[k] = keys[b + j];
+                    ls[k] = key_lens[b + j];
+                    k++;
+                    done |= 1u << j;
+                }
+            }
+
+            mps_slab_lock(pool);
+
+            mps_shdict_peek_batch(pool, k, hs, ks, ls, sds);
+
+            for (j = 0; j < k; j++) {
+                mps_shdict_sketch_add(pool, mps_shdict_tree(pool), hs[j]);
+
+                if (mps_shdict_mget_value(pool, sds[j], now, &results[idx[j]],
+                                          &arena, end) == NGX_AGAIN) {
+                    rc = NGX_AGAIN;
+                }
+            }
+
+            mps_slab_unlock(pool);
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * Add delta of the type to the number old of the type of an existing value.
+ * A double delta is added to an int64 if it is an exact integer.
+ */
+static ngx_int_t mps_shdict_number_add(int type, mps_shdict_number_t delta,
+                                       int old_type, mps_shdict_number_t *old,
+                                       char **err)
+{
+    if (old_type == MPS_SHDICT_TNUMBER) {
+        if (type != MPS_SHDICT_TNUMBER) {
+            *err = "not an integer";
+            return NGX_ERROR;
+        }
+
+        old->num += delta.num;
+        return NGX_OK;
+    }
+
+    if (type == MPS_SHDICT_TNUMBER) {
+        if (!(delta.num >= -9223372036854775808.0 &&
+              delta.num < 9223372036854775808.0) ||
+            delta.num != (double)(int64_t)delta.num) {
+            *err = "not an integer";
+            return NGX_ERROR;
+        }
+
+        delta.i64 = (int64_t)delta.num;
+    }
+
+    /* wrap around on overflow */
+    old->i64 = (int64_t)((uint64_t)old->i64 + (uint64_t)delta.i64);
+
+    return NGX_OK;
+}
+
+/* Returns the number in the type of value. */
+static ngx_inline mps_shdict_number_t
+mps_shdict_number_as(int type, int old_type, mps_shdict_number_t num)
+{
+    if (type == MPS_SHDICT_TNUMBER && old_type == MPS_SHDICT_TINT64) {
+        num.num = (double)num.i64;
+    }
+
+    return num;
+}
+
+/*
+ * Add value to an unexpired number without the lock. Returns NGX_AGAIN if the
+ * key needs the locked incr.
+ */
+static ngx_int_t mps_shdict_incr_inplace(mps_slab_pool_t *pool, uint32_t hash,
+                                         const u_char *key, size_t key_len,
+                                         int type, mps_shdict_number_t *value)
+{
+    mps_shdict_tree_t *tree;
+    mps_shdict_node_t *sd;
+    mps_shdict_number_t num;
+    uint64_t old, expires;
+    u_char *p;
+    char *err;
+
+    if (!mps_slab_enter_inplace(pool)) {
+        return NGX_AGAIN;
+    }
+
+    tree = mps_shdict_tree(pool);
+
+    if ((tree->flags & MPS_SHDICT_MIGRATING) ||
+        mps_shdict_peek(pool, hash, key, key_len, &sd) != NGX_OK ||
+        (sd->value_type != MPS_SHDICT_TNUMBER &&
+         sd->value_type != MPS_SHDICT_TINT64) ||
+        sd->value_len != sizeof(uint64_t)) {
+        goto locked;
+    }
+
+    expires = sd->expires;
+    if (expires != 0 && (int64_t)(expires - mps_clock_time_ms()) < 0) {
+        goto locked;
+    }
+
+    if (mps_shdict_flushed(mps_shdict_tree(pool), sd)) {
+        goto locked;
+    }
+
+    p = sd->data + key_len;
+
+    /*
+     * The value follows the key, so it may be at any alignment. x86 locked
+     * instructions are atomic at any alignment, but a value across cache
+     * lines would lock the bus.
+     */
+#if (__i386__ || __i386 || __amd64__ || __amd64)
+    if (((uintptr_t)p & 63) > 64 - sizeof(uint64_t)) {
+        goto locked;
+    }
+#else
+    if ((uintptr_t)p & (sizeof(uint64_t) - 1)) {
+        goto locked;
+    }
+#endif
+
+    if (sd->value_type == MPS_SHDICT_TINT64) {
+        num.i64 = 0;
+
+        /* errors are reported by the locked incr */
+        if (mps_shdict_number_add(type, *value, MPS_SHDICT_TINT64, &num,
+                                  &err) != NGX_OK) {
+            goto locked;
+        }
+
+        old = mps_atomic_fetch_add((uint64_t *)p, (uint64_t)num.i64);
+        num.i64 = (int64_t)(old + (uint64_t)num.i64);
+
+    } else {
+        if (type != MPS_SHDICT_TNUMBER) {
+            goto locked;
+        }
+
+        do {
+            old = *(volatile uint64_t *)p;
+            ngx_memcpy(&num, &old, sizeof(uint64_t));
+            num.num += value->num;
+        } while (!mps_atomic_cmp_set((uint64_t *)p, old, num.i64));
+    }
+
+    *value = mps_shdict_number_as(type, sd->value_type, num);
+
+    /* other in-place updaters may give versions at the same time */
+    sd->version = mps_atomic_fetch_add(&tree->version, 1) + 1;
+
+    if (tree->access != mps_nulloff) {
+        mps_shdict_mark_accessed(pool, tree, sd);
+    }
+
+    mps_slab_leave_inplace(pool);
+
+    return NGX_OK;
+
+locked:
+
+    mps_slab_leave_inplace(pool);
+
+    return NGX_AGAIN;
+}
+
+/* value and init are of type, MPS_SHDICT_TNUMBER or MPS_SHDICT_TINT64. */
+static int mps_shdict_incr_helper(mps_shdict_t *dict, const u_char *key,
+                                  size_t key_len, int type,
+                                  mps_shdict_number_t *value, char **err,
+                                  int has_init, mps_shdict_number_t init,
+                                  long init_ttl, int *forcible)
+{
+    mps_slab_pool_t *pool;
+    int i, n;
+    uint32_t hash;
+    ngx_int_t rc;
+    uint64_t now = 0;
+    mps_shdict_tree_t *tree;
+    mps_shdict_node_t *sd;
+    mps_shdict_number_t num;
+    mps_rbtree_node_t *node;
+    u_char *p;
+    mps_queue_t *queue, *q;
+
+    if (init_ttl > 0) {
+        now = mps_clock_time_ms();
+    }
+
+    *forcible = 0;
+
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
+    tree = mps_shdict_tree(pool);
+
+    if (pool->inplace && mps_shdict_incr_inplace(pool, hash, key, key_len,
+                                                 type, value) == NGX_OK) {
+        return NGX_OK;
+    }
+
+    // dd("looking up key %.*s in shared dict %.*s", (int) key_len, key,
+    //    (int) ctx->name.len, ctx->name.data);
+
+    mps_slab_lock(pool);
+#if 1
+    mps_shdict_expire(pool, tree, 1);
+#endif
+
+    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+
+    dd("shdict lookup returned %d", (int)rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        if (!has_init) {
+            mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+            *err = "not found";
+            return NGX_ERROR;
+        }
+
+        /* add value */
+        num = init;
+        (void)mps_shdict_number_add(type, *value, type, &num, err);
+
+        if (rc == NGX_DONE) {
+
+            /* found an expired item */
+
+            if ((size_t)sd->value_len == sizeof(uint64_t) &&
+                sd->value_type != MPS_SHDICT_TLIST) {
+                mps_log_debug(
+                    MPS_LOG_TAG,
+                    "lua shared dict incr in dict \"%.*s\": "
+                    "found old entry and value size matched, reusing it",
+                    (int)dict->name.len, dict->name.data);
+
+                mps_shdict_queue_touch(pool, tree, sd);
+
+                dd("go to setvalue");
+                goto setvalue;
+            }
+
+            dd("go to remove");
+            goto remove;
+        }
+
+        dd("go to insert");
+        goto insert;
+    }
+
+    /* rc == NGX_OK */
+
+    if ((sd->value_type != MPS_SHDICT_TNUMBER &&
+         sd->value_type != MPS_SHDICT_TINT64) ||
+        sd->value_len != sizeof(uint64_t)) {
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+        *err = "not a number";
+        return NGX_ERROR;
+    }
+
+    p = sd->data + key_len;
+
+    ngx_memcpy(&num, p, sizeof(uint64_t));
+
+    if (mps_shdict_number_add(type, *value, sd->value_type, &num, err) !=
+        NGX_OK) {
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+        return NGX_ERROR;
+    }
+
+    mps_shdict_queue_touch(pool, tree, sd);
+    mps_shdict_version_update(tree, sd);
+
+    dd("setting value type to %d", (int)sd->value_type);
+
+    ngx_memcpy(p, &num, sizeof(uint64_t));
+
+    mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+    *value = mps_shdict_number_as(type, sd->value_type, num);
+    return NGX_OK;
+
+remove:
+
+    mps_log_debug(
+        MPS_LOG_TAG,
+        "lua shared dict incr in dict \"%.*s\": "
+        "found old entry but value size NOT matched, removing it first",
+        (int)dict->name.len, dict->name.data);
+
+    if (sd->value_type == MPS_SHDICT_TLIST) {
+        queue = mps_shdict_get_list_head(sd, key_len);
+
+        for (q = mps_queue_head(pool, queue);
+             q != mps_queue_sentinel(pool, queue);
+             q = mps_queue_next(pool, q)) {
+            p = (u_char *)mps_queue_data(q, mps_shdict_list_node_t, queue);
+
+            mps_slab_free_locked(pool, p);
+        }
+    }
+
+    mps_shdict_queue_remove(pool, tree, sd);
+
+    node = (mps_rbtree_node_t *)((u_char *)sd -
+                                 offsetof(mps_rbtree_node_t, color));
+
+    mps_shdict_index_delete(pool, tree, node);
+    mps_slab_free_locked(pool, node);
+
+insert:
+
+    mps_log_debug(MPS_LOG_TAG,
+                  "lua shared dict incr in dict \"%.*s\": creating a new entry",
+                  (int)dict->name.len, dict->name.data);
+
+    n = mps_shdict_node_size(tree, offsetof(mps_rbtree_node_t, color) +
+                                       offsetof(mps_shdict_node_t, data) +
+                                       key_len + sizeof(uint64_t));
+
+    node = mps_slab_alloc_locked(pool, n);
+
+    if (node == NULL) {
+
+        mps_log_debug(MPS_LOG_TAG,
+                      "lua shared dict incr in dict \"%.*s\": overriding "
+                      "non-expired items "
+                      "due to memory shortage for entry \"%.*s\"",
+                      (int)dict->name.len, dict->name.data, (int)key_len, key);
+
+        for (i = 0; i < 30; i++) {
+            if (mps_shdict_evict(pool, tree, n) == 0) {
+                break;
+            }
+
+            *forcible = 1;
+
+            node = mps_slab_alloc_locked(pool, n);
+            if (node != NULL) {
+                goto allocated;
+            }
+        }
+
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+allocated:
+
+    sd = (mps_shdict_node_t *)&node->color;
+
+    node->key = hash;
+
+    sd->key_len = (u_short)key_len;
+
+    sd->value_len = (uint32_t)sizeof(uint64_t);
+    sd->value_type = (uint8_t)type;
+    sd->expires = 0;
+
+    mps_shdict_index_insert(pool, tree, node);
+
+    mps_shdict_queue_insert(pool, tree, sd);
+
+setvalue:
+
+    sd->user_flags = 0;
+
+    if (init_ttl > 0) {
+        sd->expires = now + (uint64_t)init_ttl;
+
+    } else {
+        sd->expires = 0;
+    }
+
+    mps_shdict_timer_update(pool, tree, sd);
+    mps_shdict_gen_update(tree, sd);
+    mps_shdict_version_update(tree, sd);
+
+    dd("setting value type to %d", type);
+
+    sd->value_type = (uint8_t)type;
+
+    p = ngx_copy(sd->data, key, key_len);
+    ngx_memcpy(p, &num, sizeof(uint64_t));
+
+    mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+    *value = num;
+    return NGX_OK;
+}
+
+int mps_shdict_incr(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                    double *value, char **err, int has_init, double init,
+                    long init_ttl, int *forcible)
+{
+    mps_shdict_number_t v, i;
+    int rc;
+
+    v.num = *value;
+    i.num = init;
+
+    rc = mps_shdict_incr_helper(dict, key, key_len, MPS_SHDICT_TNUMBER, &v,
+                                err, has_init, i, init_ttl, forcible);
+    if (rc == NGX_OK) {
+        *value = v.num;
+    }
+
+    return rc;
+}
+
+int mps_shdict_incr_int64(mps_shdict_t *dict, const u_char *key,
+                          size_t key_len, int64_t *value, char **err,
+                          int has_init, int64_t init, long init_ttl,
+                          int *forcible)
+{
+    mps_shdict_number_t v, i;
+    int rc;
+
+    v.i64 = *value;
+    i.i64 = init;
+
+    rc = mps_shdict_incr_helper(dict, key, key_len, MPS_SHDICT_TINT64, &v,
+                                err, has_init, i, init_ttl, forcible);
+    if (rc == NGX_OK) {
+        *value = v.i64;
+    }
+
+    return rc;
+}
+
+static void mps_shdict_flush_pool(mps_slab_pool_t *main)
+{
+    mps_slab_pool_t *pool;
+    mps_queue_t *q, *queues[2];
+    mps_shdict_tree_t *tree;
+    mps_shdict_node_t *sd;
+    ngx_uint_t i, k, n, nqueues;
+
+    n = mps_shdict_tree(main)->nshards;
+
+    for (i = 0; i < n; i++) {
+        pool = mps_shdict_shard_at(main, i);
+        tree = mps_shdict_tree(pool);
+
+        mps_slab_lock(pool);
+
+        /* entries of the old generation are freed as they are found */
+        if (tree->flags & MPS_SHDICT_FLAG_FLUSH_GEN) {
+            (*mps_shdict_tree_gen(tree))++;
+            tree->version++;
+            mps_slab_unlock(pool);
+            continue;
+        }
+
+        nqueues = mps_shdict_queues(tree, queues);
+
+        for (k = 0; k < nqueues; k++) {
+            for (q = mps_queue_head(pool, queues[k]);
+                 q != mps_queue_sentinel(pool, queues[k]);
+                 q = mps_queue_next(pool, q)) {
+                sd = mps_queue_data(q, mps_shdict_node_t, queue);
+                sd->expires = 1;
+                mps_shdict_timer_update(pool, tree, sd);
+            }
+        }
+
+        mps_shdict_expire(pool, tree, 0);
+
+        mps_slab_unlock(pool);
+    }
+}
+
+int mps_shdict_flush_all(mps_shdict_t *dict)
+{
+    mps_slab_pool_t *main;
+
+    main = mps_shdict_main(dict);
+
+    mps_shdict_flush_pool(main);
+
+    if (mps_shdict_tree(main)->flags & MPS_SHDICT_MIGRATING) {
+        if (mps_shdict_migrate_attach(dict) == NGX_OK) {
+            mps_shdict_flush_pool(dict->target);
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Returns the sum of the version counters of the shards of the main pool. */
+static uint64_t mps_shdict_pool_version(mps_slab_pool_t *main)
+{
+    mps_shdict_tree_t *tree;
+    uint64_t version;
+    ngx_uint_t i, n;
+
+    n = mps_shdict_tree(main)->nshards;
+
+    /* the sum changes whenever the counter of a shard does */
+    version = 0;
+    for (i = 0; i < n; i++) {
+        tree = mps_shdict_tree(mps_shdict_shard_at(main, i));
+        version += *(volatile uint64_t *)&tree->version;
+    }
+
+    return version;
+}
+
+uint64_t mps_shdict_version(mps_shdict_t *dict)
+{
+    return mps_shdict_pool_version(mps_shdict_main(dict));
+}
+
+static ngx_int_t mps_shdict_peek(mps_slab_pool_t *pool, ngx_uint_t hash,
+                                 const u_char *kdata, size_t klen,
+                                 mps_shdict_node_t **sdp)
+{
+    ngx_int_t rc;
+    mps_rbtree_node_t *node, *sentinel;
+    mps_shdict_tree_t *tree;
+    mps_shdict_node_t *sd;
+    mps_htable_iter_t it;
+    mps_ptroff_t off;
+
+    tree = mps_shdict_tree(pool);
+
+    if (tree->index != mps_nulloff) {
+        for (off = mps_htable_first(mps_shdict_index(pool, tree), hash, &it);
+             off != mps_nulloff;
+             off = mps_htable_next(mps_shdict_index(pool, tree), &it)) {
+            node = mps_rbtree_node(pool, off);
+            if (node->key != hash) {
+                continue;
+            }
+
+            sd = (mps_shdict_node_t *)&node->color;
+
+            if (ngx_memn2cmp(kdata, sd->data, klen, (size_t)sd->key_len) == 0) {
+                *sdp = sd;
+                return NGX_OK;
+            }
+        }
+
+        *sdp = NULL;
+        return NGX_DECLINED;
+    }
+
+    node = mps_rbtree_node(pool, tree->rbtree.root);
+    sentinel = mps_rbtree_node(pool, tree->rbtree.sentinel);
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = mps_rbtree_node(pool, node->left);
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = mps_rbtree_node(pool, node->right);
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sd = (mps_shdict_node_t *)&node->color;
+
+        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t)sd->key_len);
+
+        if (rc == 0) {
+            *sdp = sd;
+
+            return NGX_OK;
+        }
+
+        node = mps_rbtree_node(pool, (rc < 0) ? node->left : node->right);
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+}
+
+typedef struct {
+    mps_shdict_scan_key_t *keys;
+    ngx_uint_t max_count;
+    ngx_uint_t n;
+    u_char *arena;
+    size_t arena_size;
+    size_t used;
+    ngx_uint_t visits;
+    uint64_t now;
+    unsigned full : 1;
+} mps_shdict_scan_t;
+
+/* Returns NGX_AGAIN if the key does not fit. */
+static ngx_int_t mps_shdict_scan_add(mps_shdict_scan_t *sc,
+                                     mps_shdict_node_t *sd)
+{
+    mps_shdict_scan_key_t *k;
+
+    if (sc->n == sc->max_count || sc->arena_size - sc->used < sd->key_len) {
+        sc->full = 1;
+        return NGX_AGAIN;
+    }
+
+    k = &sc->keys[sc->n++];
+    k->key = sc->arena + sc->used;
+    k->key_len = sd->key_len;
+    ngx_memcpy(k->key, sd->data, sd->key_len);
+    sc->used += sd->key_len;
+
+    return NGX_OK;
+}
+
+/*
+ * Copy the keys of the locked pool from the cursor. Entries of the same hash
+ * are copied together since the cursor of the rbtree is a hash. Returns
+ * NGX_OK when the pool has been scanned, or NGX_AGAIN if there may be more.
+ */
+static ngx_int_t mps_shdict_scan_pool(mps_slab_pool_t *pool,
+                                      mps_shdict_scan_cursor_t *cursor,
+                                      mps_shdict_scan_t *sc)
+{
+    mps_shdict_tree_t *tree;
+    mps_rbtree_node_t *node, *sentinel, *first;
+    mps_shdict_node_t *sd;
+    mps_htable_t *ht;
+    ngx_uint_t mark, limit;
+    size_t mark_used;
+    uint64_t slot;
+    mps_ptroff_t off;
+    u_char *ctrl;
+
+    tree = mps_shdict_tree(pool);
+    limit = sc->max_count * MPS_SHDICT_SCAN_VISITS;
+
+    if (tree->index != mps_nulloff) {
+        ht = mps_shdict_index(pool, tree);
+
+        /* the index has been rebuilt, so start over */
+        if (ht->gen != cursor->gen) {
+            cursor->gen = ht->gen;
+            cursor->next = 0;
+        }
+
+        ctrl = mps_htable_ctrl(ht);
+
+        for (slot = cursor->next; slot <= ht->mask; slot++) {
+            if (sc->visits++ == limit) {
+                cursor->next = slot;
+                return NGX_AGAIN;
+            }
+
+            if (ctrl[slot] & 0x80) {
+                continue;
+            }
+
+            off = (mps_ptroff_t)mps_htable_values(ht)[slot] << ht->shift;
+            sd = (mps_shdict_node_t *)&mps_rbtree_node(pool, off)->color;
+
+            if ((sd->expires != 0 && (int64_t)(sd->expires - sc->now) < 0) ||
+                mps_shdict_flushed(tree, sd)) {
+                continue;
+            }
+
+            if (mps_shdict_scan_add(sc, sd) != NGX_OK) {
+                cursor->next = slot;
+                return NGX_AGAIN;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    /* find the first node whose hash is not less than the cursor */
+
+    node = mps_rbtree_node(pool, tree->rbtree.root);
+    sentinel = mps_rbtree_node(pool, tree->rbtree.sentinel);
+    first = NULL;
+
+    while (node != sentinel) {
+        if (node->key >= cursor->next) {
+            first = node;
+            node = mps_rbtree_node(pool, node->left);
+
+        } else {
+            node = mps_rbtree_node(pool, node->right);
+        }
+    }
+
+    mark = sc->n;
+    mark_used = sc->used;
+
+    for (node = first; node != NULL;
+         node = mps_rbtree_next(pool, &tree->rbtree, node)) {
+        if (node == first || node->key != cursor->next) {
+            if (sc->visits >= limit) {
+                cursor->next = node->key;
+                return NGX_AGAIN;
+            }
+
+            cursor->next = node->key;
+            mark = sc->n;
+            mark_used = sc->used;
+        }
+
+        sc->visits++;
+
+        sd = (mps_shdict_node_t *)&node->color;
+
+        if ((sd->expires != 0 && (int64_t)(sd->expires - sc->now) < 0) ||
+            mps_shdict_flushed(tree, sd)) {
+            continue;
+        }
+
+        if (mps_shdict_scan_add(sc, sd) != NGX_OK) {
+            /* return the keys of the hash in the next call */
+            sc->n = mark;
+            sc->used = mark_used;
+            return NGX_AGAIN;
+        }
+    }
+
+    return NGX_OK;
+}
+
+int mps_shdict_scan(mps_shdict_t *dict, mps_shdict_scan_cursor_t *cursor,
+                    mps_shdict_scan_key_t *keys, ngx_uint_t max_count,
+                    ngx_uint_t *n, u_char *arena, size_t arena_size)
+{
+    mps_slab_pool_t *main, *pool;
+    mps_shdict_scan_t sc;
+    ngx_uint_t nshards;
+    ngx_int_t rc;
+
+    sc.keys = keys;
+    sc.max_count = max_count;
+    sc.n = 0;
+    sc.arena = arena;
+    sc.arena_size = arena_size;
+    sc.used = 0;
+    sc.visits = 0;
+    sc.full = 0;
+    sc.now = mps_clock_time_ms();
+
+    main = mps_shdict_main(dict);
+    nshards = mps_shdict_tree(main)->nshards;
+
+    rc = NGX_OK;
+
+    while (cursor->shard < nshards) {
+        pool = mps_shdict_shard_at(main, cursor->shard);
+
+        mps_slab_lock(pool);
+        rc = mps_shdict_scan_pool(pool, cursor, &sc);
+        mps_slab_unlock(pool);
+
+        if (rc != NGX_OK) {
+            break;
+        }
+
+        cursor->shard++;
+        cursor->next = 0;
+        cursor->gen = 0;
+
+        if (sc.n == max_count) {
+            break;
+        }
+    }
+
+    *n = sc.n;
+
+    if (cursor->shard == nshards) {
+        return NGX_OK;
+    }
+
+    if (sc.n == 0 && sc.full) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_AGAIN;
+}
+
+/*
+ * Free up to n expired entries of the locked pool from the cursor. Returns
+ * NGX_OK when the pool has been swept, or NGX_AGAIN if there may be more.
+ */
+static ngx_int_t mps_shdict_sweep_pool(mps_slab_pool_t *pool,
+                                       mps_shdict_scan_cursor_t *cursor,
+                                       ngx_uint_t n, ngx_uint_t *freed)
+{
+    mps_shdict_tree_t *tree;
+    mps_rbtree_node_t *node, *next, *sentinel;
+    mps_shdict_node_t *sd;
+    mps_htable_t *ht;
+    ngx_uint_t visits, limit;
+    uint64_t slot, now;
+    mps_ptroff_t off;
+    u_char *ctrl;
+
+    tree = mps_shdict_tree(pool);
+    now = mps_clock_time_ms();
+    *freed = 0;
+
+    /*
+     * expired entries are at the front of the expiry index, but flushed ones
+     * are not
+     */
+    if (tree->expiry != mps_nulloff &&
+        !(tree->flags & MPS_SHDICT_FLAG_FLUSH_GEN)) {
+        *freed = (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL)
+                     ? mps_shdict_wheel_expire(pool, tree, now, n)
+                     : mps_shdict_expire_timers(pool, tree, now, n);
+
+        return *freed < n ? NGX_OK : NGX_AGAIN;
+    }
+
+    visits = 0;
+    limit = n * MPS_SHDICT_SCAN_VISITS;
+
+    if (tree->index != mps_nulloff) {
+        ht = mps_shdict_index(pool, tree);
+
+        if (ht->gen != cursor->gen) {
+            cursor->gen = ht->gen;
+            cursor->next = 0;
+        }
+
+        ctrl = mps_htable_ctrl(ht);
+
+        /* deleting from the index does not move other slots */
+        for (slot = cursor->next; slot <= ht->mask; slot++) {
+            if (visits++ == limit || *freed == n) {
+                cursor->next = slot;
+                return NGX_AGAIN;
+            }
+
+            if (ctrl[slot] & 0x80) {
+                continue;
+            }
+
+            off = (mps_ptroff_t)mps_htable_values(ht)[slot] << ht->shift;
+            sd = (mps_shdict_node_t *)&mps_rbtree_node(pool, off)->color;
+
+            if ((sd->expires != 0 && (int64_t)(sd->expires - now) < 0) ||
+                mps_shdict_flushed(tree, sd)) {
+                mps_shdict_remove_node(pool, tree, sd);
+                (*freed)++;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    node = mps_rbtree_node(pool, tree->rbtree.root);
+    sentinel = mps_rbtree_node(pool, tree->rbtree.sentinel);
+    next = NULL;
+
+    while (node != sentinel) {
+        if (node->key >= cursor->next) {
+            next = node;
+            node = mps_rbtree_node(pool, node->left);
+
+        } else {
+            node = mps_rbtree_node(pool, node->right);
+        }
+    }
+
+    for (node = next; node != NULL; node = next) {
+        if (visits++ == limit || *freed == n) {
+            cursor->next = node->key;
+            return NGX_AGAIN;
+        }
+
+        /* deleting a node does not move its successor */
+        next = mps_rbtree_next(pool, &tree->rbtree, node);
+        sd = (mps_shdict_node_t *)&node->color;
+
+        if ((sd->expires != 0 && (int64_t)(sd->expires - now) < 0) ||
+            mps_shdict_flushed(tree, sd)) {
+            mps_shdict_remove_node(pool, tree, sd);
+            (*freed)++;
+        }
+    }
+
+    return NGX_OK;
+}
+
+int mps_shdict_sweep(mps_shdict_t *dict, mps_shdict_scan_cursor_t *cursor,
+                     ngx_uint_t max_count, ngx_uint_t *freed)
+{
+    mps_slab_pool_t *main, *pool;
+    ngx_uint_t nshards;
+    ngx_int_t rc;
+
+    main = mps_shdict_main(dict);
+    nshards = mps_shdict_tree(main)->nshards;
+
+    if (cursor->shard >= nshards) {
+        ngx_memzero(cursor, sizeof(mps_shdict_scan_cursor_t));
+    }
+
+    pool = mps_shdict_shard_at(main, cursor->shard);
+
+    mps_slab_lock(pool);
+    rc = mps_shdict_sweep_pool(pool, cursor, max_count, freed);
+    mps_slab_unlock(pool);
+
+    if (rc != NGX_OK) {
+        return NGX_AGAIN;
+    }
+
+    cursor->next = 0;
+    cursor->gen = 0;
+
+    if (++cursor->shard < nshards) {
+        return NGX_AGAIN;
+    }
+
+    cursor->shard = 0;
+
+    return NGX_OK;
+}
+
+int mps_shdict_flush_expired(mps_shdict_t *dict, ngx_uint_t max_count)
+{
+    mps_shdict_scan_cursor_t cursor;
+    ngx_uint_t n, freed, total;
+    ngx_int_t rc;
+
+    ngx_memzero(&cursor, sizeof(mps_shdict_scan_cursor_t));
+    total = 0;
+
+    do {
+        n = MPS_SHDICT_SWEEP_BATCH;
+        if (max_count != 0 && max_count - total < n) {
+            n = max_count - total;
+        }
+
+        rc = mps_shdict_sweep(dict, &cursor, n, &freed);
+        total += freed;
+
+    } while (rc == NGX_AGAIN && (max_count == 0 || total < max_count));
+
+    return (int)total;
+}
+
+/* Link y, a copy of the queue link x, in the place of x. */
+static ngx_inline void mps_shdict_queue_move(mps_slab_pool_t *pool,
+                                             mps_queue_t *x, mps_queue_t *y)
+{
+    if (mps_queue_empty(pool, x)) {
+        mps_queue_init(pool, y);
+        return;
+    }
+
+    mps_queue(pool, y->next)->prev = mps_offset(pool, y);
+    mps_queue(pool, y->prev)->next = mps_offset(pool, y);
+}
+
+/*
+ * Move the node and its list nodes to denser pages of their chunk sizes, see
+ * mps_slab_alloc_move. Returns the count of chunks moved.
+ */
+static ngx_uint_t mps_shdict_move_node(mps_slab_pool_t *pool,
+                                       mps_shdict_tree_t *tree,
+                                       mps_shdict_node_t *sd)
+{
+    mps_rbtree_node_t *node, *copy;
+    mps_shdict_node_t *csd;
+    mps_queue_t *queue, *q, *next;
+    mps_shdict_list_node_t *lnode, *lcopy;
+    mps_shdict_timer_t *t;
+    mps_shdict_wheel_timer_t *wt;
+    mps_shdict_evict_t *ev;
+    uintptr_t *word, m;
+    ngx_uint_t moved;
+
+    moved = 0;
+
+    if (sd->value_type == MPS_SHDICT_TLIST) {
+        queue = mps_shdict_get_list_head(sd, sd->key_len);
+
+        for (q = mps_queue_head(pool, queue);
+             q != mps_queue_sentinel(pool, queue); q = next) {
+            next = mps_queue_next(pool, q);
+            lnode = mps_queue_data(q, mps_shdict_list_node_t, queue);
+
+            lcopy = mps_slab_alloc_move(pool, lnode);
+            if (lcopy == NULL) {
+                continue;
+            }
+
+            ngx_memcpy(lcopy, lnode,
+                       offsetof(mps_shdict_list_node_t, data) +
+                           lnode->value_len);
+            mps_shdict_queue_move(pool, &lnode->queue, &lcopy->queue);
+            mps_slab_free_locked(pool, lnode);
+            moved++;
+        }
+    }
+
+    node = (mps_rbtree_node_t *)((u_char *)sd -
+                                 offsetof(mps_rbtree_node_t, color));
+
+    copy = mps_slab_alloc_move(pool, node);
+    if (copy == NULL) {
+        return moved;
+    }
+
+    ngx_memcpy(copy, node, mps_slab_chunk_size(pool, node));
+    csd = (mps_shdict_node_t *)&copy->color;
+
+    mps_shdict_queue_move(pool, &sd->queue, &csd->queue);
+
+    if (sd->value_type == MPS_SHDICT_TLIST) {
+        mps_shdict_queue_move(pool, mps_shdict_get_list_head(sd, sd->key_len),
+                              mps_shdict_get_list_head(csd, csd->key_len));
+    }
+
+    if (tree->expiry != mps_nulloff &&
+        (tree->flags & MPS_SHDICT_FLAG_EXPIRY_WHEEL)) {
+        wt = mps_shdict_wheel_timer(csd);
+        wt->entry = mps_offset(pool, copy);
+
+        if (wt->expires != 0) {
+            mps_shdict_queue_move(pool, &mps_shdict_wheel_timer(sd)->queue,
+                                  &wt->queue);
+        }
+
+    } else if (tree->expiry != mps_nulloff) {
+        t = mps_shdict_timer(csd);
+        t->entry = mps_offset(pool, copy);
+
+        if (t->node.key != 0) {
+            mps_rbtree_replace(pool, &mps_shdict_expiry(pool, tree)->rbtree,
+                               &mps_shdict_timer(sd)->node, &t->node);
+        }
+    }
+
+    if (tree->index == mps_nulloff) {
+        mps_rbtree_replace(pool, &tree->rbtree, node, copy);
+
+    } else {
+        (void)mps_htable_replace(pool, mps_shdict_index(pool, tree),
+                                 (uint32_t)node->key, mps_offset(pool, node),
+                                 mps_offset(pool, copy));
+    }
+
+    if (tree->flags &
+        (MPS_SHDICT_FLAG_EVICT_SIEVE | MPS_SHDICT_FLAG_EVICT_S3FIFO)) {
+        ev = mps_shdict_tree_evict(tree);
+
+        if (ev->hand == mps_offset(pool, &sd->queue)) {
+            ev->hand = mps_offset(pool, &csd->queue);
+        }
+
+        if (ev->smap != mps_nulloff) {
+            word = mps_shdict_bitmap(pool, ev->smap, sd, &m);
+
+            if (*word & m) {
+                *word &= ~m;
+                word = mps_shdict_bitmap(pool, ev->smap, csd, &m);
+                *word |= m;
+            }
+        }
+    }
+
+    if (mps_shdict_clear_accessed(pool, tree, sd)) {
+        mps_shdict_mark_accessed(pool, tree, csd);
+    }
+
+    mps_slab_free_locked(pool, node);
+
+    return moved + 1;
+}
+
+/*
+ * Move up to n chunks of entries of the locked pool from the cursor. Returns
+ * NGX_OK when the pool has been compacted, or NGX_AGAIN if there may be more.
+ */
+static ngx_int_t mps_shdict_compact_pool(mps_slab_pool_t *pool,
+                                         mps_shdict_scan_cursor_t *cursor,
+                                         ngx_uint_t n, ngx_uint_t *moved)
+{
+    mps_shdict_tree_t *tree;
+    mps_rbtree_node_t *node, *next, *sentinel;
+    mps_htable_t *ht;
+    ngx_uint_t visits, limit;
+    uint64_t slot;
+    mps_ptroff_t off;
+    u_char *ctrl;
+
+    tree = mps_shdict_tree(pool);
+    *moved = 0;
+    visits = 0;
+    limit = n * MPS_SHDICT_SCAN_VISITS;
+
+    if (tree->index != mps_nulloff) {
+        ht = mps_shdict_index(pool, tree);
+
+        if (ht->gen != cursor->gen) {
+            cursor->gen = ht->gen;
+            cursor->next = 0;
+        }
+
+        ctrl = mps_htable_ctrl(ht);
+
+        /* a moved node keeps its slot */
+        for (slot = cursor->next; slot <= ht->mask; slot++) {
+            if (visits++ == limit || *moved >= n) {
+                cursor->next = slot;
+                return NGX_AGAIN;
+            }
+
+            if (ctrl[slot] & 0x80) {
+                continue;
+            }
+
+            off = (mps_ptroff_t)mps_htable_values(ht)[slot] << ht->shift;
+            *moved += mps_shdict_move_node(
+                pool, tree,
+                (mps_shdict_node_t *)&mps_rbtree_node(pool, off)->color);
+        }
+
+        return NGX_OK;
+    }
+
+    node = mps_rbtree_node(pool, tree->rbtree.root);
+    sentinel = mps_rbtree_node(pool, tree->rbtree.sentinel);
+    next = NULL;
+
+    while (node != sentinel) {
+        if (node->key >= cursor->next) {
+            next = node;
+            node = mps_rbtree_node(pool, node->left);
+
+        } else {
+            node = mps_rbtree_node(pool, node->right);
+        }
+    }
+
+    for (node = next; node != NULL; node = next) {
+        if (visits++ == limit || *moved >= n) {
+            cursor->next = node->key;
+            return NGX_AGAIN;
+        }
+
+        /* a moved node takes the place of the old one in the tree */
+        next = mps_rbtree_next(pool, &tree->rbtree, node);
+        *moved += mps_shdict_move_node(pool, tree,
+                                       (mps_shdict_node_t *)&node->color);
+    }
+
+    return NGX_OK;
+}
+
+int mps_shdict_compact(mps_shdict_t *dict, mps_shdict_scan_cursor_t *cursor,
+                       ngx_uint_t max_count, ngx_uint_t *moved)
+{
+    mps_slab_pool_t *main, *pool;
+    ngx_uint_t nshards;
+    ngx_int_t rc;
+
+    main = mps_shdict_main(dict);
+    nshards = mps_shdict_tree(main)->nshards;
+
+    if (cursor->shard >= nshards) {
+        ngx_memzero(cursor, sizeof(mps_shdict_scan_cursor_t));
+    }
+
+    pool = mps_shdict_shard_at(main, cursor->shard);
+
+    mps_slab_lock(pool);
+    rc = mps_shdict_compact_pool(pool, cursor, max_count, moved);
+    mps_slab_unlock(pool);
+
+    if (rc != NGX_OK) {
+        return NGX_AGAIN;
+    }
+
+    cursor->next = 0;
+    cursor->gen = 0;
+
+    if (++cursor->shard < nshards) {
+        return NGX_AGAIN;
+    }
+
+    cursor->shard = 0;
+
+    return NGX_OK;
+}
+
+long mps_shdict_get_ttl(mps_shdict_t *dict, const u_char *key, size_t key_len)
+{
+    mps_slab_pool_t *pool;
+    uint32_t hash;
+    uint64_t expires, now;
+    ngx_int_t rc;
+    mps_shdict_node_t *sd;
+
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
+    mps_slab_lock(pool);
+
+    rc = mps_shdict_peek(pool, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED || mps_shdict_flushed(mps_shdict_tree(pool), sd)) {
+        mps_slab_unlock(pool);
+
+        return NGX_DECLINED;
+    }
+
+    /* rc == NGX_OK */
+
+    expires = sd->expires;
+
+    mps_slab_unlock(pool);
+
+    if (expires == 0) {
+        return 0;
+    }
+
+    now = mps_clock_time_ms();
+
+    return expires - now;
+}
+
+int mps_shdict_set_expire(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                          long exptime)
+{
+    mps_slab_pool_t *pool;
+    uint32_t hash;
+    ngx_int_t rc;
+    uint64_t now = 0;
+    mps_shdict_node_t *sd;
+
+    if (exptime > 0) {
+        now = mps_clock_time_ms();
+    }
+
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
+    mps_slab_lock(pool);
+
+    rc = mps_shdict_peek(pool, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED || mps_shdict_flushed(mps_shdict_tree(pool), sd)) {
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+        return NGX_DECLINED;
+    }
+
+    /* rc == NGX_OK */
+
+    if (exptime > 0) {
+        sd->expires = now + (uint64_t)exptime;
+
+    } else {
+        sd->expires = 0;
+    }
+
+    mps_shdict_timer_update(pool, mps_shdict_tree(pool), sd);
+    mps_shdict_tree(pool)->version++;
+
+    mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+    return NGX_OK;
+}
+
+int mps_shdict_lpush(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                     int value_type, const u_char *str_value_buf,
+                     size_t str_value_len, double num_value, char **errmsg)
+{
+    return mps_shdict_push_helper(dict, MPS_SHDICT_LEFT, key, key_len,
+                                  value_type, str_value_buf, str_value_len,
+                                  num_value, errmsg);
+}
+
+int mps_shdict_rpush(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                     int value_type, const u_char *str_value_buf,
+                     size_t str_value_len, double num_value, char **errmsg)
+{
+    return mps_shdict_push_helper(dict, MPS_SHDICT_RIGHT, key, key_len,
+                                  value_type, str_value_buf, str_value_len,
+                                  num_value, errmsg);
+}
+
+static int mps_shdict_push_helper(mps_shdict_t *dict, int direction,
+                                  const u_char *key, size_t key_len,
+                                  int value_type, const u_char *str_value_buf,
+                                  size_t str_value_len, double num_value,
+                                  char **errmsg)
+{
+    mps_slab_pool_t *pool;
+    mps_shdict_tree_t *tree;
+    int n;
+    uint32_t hash;
+    ngx_int_t rc;
+    mps_shdict_node_t *sd;
+    mps_rbtree_node_t *node;
+    mps_queue_t *queue, *q;
+    mps_shdict_list_node_t *lnode;
+
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
+    tree = mps_shdict_tree(pool);
+
+    switch (value_type) {
+
+    case MPS_SHDICT_TSTRING:
+        /* do nothing */
+        break;
+
+    case MPS_SHDICT_TNUMBER:
+        dd("num value: %lf", num_value);
+        str_value_buf = (u_char *)&num_value;
+        str_value_len = sizeof(double);
+        break;
+
+    default:
+        *errmsg = "unsupported value type";
+        return NGX_ERROR;
+    }
+
+    mps_slab_lock(pool);
+
+#if 1
+    mps_shdict_expire(pool, tree, 1);
+#endif
 
     rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
 
     dd("shdict lookup returned %d", (int)rc);
 
-    if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        if (!has_init) {
-            mps_slab_unlock(pool);
-            *err = "not found";
+    /* exists but expired */
+
+    if (rc == NGX_DONE) {
+
+        if (sd->value_type != MPS_SHDICT_TLIST) {
+            /* TODO: reuse when length matched */
+
+            mps_log_debug(MPS_LOG_TAG,
+                          "lua shared dict push: found old entry and value "
+                          "type not matched, remove it first");
+
+            mps_shdict_queue_remove(pool, tree, sd);
+
+            node = (mps_rbtree_node_t *)((u_char *)sd -
+                                         offsetof(mps_rbtree_node_t, color));
+
+            mps_shdict_index_delete(pool, tree, node);
+
+            mps_slab_free_locked(pool, node);
+
+            dd("go to init_list");
+            goto init_list;
+        }
+
+        mps_log_debug(MPS_LOG_TAG,
+                      "lua shared dict push: found old entry and value "
+                      "type matched, reusing it");
+
+        sd->expires = 0;
+        mps_shdict_timer_update(pool, tree, sd);
+        mps_shdict_gen_update(tree, sd);
+        sd->value_len = 0;
+        /* free list nodes */
+
+        queue = mps_shdict_get_list_head(sd, key_len);
+
+        for (q = mps_queue_head(pool, queue);
+             q != mps_queue_sentinel(pool, queue);
+             q = mps_queue_next(pool, q)) {
+            /* TODO: reuse matched size list node */
+            lnode = mps_queue_data(q, mps_shdict_list_node_t, queue);
+            mps_slab_free_locked(pool, lnode);
+        }
+
+        mps_queue_init(pool, queue);
+
+        mps_shdict_queue_touch(pool, tree, sd);
+
+        dd("go to push_node");
+        goto push_node;
+    }
+
+    /* exists and not expired */
+
+    if (rc == NGX_OK) {
+
+        if (sd->value_type != MPS_SHDICT_TLIST) {
+            mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+            *errmsg = "value not a list";
             return NGX_ERROR;
         }
 
-        /* add value */
-        num = *value + init;
+        queue = mps_shdict_get_list_head(sd, key_len);
+
+        mps_shdict_queue_touch(pool, tree, sd);
+
+        dd("go to push_node");
+        goto push_node;
+    }
+
+    /* rc == NGX_DECLINED, not found */
+
+init_list:
 
-        if (rc == NGX_DONE) {
+    mps_log_debug(MPS_LOG_TAG, "lua shared dict list: creating a new entry");
 
-            /* found an expired item */
+    /* NOTICE: we assume the begin point aligned in slab, be careful */
+    n = offsetof(mps_rbtree_node_t, color) + offsetof(mps_shdict_node_t, data) +
+        key_len + sizeof(mps_queue_t);
 
-            if ((size_t)sd->value_len == sizeof(double) &&
-                sd->value_type != MPS_SHDICT_TLIST) {
-                mps_log_debug(
-                    MPS_LOG_TAG,
-                    "lua shared dict incr in dict \"%.*s\": "
-                    "found old entry and value size matched, reusing it",
-                    (int)dict->name.len, dict->name.data);
+    dd("length before aligned: %d", n);
 
-                mps_queue_remove(pool, &sd->queue);
-                mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    n = (int)(uintptr_t)ngx_align_ptr(n, NGX_ALIGNMENT);
 
-                dd("go to setvalue");
-                goto setvalue;
-            }
+    dd("length after aligned: %d", n);
 
-            dd("go to remove");
-            goto remove;
-        }
+    n = (int)mps_shdict_node_size(tree, n);
 
-        dd("go to insert");
-        goto insert;
-    }
+    node = mps_slab_alloc_locked(pool, n);
 
-    /* rc == NGX_OK */
+    if (node == NULL) {
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-    if (sd->value_type != MPS_SHDICT_TNUMBER ||
-        sd->value_len != sizeof(double)) {
-        mps_slab_unlock(pool);
-        *err = "not a number";
+        *errmsg = "no memory";
         return NGX_ERROR;
     }
 
-    mps_queue_remove(pool, &sd->queue);
-    mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
-
-    dd("setting value type to %d", (int)sd->value_type);
+    sd = (mps_shdict_node_t *)&node->color;
 
-    p = sd->data + key_len;
+    queue = mps_shdict_get_list_head(sd, key_len);
 
-    ngx_memcpy(&num, p, sizeof(double));
-    num += *value;
+    node->key = hash;
+    sd->key_len = (u_short)key_len;
 
-    ngx_memcpy(p, (double *)&num, sizeof(double));
+    sd->expires = 0;
 
-    mps_slab_unlock(pool);
+    sd->value_len = 0;
 
-    *value = num;
-    return NGX_OK;
+    dd("setting value type to %d", (int)MPS_SHDICT_TLIST);
 
-remove:
+    sd->value_type = (uint8_t)MPS_SHDICT_TLIST;
 
-    mps_log_debug(
-        MPS_LOG_TAG,
-        "lua shared dict incr in dict \"%.*s\": "
-        "found old entry but value size NOT matched, removing it first",
-        (int)dict->name.len, dict->name.data);
+    ngx_memcpy(sd->data, key, key_len);
 
-    if (sd->value_type == MPS_SHDICT_TLIST) {
-        queue = mps_shdict_get_list_head(sd, key_len);
+    mps_queue_init(pool, queue);
 
-        for (q = mps_queue_head(pool, queue);
-             q != mps_queue_sentinel(pool, queue);
-             q = mps_queue_next(pool, q)) {
-            p = (u_char *)mps_queue_data(q, mps_shdict_list_node_t, queue);
+    mps_shdict_index_insert(pool, tree, node);
 
-            mps_slab_free_locked(pool, p);
-        }
-    }
+    mps_shdict_queue_insert(pool, tree, sd);
 
-    mps_queue_remove(pool, &sd->queue);
+push_node:
 
-    node = (mps_rbtree_node_t *)((u_char *)sd -
-                                 offsetof(mps_rbtree_node_t, color));
+    mps_log_debug(MPS_LOG_TAG,
+                  "lua shared dict list: creating a new list node");
 
-    mps_rbtree_delete(pool, &tree->rbtree, node);
-    mps_slab_free_locked(pool, node);
+    n = offsetof(mps_shdict_list_node_t, data) + str_value_len;
 
-insert:
+    dd("list node length: %d", n);
 
-    mps_log_debug(MPS_LOG_TAG,
-                  "lua shared dict incr in dict \"%.*s\": creating a new entry",
-                  (int)dict->name.len, dict->name.data);
+    lnode = mps_slab_alloc_locked(pool, n);
 
-    n = offsetof(mps_rbtree_node_t, color) + offsetof(mps_shdict_node_t, data) +
-        key_len + sizeof(double);
+    if (lnode == NULL) {
 
-    node = mps_slab_alloc_locked(pool, n);
+        if (sd->value_len == 0) {
 
-    if (node == NULL) {
+            mps_log_debug(MPS_LOG_TAG,
+                          "lua shared dict list: no memory for create"
+                          " list node and list empty, remove it");
 
-        mps_log_debug(MPS_LOG_TAG,
-                      "lua shared dict incr in dict \"%.*s\": overriding "
-                      "non-expired items "
-                      "due to memory shortage for entry \"%.*s\"",
-                      (int)dict->name.len, dict->name.data, (int)key_len, key);
+            mps_shdict_queue_remove(pool, tree, sd);
 
-        for (i = 0; i < 30; i++) {
-            if (mps_shdict_expire(pool, tree, 0) == 0) {
-                break;
-            }
+            node = (mps_rbtree_node_t *)((u_char *)sd -
+                                         offsetof(mps_rbtree_node_t, color));
 
-            *forcible = 1;
+            mps_shdict_index_delete(pool, tree, node);
 
-            node = mps_slab_alloc_locked(pool, n);
-            if (node != NULL) {
-                goto allocated;
-            }
+            mps_slab_free_locked(pool, node);
         }
 
-        mps_slab_unlock(pool);
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-        *err = "no memory";
+        *errmsg = "no memory";
         return NGX_ERROR;
     }
 
-allocated:
-
-    sd = (mps_shdict_node_t *)&node->color;
-
-    node->key = hash;
+    dd("setting list length to %d", sd->value_len + 1);
 
-    sd->key_len = (u_short)key_len;
+    sd->value_len = sd->value_len + 1;
+    mps_shdict_version_update(tree, sd);
 
-    sd->value_len = (uint32_t)sizeof(double);
+    dd("setting list node value length to %d", (int)str_value_len);
 
-    mps_rbtree_insert(pool, &tree->rbtree, node);
+    lnode->value_len = (uint32_t)str_value_len;
 
-    mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    dd("setting list node value type to %d", value_type);
 
-setvalue:
+    lnode->value_type = (uint8_t)value_type;
 
-    sd->user_flags = 0;
+    ngx_memcpy(lnode->data, str_value_buf, str_value_len);
 
-    if (init_ttl > 0) {
-        sd->expires = now + (uint64_t)init_ttl;
+    if (direction == MPS_SHDICT_LEFT) {
+        mps_queue_insert_head(pool, queue, &lnode->queue);
 
     } else {
-        sd->expires = 0;
+        mps_queue_insert_tail(pool, queue, &lnode->queue);
     }
 
-    dd("setting value type to %d", LUA_TNUMBER);
+    mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-    sd->value_type = (uint8_t)LUA_TNUMBER;
-
-    p = ngx_copy(sd->data, key, key_len);
-    ngx_memcpy(p, (double *)&num, sizeof(double));
+    return sd->value_len;
+}
 
-    mps_slab_unlock(pool);
+int mps_shdict_lpop(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                    int *value_type, u_char **str_value_buf,
+                    size_t *str_value_len, double *num_value, char **errmsg)
+{
+    return mps_shdict_pop_helper(dict, MPS_SHDICT_LEFT, key, key_len,
+                                 value_type, str_value_buf, str_value_len,
+                                 num_value, errmsg);
+}
 
-    *value = num;
-    return NGX_OK;
+int mps_shdict_rpop(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                    int *value_type, u_char **str_value_buf,
+                    size_t *str_value_len, double *num_value, char **errmsg)
+{
+    return mps_shdict_pop_helper(dict, MPS_SHDICT_RIGHT, key, key_len,
+                                 value_type, str_value_buf, str_value_len,
+                                 num_value, errmsg);
 }
 
-int mps_shdict_flush_all(mps_shdict_t *dict)
+static int mps_shdict_pop_helper(mps_shdict_t *dict, int direction,
+                                 const u_char *key, size_t key_len,
+                                 int *value_type, u_char **str_value_buf,
+                                 size_t *str_value_len, double *num_value,
+                                 char **errmsg)
 {
     mps_slab_pool_t *pool;
-    mps_queue_t *q;
     mps_shdict_tree_t *tree;
+    uint32_t hash;
+    ngx_int_t rc;
     mps_shdict_node_t *sd;
+    mps_rbtree_node_t *node;
+    mps_queue_t *queue;
+    mps_shdict_list_node_t *lnode;
+    ngx_str_t value;
 
-    pool = dict->pool;
+    hash = ngx_murmur_hash2(key, key_len);
+
+    pool = mps_shdict_shard(dict, hash);
     tree = mps_shdict_tree(pool);
 
     mps_slab_lock(pool);
 
-    for (q = mps_queue_head(pool, &tree->lru_queue);
-         q != mps_queue_sentinel(pool, &tree->lru_queue);
-         q = mps_queue_next(pool, q)) {
-        sd = mps_queue_data(q, mps_shdict_node_t, queue);
-        sd->expires = 1;
+#if 1
+    mps_shdict_expire(pool, tree, 1);
+#endif
+
+    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+
+    dd("shdict lookup returned %d", (int)rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+        *value_type = MPS_SHDICT_TNIL;
+        return NGX_OK;
     }
 
-    mps_shdict_expire(pool, tree, 0);
+    /* rc == NGX_OK */
 
-    mps_slab_unlock(pool);
+    if (sd->value_type != MPS_SHDICT_TLIST) {
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-    return NGX_OK;
-}
+        *errmsg = "value not a list";
+        return NGX_ERROR;
+    }
 
-static ngx_int_t mps_shdict_peek(mps_slab_pool_t *pool, ngx_uint_t hash,
-                                 const u_char *kdata, size_t klen,
-                                 mps_shdict_node_t **sdp)
-{
-    ngx_int_t rc;
-    mps_rbtree_node_t *node, *sentinel;
-    mps_shdict_tree_t *tree;
-    mps_shdict_node_t *sd;
+    if (sd->value_len <= 0) {
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-    tree = mps_shdict_tree(pool);
-    node = mps_rbtree_node(pool, tree->rbtree.root);
-    sentinel = mps_rbtree_node(pool, tree->rbtree.sentinel);
+        *errmsg = "bad empty value";
+        return NGX_ERROR;
+    }
 
-    while (node != sentinel) {
+    queue = mps_shdict_get_list_head(sd, key_len);
 
-        if (hash < node->key) {
-            node = mps_rbtree_node(pool, node->left);
-            continue;
-        }
+    if (direction == MPS_SHDICT_LEFT) {
+        queue = mps_queue_head(pool, queue);
 
-        if (hash > node->key) {
-            node = mps_rbtree_node(pool, node->right);
-            continue;
-        }
+    } else {
+        queue = mps_queue_last(pool, queue);
+    }
 
-        /* hash == node->key */
+    lnode = mps_queue_data(queue, mps_shdict_list_node_t, queue);
 
-        sd = (mps_shdict_node_t *)&node->color;
+    *value_type = lnode->value_type;
 
-        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t)sd->key_len);
+    dd("data: %p", lnode->data);
+    dd("value len: %d", (int)sd->value_len);
 
-        if (rc == 0) {
-            *sdp = sd;
+    value.data = lnode->data;
+    value.len = (size_t)lnode->value_len;
 
-            return NGX_OK;
+    switch (*value_type) {
+
+    case MPS_SHDICT_TSTRING:
+        if (*str_value_len < (size_t)value.len) {
+            *str_value_buf = malloc(value.len);
+            if (*str_value_buf == NULL) {
+                mps_shdict_unlock_key(dict, pool, hash, key, key_len);
+
+                *errmsg = "no memory";
+                return NGX_ERROR;
+            }
         }
+        *str_value_len = value.len;
+        ngx_memcpy(*str_value_buf, value.data, value.len);
+        break;
 
-        node = mps_rbtree_node(pool, (rc < 0) ? node->left : node->right);
-    }
+    case MPS_SHDICT_TNUMBER:
+        if (value.len != sizeof(double)) {
+            mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-    *sdp = NULL;
+            *errmsg = "bad list number value size";
+            return NGX_ERROR;
+        }
 
-    return NGX_DECLINED;
-}
+        *str_value_len = value.len;
+        ngx_memcpy(num_value, value.data, sizeof(double));
+        break;
+
+    default:
+        mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-long mps_shdict_get_ttl(mps_shdict_t *dict, const u_char *key, size_t key_len)
-{
-    mps_slab_pool_t *pool;
-    uint32_t hash;
-    uint64_t expires, now;
-    ngx_int_t rc;
-    mps_shdict_node_t *sd;
+        *errmsg = "bad list node value type";
+        return NGX_ERROR;
+    }
 
-    hash = ngx_murmur_hash2(key, key_len);
+    mps_queue_remove(pool, queue);
 
-    pool = dict->pool;
-    mps_slab_lock(pool);
+    mps_slab_free_locked(pool, lnode);
 
-    rc = mps_shdict_peek(pool, hash, key, key_len, &sd);
+    if (sd->value_len == 1) {
+        mps_log_debug(MPS_LOG_TAG,
+                      "lua shared dict list: empty node after pop, "
+                      "remove it");
 
-    if (rc == NGX_DECLINED) {
-        mps_slab_unlock(pool);
+        mps_shdict_queue_remove(pool, tree, sd);
 
-        return NGX_DECLINED;
-    }
+        node = (mps_rbtree_node_t *)((u_char *)sd -
+                                     offsetof(mps_rbtree_node_t, color));
 
-    /* rc == NGX_OK */
+        mps_shdict_index_delete(pool, tree, node);
 
-    expires = sd->expires;
+        mps_slab_free_locked(pool, node);
 
-    mps_slab_unlock(pool);
+    } else {
+        sd->value_len = sd->value_len - 1;
+        mps_shdict_version_update(tree, sd);
 
-    if (expires == 0) {
-        return 0;
+        mps_shdict_queue_touch(pool, tree, sd);
     }
 
-    now = mps_clock_time_ms();
+    mps_shdict_unlock_key(dict, pool, hash, key, key_len);
 
-    return expires - now;
+    return NGX_OK;
 }
 
-int mps_shdict_set_expire(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                          long exptime)
+int mps_shdict_llen(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                    char **errmsg)
 {
     mps_slab_pool_t *pool;
+    mps_shdict_tree_t *tree;
     uint32_t hash;
     ngx_int_t rc;
-    uint64_t now = 0;
     mps_shdict_node_t *sd;
 
-    if (exptime > 0) {
-        now = mps_clock_time_ms();
-    }
-
     hash = ngx_murmur_hash2(key, key_len);
 
-    pool = dict->pool;
+    pool = mps_shdict_shard(dict, hash);
+    tree = mps_shdict_tree(pool);
+
     mps_slab_lock(pool);
 
-    rc = mps_shdict_peek(pool, hash, key, key_len, &sd);
+#if 1
+    mps_shdict_expire(pool, tree, 1);
+#endif
 
-    if (rc == NGX_DECLINED) {
-        mps_slab_unlock(pool);
+    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
 
-        return NGX_DECLINED;
-    }
+    dd("shdict lookup returned %d", (int)rc);
 
-    /* rc == NGX_OK */
+    if (rc == NGX_OK) {
 
-    if (exptime > 0) {
-        sd->expires = now + (uint64_t)exptime;
+        if (sd->value_type != MPS_SHDICT_TLIST) {
+            mps_slab_unlock(pool);
 
-    } else {
-        sd->expires = 0;
-    }
+            *errmsg = "value not a list";
+            return NGX_ERROR;
+        }
 
-    mps_slab_unlock(pool);
+        mps_shdict_queue_touch(pool, tree, sd);
 
-    return NGX_OK;
-}
+        mps_slab_unlock(pool);
 
-int mps_shdict_lpush(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                     int value_type, const u_char *str_value_buf,
-                     size_t str_value_len, double num_value, char **errmsg)
-{
-    return mps_shdict_push_helper(dict, MPS_SHDICT_LEFT, key, key_len,
-                                  value_type, str_value_buf, str_value_len,
-                                  num_value, errmsg);
-}
+        return sd->value_len;
+    }
 
-int mps_shdict_rpush(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                     int value_type, const u_char *str_value_buf,
-                     size_t str_value_len, double num_value, char **errmsg)
-{
-    return mps_shdict_push_helper(dict, MPS_SHDICT_RIGHT, key, key_len,
-                                  value_type, str_value_buf, str_value_len,
-                                  num_value, errmsg);
+    mps_slab_unlock(pool);
+
+    return 0;
 }
 
-static int mps_shdict_push_helper(mps_shdict_t *dict, int direction,
-                                  const u_char *key, size_t key_len,
-                                  int value_type, const u_char *str_value_buf,
-                                  size_t str_value_len, double num_value,
-                                  char **errmsg)
+static void mps_shdict_remove_node(mps_slab_pool_t *pool,
+                                   mps_shdict_tree_t *tree,
+                                   mps_shdict_node_t *sd)
 {
-    mps_slab_pool_t *pool;
-    mps_shdict_tree_t *tree;
-    int n;
-    uint32_t hash;
-    ngx_int_t rc;
-    mps_shdict_node_t *sd;
+    mps_queue_t *queue, *q, *next;
     mps_rbtree_node_t *node;
-    mps_queue_t *queue, *q;
-    mps_shdict_list_node_t *lnode;
 
-    pool = dict->pool;
-    tree = mps_shdict_tree(pool);
+    if (sd->value_type == MPS_SHDICT_TLIST) {
+        queue = mps_shdict_get_list_head(sd, sd->key_len);
 
-    hash = ngx_murmur_hash2(key, key_len);
+        for (q = mps_queue_head(pool, queue);
+             q != mps_queue_sentinel(pool, queue); q = next) {
+            next = mps_queue_next(pool, q);
+            mps_slab_free_locked(pool,
+                                 mps_queue_data(q, mps_shdict_list_node_t,
+                                                queue));
+        }
+    }
 
-    switch (value_type) {
+    mps_shdict_queue_remove(pool, tree, sd);
 
-    case MPS_SHDICT_TSTRING:
-        /* do nothing */
-        break;
+    node = (mps_rbtree_node_t *)((u_char *)sd -
+                                 offsetof(mps_rbtree_node_t, color));
 
-    case MPS_SHDICT_TNUMBER:
-        dd("num value: %lf", num_value);
-        str_value_buf = (u_char *)&num_value;
-        str_value_len = sizeof(double);
-        break;
+    mps_shdict_index_delete(pool, tree, node);
 
-    default:
-        *errmsg = "unsupported value type";
-        return NGX_ERROR;
-    }
+    mps_slab_free_locked(pool, node);
+}
 
-    mps_slab_lock(pool);
+/*
+ * Copy the node to the dict of the main pool dst, replacing the entry of the
+ * same key. The caller holds the lock of the pool of the node.
+ */
+static ngx_int_t mps_shdict_copy_node(mps_slab_pool_t *pool,
+                                      mps_shdict_node_t *sd,
+                                      mps_slab_pool_t *dst)
+{
+    mps_shdict_tree_t *tree;
+    mps_rbtree_node_t *node, *dnode;
+    mps_shdict_node_t *dsd;
+    mps_queue_t *queue, *dqueue, *q;
+    mps_shdict_list_node_t *lnode, *dlnode;
+    uint32_t hash;
+    size_t n, size;
+    int i;
 
-#if 1
-    mps_shdict_expire(pool, tree, 1);
-#endif
+    node = (mps_rbtree_node_t *)((u_char *)sd -
+                                 offsetof(mps_rbtree_node_t, color));
+    hash = (uint32_t)node->key;
 
-    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+    dst = mps_shdict_shard_at(dst, hash % mps_shdict_tree(dst)->nshards);
+    tree = mps_shdict_tree(dst);
 
-    dd("shdict lookup returned %d", (int)rc);
+    mps_slab_lock(dst);
 
-    /* exists but expired */
+    if (mps_shdict_peek(dst, hash, sd->data, sd->key_len, &dsd) == NGX_OK) {
+        mps_shdict_remove_node(dst, tree, dsd);
+    }
 
-    if (rc == NGX_DONE) {
+    if (sd->value_type == MPS_SHDICT_TLIST) {
+        n = (size_t)(uintptr_t)ngx_align_ptr(MPS_SHDICT_NODE_HEADER_SIZE +
+                                                 sd->key_len +
+                                                 sizeof(mps_queue_t),
+                                             NGX_ALIGNMENT);
 
-        if (sd->value_type != MPS_SHDICT_TLIST) {
-            /* TODO: reuse when length matched */
+    } else {
+        n = MPS_SHDICT_NODE_HEADER_SIZE + sd->key_len + sd->value_len;
+    }
 
-            mps_log_debug(MPS_LOG_TAG,
-                          "lua shared dict push: found old entry and value "
-                          "type not matched, remove it first");
+    /* the value is copied without the timer of the source */
+    size = mps_shdict_node_size(tree, n);
 
-            mps_queue_remove(pool, &sd->queue);
+    dnode = mps_slab_alloc_locked(dst, size);
 
-            node = (mps_rbtree_node_t *)((u_char *)sd -
-                                         offsetof(mps_rbtree_node_t, color));
+    for (i = 0; dnode == NULL && i < 30; i++) {
+        if (mps_shdict_evict(dst, tree, size) == 0) {
+            break;
+        }
 
-            mps_rbtree_delete(pool, &tree->rbtree, node);
+        dnode = mps_slab_alloc_locked(dst, size);
+    }
 
-            mps_slab_free_locked(pool, node);
+    if (dnode == NULL) {
+        goto failed;
+    }
 
-            dd("go to init_list");
-            goto init_list;
-        }
+    ngx_memcpy(&dnode->color, &node->color,
+               n - offsetof(mps_rbtree_node_t, color));
+    dnode->key = hash;
+    dsd = (mps_shdict_node_t *)&dnode->color;
 
-        mps_log_debug(MPS_LOG_TAG,
-                      "lua shared dict push: found old entry and value "
-                      "type matched, reusing it");
+    if (mps_shdict_flushed(mps_shdict_tree(pool), sd)) {
+        dsd->expires = 1;
+    }
 
-        sd->expires = 0;
-        sd->value_len = 0;
-        /* free list nodes */
+    mps_shdict_index_insert(dst, tree, dnode);
+    mps_shdict_queue_insert(dst, tree, dsd);
 
-        queue = mps_shdict_get_list_head(sd, key_len);
+    /* keep the version, so that a cas started before the copy still works */
+    dsd->version = sd->version;
+    tree->version = ngx_max(tree->version, sd->version);
+
+    if (sd->value_type == MPS_SHDICT_TLIST) {
+        queue = mps_shdict_get_list_head(sd, sd->key_len);
+        dqueue = mps_shdict_get_list_head(dsd, dsd->key_len);
+        mps_queue_init(dst, dqueue);
 
         for (q = mps_queue_head(pool, queue);
              q != mps_queue_sentinel(pool, queue);
              q = mps_queue_next(pool, q)) {
-            /* TODO: reuse matched size list node */
             lnode = mps_queue_data(q, mps_shdict_list_node_t, queue);
-            mps_slab_free_locked(pool, lnode);
+            n = offsetof(mps_shdict_list_node_t, data) + lnode->value_len;
+
+            dlnode = mps_slab_alloc_locked(dst, n);
+            if (dlnode == NULL) {
+                mps_shdict_remove_node(dst, tree, dsd);
+                goto failed;
+            }
+
+            ngx_memcpy(dlnode, lnode, n);
+            mps_queue_insert_tail(dst, dqueue, &dlnode->queue);
         }
+    }
 
-        mps_queue_init(pool, queue);
+    mps_slab_unlock(dst);
 
-        mps_queue_remove(pool, &sd->queue);
-        mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    return NGX_OK;
 
-        dd("go to push_node");
-        goto push_node;
-    }
+failed:
 
-    /* exists and not expired */
+    mps_slab_unlock(dst);
 
-    if (rc == NGX_OK) {
+    mps_log_error("mps_shdict_copy_node: no memory in migration target");
+    return NGX_ERROR;
+}
 
-        if (sd->value_type != MPS_SHDICT_TLIST) {
-            mps_slab_unlock(pool);
+/*
+ * Raise the version counter of each shard of the main pool dst to the version
+ * of the main pool, so that neither the version of the dict nor the next
+ * version of a key go back when the dict switches to dst.
+ */
+static void mps_shdict_migrate_seed(mps_slab_pool_t *main,
+                                    mps_slab_pool_t *dst)
+{
+    mps_slab_pool_t *pool;
+    mps_shdict_tree_t *tree;
+    uint64_t version;
+    ngx_uint_t i;
 
-            *errmsg = "value not a list";
-            return NGX_ERROR;
-        }
+    version = mps_shdict_pool_version(main);
 
-        queue = mps_shdict_get_list_head(sd, key_len);
+    for (i = 0; i < mps_shdict_tree(dst)->nshards; i++) {
+        pool = mps_shdict_shard_at(dst, i);
+        tree = mps_shdict_tree(pool);
 
-        mps_queue_remove(pool, &sd->queue);
-        mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+        mps_slab_lock(pool);
+        tree->version = ngx_max(tree->version, version);
+        mps_slab_unlock(pool);
+    }
+}
 
-        dd("go to push_node");
-        goto push_node;
+/* Map the migration target in this process. */
+static ngx_int_t mps_shdict_migrate_attach(mps_shdict_t *dict)
+{
+    mps_shdict_tree_t *tree;
+    mps_shdict_migrate_t *mg;
+    mps_slab_pool_t *pool;
+    ngx_int_t rc;
+
+    if (dict->target != NULL) {
+        return NGX_OK;
     }
 
-    /* rc == NGX_DECLINED, not found */
+    pthread_mutex_lock(&dicts_lock);
 
-init_list:
+    rc = NGX_OK;
 
-    mps_log_debug(MPS_LOG_TAG, "lua shared dict list: creating a new entry");
+    /* dict->pool is the source until the target is mapped */
+    tree = mps_shdict_tree(dict->pool);
 
-    /* NOTICE: we assume the begin point aligned in slab, be careful */
-    n = offsetof(mps_rbtree_node_t, color) + offsetof(mps_shdict_node_t, data) +
-        key_len + sizeof(mps_queue_t);
+    if (dict->target != NULL) {
+        goto done;
+    }
 
-    dd("length before aligned: %d", n);
+    if (tree->migrate == mps_nulloff) {
+        rc = NGX_DECLINED;
+        goto done;
+    }
 
-    n = (int)(uintptr_t)ngx_align_ptr(n, NGX_ALIGNMENT);
+    mg = (mps_shdict_migrate_t *)mps_ptr(dict->pool, tree->migrate);
 
-    dd("length after aligned: %d", n);
+    pool = mps_slab_open_or_create_max((const char *)mg->name, mg->size,
+                                       mg->max_size, MPS_SLAB_DEFAULT_MIN_SHIFT,
+                                       mg->mode, mps_shdict_on_init);
+    if (pool == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
 
-    node = mps_slab_alloc_locked(pool, n);
+    dict->target_size = mg->max_size;
+    mps_memory_barrier();
+    dict->target = pool;
 
-    if (node == NULL) {
-        mps_slab_unlock(pool);
+done:
 
-        *errmsg = "no memory";
-        return NGX_ERROR;
-    }
+    pthread_mutex_unlock(&dicts_lock);
 
-    sd = (mps_shdict_node_t *)&node->color;
+    return rc;
+}
 
-    queue = mps_shdict_get_list_head(sd, key_len);
+/* Switch the dict to the migration target once the migration is done. */
+static void mps_shdict_migrate_update(mps_shdict_t *dict)
+{
+    mps_shdict_migrate_t *mg;
 
-    node->key = hash;
-    sd->key_len = (u_short)key_len;
+    mg = (mps_shdict_migrate_t *)mps_ptr(dict->pool,
+                                         mps_shdict_tree(dict->pool)->migrate);
 
-    sd->expires = 0;
+    if (mg->state != MPS_SHDICT_MIGRATE_DONE ||
+        mps_shdict_migrate_attach(dict) != NGX_OK) {
+        return;
+    }
 
-    sd->value_len = 0;
+    pthread_mutex_lock(&dicts_lock);
 
-    dd("setting value type to %d", (int)MPS_SHDICT_TLIST);
+    if (dict->source == NULL) {
+        dict->source = dict->pool;
+        dict->source_size = dict->size;
+        dict->size = dict->target_size;
+        mps_memory_barrier();
+        dict->pool = dict->target;
+    }
 
-    sd->value_type = (uint8_t)MPS_SHDICT_TLIST;
+    pthread_mutex_unlock(&dicts_lock);
+}
 
-    ngx_memcpy(sd->data, key, key_len);
+/* Copy the current state of the key in the locked pool to the target. */
+static void mps_shdict_sync_key(mps_shdict_t *dict, mps_slab_pool_t *pool,
+                                uint32_t hash, const u_char *key,
+                                size_t key_len)
+{
+    mps_slab_pool_t *dst;
+    mps_shdict_node_t *sd;
 
-    mps_queue_init(pool, queue);
+    if (!(mps_shdict_tree(pool)->flags & MPS_SHDICT_MIGRATING) ||
+        mps_shdict_migrate_attach(dict) != NGX_OK) {
+        return;
+    }
 
-    mps_rbtree_insert(pool, &tree->rbtree, node);
+    /* a dict switched to the target does not follow its migration */
+    if ((u_char *)pool >= (u_char *)dict->target &&
+        (u_char *)pool < (u_char *)dict->target + dict->target_size) {
+        return;
+    }
 
-    mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    if (mps_shdict_peek(pool, hash, key, key_len, &sd) == NGX_OK) {
+        (void)mps_shdict_copy_node(pool, sd, dict->target);
 
-push_node:
+    } else {
+        dst = dict->target;
+        dst = mps_shdict_shard_at(dst, hash % mps_shdict_tree(dst)->nshards);
 
-    mps_log_debug(MPS_LOG_TAG,
-                  "lua shared dict list: creating a new list node");
+        mps_slab_lock(dst);
 
-    n = offsetof(mps_shdict_list_node_t, data) + str_value_len;
+        if (mps_shdict_peek(dst, hash, key, key_len, &sd) == NGX_OK) {
+            mps_shdict_remove_node(dst, mps_shdict_tree(dst), sd);
+        }
 
-    dd("list node length: %d", n);
+        mps_slab_unlock(dst);
+    }
+}
 
-    lnode = mps_slab_alloc_locked(pool, n);
+/*
+ * Unlock the pool after a write of the key. While the dict is being migrated
+ * the entry is also written to the target with the lock held, so the target
+ * never gets an older entry than the source.
+ */
+static void mps_shdict_unlock_key(mps_shdict_t *dict, mps_slab_pool_t *pool,
+                                  uint32_t hash, const u_char *key,
+                                  size_t key_len)
+{
+    mps_shdict_sync_key(dict, pool, hash, key, key_len);
+    mps_slab_unlock(pool);
+}
 
-    if (lnode == NULL) {
+int mps_shdict_migrate_start(mps_shdict_t *dict, const char *pathname,
+                             size_t shm_size, mode_t mode,
+                             const mps_shdict_opts_t *opts)
+{
+    mps_slab_pool_t *main, *pool, *target;
+    mps_shdict_tree_t *tree;
+    mps_shdict_migrate_t *mg;
+    ngx_uint_t i;
+    size_t len, size;
 
-        if (sd->value_len == 0) {
+    main = mps_shdict_main(dict);
+    tree = mps_shdict_tree(main);
 
-            mps_log_debug(MPS_LOG_TAG,
-                          "lua shared dict list: no memory for create"
-                          " list node and list empty, remove it");
+    if (dict->source != NULL || dict->target != NULL ||
+        tree->migrate != mps_nulloff) {
+        return NGX_DECLINED;
+    }
 
-            mps_queue_remove(pool, &sd->queue);
+    pthread_mutex_lock(&dicts_lock);
 
-            node = (mps_rbtree_node_t *)((u_char *)sd -
-                                         offsetof(mps_rbtree_node_t, color));
+    size = ngx_max(shm_size, opts->max_size);
 
-            mps_rbtree_delete(pool, &tree->rbtree, node);
+    creating_opts = opts;
+    target = mps_slab_open_or_create_max(pathname, shm_size, size,
+                                         opts->min_shift, mode,
+                                         mps_shdict_on_init);
+    creating_opts = NULL;
 
-            mps_slab_free_locked(pool, node);
-        }
+    pthread_mutex_unlock(&dicts_lock);
 
-        mps_slab_unlock(pool);
+    if (target == NULL) {
+        return NGX_ERROR;
+    }
 
-        *errmsg = "no memory";
+    if (target->max_end > size) {
+        mps_log_error("mps_shdict_migrate_start: target was created with "
+                      "max_size=%lu, but opened with %lu",
+                      (size_t)target->max_end, size);
+        mps_slab_close(target, size);
         return NGX_ERROR;
     }
 
-    dd("setting list length to %d", sd->value_len + 1);
+    len = strlen(pathname);
 
-    sd->value_len = sd->value_len + 1;
+    mps_slab_lock(main);
 
-    dd("setting list node value length to %d", (int)str_value_len);
+    if (tree->migrate != mps_nulloff) {
+        mps_slab_unlock(main);
+        mps_slab_close(target, size);
+        return NGX_DECLINED;
+    }
 
-    lnode->value_len = (uint32_t)str_value_len;
+    mg = mps_slab_alloc_locked(main,
+                               offsetof(mps_shdict_migrate_t, name) + len + 1);
+    if (mg == NULL) {
+        mps_slab_unlock(main);
+        mps_slab_close(target, size);
+        mps_log_error("mps_shdict_migrate_start: no memory for migration");
+        return NGX_ERROR;
+    }
 
-    dd("setting list node value type to %d", value_type);
+    mg->state = MPS_SHDICT_MIGRATE_COPYING;
+    mg->shard = 0;
+    mg->next = 0;
+    mg->gen = 0;
+    mg->mode = mode;
+    mg->size = shm_size;
+    mg->max_size = size;
+    ngx_memcpy(mg->name, pathname, len + 1);
 
-    lnode->value_type = (uint8_t)value_type;
+    dict->target_size = size;
+    dict->target = target;
 
-    ngx_memcpy(lnode->data, str_value_buf, str_value_len);
+    mps_shdict_migrate_seed(main, target);
 
-    if (direction == MPS_SHDICT_LEFT) {
-        mps_queue_insert_head(pool, queue, &lnode->queue);
+    tree->flags |= MPS_SHDICT_MIGRATING;
 
-    } else {
-        mps_queue_insert_tail(pool, queue, &lnode->queue);
-    }
+    for (i = 0; tree->nshards > 1 && i < tree->nshards; i++) {
+        pool = mps_shdict_shard_at(main, i);
 
-    mps_slab_unlock(pool);
+        mps_slab_lock(pool);
+        mps_shdict_tree(pool)->flags |= MPS_SHDICT_MIGRATING;
+        mps_slab_unlock(pool);
+    }
 
-    return sd->value_len;
-}
+    tree->migrate = mps_offset(main, mg);
 
-int mps_shdict_lpop(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                    int *value_type, u_char **str_value_buf,
-                    size_t *str_value_len, double *num_value, char **errmsg)
-{
-    return mps_shdict_pop_helper(dict, MPS_SHDICT_LEFT, key, key_len,
-                                 value_type, str_value_buf, str_value_len,
-                                 num_value, errmsg);
-}
+    mps_slab_unlock(main);
 
-int mps_shdict_rpop(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                    int *value_type, u_char **str_value_buf,
-                    size_t *str_value_len, double *num_value, char **errmsg)
-{
-    return mps_shdict_pop_helper(dict, MPS_SHDICT_RIGHT, key, key_len,
-                                 value_type, str_value_buf, str_value_len,
-                                 num_value, errmsg);
+    return NGX_OK;
 }
 
-static int mps_shdict_pop_helper(mps_shdict_t *dict, int direction,
-                                 const u_char *key, size_t key_len,
-                                 int *value_type, u_char **str_value_buf,
-                                 size_t *str_value_len, double *num_value,
-                                 char **errmsg)
+/*
+ * Copy about n entries of the locked pool from the cursor to the main pool
+ * dst. Entries of the same hash are copied together since the cursor of the
+ * rbtree is a hash. Returns 1 when all entries have been copied.
+ */
+static ngx_uint_t mps_shdict_migrate_copy(mps_slab_pool_t *pool,
+                                          mps_shdict_migrate_t *mg,
+                                          mps_slab_pool_t *dst, ngx_uint_t n)
 {
-    mps_slab_pool_t *pool;
     mps_shdict_tree_t *tree;
-    uint32_t hash;
-    ngx_int_t rc;
-    mps_shdict_node_t *sd;
-    mps_rbtree_node_t *node;
-    mps_queue_t *queue;
-    mps_shdict_list_node_t *lnode;
-    ngx_str_t value;
+    mps_rbtree_node_t *node, *sentinel, *first;
+    mps_htable_t *ht;
+    mps_rbtree_key_t last;
+    ngx_uint_t copied;
+    uint64_t slot;
+    mps_ptroff_t off;
+    u_char *ctrl;
 
-    pool = dict->pool;
     tree = mps_shdict_tree(pool);
+    copied = 0;
 
-    hash = ngx_murmur_hash2(key, key_len);
+    if (tree->index != mps_nulloff) {
+        ht = mps_shdict_index(pool, tree);
 
-    mps_slab_lock(pool);
+        /* the index has been rebuilt, so start over */
+        if (ht->gen != mg->gen) {
+            mg->gen = ht->gen;
+            mg->next = 0;
+        }
 
-#if 1
-    mps_shdict_expire(pool, tree, 1);
-#endif
+        ctrl = mps_htable_ctrl(ht);
 
-    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+        for (slot = mg->next; slot <= ht->mask; slot++) {
+            if (copied == n) {
+                mg->next = slot;
+                return 0;
+            }
 
-    dd("shdict lookup returned %d", (int)rc);
+            if (ctrl[slot] & 0x80) {
+                continue;
+            }
 
-    if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        mps_slab_unlock(pool);
+            off = (mps_ptroff_t)mps_htable_values(ht)[slot] << ht->shift;
+            node = mps_rbtree_node(pool, off);
 
-        *value_type = MPS_SHDICT_TNIL;
-        return NGX_OK;
+            (void)mps_shdict_copy_node(pool, (mps_shdict_node_t *)&node->color,
+                                       dst);
+            copied++;
+        }
+
+        return 1;
     }
 
-    /* rc == NGX_OK */
+    /* find the first node whose hash is not less than the cursor */
 
-    if (sd->value_type != MPS_SHDICT_TLIST) {
-        mps_slab_unlock(pool);
+    node = mps_rbtree_node(pool, tree->rbtree.root);
+    sentinel = mps_rbtree_node(pool, tree->rbtree.sentinel);
+    first = NULL;
 
-        *errmsg = "value not a list";
-        return NGX_ERROR;
+    while (node != sentinel) {
+        if (node->key >= mg->next) {
+            first = node;
+            node = mps_rbtree_node(pool, node->left);
+
+        } else {
+            node = mps_rbtree_node(pool, node->right);
+        }
     }
 
-    if (sd->value_len <= 0) {
-        mps_slab_unlock(pool);
+    last = 0;
 
-        *errmsg = "bad empty value";
-        return NGX_ERROR;
+    for (node = first; node != NULL;
+         node = mps_rbtree_next(pool, &tree->rbtree, node)) {
+        if (copied >= n && node->key != last) {
+            mg->next = node->key;
+            return 0;
+        }
+
+        (void)mps_shdict_copy_node(pool, (mps_shdict_node_t *)&node->color,
+                                   dst);
+        last = node->key;
+        copied++;
     }
 
-    queue = mps_shdict_get_list_head(sd, key_len);
+    return 1;
+}
 
-    if (direction == MPS_SHDICT_LEFT) {
-        queue = mps_queue_head(pool, queue);
+int mps_shdict_migrate_step(mps_shdict_t *dict, ngx_uint_t n)
+{
+    mps_slab_pool_t *main, *pool;
+    mps_shdict_tree_t *tree;
+    mps_shdict_migrate_t *mg;
+    ngx_uint_t i;
 
-    } else {
-        queue = mps_queue_last(pool, queue);
-    }
+    main = mps_shdict_main(dict);
 
-    lnode = mps_queue_data(queue, mps_shdict_list_node_t, queue);
+    if (dict->source != NULL) {
+        return NGX_OK;
+    }
 
-    *value_type = lnode->value_type;
+    tree = mps_shdict_tree(main);
+    if (tree->migrate == mps_nulloff) {
+        return NGX_DECLINED;
+    }
 
-    dd("data: %p", lnode->data);
-    dd("value len: %d", (int)sd->value_len);
+    if (mps_shdict_migrate_attach(dict) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    value.data = lnode->data;
-    value.len = (size_t)lnode->value_len;
+    mg = (mps_shdict_migrate_t *)mps_ptr(main, tree->migrate);
 
-    switch (*value_type) {
+    while (mg->state != MPS_SHDICT_MIGRATE_DONE) {
+        i = mg->shard;
+        pool = mps_shdict_shard_at(main, i);
 
-    case MPS_SHDICT_TSTRING:
-        if (*str_value_len < (size_t)value.len) {
-            *str_value_buf = malloc(value.len);
-            if (*str_value_buf == NULL) {
-                mps_slab_unlock(pool);
+        mps_slab_lock(pool);
 
-                *errmsg = "no memory";
-                return NGX_ERROR;
-            }
+        /* the cursor is moved with the lock of the shard held */
+        if (mg->shard != i || mg->state == MPS_SHDICT_MIGRATE_DONE) {
+            mps_slab_unlock(pool);
+            continue;
         }
-        *str_value_len = value.len;
-        ngx_memcpy(*str_value_buf, value.data, value.len);
-        break;
 
-    case MPS_SHDICT_TNUMBER:
-        if (value.len != sizeof(double)) {
-            mps_slab_unlock(pool);
+        if (mps_shdict_migrate_copy(pool, mg, dict->target, n)) {
+            mg->next = 0;
+            mg->gen = 0;
 
-            *errmsg = "bad list number value size";
-            return NGX_ERROR;
-        }
+            if (mg->shard + 1 == tree->nshards) {
+                /* entries may have been removed from the source meanwhile */
+                mps_shdict_migrate_seed(main, dict->target);
+                mg->state = MPS_SHDICT_MIGRATE_DONE;
 
-        *str_value_len = value.len;
-        ngx_memcpy(num_value, value.data, sizeof(double));
-        break;
+            } else {
+                mg->shard++;
+            }
+        }
 
-    default:
         mps_slab_unlock(pool);
 
-        *errmsg = "bad list node value type";
-        return NGX_ERROR;
+        if (mg->state != MPS_SHDICT_MIGRATE_DONE) {
+            return NGX_AGAIN;
+        }
     }
 
-    mps_queue_remove(pool, queue);
-
-    mps_slab_free_locked(pool, lnode);
-
-    if (sd->value_len == 1) {
-        mps_log_debug(MPS_LOG_TAG,
-                      "lua shared dict list: empty node after pop, "
-                      "remove it");
+    mps_shdict_migrate_update(dict);
 
-        mps_queue_remove(pool, &sd->queue);
+    return NGX_OK;
+}
 
-        node = (mps_rbtree_node_t *)((u_char *)sd -
-                                     offsetof(mps_rbtree_node_t, color));
+int mps_shdict_grow(mps_shdict_t *dict, size_t size)
+{
+    mps_slab_pool_t *pool;
+    mps_shdict_tree_t *tree;
+    mps_shdict_migrate_t *mg;
+    const char *pathname;
 
-        mps_rbtree_delete(pool, &tree->rbtree, node);
+    pool = dict->pool;
+    tree = mps_shdict_tree(pool);
 
-        mps_slab_free_locked(pool, node);
+    if (tree->nshards > 1 || tree->migrate != mps_nulloff ||
+        size > pool->max_end) {
+        return NGX_DECLINED;
+    }
 
-    } else {
-        sd->value_len = sd->value_len - 1;
+    pathname = (const char *)dict->name.data;
 
-        mps_queue_remove(pool, &sd->queue);
-        mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    /* the file of a migrated dict is the migration target */
+    if (dict->source != NULL) {
+        mg = (mps_shdict_migrate_t *)mps_ptr(
+            dict->source, mps_shdict_tree(dict->source)->migrate);
+        pathname = (const char *)mg->name;
     }
 
-    mps_slab_unlock(pool);
+    if (mps_slab_grow(pool, pathname, size) != 0) {
+        return NGX_ERROR;
+    }
 
     return NGX_OK;
 }
 
-int mps_shdict_llen(mps_shdict_t *dict, const u_char *key, size_t key_len,
-                    char **errmsg)
+size_t mps_shdict_capacity(mps_shdict_t *dict)
 {
     mps_slab_pool_t *pool;
-    mps_shdict_tree_t *tree;
-    uint32_t hash;
-    ngx_int_t rc;
-    mps_shdict_node_t *sd;
-
-    hash = ngx_murmur_hash2(key, key_len);
 
     pool = dict->pool;
-    tree = mps_shdict_tree(pool);
+    return (size_t)pool->end;
+}
 
-    mps_slab_lock(pool);
+size_t mps_shdict_free_space(mps_shdict_t *dict)
+{
+    mps_slab_pool_t *pool, *main;
+    size_t bytes;
+    ngx_uint_t i, n;
 
-#if 1
-    mps_shdict_expire(pool, tree, 1);
-#endif
+    bytes = 0;
+    main = mps_shdict_main(dict);
+    n = mps_shdict_tree(main)->nshards;
 
-    rc = mps_shdict_lookup(pool, hash, key, key_len, &sd);
+    for (i = 0; i < n; i++) {
+        pool = mps_shdict_shard_at(main, i);
+        mps_slab_lock(pool);
+        bytes += pool->pfree * mps_pagesize;
+        mps_slab_unlock(pool);
+    }
 
-    dd("shdict lookup returned %d", (int)rc);
+    return bytes;
+}
 
-    if (rc == NGX_OK) {
+static void mps_shdict_lock_stat_add(mps_slab_lock_stat_t *dst,
+                                     const mps_slab_lock_stat_t *src)
+{
+    ngx_uint_t i;
+
+    dst->acquires += src->acquires;
+    dst->contended += src->contended;
+    dst->wait_total += src->wait_total;
+    dst->wait_max = ngx_max(dst->wait_max, src->wait_max);
+    dst->hold_total += src->hold_total;
+    dst->hold_max = ngx_max(dst->hold_max, src->hold_max);
+
+    for (i = 0; i < MPS_SLAB_LOCK_HIST_SIZE; i++) {
+        dst->wait_hist[i] += src->wait_hist[i];
+        dst->hold_hist[i] += src->hold_hist[i];
+    }
+}
 
-        if (sd->value_type != MPS_SHDICT_TLIST) {
-            mps_slab_unlock(pool);
+int mps_shdict_lock_stats(mps_shdict_t *dict, mps_slab_lock_stat_t *stats)
+{
+    mps_slab_pool_t *pool, *main;
+    ngx_uint_t i, n;
 
-            *errmsg = "value not a list";
-            return NGX_ERROR;
-        }
+    ngx_memzero(stats, sizeof(mps_slab_lock_stat_t));
 
-        mps_queue_remove(pool, &sd->queue);
-        mps_queue_insert_head(pool, &tree->lru_queue, &sd->queue);
+    main = mps_shdict_main(dict);
+    if (!main->lock_stats) {
+        return NGX_DECLINED;
+    }
 
-        mps_slab_unlock(pool);
+    mps_shdict_lock_stat_add(stats, &main->lock_stat);
 
-        return sd->value_len;
+    n = mps_shdict_tree(main)->nshards;
+    if (n <= 1) {
+        return NGX_OK;
     }
 
-    mps_slab_unlock(pool);
+    for (i = 0; i < n; i++) {
+        pool = mps_shdict_shard_at(main, i);
+        mps_shdict_lock_stat_add(stats, &pool->lock_stat);
+    }
 
-    return 0;
+    return NGX_OK;
 }
 
-size_t mps_shdict_capacity(mps_shdict_t *dict)
+int mps_shdict_slab_stats(mps_shdict_t *dict, mps_slab_pool_stat_t *stats,
+                          mps_slab_slot_stat_t *slots, ngx_uint_t n)
 {
-    mps_slab_pool_t *pool;
+    mps_slab_pool_t *pool, *main;
+    ngx_uint_t i, nshards;
 
-    pool = dict->pool;
-    return (size_t)pool->end;
-}
+    ngx_memzero(stats, sizeof(mps_slab_pool_stat_t));
+    ngx_memzero(slots, n * sizeof(mps_slab_slot_stat_t));
 
-size_t mps_shdict_free_space(mps_shdict_t *dict)
-{
-    mps_slab_pool_t *pool;
-    size_t bytes;
+    main = mps_shdict_main(dict);
+    nshards = mps_shdict_tree(main)->nshards;
 
-    pool = dict->pool;
-    mps_slab_lock(pool);
-    bytes = pool->pfree * mps_pagesize;
-    mps_slab_unlock(pool);
+    /* the main pool of shards holds only the shards and the tables */
+    for (i = 0; i < nshards; i++) {
+        pool = mps_shdict_shard_at(main, i);
+        mps_slab_lock(pool);
+        mps_slab_stats(pool, stats, slots, n);
+        mps_slab_unlock(pool);
+    }
 
-    return bytes;
+    return NGX_OK;
 }
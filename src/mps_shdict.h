@@ -8,6 +8,7 @@
 #include "mps_slab.h"
 #include "mps_queue.h"
 #include "mps_rbtree.h"
+#include "mps_htable.h"
 
 typedef struct {
     uint8_t type;
@@ -26,11 +27,52 @@ typedef struct {
     u_short key_len;
     uint32_t value_len;
     uint64_t expires;
+    uint64_t version; /* changed whenever the value is stored */
     mps_queue_t queue;
     uint32_t user_flags;
     u_char data[1];
 } mps_shdict_node_t;
 
+/*
+ * A node of the expiry tree, whose key is the expires of the entry or 0 if it
+ * is not in the tree. It follows the value of an entry in a dict with
+ * MPS_SHDICT_FLAG_EXPIRY_INDEX.
+ */
+typedef struct {
+    mps_rbtree_node_t node;
+    mps_ptroff_t entry; /* the rbtree node of the entry */
+} mps_shdict_timer_t;
+
+/* the tree of timers of MPS_SHDICT_FLAG_EXPIRY_INDEX */
+typedef struct {
+    mps_rbtree_t rbtree;
+    mps_rbtree_node_t sentinel;
+} mps_shdict_expiry_t;
+
+#define MPS_SHDICT_WHEEL_BITS 6
+#define MPS_SHDICT_WHEEL_SLOTS (1 << MPS_SHDICT_WHEEL_BITS)
+#define MPS_SHDICT_WHEEL_LEVELS 4
+
+/* a timer of MPS_SHDICT_FLAG_EXPIRY_WHEEL, which follows the value */
+typedef struct {
+    mps_queue_t queue;
+    mps_ptroff_t entry; /* the rbtree node of the entry */
+    uint64_t expires;   /* 0 if it is not in the wheel */
+} mps_shdict_wheel_timer_t;
+
+/*
+ * A hierarchical timing wheel of milliseconds. A slot of level n holds the
+ * timers in a range of 1 << (n * MPS_SHDICT_WHEEL_BITS) milliseconds, which
+ * are moved to lower levels when now reaches the range. Timers beyond the top
+ * level wait in the overflow queue.
+ */
+typedef struct {
+    uint64_t now; /* timers before now have been expired */
+    uint64_t occupied[MPS_SHDICT_WHEEL_LEVELS]; /* slots which may be used */
+    mps_queue_t overflow;
+    mps_queue_t slots[MPS_SHDICT_WHEEL_LEVELS][MPS_SHDICT_WHEEL_SLOTS];
+} mps_shdict_wheel_t;
+
 typedef struct {
     mps_queue_t queue;
     uint32_t value_len;
@@ -42,14 +84,182 @@ typedef struct {
     mps_rbtree_t rbtree;
     mps_rbtree_node_t sentinel;
     mps_queue_t lru_queue;
+    mps_ptroff_t access;
+    uint32_t flags;
+    uint32_t nshards;     /* offsets of the shard pools follow if > 1 */
+    mps_ptroff_t index;   /* mps_htable_t used instead of rbtree, if any */
+    mps_ptroff_t migrate; /* migration of this dict to another one, if any */
+    mps_ptroff_t expiry;  /* mps_shdict_expiry_t or mps_shdict_wheel_t */
+    /*
+     * the last version given to a value, also incremented when an entry is
+     * removed or its expiry is changed
+     */
+    uint64_t version;
 } mps_shdict_tree_t;
 
+/*
+ * The state of the SIEVE and S3-FIFO eviction policies and of the admission
+ * filter, which follows the tree and its flush generation.
+ */
+typedef struct {
+    mps_ptroff_t hand; /* SIEVE: the link looked at next, or 0 for the tail */
+    mps_queue_t small; /* S3-FIFO: the LRU queue is the main queue */
+    ngx_uint_t nsmall;
+    ngx_uint_t count;  /* S3-FIFO: count of entries in both queues */
+    mps_ptroff_t smap; /* S3-FIFO: bitmap of entries in the small queue */
+    mps_ptroff_t ghost; /* S3-FIFO: hashes evicted from the small queue */
+    uint32_t ghost_mask;
+    mps_ptroff_t sketch; /* mps_shdict_sketch_t of the admission filter */
+} mps_shdict_evict_t;
+
+#define MPS_SHDICT_SKETCH_DEPTH 4
+#define MPS_SHDICT_SKETCH_MAX 15
+
+/*
+ * A count-min sketch of the frequencies of key hashes. The counters are
+ * halved once every sample additions, so that old hits count less.
+ */
+typedef struct {
+    uint32_t mask; /* count of counters per row - 1 */
+    uint32_t additions;
+    uint32_t sample;
+    uint32_t agings;
+    /* u_char counters[MPS_SHDICT_SKETCH_DEPTH][mask + 1] follow */
+} mps_shdict_sketch_t;
+
 typedef struct {
     mps_slab_pool_t *pool;
     ngx_str_t name;
     size_t size;
+
+    /* the migration target and the source after the cutover, if mapped */
+    mps_slab_pool_t *target;
+    size_t target_size;
+    mps_slab_pool_t *source;
+    size_t source_size;
 } mps_shdict_t;
 
+/* a value returned by mps_shdict_mget */
+typedef struct {
+    int value_type; /* MPS_SHDICT_TNIL if not found or expired */
+    int user_flags;
+    double num_value; /* a number, or 1 and 0 for a boolean */
+    u_char *str_value; /* a string or an int64 in the arena, or NULL */
+    size_t str_value_len;
+} mps_shdict_mget_result_t;
+
+/*
+ * A cursor of mps_shdict_scan, which starts from a zeroed one. next is a hash
+ * in the rbtree or a slot in the hash index of the shard.
+ */
+typedef struct {
+    ngx_uint_t shard;
+    uint64_t next;
+    uint32_t gen;
+} mps_shdict_scan_cursor_t;
+
+/* a key returned by mps_shdict_scan */
+typedef struct {
+    u_char *key; /* in the arena */
+    size_t key_len;
+} mps_shdict_scan_key_t;
+
+/* an item of mps_shdict_mset and mps_shdict_mdelete */
+typedef struct {
+    const u_char *key;
+    size_t key_len;
+    int value_type;
+    const u_char *str_value_buf;
+    size_t str_value_len;
+    double num_value;
+    long exptime;
+    int user_flags;
+
+    /* results, same as those of mps_shdict_store */
+    int rc;
+    char *err;
+    int forcible;
+} mps_shdict_mset_item_t;
+
+typedef struct {
+    size_t min_shift;
+    ngx_uint_t flags;
+    /* count of independently locked sub-pools; 0 and 1 mean no sharding */
+    ngx_uint_t shards;
+    /*
+     * growth factor in percent of slab size classes used instead of powers
+     * of two, e.g. 125; 0 means powers of two
+     */
+    ngx_uint_t size_classes;
+    /*
+     * the size up to which mps_shdict_grow can grow the dict without shards;
+     * 0 means the dict does not grow. Every process which opens the dict
+     * must pass the same max_size.
+     */
+    size_t max_size;
+} mps_shdict_opts_t;
+
+/* dict flags, fixed when the dict is created */
+
+/* mps_shdict_get does not take the lock and marks the node as accessed
+ * instead of moving it to the head of the LRU queue. */
+#define MPS_SHDICT_FLAG_LOCKFREE_GET 0x0001
+
+/* keys are indexed by an open addressing hash table instead of the rbtree. */
+#define MPS_SHDICT_FLAG_HASH_INDEX 0x0002
+
+/* mps_slab_lock measures lock wait and hold times for mps_shdict_lock_stats. */
+#define MPS_SHDICT_FLAG_LOCK_STATS 0x0004
+
+/* mps_slab_lock spins on the robust pthread mutex before sleeping in its
+ * futex wait. */
+#define MPS_SHDICT_FLAG_FUTEX_LOCK 0x0008
+
+/* mps_shdict_incr updates an existing number without the lock, and marks the
+ * node as accessed instead of moving it to the head of the LRU queue. */
+#define MPS_SHDICT_FLAG_ATOMIC_INCR 0x0010
+
+/* entries with a ttl are also indexed by their deadlines, so expired ones are
+ * freed oldest first even if they are not at the tail of the LRU queue. */
+#define MPS_SHDICT_FLAG_EXPIRY_INDEX 0x0020
+
+/* same as MPS_SHDICT_FLAG_EXPIRY_INDEX with a timing wheel instead of a tree,
+ * whose cost does not depend on the count of entries. */
+#define MPS_SHDICT_FLAG_EXPIRY_WHEEL 0x0040
+
+/* mps_shdict_flush_all bumps a generation instead of expiring every entry.
+ * Entries of older generations are treated as expired and freed lazily. */
+#define MPS_SHDICT_FLAG_FLUSH_GEN 0x0080
+
+/*
+ * Eviction policies other than LRU, one of which may be set. Hits only set
+ * the access bit of the entry instead of moving it in the LRU queue.
+ *
+ * CLOCK: entries hit since they reached the tail get a second chance.
+ * SIEVE: a hand moves from the tail to the head, clearing access bits, and
+ * frees the first entry not hit. Entries stay where they were inserted.
+ * S3-FIFO: new entries go to a small queue of about 10% of entries. Those not
+ * hit there are freed and their hashes kept in a ghost table, so they go to
+ * the main queue, which works like CLOCK, when they are stored again.
+ */
+#define MPS_SHDICT_FLAG_EVICT_CLOCK 0x0100
+#define MPS_SHDICT_FLAG_EVICT_SIEVE 0x0200
+#define MPS_SHDICT_FLAG_EVICT_S3FIFO 0x0400
+
+/*
+ * TinyLFU admission: locked lookups and stores count the hash of the key in a
+ * sketch, and a store which must free entries by force is rejected with
+ * "not admitted" if its key is less frequent than the entry to be freed.
+ * Reads by MPS_SHDICT_FLAG_LOCKFREE_GET are not counted.
+ */
+#define MPS_SHDICT_FLAG_ADMISSION 0x0800
+
+#define MPS_SHDICT_SCAN_VISITS 16
+
+#define MPS_SHDICT_SWEEP_BATCH 64
+
+#define MPS_SHDICT_MGET_BATCH 32
+
 /* value type */
 enum {
     MPS_SHDICT_TNIL = 0,     /* same as LUA_TNIL */
@@ -57,10 +267,16 @@ enum {
     MPS_SHDICT_TNUMBER = 3,  /* same as LUA_TNUMBER */
     MPS_SHDICT_TSTRING = 4,  /* same as LUA_TSTRING */
     MPS_SHDICT_TLIST = 5,
+    /* an int64_t in str_value_buf with str_value_len of 8 */
+    MPS_SHDICT_TINT64 = 6,
 };
 
 mps_shdict_t *mps_shdict_open_or_create(const char *pathname, size_t shm_size,
                                         size_t min_shift, mode_t mode);
+/* opts are used only when the dict is created. */
+mps_shdict_t *mps_shdict_open_or_create_opts(const char *pathname,
+                                             size_t shm_size, mode_t mode,
+                                             const mps_shdict_opts_t *opts);
 void mps_shdict_close(mps_shdict_t *dict);
 
 /* Unconditionally set the value. */
@@ -99,17 +315,144 @@ int mps_shdict_replace(mps_shdict_t *dict, const u_char *key, size_t key_len,
  * an error. */
 int mps_shdict_delete(mps_shdict_t *dict, const u_char *key, size_t key_len);
 
+/*
+ * Set the values of n items like mps_shdict_set, taking the lock once per
+ * shard. The result of each item is stored in its rc, err and forcible.
+ * Returns NGX_OK if all items are stored, NGX_DECLINED otherwise.
+ */
+int mps_shdict_mset(mps_shdict_t *dict, mps_shdict_mset_item_t *items,
+                    ngx_uint_t n);
+
+/* Delete the keys of n items, taking the lock once per shard. Only key and
+ * key_len of the items are used. */
+int mps_shdict_mdelete(mps_shdict_t *dict, mps_shdict_mset_item_t *items,
+                       ngx_uint_t n);
+
 int mps_shdict_get(mps_shdict_t *dict, const u_char *key, size_t key_len,
                    int *value_type, u_char **str_value_buf,
                    size_t *str_value_len, double *num_value, int *user_flags,
                    int get_stale, int *is_stale, char **err);
 
+/* Same as mps_shdict_get, and sets *version to 0 if there is no value. */
+int mps_shdict_get_versioned(mps_shdict_t *dict, const u_char *key,
+                             size_t key_len, int *value_type,
+                             u_char **str_value_buf, size_t *str_value_len,
+                             double *num_value, int *user_flags, int get_stale,
+                             int *is_stale, uint64_t *version, char **err);
+
+/*
+ * Same as mps_shdict_get_versioned, but returns NGX_DECLINED without copying
+ * the value if its version is still *version, so that a caller which keeps
+ * the value polls it in constant time.
+ */
+int mps_shdict_get_if_modified(mps_shdict_t *dict, const u_char *key,
+                               size_t key_len, int *value_type,
+                               u_char **str_value_buf, size_t *str_value_len,
+                               double *num_value, int *user_flags,
+                               int get_stale, int *is_stale, uint64_t *version,
+                               char **err);
+
+/*
+ * Set the value only if the version of the key is still *version, which is 0
+ * for a key without an unexpired value. A nil value deletes the key. Returns
+ * NGX_OK and sets *version to the new version, NGX_DECLINED and sets *version
+ * to the current version if it has changed, or NGX_ERROR.
+ */
+int mps_shdict_cas(mps_shdict_t *dict, const u_char *key, size_t key_len,
+                   uint64_t *version, int value_type,
+                   const u_char *str_value_buf, size_t str_value_len,
+                   double num_value, long exptime, int user_flags,
+                   char **errmsg, int *forcible);
+
+/*
+ * Get the values of n keys, taking the lock once per shard for up to
+ * MPS_SHDICT_MGET_BATCH keys. Strings and int64 values are copied to the
+ * arena. Returns NGX_AGAIN if the arena is too small for some of them, whose
+ * str_value are NULL and str_value_len are the needed sizes. A list is
+ * returned as MPS_SHDICT_TLIST without a value.
+ */
+int mps_shdict_mget(mps_shdict_t *dict, const u_char **keys,
+                    const size_t *key_lens, ngx_uint_t n,
+                    mps_shdict_mget_result_t *results, u_char *arena,
+                    size_t arena_size);
+
 int mps_shdict_incr(mps_shdict_t *dict, const u_char *key, size_t key_len,
                     double *value, char **err, int has_init, double init,
                     long init_ttl, int *forcible);
 
+/*
+ * Same as mps_shdict_incr for MPS_SHDICT_TINT64 values, which wrap around on
+ * overflow. mps_shdict_incr also adds to an int64 value if the increment is
+ * an integer, and mps_shdict_incr_int64 fails for a double value.
+ */
+int mps_shdict_incr_int64(mps_shdict_t *dict, const u_char *key,
+                          size_t key_len, int64_t *value, char **err,
+                          int has_init, int64_t init, long init_ttl,
+                          int *forcible);
+
 int mps_shdict_flush_all(mps_shdict_t *dict);
 
+/*
+ * Returns a number which changes whenever an entry of the dict is stored or
+ * removed, or its expiry is changed, so that a process can tell whether the
+ * values it copied may be stale. The dict is not locked.
+ */
+uint64_t mps_shdict_version(mps_shdict_t *dict);
+
+/*
+ * Copy up to max_count unexpired keys from the cursor to keys and the arena,
+ * moving the cursor. The lock of a shard is held only while a batch is
+ * copied, and the walk stops after visiting MPS_SHDICT_SCAN_VISITS entries
+ * per key, so a call may return no keys.
+ *
+ * Returns NGX_OK when all keys have been scanned, NGX_AGAIN if there may be
+ * more, or NGX_DECLINED if the next key does not fit in the arena. A key
+ * which exists during the whole scan is returned at least once. Keys may be
+ * returned again when the hash index of a shard is rebuilt.
+ */
+int mps_shdict_scan(mps_shdict_t *dict, mps_shdict_scan_cursor_t *cursor,
+                    mps_shdict_scan_key_t *keys, ngx_uint_t max_count,
+                    ngx_uint_t *n, u_char *arena, size_t arena_size);
+
+/*
+ * Free up to max_count expired entries, or all of them if max_count is 0.
+ * The lock of a shard is released after every MPS_SHDICT_SWEEP_BATCH freed
+ * entries. Returns the count of freed entries.
+ */
+int mps_shdict_flush_expired(mps_shdict_t *dict, ngx_uint_t max_count);
+
+/*
+ * Free up to max_count expired entries from the cursor in one lock hold of a
+ * shard, visiting at most max_count * MPS_SHDICT_SCAN_VISITS entries. This is
+ * for a process which sweeps the dict periodically in small slices, keeping
+ * the cursor, which starts from a zeroed one, between calls. The count of
+ * freed entries is set to freed. Returns NGX_OK when a pass over the dict has
+ * been done and the cursor is zeroed again, or NGX_AGAIN otherwise.
+ */
+int mps_shdict_sweep(mps_shdict_t *dict, mps_shdict_scan_cursor_t *cursor,
+                     ngx_uint_t max_count, ngx_uint_t *freed);
+
+/*
+ * Move entries and list nodes from the cursor out of sparse pages to pages of
+ * the same chunk size which have more chunks in use, so that sparse pages
+ * become free and return to the pool. The cursor is used like the one of
+ * mps_shdict_sweep: up to max_count chunks are moved in one lock hold of a
+ * shard, visiting at most max_count * MPS_SHDICT_SCAN_VISITS entries. The
+ * count of moved chunks is set to moved. Returns NGX_OK when a pass over the
+ * dict has been done, or NGX_AGAIN otherwise.
+ */
+int mps_shdict_compact(mps_shdict_t *dict, mps_shdict_scan_cursor_t *cursor,
+                       ngx_uint_t max_count, ngx_uint_t *moved);
+
+/*
+ * Grow the shared memory of the dict to size, which is at most the max_size
+ * it was created with, keeping all the entries. Other processes see the new
+ * pages without remapping since max_size is mapped. Returns NGX_OK, or
+ * NGX_DECLINED if the dict cannot grow to size, e.g. it has shards or is
+ * being migrated, or NGX_ERROR.
+ */
+int mps_shdict_grow(mps_shdict_t *dict, size_t size);
+
 long mps_shdict_get_ttl(mps_shdict_t *dict, const u_char *key, size_t key_len);
 
 int mps_shdict_set_expire(mps_shdict_t *dict, const u_char *key, size_t key_len,
@@ -134,11 +477,54 @@ int mps_shdict_rpop(mps_shdict_t *dict, const u_char *key, size_t key_len,
 int mps_shdict_llen(mps_shdict_t *dict, const u_char *key, size_t key_len,
                     char **errmsg);
 
+/*
+ * Start migrating the dict to a new dict at pathname. Entries are copied by
+ * mps_shdict_migrate_step and writes are applied to both dicts until then.
+ * The new dict is created with opts, so it can grow up to opts->max_size
+ * once the dict has switched to it. Returns NGX_DECLINED if the dict is
+ * already being migrated.
+ */
+int mps_shdict_migrate_start(mps_shdict_t *dict, const char *pathname,
+                             size_t shm_size, mode_t mode,
+                             const mps_shdict_opts_t *opts);
+
+/*
+ * Copy at most about n entries to the migration target. Returns NGX_AGAIN
+ * while entries remain, and NGX_OK after the dict has switched to the target.
+ * Returns NGX_DECLINED if the dict is not being migrated.
+ */
+int mps_shdict_migrate_step(mps_shdict_t *dict, ngx_uint_t n);
+
 size_t mps_shdict_capacity(mps_shdict_t *dict);
 
 size_t mps_shdict_free_space(mps_shdict_t *dict);
 
+/*
+ * Sum the lock statistics of the pools of the dict into stats. The counters
+ * are read without the locks, so they may be slightly inconsistent.
+ * Returns NGX_DECLINED if the dict was not created with
+ * MPS_SHDICT_FLAG_LOCK_STATS.
+ */
+int mps_shdict_lock_stats(mps_shdict_t *dict, mps_slab_lock_stat_t *stats);
+
+/*
+ * Sum the allocator statistics of the pools which hold the entries of the
+ * dict into stats, and those of its first n slots into slots. Page counts
+ * tell whether "no memory" comes from fragmentation, when there are free
+ * pages but no long enough run, and slot counters which chunk sizes are used
+ * or fail. Returns NGX_OK.
+ */
+int mps_shdict_slab_stats(mps_shdict_t *dict, mps_slab_pool_stat_t *stats,
+                          mps_slab_slot_stat_t *slots, ngx_uint_t n);
+
 #define mps_shdict_tree(pool)                                                  \
     ((mps_shdict_tree_t *)mps_ptr((pool), ((pool)->data)))
 
+/*
+ * The offsets of the shard pools, which follow the main tree if nshards > 1
+ * at the place of mps_shdict_evict_t of a shard tree.
+ */
+#define mps_shdict_tree_shards(tree)                                           \
+    ((mps_ptroff_t *)((u_char *)((tree) + 1) + NGX_ALIGNMENT))
+
 #endif /* _MPS_SHDICT_H_INCLUDED_ */
@@ -43,6 +43,9 @@
 
 #endif
 
+/* max count of pages of a slot looked at for one to move a chunk to */
+#define MPS_SLAB_MOVE_SCAN 8
+
 #define mps_pool_stats(pool)                                                   \
     ((mps_slab_stat_t *)((u_char *)(pool) + (pool)->stats))
 
@@ -105,9 +108,19 @@ static void mps_slab_sizes_init(ngx_uint_t pagesize)
 
 static pthread_once_t mps_slab_initialized = PTHREAD_ONCE_INIT;
 
+/* spin iterations before sleeping while waiting for others, as ngx_shmtx_t */
+#define MPS_SLAB_SPIN 2048
+
+static ngx_uint_t mps_ncpu;
+
 static void mps_slab_init_once()
 {
+    long n;
+
     mps_slab_sizes_init(getpagesize());
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    mps_ncpu = n > 0 ? (ngx_uint_t)n : 1;
 }
 
 static mps_err_t mps_slab_init_mutex(mps_slab_pool_t *pool)
@@ -143,27 +156,45 @@ static mps_err_t mps_slab_init_mutex(mps_slab_pool_t *pool)
     return 0;
 }
 
-static mps_err_t mps_slab_init(mps_slab_pool_t *pool, u_char *addr,
-                               size_t pool_size, size_t min_shift)
+/*
+ * Fill sizes with the chunk sizes of classes growing by factor percent, from
+ * the aligned min size up to mps_slab_max_size, if sizes is not NULL. Returns
+ * the count of classes.
+ */
+static ngx_uint_t mps_slab_class_sizes(size_t min_size, ngx_uint_t factor,
+                                       uint32_t *sizes)
+{
+    size_t size, next;
+    ngx_uint_t n;
+
+    size = ngx_align(min_size, NGX_ALIGNMENT);
+
+    for (n = 0;; n++) {
+        if (sizes) {
+            sizes[n] = (uint32_t)size;
+        }
+
+        if (size >= mps_slab_max_size) {
+            return n + 1;
+        }
+
+        next = ngx_align(size * factor / 100, NGX_ALIGNMENT);
+        if (next <= size) {
+            next = size + NGX_ALIGNMENT;
+        }
+
+        size = ngx_min(next, mps_slab_max_size);
+    }
+}
+
+/* Lay out the slots, stats and pages of an empty pool. */
+static void mps_slab_init_pages(mps_slab_pool_t *pool, ngx_uint_t factor)
 {
     u_char *p, *start;
     size_t size;
     ngx_int_t m;
     ngx_uint_t i, n, pages;
     mps_slab_page_t *slots, *page, *last;
-    mps_err_t err;
-
-    err = mps_slab_init_mutex(pool);
-    if (err != 0) {
-        mps_log_error("mps_slab_init_mutex failed, err=%d", err);
-        return err;
-    }
-
-    pool->data = 0;
-    pool->end = pool_size;
-    pool->min_shift = min_shift;
-
-    pool->min_size = (size_t)1 << pool->min_shift;
 
     slots = mps_slab_slots(pool);
 
@@ -172,7 +203,12 @@ static mps_err_t mps_slab_init(mps_slab_pool_t *pool, u_char *addr,
 
     mps_slab_junk(p, size);
 
-    n = mps_pagesize_shift - pool->min_shift;
+    if (factor) {
+        n = mps_slab_class_sizes(pool->min_size, factor, NULL);
+
+    } else {
+        n = mps_pagesize_shift - pool->min_shift;
+    }
 
     for (i = 0; i < n; i++) {
         /* only "next" is used in list head */
@@ -190,7 +226,21 @@ static mps_err_t mps_slab_init(mps_slab_pool_t *pool, u_char *addr,
 
     size -= n * (sizeof(mps_slab_page_t) + sizeof(mps_slab_stat_t));
 
-    pages = (ngx_uint_t)(size / (mps_pagesize + sizeof(mps_slab_page_t)));
+    pool->classes = mps_nulloff;
+    pool->nclasses = 0;
+
+    if (factor) {
+        pool->classes = mps_offset(pool, p);
+        pool->nclasses = n;
+        (void)mps_slab_class_sizes(pool->min_size, factor, (uint32_t *)p);
+
+        p += ngx_align(n * sizeof(uint32_t), NGX_ALIGNMENT);
+        size -= ngx_align(n * sizeof(uint32_t), NGX_ALIGNMENT);
+    }
+
+    /* the pages of a pool which can grow are there from the start */
+    pages = (ngx_uint_t)((size + pool->max_end - pool->end) /
+                         (mps_pagesize + sizeof(mps_slab_page_t)));
 
     pool->pages = mps_offset(pool, p);
     ngx_memzero(p, pages * sizeof(mps_slab_page_t));
@@ -210,19 +260,72 @@ static mps_err_t mps_slab_init(mps_slab_pool_t *pool, u_char *addr,
     pool->start = mps_offset(pool, start);
 
     m = pages - (pool->end - pool->start) / mps_pagesize;
+    if (pool->end <= pool->start) {
+        m = pages;
+    }
+
     if (m > 0) {
         pages -= m;
         page->slab = pages;
     }
 
+    /* the last free page points to the first one, see mps_slab_free_pages */
+    if (pages > 1) {
+        page[pages - 1].prev = mps_offset(pool, page);
+    }
+
     last = mps_slab_page(pool, pool->pages) + pages;
     pool->last = mps_offset(pool, last);
     pool->pfree = pages;
+}
+
+mps_err_t mps_slab_init(mps_slab_pool_t *pool, u_char *addr, size_t pool_size,
+                        size_t min_shift)
+{
+    mps_err_t err;
+
+    err = mps_slab_init_mutex(pool);
+    if (err != 0) {
+        mps_log_error("mps_slab_init_mutex failed, err=%d", err);
+        return err;
+    }
+
+    pool->seq = 0;
+    pool->data = 0;
+    pool->locked_at = 0;
+    ngx_memzero(&pool->lock_stat, sizeof(mps_slab_lock_stat_t));
+    pool->lock_stats = 0;
+    pool->spin_lock = 0;
+    pool->updaters = 0;
+    pool->inplace = 0;
+    pool->end = pool_size;
+    pool->max_end = pool_size;
+    pool->min_shift = min_shift;
+
+    pool->min_size = (size_t)1 << pool->min_shift;
+
+    mps_slab_init_pages(pool, 0);
 
     pool->log_nomem = 1;
     return 0;
 }
 
+mps_err_t mps_slab_init_classes(mps_slab_pool_t *pool, ngx_uint_t factor)
+{
+    if (factor <= 100 || pool->data != mps_nulloff ||
+        pool->pfree != (ngx_uint_t)(mps_slab_page(pool, pool->last) -
+                                    mps_slab_page(pool, pool->pages))) {
+        mps_log_error("mps_slab_init_classes: pool=%p: bad factor=%lu or "
+                      "pool is not empty",
+                      pool, factor);
+        return EINVAL;
+    }
+
+    mps_slab_init_pages(pool, factor);
+
+    return 0;
+}
+
 #define SHM_PATH_PREFIX "/dev/shm/"
 #define SHM_PATH_PREFIX_LEN 9
 
@@ -243,7 +346,8 @@ static int open_shm_or_file(const char *pathname, int flags, mode_t mode)
 }
 
 static mps_err_t mps_slab_create(mps_slab_pool_t **pool, const char *pathname,
-                                 size_t shm_size, size_t min_shift, mode_t mode,
+                                 size_t shm_size, size_t max_size,
+                                 size_t min_shift, mode_t mode,
                                  mps_slab_on_init_pt on_init)
 {
     int fd;
@@ -260,7 +364,7 @@ static mps_err_t mps_slab_create(mps_slab_pool_t **pool, const char *pathname,
         goto close;
     }
 
-    addr = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    addr = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (addr == MAP_FAILED) {
         err = errno;
         goto close;
@@ -272,6 +376,19 @@ static mps_err_t mps_slab_create(mps_slab_pool_t **pool, const char *pathname,
         goto close;
     }
 
+    if (max_size > shm_size) {
+        (*pool)->max_end = max_size;
+        mps_slab_init_pages(*pool, 0);
+
+        if ((*pool)->pfree == 0) {
+            mps_log_error("mps_slab_create: shm_size=%lu is too small for "
+                          "max_size=%lu",
+                          shm_size, max_size);
+            err = EINVAL;
+            goto close;
+        }
+    }
+
     if (on_init) {
         err = on_init(*pool);
         if (err != 0) {
@@ -283,7 +400,7 @@ static mps_err_t mps_slab_create(mps_slab_pool_t **pool, const char *pathname,
         err = errno;
     }
 
-    if (err && munmap(addr, shm_size) == -1) {
+    if (err && munmap(addr, max_size) == -1) {
         mps_log_error("mps_slab_create: munmap: err=%s\n", strerror(errno));
     }
 
@@ -328,6 +445,15 @@ static mps_err_t mps_slab_open(mps_slab_pool_t **pool, const char *pathname,
 mps_slab_pool_t *mps_slab_open_or_create(const char *pathname, size_t shm_size,
                                          size_t min_shift, mode_t mode,
                                          mps_slab_on_init_pt on_init)
+{
+    return mps_slab_open_or_create_max(pathname, shm_size, shm_size, min_shift,
+                                       mode, on_init);
+}
+
+mps_slab_pool_t *mps_slab_open_or_create_max(const char *pathname,
+                                             size_t shm_size, size_t max_size,
+                                             size_t min_shift, mode_t mode,
+                                             mps_slab_on_init_pt on_init)
 {
     mps_err_t err = 0;
     mps_slab_pool_t *pool;
@@ -341,7 +467,11 @@ mps_slab_pool_t *mps_slab_open_or_create(const char *pathname, size_t shm_size,
         return NULL;
     }
 
-    err = mps_slab_open(&pool, pathname, shm_size, mode);
+    if (max_size < shm_size) {
+        max_size = shm_size;
+    }
+
+    err = mps_slab_open(&pool, pathname, max_size, mode);
     if (err) {
         if (err != ENOENT && err != EACCES) {
             mps_log_error("mps_slab_open_or_create: mps_slab_open#1: err=%s",
@@ -349,8 +479,8 @@ mps_slab_pool_t *mps_slab_open_or_create(const char *pathname, size_t shm_size,
             return NULL;
         }
 
-        err = mps_slab_create(&pool, pathname, shm_size, min_shift, mode,
-                              on_init);
+        err = mps_slab_create(&pool, pathname, shm_size, max_size, min_shift,
+                              mode, on_init);
         if (err) {
             if (err != EEXIST) {
                 mps_log_error(
@@ -367,7 +497,7 @@ mps_slab_pool_t *mps_slab_open_or_create(const char *pathname, size_t shm_size,
                 return NULL;
             }
 
-            err = mps_slab_open(&pool, pathname, shm_size, mode);
+            err = mps_slab_open(&pool, pathname, max_size, mode);
             if (err) {
                 mps_log_error(
                     "mps_slab_open_or_create: mps_slab_open#2: err=%s",
@@ -398,14 +528,246 @@ void mps_slab_close(mps_slab_pool_t *pool, size_t shm_size)
     }
 }
 
+mps_err_t mps_slab_grow(mps_slab_pool_t *pool, const char *pathname,
+                        size_t size)
+{
+    int fd;
+    struct stat st;
+    mps_err_t err;
+    ngx_uint_t n, max;
+    mps_slab_page_t *page;
+
+    if (size > pool->max_end) {
+        mps_log_error("mps_slab_grow: pool=%p: size=%lu is larger than "
+                      "max_size=%lu",
+                      pool, size, (size_t)pool->max_end);
+        return EINVAL;
+    }
+
+    fd = open_shm_or_file(pathname, O_RDWR, 0);
+    if (fd == -1) {
+        return errno;
+    }
+
+    err = 0;
+
+    mps_slab_lock(pool);
+
+    if (size <= pool->end) {
+        goto unlock;
+    }
+
+    /* the file is never shrunk, another pool may have grown it already */
+    if (fstat(fd, &st) == -1) {
+        err = errno;
+        goto unlock;
+    }
+
+    if ((size_t)st.st_size < size && ftruncate(fd, size) == -1) {
+        err = errno;
+        goto unlock;
+    }
+
+    n = (size - pool->start) / mps_pagesize -
+        (pool->last - pool->pages) / sizeof(mps_slab_page_t);
+    max = (pool->start - pool->last) / sizeof(mps_slab_page_t);
+
+    if (n > max) {
+        n = max;
+    }
+
+    pool->end = size;
+
+    if (n) {
+        page = mps_slab_page(pool, pool->last);
+        ngx_memzero(page, n * sizeof(mps_slab_page_t));
+
+        pool->last += n * sizeof(mps_slab_page_t);
+
+        /* the new pages join the last free pages if any */
+        mps_slab_free_pages(pool, page, n);
+    }
+
+    mps_log_status("mps_slab_grow: pool=%p: size=%lu, pages=%lu", pool, size,
+                   n);
+
+unlock:
+
+    mps_slab_unlock(pool);
+
+    if (close(fd) == -1 && err == 0) {
+        err = errno;
+    }
+
+    return err;
+}
+
+/*
+ * The kernel marks the robust mutex of an owner which died, and the new owner
+ * gets EOWNERDEAD. The mutex is made consistent again, so that it can still
+ * be used after it is unlocked.
+ */
+static ngx_inline ngx_int_t mps_slab_mutex_locked(mps_slab_pool_t *pool,
+                                                  int rc)
+{
+    if (rc == EOWNERDEAD) {
+        mps_log_error("mps_slab_lock: pool=%p: owner died holding the lock",
+                      pool);
+        pthread_mutex_consistent(&pool->mutex);
+        return 1;
+    }
+
+    return rc == 0;
+}
+
+static ngx_inline ngx_int_t mps_slab_trylock_raw(mps_slab_pool_t *pool)
+{
+    return mps_slab_mutex_locked(pool, pthread_mutex_trylock(&pool->mutex));
+}
+
+/*
+ * With spin_lock, spin with pause like ngx_shmtx_t before sleeping in the
+ * futex wait of the mutex, since the lock is usually held very briefly.
+ */
+static ngx_inline void mps_slab_lock_raw(mps_slab_pool_t *pool)
+{
+    ngx_uint_t i, n;
+
+    if (pool->spin_lock && mps_ncpu > 1) {
+        for (n = 1; n < MPS_SLAB_SPIN; n <<= 1) {
+            if (mps_slab_trylock_raw(pool)) {
+                return;
+            }
+
+            for (i = 0; i < n; i++) {
+                mps_cpu_pause();
+            }
+        }
+    }
+
+    mps_slab_mutex_locked(pool, pthread_mutex_lock(&pool->mutex));
+}
+
+static ngx_inline void mps_slab_unlock_raw(mps_slab_pool_t *pool)
+{
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static ngx_inline uint64_t mps_slab_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static ngx_inline void mps_slab_lock_stat_add(ngx_uint_t *hist,
+                                              ngx_uint_t *total,
+                                              ngx_uint_t *max, uint64_t ns)
+{
+    ngx_uint_t i;
+
+    i = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (i >= MPS_SLAB_LOCK_HIST_SIZE) {
+        i = MPS_SLAB_LOCK_HIST_SIZE - 1;
+    }
+
+    hist[i]++;
+    *total += ns;
+    if (*max < ns) {
+        *max = ns;
+    }
+}
+
+/*
+ * With lock_stats, try the mutex first so that an uncontended acquisition
+ * reads the clock only once.
+ */
+static void mps_slab_lock_timed(mps_slab_pool_t *pool)
+{
+    mps_slab_lock_stat_t *st;
+    uint64_t start, now;
+
+    st = &pool->lock_stat;
+
+    if (mps_slab_trylock_raw(pool)) {
+        now = mps_slab_now_ns();
+        start = now;
+
+    } else {
+        start = mps_slab_now_ns();
+        mps_slab_lock_raw(pool);
+        now = mps_slab_now_ns();
+        st->contended++;
+    }
+
+    st->acquires++;
+    mps_slab_lock_stat_add(st->wait_hist, &st->wait_total, &st->wait_max,
+                           now - start);
+    pool->locked_at = now;
+}
+
 void mps_slab_lock(mps_slab_pool_t *pool)
 {
-    pthread_mutex_lock(&pool->mutex);
+    ngx_uint_t n;
+
+    if (pool->lock_stats) {
+        mps_slab_lock_timed(pool);
+
+    } else {
+        mps_slab_lock_raw(pool);
+    }
+
+    /* keep seq odd even if the previous owner died while holding the lock */
+    pool->seq = (pool->seq + 1) | 1;
+    mps_write_barrier();
+
+    if (pool->inplace) {
+        /* updaters increment updaters before they check seq */
+        mps_memory_barrier();
+
+        for (n = 0; pool->updaters; n++) {
+            if (n < MPS_SLAB_SPIN && mps_ncpu > 1) {
+                mps_cpu_pause();
+
+            } else {
+                sched_yield();
+            }
+        }
+    }
 }
 
 void mps_slab_unlock(mps_slab_pool_t *pool)
 {
-    pthread_mutex_unlock(&pool->mutex);
+    mps_slab_lock_stat_t *st;
+
+    mps_write_barrier();
+    pool->seq++;
+
+    if (pool->lock_stats) {
+        st = &pool->lock_stat;
+        mps_slab_lock_stat_add(st->hold_hist, &st->hold_total, &st->hold_max,
+                               mps_slab_now_ns() - pool->locked_at);
+    }
+
+    mps_slab_unlock_raw(pool);
+}
+
+ngx_int_t mps_slab_enter_inplace(mps_slab_pool_t *pool)
+{
+    mps_atomic_fetch_add(&pool->updaters, 1);
+
+    if (pool->seq & 1) {
+        mps_atomic_fetch_add(&pool->updaters, -1);
+        return 0;
+    }
+
+    return 1;
+}
+
+void mps_slab_leave_inplace(mps_slab_pool_t *pool)
+{
+    mps_atomic_fetch_add(&pool->updaters, -1);
 }
 
 void *mps_slab_alloc(mps_slab_pool_t *pool, size_t size)
@@ -421,6 +783,269 @@ void *mps_slab_alloc(mps_slab_pool_t *pool, size_t size)
     return p;
 }
 
+#define mps_slab_class_size(pool, slot)                                        \
+    (((uint32_t *)mps_ptr((pool), (pool)->classes))[slot])
+
+/*
+ * The slab of a class page holds the slot in the low bits. Its chunks are
+ * tracked by a bitmap in the high bits of the slab if they fit, or else by a
+ * bitmap in the first chunks of the page and a count of used chunks in the
+ * high bits of the slab.
+ */
+#define MPS_SLAB_CLASS_MASK (((uintptr_t)1 << MPS_SLAB_MAP_SHIFT) - 1)
+#define MPS_SLAB_CLASS_MAP_BITS (8 * sizeof(uintptr_t) - MPS_SLAB_MAP_SHIFT)
+
+/* Returns the slot of the smallest class of at least size. */
+static ngx_uint_t mps_slab_class_slot(mps_slab_pool_t *pool, size_t size)
+{
+    ngx_uint_t lo, hi, mid;
+
+    lo = 0;
+    hi = pool->nclasses - 1;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if (mps_slab_class_size(pool, mid) < size) {
+            lo = mid + 1;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * Returns the count of chunks of size in a page, and sets reserved to the
+ * count of the first ones taken by the bitmap.
+ */
+static ngx_uint_t mps_slab_class_chunks(size_t size, ngx_uint_t *reserved)
+{
+    ngx_uint_t n, map;
+
+    n = mps_pagesize / size;
+
+    if (n <= MPS_SLAB_CLASS_MAP_BITS) {
+        *reserved = 0;
+        return n;
+    }
+
+    map = (n + 8 * sizeof(uintptr_t) - 1) / (8 * sizeof(uintptr_t));
+    *reserved = (map * sizeof(uintptr_t) + size - 1) / size;
+
+    return n;
+}
+
+static void *mps_slab_alloc_class(mps_slab_pool_t *pool, size_t size)
+{
+    size_t c;
+    uintptr_t p, m, *bitmap;
+    ngx_uint_t i, n, slot, chunks, reserved, map;
+    mps_slab_page_t *page, *slots;
+
+    slot = mps_slab_class_slot(pool, size);
+    c = mps_slab_class_size(pool, slot);
+    chunks = mps_slab_class_chunks(c, &reserved);
+    map = (chunks + 8 * sizeof(uintptr_t) - 1) / (8 * sizeof(uintptr_t));
+
+    mps_log_debug(MPS_LOG_TAG,
+                  "mps_slab_alloc_class: pool=%p, alloc: size=%lu, slot=%lu, "
+                  "alloc_size=%lu",
+                  pool, size, slot, c);
+
+    mps_pool_stats(pool)[slot].reqs++;
+
+    slots = mps_slab_slots(pool);
+    page = mps_slab_page_next(pool, &slots[slot]);
+
+    if (mps_slab_page_next(pool, page) != page) {
+
+        if (reserved == 0) {
+
+            for (i = 0; i < chunks; i++) {
+                m = (uintptr_t)1 << (i + MPS_SLAB_MAP_SHIFT);
+
+                if (page->slab & m) {
+                    continue;
+                }
+
+                page->slab |= m;
+                p = mps_slab_page_addr(pool, page) + i * c;
+
+                if ((page->slab >> MPS_SLAB_MAP_SHIFT) ==
+                    ((uintptr_t)1 << chunks) - 1) {
+                    goto full;
+                }
+
+                goto done;
+            }
+
+        } else {
+
+            bitmap = (uintptr_t *)mps_slab_page_addr(pool, page);
+
+            for (n = 0; n < map; n++) {
+
+                if (bitmap[n] == MPS_SLAB_BUSY) {
+                    continue;
+                }
+
+                for (m = 1, i = 0; m; m <<= 1, i++) {
+                    if (bitmap[n] & m) {
+                        continue;
+                    }
+
+                    bitmap[n] |= m;
+                    page->slab += (uintptr_t)1 << MPS_SLAB_MAP_SHIFT;
+
+                    p = (uintptr_t)bitmap +
+                        (n * 8 * sizeof(uintptr_t) + i) * c;
+
+                    if ((page->slab >> MPS_SLAB_MAP_SHIFT) ==
+                        chunks - reserved) {
+                        goto full;
+                    }
+
+                    goto done;
+                }
+            }
+        }
+
+        mps_log_error("mps_slab_alloc_class: page is busy: pool=%p", pool);
+        ngx_debug_point();
+        goto fail;
+    }
+
+    page = mps_slab_alloc_pages(pool, 1);
+    if (page == NULL) {
+        goto fail;
+    }
+
+    if (reserved) {
+        bitmap = (uintptr_t *)mps_slab_page_addr(pool, page);
+        ngx_memzero(bitmap, map * sizeof(uintptr_t));
+
+        /* the bitmap, the requested chunk and the bits beyond the page */
+
+        for (i = 0; i <= reserved; i++) {
+            bitmap[i / (8 * sizeof(uintptr_t))] |=
+                (uintptr_t)1 << (i % (8 * sizeof(uintptr_t)));
+        }
+
+        for (i = chunks; i < map * 8 * sizeof(uintptr_t); i++) {
+            bitmap[i / (8 * sizeof(uintptr_t))] |=
+                (uintptr_t)1 << (i % (8 * sizeof(uintptr_t)));
+        }
+    }
+
+    page->slab = slot | ((uintptr_t)1 << MPS_SLAB_MAP_SHIFT);
+    page->next = mps_offset(pool, &slots[slot]);
+    page->prev = mps_offset(pool, &slots[slot]) | MPS_SLAB_SMALL;
+
+    slots[slot].next = mps_offset(pool, page);
+
+    mps_pool_stats(pool)[slot].total += chunks - reserved;
+
+    p = mps_slab_page_addr(pool, page) + reserved * c;
+
+    goto done;
+
+full:
+
+    mps_slab_page_prev(pool, page)->next = page->next;
+    mps_slab_page_next(pool, page)->prev = page->prev;
+
+    page->next = mps_nulloff;
+    page->prev = MPS_SLAB_SMALL;
+
+done:
+
+    mps_pool_stats(pool)[slot].used++;
+
+    return (void *)p;
+
+fail:
+
+    mps_pool_stats(pool)[slot].fails++;
+
+    return NULL;
+}
+
+static void mps_slab_free_class(mps_slab_pool_t *pool, mps_slab_page_t *page,
+                                void *p)
+{
+    size_t c;
+    uintptr_t m, *bitmap;
+    ngx_uint_t i, slot, chunks, reserved, empty;
+    mps_slab_page_t *slots, *next;
+
+    slot = page->slab & MPS_SLAB_CLASS_MASK;
+    c = mps_slab_class_size(pool, slot);
+    chunks = mps_slab_class_chunks(c, &reserved);
+
+    i = (uintptr_t)p & (mps_pagesize - 1);
+
+    if (i % c || i / c < reserved || i / c >= chunks) {
+        mps_log_error("mps_slab_free_locked: pool=%p: pointer to wrong chunk",
+                      pool);
+        return;
+    }
+
+    i /= c;
+
+    if (reserved == 0) {
+        m = (uintptr_t)1 << (i + MPS_SLAB_MAP_SHIFT);
+
+        if (!(page->slab & m)) {
+            goto already_free;
+        }
+
+        page->slab &= ~m;
+        empty = !(page->slab & MPS_SLAB_MAP_MASK);
+
+    } else {
+        bitmap = (uintptr_t *)((uintptr_t)p & ~((uintptr_t)mps_pagesize - 1));
+        m = (uintptr_t)1 << (i % (8 * sizeof(uintptr_t)));
+        i /= 8 * sizeof(uintptr_t);
+
+        if (!(bitmap[i] & m)) {
+            goto already_free;
+        }
+
+        bitmap[i] &= ~m;
+        page->slab -= (uintptr_t)1 << MPS_SLAB_MAP_SHIFT;
+        empty = !(page->slab & MPS_SLAB_MAP_MASK);
+    }
+
+    if (page->next == 0) {
+        slots = mps_slab_slots(pool);
+
+        page->next = slots[slot].next;
+        slots[slot].next = mps_offset(pool, page);
+
+        page->prev = mps_offset(pool, &slots[slot]) | MPS_SLAB_SMALL;
+        next = mps_slab_page_next(pool, page);
+        next->prev = mps_offset(pool, page) | MPS_SLAB_SMALL;
+    }
+
+    mps_pool_stats(pool)[slot].used--;
+
+    mps_slab_junk(p, c);
+
+    if (empty) {
+        mps_slab_free_pages(pool, page, 1);
+        mps_pool_stats(pool)[slot].total -= chunks - reserved;
+    }
+
+    return;
+
+already_free:
+
+    mps_log_error("mps_slab_free_locked: pool=%p: chunk is already free", pool);
+}
+
 void *mps_slab_alloc_locked(mps_slab_pool_t *pool, size_t size)
 {
     size_t s;
@@ -446,6 +1071,10 @@ void *mps_slab_alloc_locked(mps_slab_pool_t *pool, size_t size)
         goto done;
     }
 
+    if (pool->nclasses) {
+        return mps_slab_alloc_class(pool, size);
+    }
+
     if (size > pool->min_size) {
         shift = 1;
         for (s = size - 1; s >>= 1; shift++) {
@@ -692,6 +1321,198 @@ void mps_slab_free(mps_slab_pool_t *pool, void *p)
     mps_slab_unlock(pool);
 }
 
+size_t mps_slab_alloc_size(mps_slab_pool_t *pool, size_t size)
+{
+    size_t s;
+    ngx_uint_t shift;
+
+    if (size > mps_slab_max_size) {
+        return 0;
+    }
+
+    if (pool->nclasses) {
+        return mps_slab_class_size(pool, mps_slab_class_slot(pool, size));
+    }
+
+    if (size <= pool->min_size) {
+        return pool->min_size;
+    }
+
+    shift = 1;
+    for (s = size - 1; s >>= 1; shift++) {
+        /* void */
+    }
+
+    return (size_t)1 << shift;
+}
+
+size_t mps_slab_chunk_size(mps_slab_pool_t *pool, void *p)
+{
+    mps_slab_page_t *page;
+    ngx_uint_t n;
+
+    n = (mps_offset(pool, p) - pool->start) >> mps_pagesize_shift;
+    page = &mps_slab_page(pool, pool->pages)[n];
+
+    switch (mps_slab_page_type(page)) {
+
+    case MPS_SLAB_SMALL:
+        if (pool->nclasses) {
+            return mps_slab_class_size(pool, page->slab & MPS_SLAB_CLASS_MASK);
+        }
+
+        /* fall through */
+
+    case MPS_SLAB_BIG:
+        return (size_t)1 << (page->slab & MPS_SLAB_SHIFT_MASK);
+
+    case MPS_SLAB_EXACT:
+        return mps_slab_exact_size;
+
+    default: /* MPS_SLAB_PAGE */
+        return 0;
+    }
+}
+
+void mps_slab_stats(mps_slab_pool_t *pool, mps_slab_pool_stat_t *stats,
+                    mps_slab_slot_stat_t *slots, ngx_uint_t n)
+{
+    ngx_uint_t i, nslots;
+    mps_slab_stat_t *stat;
+    mps_slab_page_t *page;
+
+    stats->pages += (pool->last - pool->pages) / sizeof(mps_slab_page_t);
+    stats->free_pages += pool->pfree;
+
+    for (page = mps_slab_page_next(pool, &pool->free); page != &pool->free;
+         page = mps_slab_page_next(pool, page)) {
+        stats->max_free_run = ngx_max(stats->max_free_run, page->slab);
+    }
+
+    nslots = pool->nclasses ? pool->nclasses
+                            : mps_pagesize_shift - pool->min_shift;
+    stats->nslots = ngx_max(stats->nslots, nslots);
+
+    stat = mps_pool_stats(pool);
+
+    for (i = 0; i < ngx_min(n, nslots); i++) {
+        slots[i].size = pool->nclasses ? mps_slab_class_size(pool, i)
+                                       : (size_t)1 << (i + pool->min_shift);
+        slots[i].stat.total += stat[i].total;
+        slots[i].stat.used += stat[i].used;
+        slots[i].stat.reqs += stat[i].reqs;
+        slots[i].stat.fails += stat[i].fails;
+    }
+}
+
+/* Returns the count of used chunks in a page of chunks, and sets slot. */
+static ngx_uint_t mps_slab_page_used(mps_slab_pool_t *pool,
+                                     mps_slab_page_t *page, ngx_uint_t *slot)
+{
+    uintptr_t *bitmap;
+    ngx_uint_t i, n, shift, map, reserved;
+
+    switch (mps_slab_page_type(page)) {
+
+    case MPS_SLAB_SMALL:
+        if (pool->nclasses) {
+            *slot = page->slab & MPS_SLAB_CLASS_MASK;
+            (void)mps_slab_class_chunks(mps_slab_class_size(pool, *slot),
+                                        &reserved);
+
+            if (reserved) {
+                return page->slab >> MPS_SLAB_MAP_SHIFT;
+            }
+
+            return __builtin_popcountl(page->slab >> MPS_SLAB_MAP_SHIFT);
+        }
+
+        shift = page->slab & MPS_SLAB_SHIFT_MASK;
+        *slot = shift - pool->min_shift;
+
+        bitmap = (uintptr_t *)mps_slab_page_addr(pool, page);
+        map = (mps_pagesize >> shift) / (8 * sizeof(uintptr_t));
+
+        for (n = 0, i = 0; i < map; i++) {
+            n += __builtin_popcountl(bitmap[i]);
+        }
+
+        /* the chunks taken by the bitmap */
+
+        reserved = (mps_pagesize >> shift) / ((1 << shift) * 8);
+
+        return n - (reserved ? reserved : 1);
+
+    case MPS_SLAB_EXACT:
+        *slot = mps_slab_exact_shift - pool->min_shift;
+        return __builtin_popcountl(page->slab);
+
+    default: /* MPS_SLAB_BIG */
+        *slot = (page->slab & MPS_SLAB_SHIFT_MASK) - pool->min_shift;
+        return __builtin_popcountl(page->slab & MPS_SLAB_MAP_MASK);
+    }
+}
+
+void *mps_slab_alloc_move(mps_slab_pool_t *pool, void *p)
+{
+    size_t size;
+    ngx_uint_t i, slot, other, used, n, best_used;
+    mps_slab_page_t *page, *best, *slots, *next;
+
+    size = mps_slab_chunk_size(pool, p);
+
+    n = (mps_offset(pool, p) - pool->start) >> mps_pagesize_shift;
+    page = &mps_slab_page(pool, pool->pages)[n];
+
+    /* whole pages and full pages are not moved */
+    if (size == 0 || page->next == mps_nulloff) {
+        return NULL;
+    }
+
+    used = mps_slab_page_used(pool, page, &slot);
+
+    slots = mps_slab_slots(pool);
+    best = NULL;
+    best_used = used;
+
+    for (next = mps_slab_page_next(pool, &slots[slot]), i = 0;
+         next != &slots[slot] && i < MPS_SLAB_MOVE_SCAN;
+         next = mps_slab_page_next(pool, next), i++) {
+
+        if (next == page) {
+            continue;
+        }
+
+        n = mps_slab_page_used(pool, next, &other);
+
+        if (n > best_used) {
+            best = next;
+            best_used = n;
+        }
+    }
+
+    if (best == NULL) {
+        return NULL;
+    }
+
+    /* the allocation takes a chunk of the first page of the slot */
+
+    if (slots[slot].next != mps_offset(pool, best)) {
+        mps_slab_page_prev(pool, best)->next = best->next;
+        mps_slab_page_next(pool, best)->prev = best->prev;
+
+        next = mps_slab_page_next(pool, &slots[slot]);
+
+        best->next = slots[slot].next;
+        best->prev = mps_offset(pool, &slots[slot]) | mps_slab_page_type(best);
+        next->prev = mps_offset(pool, best) | mps_slab_page_type(next);
+
+        slots[slot].next = mps_offset(pool, best);
+    }
+
+    return mps_slab_alloc_locked(pool, size);
+}
+
 void mps_slab_free_locked(mps_slab_pool_t *pool, void *p)
 {
     size_t size;
@@ -717,6 +1538,11 @@ void mps_slab_free_locked(mps_slab_pool_t *pool, void *p)
 
     case MPS_SLAB_SMALL:
 
+        if (pool->nclasses) {
+            mps_slab_free_class(pool, page, p);
+            return;
+        }
+
         shift = slab & MPS_SLAB_SHIFT_MASK;
         size = (size_t)1 << shift;
 
@@ -9,6 +9,7 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
+#include "mps_atomic.h"
 
 extern ngx_uint_t mps_pagesize;
 
@@ -31,8 +32,44 @@ typedef struct {
     ngx_uint_t fails;
 } mps_slab_stat_t;
 
+/* the counters of the chunks of one size, see mps_slab_stats */
+typedef struct {
+    size_t size;
+    mps_slab_stat_t stat;
+} mps_slab_slot_stat_t;
+
+typedef struct {
+    ngx_uint_t pages;
+    ngx_uint_t free_pages;
+    /* the largest run of contiguous free pages in one pool */
+    ngx_uint_t max_free_run;
+    /* count of slots, which may be more than the slots returned */
+    ngx_uint_t nslots;
+} mps_slab_pool_stat_t;
+
+/* bucket i > 0 counts durations in [2^(i-1), 2^i) nanoseconds, and the last
+ * bucket also counts longer ones */
+#define MPS_SLAB_LOCK_HIST_SIZE 32
+
+/* updated by the lock owner, so the counters need no atomic operations */
+typedef struct {
+    ngx_uint_t acquires;
+    ngx_uint_t contended;
+
+    /* in nanoseconds */
+    ngx_uint_t wait_total;
+    ngx_uint_t wait_max;
+    ngx_uint_t hold_total;
+    ngx_uint_t hold_max;
+
+    ngx_uint_t wait_hist[MPS_SLAB_LOCK_HIST_SIZE];
+    ngx_uint_t hold_hist[MPS_SLAB_LOCK_HIST_SIZE];
+} mps_slab_lock_stat_t;
+
 typedef struct {
     pthread_mutex_t mutex;
+    /* odd while the mutex is held, for readers which do not lock */
+    mps_atomic_t seq;
     mps_ptroff_t data;
 
     size_t min_size;
@@ -45,10 +82,26 @@ typedef struct {
     mps_ptroff_t stats;
     ngx_uint_t pfree;
 
+    /* sizes of chunks, used instead of powers of two if nclasses is not 0 */
+    mps_ptroff_t classes;
+    ngx_uint_t nclasses;
+
     mps_ptroff_t start;
     mps_ptroff_t end;
+    /* the end up to which the pool can grow, there are pages for it */
+    mps_ptroff_t max_end;
+
+    /* used only if lock_stats is set */
+    uint64_t locked_at;
+    mps_slab_lock_stat_t lock_stat;
+
+    /* count of lock-free in place updates in progress, if inplace is set */
+    mps_atomic_t updaters;
 
     unsigned log_nomem : 1;
+    unsigned lock_stats : 1;
+    unsigned spin_lock : 1;
+    unsigned inplace : 1;
 } mps_slab_pool_t;
 
 #define mps_nulloff 0
@@ -67,8 +120,48 @@ mps_slab_pool_t *mps_slab_open_or_create(const char *pathname, size_t shm_size,
                                          mps_slab_on_init_pt on_init);
 void mps_slab_close(mps_slab_pool_t *pool, size_t shm_size);
 
+/*
+ * Same as mps_slab_open_or_create, but a created pool can grow up to max_size
+ * with mps_slab_grow. max_size is mapped from the start, so the pages added
+ * by another process become accessible without remapping, and every process
+ * must open the pool with the same max_size.
+ */
+mps_slab_pool_t *mps_slab_open_or_create_max(const char *pathname,
+                                             size_t shm_size, size_t max_size,
+                                             size_t min_shift, mode_t mode,
+                                             mps_slab_on_init_pt on_init);
+
+/*
+ * Grow the file at pathname of the pool to size and add the new pages to the
+ * free pages of the pool. It does nothing if the pool is already that large.
+ */
+mps_err_t mps_slab_grow(mps_slab_pool_t *pool, const char *pathname,
+                        size_t size);
+
+/* Initialize a pool at addr, which may be a page aligned run of pages
+ * allocated from another pool. */
+mps_err_t mps_slab_init(mps_slab_pool_t *pool, u_char *addr, size_t pool_size,
+                        size_t min_shift);
+
+/*
+ * Make an empty pool allocate chunks of up to half a page from size classes
+ * which grow by factor percent, instead of powers of two. Chunks are aligned
+ * to NGX_ALIGNMENT only.
+ */
+mps_err_t mps_slab_init_classes(mps_slab_pool_t *pool, ngx_uint_t factor);
+
 void mps_slab_lock(mps_slab_pool_t *pool);
 void mps_slab_unlock(mps_slab_pool_t *pool);
+
+/*
+ * Enter a section which updates existing data in place without the lock, if
+ * the pool has inplace set. Returns 0 if the lock is held, then the caller
+ * must take the lock instead. The lock owner waits until all sections are
+ * left, so nothing is freed or moved in a section, but sections run at the
+ * same time and must update shared data atomically.
+ */
+ngx_int_t mps_slab_enter_inplace(mps_slab_pool_t *pool);
+void mps_slab_leave_inplace(mps_slab_pool_t *pool);
 void *mps_slab_alloc(mps_slab_pool_t *pool, size_t size);
 void *mps_slab_alloc_locked(mps_slab_pool_t *pool, size_t size);
 void *mps_slab_calloc(mps_slab_pool_t *pool, size_t size);
@@ -76,4 +169,27 @@ void *mps_slab_calloc_locked(mps_slab_pool_t *pool, size_t size);
 void mps_slab_free(mps_slab_pool_t *pool, void *p);
 void mps_slab_free_locked(mps_slab_pool_t *pool, void *p);
 
+/*
+ * Return the size of the chunk which an allocation of size takes or the chunk
+ * at p is, or 0 for whole pages. Chunks of a size share pages, so freeing one
+ * makes room for an allocation of the same size.
+ */
+size_t mps_slab_alloc_size(mps_slab_pool_t *pool, size_t size);
+size_t mps_slab_chunk_size(mps_slab_pool_t *pool, void *p);
+
+/*
+ * Allocate a chunk of the size of the chunk at p in a page which has more
+ * chunks in use than the page of p, so that moving the data of p there may
+ * free its page. Returns NULL if there is no such page with a free chunk. The
+ * caller holds the lock.
+ */
+void *mps_slab_alloc_move(mps_slab_pool_t *pool, void *p);
+
+/*
+ * Add the page counts of the locked pool to stats, and the counters of its
+ * first n slots, one per chunk size from the smallest, to slots.
+ */
+void mps_slab_stats(mps_slab_pool_t *pool, mps_slab_pool_stat_t *stats,
+                    mps_slab_slot_stat_t *slots, ngx_uint_t n);
+
 #endif /* _MPS_SLAB_H_INCLUDED_ */
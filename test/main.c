@@ -1612,6 +1612,3384 @@ void test_memory_mapped_file(void)
     delete_shdict_file("/tmp/dic");
 }
 
+static mps_shdict_t *open_shdict_opts(size_t shm_size, ngx_uint_t flags,
+                                      ngx_uint_t shards, size_t max_size)
+{
+    mps_shdict_opts_t opts;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.min_shift = MPS_SLAB_DEFAULT_MIN_SHIFT;
+    opts.flags = flags;
+    opts.shards = shards;
+    opts.max_size = max_size;
+    return mps_shdict_open_or_create_opts(SHM_PATHNAME, shm_size,
+                                          S_IRUSR | S_IWUSR, &opts);
+}
+
+void test_lockfree_get_happy(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 8, MPS_SHDICT_FLAG_LOCKFREE_GET, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    sleep_till_next_ms();
+
+    const u_char *key1 = (const u_char *)"key1";
+    size_t key1_len = strlen((const char *)key1);
+    const u_char *str_value = (const u_char *)"Hello, world!";
+    size_t str_value_len = strlen((const char *)str_value);
+    int value_type, user_flags = 0xcafe, is_stale = 0, forcible = 0;
+    double num_value = 0;
+    char *err = NULL;
+    int rc = mps_shdict_set(dict, key1, key1_len, MPS_SHDICT_TSTRING,
+                            str_value, str_value_len, num_value, 1, user_flags,
+                            &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    const u_char *key2 = (const u_char *)"key2";
+    size_t key2_len = strlen((const char *)key2);
+    num_value = 23.5;
+    rc = mps_shdict_set(dict, key2, key2_len, MPS_SHDICT_TNUMBER, NULL, 0,
+                        num_value, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    /* a string which fits in the buffer */
+    u_char buf[64], *got_str_value = buf;
+    size_t got_str_value_len = sizeof(buf);
+    value_type = -1;
+    user_flags = 0;
+    rc = mps_shdict_get(dict, key1, key1_len, &value_type, &got_str_value,
+                        &got_str_value_len, &num_value, &user_flags, 0,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+    TEST_ASSERT_EQUAL_PTR(buf, got_str_value);
+    TEST_ASSERT_EQUAL_UINT64(str_value_len, got_str_value_len);
+    TEST_ASSERT_EQUAL_MEMORY(str_value, got_str_value, got_str_value_len);
+    TEST_ASSERT_EQUAL_INT(0xcafe, user_flags);
+
+    /* a string which does not fit in the buffer */
+    got_str_value = NULL;
+    got_str_value_len = 0;
+    rc = mps_shdict_get(dict, key1, key1_len, &value_type, &got_str_value,
+                        &got_str_value_len, &num_value, &user_flags, 0,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+    TEST_ASSERT_NOT_NULL(got_str_value);
+    TEST_ASSERT_EQUAL_UINT64(str_value_len, got_str_value_len);
+    TEST_ASSERT_EQUAL_MEMORY(str_value, got_str_value, got_str_value_len);
+    free(got_str_value);
+
+    value_type = -1;
+    num_value = 0;
+    rc = mps_shdict_get(dict, key2, key2_len, &value_type, &got_str_value,
+                        &got_str_value_len, &num_value, &user_flags, 0,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+    TEST_ASSERT_EQUAL_DOUBLE(23.5, num_value);
+
+    /* expired value is returned only with get_stale */
+    sleep_ms(2);
+
+    value_type = -1;
+    got_str_value = buf;
+    got_str_value_len = sizeof(buf);
+    rc = mps_shdict_get(dict, key1, key1_len, &value_type, &got_str_value,
+                        &got_str_value_len, &num_value, &user_flags, 0,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+
+    value_type = -1;
+    rc = mps_shdict_get(dict, key1, key1_len, &value_type, &got_str_value,
+                        &got_str_value_len, &num_value, &user_flags, 1,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+    TEST_ASSERT_EQUAL_INT(1, is_stale);
+
+    /* errors are reported as with the locked get */
+    const u_char *key3 = (const u_char *)"key3";
+    size_t key3_len = strlen((const char *)key3);
+    int n = mps_shdict_lpush(dict, key3, key3_len, MPS_SHDICT_TNUMBER, NULL, 0,
+                             num_value, &err);
+    TEST_ASSERT_EQUAL_INT(1, n);
+
+    rc = mps_shdict_get(dict, key3, key3_len, &value_type, &got_str_value,
+                        &got_str_value_len, &num_value, &user_flags, 0,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_ERROR, rc);
+    TEST_ASSERT_EQUAL_STRING("value is a list", err);
+
+    mps_shdict_close(dict);
+}
+
+void test_lockfree_get_second_chance(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 3, MPS_SHDICT_FLAG_LOCKFREE_GET, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key_buf[64];
+    const u_char *key = (const u_char *)key_buf;
+    size_t key_len, str_value_len = 0;
+    int value_type, user_flags = 0, is_stale = 0, forcible = 0, i, rc;
+    double num_value = 1;
+    u_char *str_value_ptr = NULL;
+    char *err = NULL;
+
+    /* the access bitmap takes the only free page, so the page of the tree
+     * has room for 31 nodes */
+    for (i = 0; i < 31; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, key, key_len, MPS_SHDICT_TNUMBER, NULL, 0,
+                            num_value, 0, user_flags, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(0, forcible);
+    }
+
+    /* key0 is the oldest, but it was read */
+    key_len = sprintf(key_buf, "key%d", 0);
+    value_type = -1;
+    rc = mps_shdict_get(dict, key, key_len, &value_type, &str_value_ptr,
+                        &str_value_len, &num_value, &user_flags, 0, &is_stale,
+                        &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+
+    key_len = sprintf(key_buf, "key%d", 31);
+    rc = mps_shdict_set(dict, key, key_len, MPS_SHDICT_TNUMBER, NULL, 0,
+                        num_value, 0, user_flags, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(1, forcible);
+
+    key_len = sprintf(key_buf, "key%d", 0);
+    value_type = -1;
+    rc = mps_shdict_get(dict, key, key_len, &value_type, &str_value_ptr,
+                        &str_value_len, &num_value, &user_flags, 0, &is_stale,
+                        &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+
+    key_len = sprintf(key_buf, "key%d", 1);
+    value_type = -1;
+    rc = mps_shdict_get(dict, key, key_len, &value_type, &str_value_ptr,
+                        &str_value_len, &num_value, &user_flags, 0, &is_stale,
+                        &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+
+    mps_shdict_close(dict);
+}
+
+#define LOCKFREE_TEST_KEYS 64
+#define LOCKFREE_TEST_LOOPS 2000
+
+static void *lockfree_get_writer_start(void *arg)
+{
+    mps_shdict_t *dict = (mps_shdict_t *)arg;
+    char key_buf[64], value_buf[128];
+    size_t key_len, value_len;
+    int forcible, i, rc;
+    char *err;
+
+    for (i = 0; i < LOCKFREE_TEST_LOOPS; i++) {
+        key_len = sprintf(key_buf, "key%d", i % LOCKFREE_TEST_KEYS);
+
+        if (i % 7 == 0) {
+            mps_shdict_delete(dict, (const u_char *)key_buf, key_len);
+            continue;
+        }
+
+        /* vary the length so that nodes are freed and reallocated */
+        value_len = sprintf(value_buf, "%s:%0*d", key_buf, i % 50 + 1, i);
+        rc = mps_shdict_set(dict, (const u_char *)key_buf, key_len,
+                            MPS_SHDICT_TSTRING, (const u_char *)value_buf,
+                            value_len, 0, 0, 0, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    return NULL;
+}
+
+static void *lockfree_get_reader_start(void *arg)
+{
+    mps_shdict_t *dict = (mps_shdict_t *)arg;
+    char key_buf[64];
+    u_char buf[128], *value;
+    size_t key_len, value_len;
+    int value_type, user_flags, is_stale, i, rc;
+    double num_value;
+    char *err;
+
+    for (i = 0; i < LOCKFREE_TEST_LOOPS * 4; i++) {
+        key_len = sprintf(key_buf, "key%d", i % LOCKFREE_TEST_KEYS);
+        value = buf;
+        value_len = sizeof(buf);
+        rc = mps_shdict_get(dict, (const u_char *)key_buf, key_len,
+                            &value_type, &value, &value_len, &num_value,
+                            &user_flags, 0, &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+        if (value_type == MPS_SHDICT_TNIL) {
+            continue;
+        }
+
+        /* a torn read would show a value of another key */
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+        TEST_ASSERT_TRUE(value_len > key_len);
+        TEST_ASSERT_EQUAL_MEMORY(key_buf, value, key_len);
+        TEST_ASSERT_EQUAL_UINT8(':', value[key_len]);
+    }
+
+    return NULL;
+}
+
+void test_lockfree_get_multithread(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_LOCKFREE_GET, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    pthread_t writer, readers[2];
+    int err, i;
+
+    err = pthread_create(&writer, NULL, lockfree_get_writer_start, dict);
+    TEST_ASSERT_EQUAL_INT(0, err);
+
+    for (i = 0; i < 2; i++) {
+        err = pthread_create(&readers[i], NULL, lockfree_get_reader_start,
+                             dict);
+        TEST_ASSERT_EQUAL_INT(0, err);
+    }
+
+    err = pthread_join(writer, NULL);
+    TEST_ASSERT_EQUAL_INT(0, err);
+
+    for (i = 0; i < 2; i++) {
+        err = pthread_join(readers[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, err);
+    }
+
+    mps_shdict_close(dict);
+}
+
+/* Returns 1 if key holds the number n. */
+static int has_number(mps_shdict_t *dict, const char *key, double n)
+{
+    char *err = NULL;
+    u_char *str_value = NULL;
+    size_t str_value_len = 0;
+    int rc, value_type = -1, user_flags, is_stale;
+    double num_value = 0;
+
+    rc = mps_shdict_get(dict, (const u_char *)key, strlen(key), &value_type,
+                        &str_value, &str_value_len, &num_value, &user_flags,
+                        0, &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    return value_type == MPS_SHDICT_TNUMBER && num_value == n;
+}
+
+#define SHARDS_TEST_KEYS 100
+
+void test_shards(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 32, 0, 4, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_tree_t *tree = mps_shdict_tree(dict->pool);
+    TEST_ASSERT_EQUAL_UINT32(4, tree->nshards);
+
+    size_t free_space = mps_shdict_free_space(dict);
+    TEST_ASSERT_TRUE(free_space > 0);
+    TEST_ASSERT_TRUE(free_space < mps_shdict_capacity(dict));
+
+    char key_buf[16];
+    u_char *value;
+    size_t key_len, value_len;
+    int i, rc, value_type, user_flags, is_stale, forcible;
+    double num_value;
+    char *err = NULL;
+
+    for (i = 0; i < SHARDS_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(0, forcible);
+    }
+
+    /* keys are spread over all shards */
+    mps_ptroff_t *shards = mps_shdict_tree_shards(tree);
+    for (i = 0; i < 4; i++) {
+        mps_slab_pool_t *shard =
+            (mps_slab_pool_t *)mps_ptr(dict->pool, shards[i]);
+        mps_shdict_tree_t *shard_tree = mps_shdict_tree(shard);
+        TEST_ASSERT_FALSE(mps_queue_empty(shard, &shard_tree->lru_queue));
+    }
+    TEST_ASSERT_TRUE(mps_shdict_free_space(dict) < free_space);
+
+    for (i = 0; i < SHARDS_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        value = NULL;
+        value_len = 0;
+        rc = mps_shdict_get(dict, (u_char *)key_buf, key_len, &value_type,
+                            &value, &value_len, &num_value, &user_flags, 0,
+                            &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i, num_value);
+    }
+
+    rc = mps_shdict_flush_all(dict);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < SHARDS_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        value_type = -1;
+        rc = mps_shdict_get(dict, (u_char *)key_buf, key_len, &value_type,
+                            &value, &value_len, &num_value, &user_flags, 0,
+                            &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+    }
+
+    mps_shdict_close(dict);
+}
+
+void test_shards_too_many(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 3, 0, 8, 0);
+    TEST_ASSERT_NULL(dict);
+}
+
+void test_htable(void)
+{
+    mps_slab_pool_t *pool;
+    mps_htable_t *ht;
+    mps_htable_iter_t it;
+    mps_ptroff_t off;
+    int i, found, rc;
+
+    pool = mps_slab_open_or_create(SHM_PATHNAME, 4096 * 5,
+                                   MPS_SLAB_DEFAULT_MIN_SHIFT,
+                                   S_IRUSR | S_IWUSR, NULL);
+    TEST_ASSERT_NOT_NULL(pool);
+
+    ht = mps_htable_create(pool, 20, 7);
+    TEST_ASSERT_NOT_NULL(ht);
+    TEST_ASSERT_EQUAL_UINT32(31, ht->mask);
+
+    /* the same hash fills the first group and spills to another one */
+    for (i = 1; i <= 20; i++) {
+        rc = mps_htable_insert(pool, ht, 0x1234, i << 7);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+    TEST_ASSERT_EQUAL_UINT32(20, ht->used);
+
+    found = 0;
+    for (off = mps_htable_first(ht, 0x1234, &it); off != mps_nulloff;
+         off = mps_htable_next(ht, &it)) {
+        TEST_ASSERT_EQUAL_UINT(0, off & 127);
+        found++;
+    }
+    TEST_ASSERT_EQUAL_INT(20, found);
+
+    /* the tag differs */
+    off = mps_htable_first(ht, 0x1235, &it);
+    TEST_ASSERT_EQUAL_UINT(mps_nulloff, off);
+
+    for (i = 1; i <= 10; i++) {
+        rc = mps_htable_delete(pool, ht, 0x1234, i << 7);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+    rc = mps_htable_delete(pool, ht, 0x1234, 1 << 7);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+    TEST_ASSERT_EQUAL_UINT32(10, ht->used);
+
+    /* the first group had no empty slot, so the slots are marked deleted */
+    TEST_ASSERT_TRUE(ht->deleted > 0);
+
+    found = 0;
+    for (off = mps_htable_first(ht, 0x1234, &it); off != mps_nulloff;
+         off = mps_htable_next(ht, &it)) {
+        TEST_ASSERT_TRUE(off > (10 << 7));
+        found++;
+    }
+    TEST_ASSERT_EQUAL_INT(10, found);
+
+    for (i = 21; ht->used + ht->deleted < 28; i++) {
+        rc = mps_htable_insert(pool, ht, 0x5678 + i * 128, i << 7);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+    rc = mps_htable_insert(pool, ht, 0x5678, i << 7);
+    TEST_ASSERT_EQUAL_INT(NGX_AGAIN, rc);
+
+    mps_htable_clear(ht);
+    TEST_ASSERT_EQUAL_UINT32(0, ht->used);
+    TEST_ASSERT_EQUAL_UINT32(0, ht->deleted);
+    off = mps_htable_first(ht, 0x1234, &it);
+    TEST_ASSERT_EQUAL_UINT(mps_nulloff, off);
+
+    mps_slab_close(pool, 4096 * 5);
+}
+
+#define HASH_INDEX_TEST_KEYS 64
+#define HASH_INDEX_TEST_LOOPS 20
+
+void test_hash_index(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_HASH_INDEX, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+    TEST_ASSERT_NOT_EQUAL(mps_nulloff, mps_shdict_tree(dict->pool)->index);
+
+    char key_buf[16];
+    u_char *value;
+    size_t key_len, value_len;
+    int i, j, rc, value_type, user_flags, is_stale, forcible;
+    double num_value;
+    char *err = NULL;
+
+    /* deletes leave deleted slots and the index is rebuilt sometimes */
+    for (j = 0; j < HASH_INDEX_TEST_LOOPS; j++) {
+        for (i = 0; i < HASH_INDEX_TEST_KEYS; i++) {
+            key_len = sprintf(key_buf, "key%d", i + j);
+            rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, i + j, 0, 0, &err,
+                                &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+            TEST_ASSERT_EQUAL_INT(0, forcible);
+        }
+
+        for (i = 0; i < HASH_INDEX_TEST_KEYS; i++) {
+            key_len = sprintf(key_buf, "key%d", i + j);
+            rc = mps_shdict_get(dict, (u_char *)key_buf, key_len, &value_type,
+                                &value, &value_len, &num_value, &user_flags, 0,
+                                &is_stale, &err);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+            TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+            TEST_ASSERT_EQUAL_DOUBLE(i + j, num_value);
+        }
+
+        for (i = 0; i < HASH_INDEX_TEST_KEYS; i += 2) {
+            key_len = sprintf(key_buf, "key%d", i + j);
+            rc = mps_shdict_delete(dict, (u_char *)key_buf, key_len);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+            value_type = -1;
+            rc = mps_shdict_get(dict, (u_char *)key_buf, key_len, &value_type,
+                                &value, &value_len, &num_value, &user_flags, 0,
+                                &is_stale, &err);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+            TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+        }
+    }
+
+    /* fill the dict to evict old entries by force */
+    for (i = 0, forcible = 0; !forcible; i++) {
+        key_len = sprintf(key_buf, "fill%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    rc = mps_shdict_get(dict, (u_char *)key_buf, key_len, &value_type, &value,
+                        &value_len, &num_value, &user_flags, 0, &is_stale,
+                        &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_DOUBLE(i - 1, num_value);
+
+    mps_shdict_close(dict);
+}
+
+/* Lock-free gets probe the index while it is changed and rebuilt. */
+void test_hash_index_lockfree_get(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(
+        4096 * 16, MPS_SHDICT_FLAG_HASH_INDEX | MPS_SHDICT_FLAG_LOCKFREE_GET, 1,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key_buf[16];
+    size_t key_len;
+    int i, j, rc, forcible;
+    char *err = NULL;
+
+    for (j = 0; j < HASH_INDEX_TEST_LOOPS; j++) {
+        for (i = 0; i < HASH_INDEX_TEST_KEYS; i++) {
+            key_len = sprintf(key_buf, "key%d", i + j);
+            rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, i + j, 0, 0, &err,
+                                &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+            TEST_ASSERT_TRUE(has_number(dict, key_buf, i + j));
+        }
+
+        for (i = 0; i < HASH_INDEX_TEST_KEYS; i += 2) {
+            key_len = sprintf(key_buf, "key%d", i + j);
+            rc = mps_shdict_delete(dict, (u_char *)key_buf, key_len);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+            TEST_ASSERT_FALSE(has_number(dict, key_buf, i + j));
+        }
+    }
+
+    mps_shdict_close(dict);
+}
+
+#define MIGRATE_TARGET_PATHNAME "/dev/shm/test_dict2"
+#define MIGRATE_TEST_KEYS 50
+
+void test_migrate(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_slab_pool_t *source = dict->pool;
+    char key_buf[16];
+    u_char *value;
+    size_t key_len, value_len;
+    int i, rc, value_type, user_flags, is_stale, forcible, steps;
+    double num_value;
+    char *err = NULL;
+
+    for (i = 0; i < MIGRATE_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    const u_char *list_key = (const u_char *)"list";
+    rc = mps_shdict_rpush(dict, list_key, 4, MPS_SHDICT_TSTRING,
+                          (const u_char *)"foo", 3, 0, &err);
+    TEST_ASSERT_EQUAL_INT(1, rc);
+    rc = mps_shdict_rpush(dict, list_key, 4, MPS_SHDICT_TNUMBER, NULL, 0, 2,
+                          &err);
+    TEST_ASSERT_EQUAL_INT(2, rc);
+
+    rc = mps_shdict_migrate_step(dict, 10);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+
+    mps_shdict_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.min_shift = MPS_SLAB_DEFAULT_MIN_SHIFT;
+    opts.shards = 3;
+    rc = mps_shdict_migrate_start(dict, MIGRATE_TARGET_PATHNAME, 4096 * 32,
+                                  S_IRUSR | S_IWUSR, &opts);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    rc = mps_shdict_migrate_start(dict, MIGRATE_TARGET_PATHNAME, 4096 * 32,
+                                  S_IRUSR | S_IWUSR, &opts);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+
+    rc = mps_shdict_migrate_step(dict, 10);
+    TEST_ASSERT_EQUAL_INT(NGX_AGAIN, rc);
+
+    /* writes during the migration go to both dicts */
+    for (i = 0; i < MIGRATE_TEST_KEYS; i += 5) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i * 10, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    key_len = sprintf(key_buf, "key%d", 1);
+    rc = mps_shdict_delete(dict, (u_char *)key_buf, key_len);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    key_len = sprintf(key_buf, "new");
+    rc = mps_shdict_set(dict, (u_char *)key_buf, key_len, MPS_SHDICT_TNUMBER,
+                        NULL, 0, 123, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    rc = mps_shdict_lpush(dict, list_key, 4, MPS_SHDICT_TSTRING,
+                          (const u_char *)"bar", 3, 0, &err);
+    TEST_ASSERT_EQUAL_INT(3, rc);
+
+    for (steps = 0; rc != NGX_OK; steps++) {
+        rc = mps_shdict_migrate_step(dict, 10);
+        TEST_ASSERT_TRUE(rc == NGX_OK || rc == NGX_AGAIN);
+        TEST_ASSERT_TRUE(dict->pool == source || rc == NGX_OK);
+    }
+    TEST_ASSERT_TRUE(steps >= 4);
+
+    /* the dict has switched to the target */
+    TEST_ASSERT_TRUE(dict->pool != source);
+    TEST_ASSERT_TRUE(dict->pool == dict->target);
+    TEST_ASSERT_EQUAL_UINT32(3, mps_shdict_tree(dict->pool)->nshards);
+    TEST_ASSERT_EQUAL_size_t(4096 * 32, mps_shdict_capacity(dict));
+
+    rc = mps_shdict_migrate_step(dict, 10);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < MIGRATE_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        value_type = -1;
+        rc = mps_shdict_get(dict, (u_char *)key_buf, key_len, &value_type,
+                            &value, &value_len, &num_value, &user_flags, 0,
+                            &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+        if (i == 1) {
+            TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+            continue;
+        }
+
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i % 5 ? i : i * 10, num_value);
+    }
+
+    key_len = sprintf(key_buf, "new");
+    rc = mps_shdict_get(dict, (u_char *)key_buf, key_len, &value_type, &value,
+                        &value_len, &num_value, &user_flags, 0, &is_stale,
+                        &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_DOUBLE(123, num_value);
+
+    rc = mps_shdict_llen(dict, list_key, 4, &err);
+    TEST_ASSERT_EQUAL_INT(3, rc);
+
+    value = NULL;
+    value_len = 0;
+    rc = mps_shdict_lpop(dict, list_key, 4, &value_type, &value, &value_len,
+                         &num_value, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+    TEST_ASSERT_EQUAL_MEMORY("bar", value, 3);
+    free(value);
+
+    value = NULL;
+    value_len = 0;
+    rc = mps_shdict_lpop(dict, list_key, 4, &value_type, &value, &value_len,
+                         &num_value, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+    TEST_ASSERT_EQUAL_MEMORY("foo", value, 3);
+    free(value);
+
+    mps_shdict_close(dict);
+    delete_shdict_file(MIGRATE_TARGET_PATHNAME);
+}
+
+/* The hash index of every shard is copied slot by slot. */
+void test_migrate_sharded_hash_index(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_HASH_INDEX, 2, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_opts_t opts;
+    char key_buf[16];
+    size_t key_len;
+    int i, rc, forcible;
+    char *err = NULL;
+
+    for (i = 0; i < MIGRATE_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.min_shift = MPS_SLAB_DEFAULT_MIN_SHIFT;
+    opts.flags = MPS_SHDICT_FLAG_HASH_INDEX;
+    rc = mps_shdict_migrate_start(dict, MIGRATE_TARGET_PATHNAME, 4096 * 16,
+                                  S_IRUSR | S_IWUSR, &opts);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    /* keys are changed behind and ahead of the cursor */
+    for (i = 0;; i++) {
+        rc = mps_shdict_migrate_step(dict, 5);
+        TEST_ASSERT_TRUE(rc == NGX_OK || rc == NGX_AGAIN);
+
+        if (rc == NGX_OK) {
+            break;
+        }
+
+        if (i * 5 < MIGRATE_TEST_KEYS) {
+            key_len = sprintf(key_buf, "key%d", i * 5);
+            rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, i * 50, 0, 0,
+                                &err, &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+    }
+
+    TEST_ASSERT_TRUE(dict->pool == dict->target);
+    TEST_ASSERT_NOT_EQUAL(mps_nulloff, mps_shdict_tree(dict->pool)->index);
+
+    for (i = 0; i < MIGRATE_TEST_KEYS; i++) {
+        sprintf(key_buf, "key%d", i);
+        TEST_ASSERT_TRUE(has_number(dict, key_buf, i % 5 ? i : i * 10));
+    }
+
+    mps_shdict_close(dict);
+    delete_shdict_file(MIGRATE_TARGET_PATHNAME);
+}
+
+static ngx_uint_t lock_hist_sum(const ngx_uint_t *hist)
+{
+    ngx_uint_t i, sum;
+
+    sum = 0;
+    for (i = 0; i < MPS_SLAB_LOCK_HIST_SIZE; i++) {
+        sum += hist[i];
+    }
+
+    return sum;
+}
+
+void test_lock_stats(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 32, MPS_SHDICT_FLAG_LOCK_STATS, 2, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_slab_lock_stat_t stats;
+    int rc = mps_shdict_lock_stats(dict, &stats);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    ngx_uint_t acquires = stats.acquires;
+
+    char key_buf[16];
+    size_t key_len;
+    int i, forcible;
+    char *err = NULL;
+
+    for (i = 0; i < 10; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    rc = mps_shdict_lock_stats(dict, &stats);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_TRUE(stats.acquires >= acquires + 10);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.contended);
+    TEST_ASSERT_EQUAL_UINT64(stats.acquires, lock_hist_sum(stats.wait_hist));
+    TEST_ASSERT_EQUAL_UINT64(stats.acquires, lock_hist_sum(stats.hold_hist));
+    TEST_ASSERT_TRUE(stats.hold_max <= stats.hold_total);
+    TEST_ASSERT_TRUE(stats.wait_max <= stats.wait_total);
+
+    mps_shdict_close(dict);
+}
+
+void test_lock_stats_disabled(void)
+{
+    mps_shdict_t *dict = open_shdict();
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_slab_lock_stat_t stats;
+    int rc = mps_shdict_lock_stats(dict, &stats);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+    TEST_ASSERT_EQUAL_UINT64(0, stats.acquires);
+    TEST_ASSERT_EQUAL_UINT64(0, dict->pool->lock_stat.acquires);
+
+    mps_shdict_close(dict);
+}
+
+#define INCR_TEST_THREADS 4
+#define INCR_TEST_INCRS 2000
+
+static void *incr_counter_start(void *arg)
+{
+    mps_shdict_t *dict = arg;
+    double value;
+    char *err = NULL;
+    int i, rc, forcible;
+
+    for (i = 0; i < INCR_TEST_INCRS; i++) {
+        value = 1;
+        rc = mps_shdict_incr(dict, (const u_char *)"counter", 7, &value, &err,
+                             1, 0, 0, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    return NULL;
+}
+
+static void incr_counter_threads(mps_shdict_t *dict)
+{
+    pthread_t threads[INCR_TEST_THREADS];
+    int i, err;
+
+    for (i = 0; i < INCR_TEST_THREADS; i++) {
+        err = pthread_create(&threads[i], NULL, incr_counter_start, dict);
+        TEST_ASSERT_EQUAL_INT(0, err);
+    }
+
+    for (i = 0; i < INCR_TEST_THREADS; i++) {
+        err = pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, err);
+    }
+
+    double value = 0;
+    char *errmsg = NULL;
+    int forcible;
+    int rc = mps_shdict_incr(dict, (const u_char *)"counter", 7, &value,
+                             &errmsg, 0, 0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_DOUBLE(INCR_TEST_THREADS * INCR_TEST_INCRS, value);
+}
+
+void test_futex_lock(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(
+        4096 * 8, MPS_SHDICT_FLAG_FUTEX_LOCK | MPS_SHDICT_FLAG_LOCK_STATS, 1,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+    TEST_ASSERT_TRUE(dict->pool->spin_lock);
+
+    incr_counter_threads(dict);
+
+    TEST_ASSERT_EQUAL_INT(0, pthread_mutex_trylock(&dict->pool->mutex));
+    pthread_mutex_unlock(&dict->pool->mutex);
+
+    mps_slab_lock_stat_t stats;
+    int rc = mps_shdict_lock_stats(dict, &stats);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_TRUE(stats.acquires >= INCR_TEST_THREADS * INCR_TEST_INCRS);
+
+    mps_shdict_close(dict);
+}
+
+void test_futex_lock_owner_died(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 8, MPS_SHDICT_FLAG_FUTEX_LOCK,
+                                          1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    /* a process which exits while holding the lock */
+    pid_t pid = fork();
+    TEST_ASSERT_TRUE(pid != -1);
+    if (pid == 0) {
+        mps_slab_lock(dict->pool);
+        _exit(0);
+    }
+    TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, NULL, 0));
+
+    int i, rc, forcible;
+    char *err = NULL;
+
+    /* the lock is still usable after it is taken over once */
+    for (i = 0; i < 2; i++) {
+        rc = mps_shdict_set(dict, (const u_char *)"key1", 4,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_TRUE(has_number(dict, "key1", i));
+    }
+
+    TEST_ASSERT_EQUAL_UINT(0, dict->pool->seq & 1);
+
+    mps_shdict_close(dict);
+}
+
+void test_atomic_incr(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(
+        4096 * 8, MPS_SHDICT_FLAG_ATOMIC_INCR | MPS_SHDICT_FLAG_LOCK_STATS, 1,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    double value = 0;
+    char *err = NULL;
+    int rc, forcible;
+
+    /* the first incr inserts the key with the lock */
+    rc = mps_shdict_incr(dict, (const u_char *)"counter", 7, &value, &err, 1,
+                         0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    mps_slab_lock_stat_t stats;
+    rc = mps_shdict_lock_stats(dict, &stats);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    ngx_uint_t acquires = stats.acquires;
+
+    incr_counter_threads(dict);
+
+    /* the counter is found and updated without the lock */
+    rc = mps_shdict_lock_stats(dict, &stats);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_UINT64(acquires, stats.acquires);
+    TEST_ASSERT_EQUAL_UINT64(0, dict->pool->updaters);
+
+    /* not a number */
+    rc = mps_shdict_set(dict, (const u_char *)"str", 3, MPS_SHDICT_TSTRING,
+                        (const u_char *)"foo", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    value = 1;
+    rc = mps_shdict_incr(dict, (const u_char *)"str", 3, &value, &err, 0, 0, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_ERROR, rc);
+    TEST_ASSERT_EQUAL_STRING("not a number", err);
+
+    /* an expired number is initialized with the lock */
+    rc = mps_shdict_set(dict, (const u_char *)"num", 3, MPS_SHDICT_TNUMBER,
+                        NULL, 0, 10, 1, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    sleep_till_next_ms();
+    sleep_till_next_ms();
+    value = 1;
+    rc = mps_shdict_incr(dict, (const u_char *)"num", 3, &value, &err, 1, 5, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_DOUBLE(6, value);
+
+    mps_shdict_close(dict);
+}
+
+static int64_t get_int64(mps_shdict_t *dict, const char *key)
+{
+    u_char buf[sizeof(int64_t)], *value = buf;
+    size_t value_len = sizeof(buf);
+    int value_type, user_flags, is_stale;
+    double num_value;
+    char *err = NULL;
+    int64_t i64;
+
+    int rc = mps_shdict_get(dict, (const u_char *)key, strlen(key),
+                            &value_type, &value, &value_len, &num_value,
+                            &user_flags, 0, &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TINT64, value_type);
+    TEST_ASSERT_EQUAL_size_t(sizeof(int64_t), value_len);
+    memcpy(&i64, value, sizeof(int64_t));
+    return i64;
+}
+
+void test_int64(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 8, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    int64_t i64 = ((int64_t)1 << 53) + 1;
+    char *err = NULL;
+    int rc, forcible;
+
+    rc = mps_shdict_set(dict, (const u_char *)"int", 3, MPS_SHDICT_TINT64,
+                        (const u_char *)&i64, sizeof(i64), 0, 0, 0, &err,
+                        &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT64(((int64_t)1 << 53) + 1, get_int64(dict, "int"));
+
+    rc = mps_shdict_set(dict, (const u_char *)"bad", 3, MPS_SHDICT_TINT64,
+                        (const u_char *)&i64, 4, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_ERROR, rc);
+    TEST_ASSERT_EQUAL_STRING("bad int64 value size", err);
+
+    /* exact beyond 2^53 */
+    i64 = 1;
+    rc = mps_shdict_incr_int64(dict, (const u_char *)"int", 3, &i64, &err, 0,
+                               0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT64(((int64_t)1 << 53) + 2, i64);
+    TEST_ASSERT_EQUAL_INT64(((int64_t)1 << 53) + 2, get_int64(dict, "int"));
+
+    /* an integral double increment keeps the value an int64 */
+    double num = -2;
+    rc = mps_shdict_incr(dict, (const u_char *)"int", 3, &num, &err, 0, 0, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_DOUBLE((double)((int64_t)1 << 53), num);
+    TEST_ASSERT_EQUAL_INT64((int64_t)1 << 53, get_int64(dict, "int"));
+
+    num = 0.5;
+    rc = mps_shdict_incr(dict, (const u_char *)"int", 3, &num, &err, 0, 0, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_ERROR, rc);
+    TEST_ASSERT_EQUAL_STRING("not an integer", err);
+
+    /* wraps around on overflow */
+    i64 = INT64_MAX;
+    rc = mps_shdict_incr_int64(dict, (const u_char *)"max", 3, &i64, &err, 1,
+                               0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT64(INT64_MAX, get_int64(dict, "max"));
+    i64 = 1;
+    rc = mps_shdict_incr_int64(dict, (const u_char *)"max", 3, &i64, &err, 0,
+                               0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT64(INT64_MIN, i64);
+
+    /* a double value is not incremented by an int64 */
+    rc = mps_shdict_set(dict, (const u_char *)"num", 3, MPS_SHDICT_TNUMBER,
+                        NULL, 0, 1.5, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    i64 = 1;
+    rc = mps_shdict_incr_int64(dict, (const u_char *)"num", 3, &i64, &err, 0,
+                               0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_ERROR, rc);
+    TEST_ASSERT_EQUAL_STRING("not an integer", err);
+
+    mps_shdict_close(dict);
+}
+
+/* An int64 is incremented in place, and read without the lock. */
+void test_int64_lockfree(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(
+        4096 * 8, MPS_SHDICT_FLAG_LOCKFREE_GET | MPS_SHDICT_FLAG_ATOMIC_INCR, 1,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    int64_t i64 = ((int64_t)1 << 53) + 1;
+    char *err = NULL;
+    int rc, forcible;
+
+    rc = mps_shdict_set(dict, (const u_char *)"int", 3, MPS_SHDICT_TINT64,
+                        (const u_char *)&i64, sizeof(i64), 0, 0, 0, &err,
+                        &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    i64 = 1;
+    rc = mps_shdict_incr_int64(dict, (const u_char *)"int", 3, &i64, &err, 0,
+                               0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT64(((int64_t)1 << 53) + 2, i64);
+    TEST_ASSERT_EQUAL_INT64(((int64_t)1 << 53) + 2, get_int64(dict, "int"));
+
+    /* wraps around on overflow */
+    i64 = INT64_MAX;
+    rc = mps_shdict_incr_int64(dict, (const u_char *)"int", 3, &i64, &err, 0,
+                               0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT64(((int64_t)1 << 53) + 1 + INT64_MIN, i64);
+    TEST_ASSERT_EQUAL_INT64(i64, get_int64(dict, "int"));
+
+    mps_shdict_close(dict);
+}
+
+void test_mget(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 8, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char *err = NULL;
+    int rc, forcible;
+    int64_t i64 = -7;
+
+    rc = mps_shdict_set(dict, (const u_char *)"str", 3, MPS_SHDICT_TSTRING,
+                        (const u_char *)"hello", 5, 0, 0, 3, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    rc = mps_shdict_set(dict, (const u_char *)"num", 3, MPS_SHDICT_TNUMBER,
+                        NULL, 0, 1.5, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    rc = mps_shdict_set(dict, (const u_char *)"bool", 4, MPS_SHDICT_TBOOLEAN,
+                        NULL, 0, 1, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    rc = mps_shdict_set(dict, (const u_char *)"int", 3, MPS_SHDICT_TINT64,
+                        (const u_char *)&i64, sizeof(i64), 0, 0, 0, &err,
+                        &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    rc = mps_shdict_set(dict, (const u_char *)"exp", 3, MPS_SHDICT_TNUMBER,
+                        NULL, 0, 2, 1, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    sleep_till_next_ms();
+    sleep_till_next_ms();
+
+    const u_char *keys[] = {
+        (const u_char *)"str", (const u_char *)"num", (const u_char *)"none",
+        (const u_char *)"bool", (const u_char *)"int", (const u_char *)"exp",
+    };
+    size_t key_lens[] = {3, 3, 4, 4, 3, 3};
+    mps_shdict_mget_result_t res[6];
+    u_char arena[16];
+
+    rc = mps_shdict_mget(dict, keys, key_lens, 6, res, arena, sizeof(arena));
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, res[0].value_type);
+    TEST_ASSERT_EQUAL_INT(3, res[0].user_flags);
+    TEST_ASSERT_EQUAL_size_t(5, res[0].str_value_len);
+    TEST_ASSERT_EQUAL_MEMORY("hello", res[0].str_value, 5);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, res[1].value_type);
+    TEST_ASSERT_EQUAL_DOUBLE(1.5, res[1].num_value);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, res[2].value_type);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TBOOLEAN, res[3].value_type);
+    TEST_ASSERT_EQUAL_DOUBLE(1, res[3].num_value);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TINT64, res[4].value_type);
+    TEST_ASSERT_EQUAL_size_t(sizeof(int64_t), res[4].str_value_len);
+    memcpy(&i64, res[4].str_value, sizeof(int64_t));
+    TEST_ASSERT_EQUAL_INT64(-7, i64);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, res[5].value_type);
+
+    /* the string does not fit after the int64 */
+    keys[0] = (const u_char *)"int";
+    keys[1] = (const u_char *)"str";
+    rc = mps_shdict_mget(dict, keys, key_lens, 2, res, arena, 10);
+    TEST_ASSERT_EQUAL_INT(NGX_AGAIN, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TINT64, res[0].value_type);
+    TEST_ASSERT_NOT_NULL(res[0].str_value);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, res[1].value_type);
+    TEST_ASSERT_NULL(res[1].str_value);
+    TEST_ASSERT_EQUAL_size_t(5, res[1].str_value_len);
+
+    mps_shdict_close(dict);
+}
+
+#define MGET_TEST_KEYS 50
+
+void test_mget_many(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 32, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key_bufs[MGET_TEST_KEYS][16];
+    const u_char *keys[MGET_TEST_KEYS];
+    size_t key_lens[MGET_TEST_KEYS];
+    mps_shdict_mget_result_t res[MGET_TEST_KEYS];
+    char *err = NULL;
+    int i, rc, forcible;
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        key_lens[i] = sprintf(key_bufs[i], "key%d", i);
+        keys[i] = (const u_char *)key_bufs[i];
+
+        /* every third key is missing */
+        if (i % 3 == 0) {
+            continue;
+        }
+
+        rc = mps_shdict_set(dict, keys[i], key_lens[i], MPS_SHDICT_TNUMBER,
+                            NULL, 0, i, 0, 0, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    rc = mps_shdict_mget(dict, keys, key_lens, MGET_TEST_KEYS, res, NULL, 0);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        if (i % 3 == 0) {
+            TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, res[i].value_type);
+            continue;
+        }
+
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, res[i].value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i, res[i].num_value);
+    }
+
+    mps_shdict_close(dict);
+}
+
+/* The keys are looked up shard by shard, but results keep their order. */
+void test_mget_sharded_hash_index(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 32, MPS_SHDICT_FLAG_HASH_INDEX, 3, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key_bufs[MGET_TEST_KEYS][16];
+    const u_char *keys[MGET_TEST_KEYS];
+    size_t key_lens[MGET_TEST_KEYS];
+    mps_shdict_mget_result_t res[MGET_TEST_KEYS];
+    char *err = NULL;
+    int i, rc, forcible;
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        key_lens[i] = sprintf(key_bufs[i], "key%d", MGET_TEST_KEYS - i);
+        keys[i] = (const u_char *)key_bufs[i];
+
+        if (i % 2) {
+            rc = mps_shdict_set(dict, keys[i], key_lens[i],
+                                MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                                &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+    }
+
+    rc = mps_shdict_mget(dict, keys, key_lens, MGET_TEST_KEYS, res, NULL, 0);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        if (i % 2 == 0) {
+            TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, res[i].value_type);
+            continue;
+        }
+
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, res[i].value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i, res[i].num_value);
+    }
+
+    mps_shdict_close(dict);
+}
+
+void test_mset(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 32, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key_bufs[MGET_TEST_KEYS][16];
+    const u_char *keys[MGET_TEST_KEYS];
+    size_t key_lens[MGET_TEST_KEYS];
+    mps_shdict_mset_item_t items[MGET_TEST_KEYS];
+    mps_shdict_mget_result_t res[MGET_TEST_KEYS];
+    int i, rc;
+
+    memset(items, 0, sizeof(items));
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        key_lens[i] = sprintf(key_bufs[i], "key%d", i);
+        keys[i] = (const u_char *)key_bufs[i];
+        items[i].key = keys[i];
+        items[i].key_len = key_lens[i];
+        items[i].value_type = MPS_SHDICT_TNUMBER;
+        items[i].num_value = i;
+        items[i].user_flags = i;
+    }
+
+    /* an int64 value with a bad size fails alone */
+    items[7].value_type = MPS_SHDICT_TINT64;
+    items[7].str_value_buf = (const u_char *)"abc";
+    items[7].str_value_len = 3;
+
+    rc = mps_shdict_mset(dict, items, MGET_TEST_KEYS);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        if (i == 7) {
+            TEST_ASSERT_EQUAL_INT(NGX_ERROR, items[i].rc);
+            TEST_ASSERT_EQUAL_STRING("bad int64 value size", items[i].err);
+            continue;
+        }
+
+        TEST_ASSERT_EQUAL_INT(NGX_OK, items[i].rc);
+        TEST_ASSERT_EQUAL_INT(0, items[i].forcible);
+    }
+
+    rc = mps_shdict_mget(dict, keys, key_lens, MGET_TEST_KEYS, res, NULL, 0);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        if (i == 7) {
+            TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, res[i].value_type);
+            continue;
+        }
+
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, res[i].value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i, res[i].num_value);
+        TEST_ASSERT_EQUAL_INT(i, res[i].user_flags);
+    }
+
+    /* delete the even keys */
+    for (i = 0; i < MGET_TEST_KEYS / 2; i++) {
+        items[i].key = keys[i * 2];
+        items[i].key_len = key_lens[i * 2];
+    }
+
+    rc = mps_shdict_mdelete(dict, items, MGET_TEST_KEYS / 2);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    rc = mps_shdict_mget(dict, keys, key_lens, MGET_TEST_KEYS, res, NULL, 0);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        if (i % 2 == 0 || i == 7) {
+            TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, res[i].value_type);
+            continue;
+        }
+
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, res[i].value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i, res[i].num_value);
+    }
+
+    mps_shdict_close(dict);
+}
+
+void test_mset_sharded(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 32, MPS_SHDICT_FLAG_HASH_INDEX, 3, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key_bufs[MGET_TEST_KEYS][16];
+    mps_shdict_mset_item_t items[MGET_TEST_KEYS];
+    int i, rc;
+
+    memset(items, 0, sizeof(items));
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        items[i].key = (const u_char *)key_bufs[i];
+        items[i].key_len = sprintf(key_bufs[i], "key%d", i);
+        items[i].value_type = MPS_SHDICT_TNUMBER;
+        items[i].num_value = i;
+    }
+
+    rc = mps_shdict_mset(dict, items, MGET_TEST_KEYS);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        TEST_ASSERT_EQUAL_INT(NGX_OK, items[i].rc);
+        TEST_ASSERT_TRUE(has_number(dict, key_bufs[i], i));
+    }
+
+    /* delete the first half, which spreads over all the shards */
+    rc = mps_shdict_mdelete(dict, items, MGET_TEST_KEYS / 2);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    for (i = 0; i < MGET_TEST_KEYS; i++) {
+        TEST_ASSERT_EQUAL_INT(i >= MGET_TEST_KEYS / 2,
+                              has_number(dict, key_bufs[i], i));
+    }
+
+    mps_shdict_close(dict);
+}
+
+#define SCAN_TEST_KEYS 300
+
+void test_scan(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 64, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_scan_cursor_t cursor;
+    mps_shdict_scan_key_t keys[7];
+    int seen[SCAN_TEST_KEYS * 2];
+    char key[16];
+    u_char arena[64];
+    char *err = NULL;
+    ngx_uint_t i, n, calls;
+    int j, rc, scan_rc, forcible;
+    size_t key_len;
+
+    for (j = 0; j < SCAN_TEST_KEYS; j++) {
+        key_len = sprintf(key, "key%d", j);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, j,
+                            j % 10 == 9 ? 1 : 0, 0, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+    sleep_till_next_ms();
+    sleep_till_next_ms();
+
+    memset(&cursor, 0, sizeof(cursor));
+    memset(seen, 0, sizeof(seen));
+    calls = 0;
+
+    do {
+        scan_rc = mps_shdict_scan(dict, &cursor, keys, 7, &n, arena,
+                                  sizeof(arena));
+        TEST_ASSERT_TRUE(scan_rc == NGX_OK || scan_rc == NGX_AGAIN);
+        TEST_ASSERT_TRUE(n <= 7);
+
+        for (i = 0; i < n; i++) {
+            TEST_ASSERT_TRUE(keys[i].key_len > 3 && keys[i].key_len < 16);
+            memcpy(key, keys[i].key, keys[i].key_len);
+            key[keys[i].key_len] = '\0';
+            seen[atoi(key + 3)]++;
+        }
+
+        /* keys added and deleted during the scan do not break it */
+        if (calls < SCAN_TEST_KEYS) {
+            key_len = sprintf(key, "key%lu", SCAN_TEST_KEYS + calls);
+            rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, 1, 0, 0, &err,
+                                &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+        if (calls % 2 == 0 && calls * 10 + 5 < SCAN_TEST_KEYS) {
+            key_len = sprintf(key, "key%lu", calls * 10 + 5);
+            rc = mps_shdict_delete(dict, (const u_char *)key, key_len);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+
+        calls++;
+        TEST_ASSERT_TRUE(calls < SCAN_TEST_KEYS * 2);
+    } while (scan_rc == NGX_AGAIN);
+
+    for (j = 0; j < SCAN_TEST_KEYS; j++) {
+        if (j % 10 == 9) {
+            /* expired */
+            TEST_ASSERT_EQUAL_INT(0, seen[j]);
+
+        } else if (j % 20 != 5) {
+            TEST_ASSERT_EQUAL_INT(1, seen[j]);
+        }
+    }
+
+    /* the arena is too small for a key */
+    memset(&cursor, 0, sizeof(cursor));
+    rc = mps_shdict_scan(dict, &cursor, keys, 7, &n, arena, 3);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+    TEST_ASSERT_EQUAL_UINT(0, n);
+
+    mps_shdict_close(dict);
+}
+
+/*
+ * A shard is scanned again from the start when its hash index is rebuilt, so
+ * keys may be returned twice, but none is missed.
+ */
+void test_scan_hash_index(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_HASH_INDEX, 2, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_scan_cursor_t cursor;
+    mps_shdict_scan_key_t keys[7];
+    int seen[SCAN_TEST_KEYS * 2];
+    char key[16];
+    u_char arena[64];
+    char *err = NULL;
+    ngx_uint_t i, n, calls;
+    int j, rc, scan_rc, forcible;
+    size_t key_len;
+
+    for (j = 0; j < SCAN_TEST_KEYS; j++) {
+        key_len = sprintf(key, "key%d", j);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, j, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    memset(&cursor, 0, sizeof(cursor));
+    memset(seen, 0, sizeof(seen));
+    calls = 0;
+
+    do {
+        scan_rc = mps_shdict_scan(dict, &cursor, keys, 7, &n, arena,
+                                  sizeof(arena));
+        TEST_ASSERT_TRUE(scan_rc == NGX_OK || scan_rc == NGX_AGAIN);
+
+        for (i = 0; i < n; i++) {
+            memcpy(key, keys[i].key, keys[i].key_len);
+            key[keys[i].key_len] = '\0';
+            seen[atoi(key + 3)]++;
+        }
+
+        /* the index grows while it is scanned */
+        if (calls < SCAN_TEST_KEYS) {
+            key_len = sprintf(key, "key%lu", SCAN_TEST_KEYS + calls);
+            rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, 1, 0, 0, &err,
+                                &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+
+        calls++;
+        TEST_ASSERT_TRUE(calls < SCAN_TEST_KEYS * 4);
+    } while (scan_rc == NGX_AGAIN);
+
+    for (j = 0; j < SCAN_TEST_KEYS; j++) {
+        TEST_ASSERT_TRUE(seen[j] >= 1);
+    }
+
+    mps_shdict_close(dict);
+}
+
+static ngx_uint_t count_entries(mps_shdict_t *dict)
+{
+    mps_slab_pool_t *pool = dict->pool;
+    mps_shdict_tree_t *tree = mps_shdict_tree(pool);
+    mps_queue_t *q;
+    ngx_uint_t n = 0;
+
+    for (q = mps_queue_head(pool, &tree->lru_queue);
+         q != mps_queue_sentinel(pool, &tree->lru_queue);
+         q = mps_queue_next(pool, q)) {
+        n++;
+    }
+
+    return n;
+}
+
+static ngx_uint_t set_short_ttl_behind_hot_keys(mps_shdict_t *dict)
+{
+    char key[16];
+    char *err = NULL;
+    double value;
+    int i, rc, forcible;
+    size_t key_len;
+
+    /* long lived keys at the LRU tail */
+    for (i = 0; i < 10; i++) {
+        key_len = sprintf(key, "hot%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TSTRING, (const u_char *)"v", 1, 0, 0,
+                            0, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    for (i = 0; i < 20; i++) {
+        key_len = sprintf(key, "short%d", i);
+        if (i % 4 == 0) {
+            value = 1;
+            rc = mps_shdict_incr(dict, (const u_char *)key, key_len, &value,
+                                 &err, 1, 0, 1, &forcible);
+        } else if (i % 4 == 1) {
+            rc = mps_shdict_rpush(dict, (const u_char *)key, key_len,
+                                  MPS_SHDICT_TSTRING, (const u_char *)"l", 1,
+                                  0, &err);
+            TEST_ASSERT_EQUAL_INT(1, rc);
+            rc = mps_shdict_set_expire(dict, (const u_char *)key, key_len, 1);
+        } else {
+            rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                                MPS_SHDICT_TSTRING, (const u_char *)"v", 1, 0,
+                                1, 0, &err, &forcible);
+        }
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    /* a ttl removed before it passes */
+    rc = mps_shdict_set(dict, (const u_char *)"kept", 4, MPS_SHDICT_TSTRING,
+                        (const u_char *)"v", 1, 0, 1, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    rc = mps_shdict_set_expire(dict, (const u_char *)"kept", 4, 0);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    sleep_till_next_ms();
+    sleep_till_next_ms();
+
+    /* the hot keys are used again and the expired ones stay behind them */
+    for (i = 0; i < 10; i++) {
+        key_len = sprintf(key, "hot%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TSTRING, (const u_char *)"w", 1, 0, 0,
+                            0, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    return count_entries(dict);
+}
+
+void test_expiry_index(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16,
+                                          MPS_SHDICT_FLAG_EXPIRY_INDEX, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_tree_t *tree = mps_shdict_tree(dict->pool);
+    mps_shdict_expiry_t *expiry =
+        (mps_shdict_expiry_t *)mps_ptr(dict->pool, tree->expiry);
+
+    /* each store frees two expired entries in the order of deadlines */
+    TEST_ASSERT_EQUAL_UINT(11, set_short_ttl_behind_hot_keys(dict));
+    TEST_ASSERT_EQUAL(expiry->rbtree.sentinel, expiry->rbtree.root);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_flush_all(dict));
+    TEST_ASSERT_NOT_EQUAL(expiry->rbtree.sentinel, expiry->rbtree.root);
+
+    mps_shdict_close(dict);
+}
+
+void test_expiry_index_disabled(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    TEST_ASSERT_EQUAL(mps_nulloff, mps_shdict_tree(dict->pool)->expiry);
+
+    /* only expired entries at the LRU tail are freed */
+    TEST_ASSERT_EQUAL_UINT(31, set_short_ttl_behind_hot_keys(dict));
+
+    mps_shdict_close(dict);
+}
+
+void test_expiry_wheel(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16,
+                                          MPS_SHDICT_FLAG_EXPIRY_WHEEL, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    TEST_ASSERT_EQUAL_UINT(11, set_short_ttl_behind_hot_keys(dict));
+
+    mps_shdict_close(dict);
+}
+
+void test_expiry_wheel_cascade(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16,
+                                          MPS_SHDICT_FLAG_EXPIRY_WHEEL, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_tree_t *tree = mps_shdict_tree(dict->pool);
+    mps_shdict_wheel_t *wheel =
+        (mps_shdict_wheel_t *)mps_ptr(dict->pool, tree->expiry);
+    char key[16];
+    char *err = NULL;
+    uint64_t now = wheel->now;
+    int i, rc, forcible;
+    size_t key_len;
+
+    for (i = 0; i < 20; i++) {
+        key_len = sprintf(key, "key%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TSTRING, (const u_char *)"v", 1, 0, 0,
+                            0, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    /*
+     * Move the wheel back in time, so that timers are placed at upper levels
+     * and in the overflow queue, and moved down while catching up.
+     * mps_shdict_set_expire does not advance the wheel.
+     */
+    wheel->now -= ((uint64_t)1 << 24) + 12345;
+
+    for (i = 0; i < 20; i++) {
+        key_len = sprintf(key, "key%d", i);
+        rc = mps_shdict_set_expire(dict, (const u_char *)key, key_len,
+                                   i % 2 ? 3600 * 1000 : 1 + i);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+    TEST_ASSERT_FALSE(mps_queue_empty(dict->pool, &wheel->overflow));
+
+    for (i = 0; i < 25; i++) {
+        sleep_till_next_ms();
+    }
+
+    for (i = 0; i < 10; i++) {
+        rc = mps_shdict_set(dict, (const u_char *)"x", 1, MPS_SHDICT_TSTRING,
+                            (const u_char *)"v", 1, 0, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    /* the entries of an hour and x are left */
+    TEST_ASSERT_EQUAL_UINT(11, count_entries(dict));
+    TEST_ASSERT_TRUE(mps_queue_empty(dict->pool, &wheel->overflow));
+    TEST_ASSERT_TRUE(wheel->now > now);
+
+    mps_shdict_close(dict);
+}
+
+/* Returns the count of unexpired keys found by mps_shdict_scan. */
+static ngx_uint_t scan_count(mps_shdict_t *dict)
+{
+    mps_shdict_scan_cursor_t cursor;
+    mps_shdict_scan_key_t keys[16];
+    u_char arena[256];
+    ngx_uint_t n, total;
+    int rc;
+
+    memset(&cursor, 0, sizeof(cursor));
+    total = 0;
+
+    do {
+        rc = mps_shdict_scan(dict, &cursor, keys, 16, &n, arena,
+                             sizeof(arena));
+        TEST_ASSERT_TRUE(rc == NGX_OK || rc == NGX_AGAIN);
+        total += n;
+    } while (rc == NGX_AGAIN);
+
+    return total;
+}
+
+#define FLUSH_TEST_KEYS 200
+
+/* Sets keys whose even ones are expired, and returns the count of them. */
+static ngx_uint_t set_half_expired(mps_shdict_t *dict)
+{
+    char key[16];
+    char *err = NULL;
+    int i, rc, forcible;
+    size_t key_len;
+
+    for (i = 0; i < FLUSH_TEST_KEYS; i++) {
+        key_len = sprintf(key, "key%d", i);
+
+        if (i % 10 == 0) {
+            rc = mps_shdict_rpush(dict, (const u_char *)key, key_len,
+                                  MPS_SHDICT_TSTRING, (const u_char *)"l", 1,
+                                  0, &err);
+            TEST_ASSERT_EQUAL_INT(1, rc);
+
+        } else {
+            rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                                &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+    }
+
+    /* mps_shdict_set_expire does not free expired entries */
+    for (i = 0; i < FLUSH_TEST_KEYS; i += 2) {
+        key_len = sprintf(key, "key%d", i);
+        rc = mps_shdict_set_expire(dict, (const u_char *)key, key_len, 1);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    sleep_till_next_ms();
+    sleep_till_next_ms();
+
+    return FLUSH_TEST_KEYS / 2;
+}
+
+void test_flush_expired(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 64, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_scan_cursor_t cursor;
+    ngx_uint_t expired, freed, total, slices;
+    int rc;
+
+    expired = set_half_expired(dict);
+
+    TEST_ASSERT_EQUAL_INT(10, mps_shdict_flush_expired(dict, 10));
+    TEST_ASSERT_EQUAL_INT(expired - 10, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_INT(0, mps_shdict_flush_expired(dict, 0));
+
+    /* sweep in slices */
+    mps_shdict_flush_all(dict);
+    mps_shdict_flush_expired(dict, 0);
+    expired = set_half_expired(dict);
+
+    memset(&cursor, 0, sizeof(cursor));
+    total = 0;
+    slices = 0;
+
+    do {
+        rc = mps_shdict_sweep(dict, &cursor, 4, &freed);
+        TEST_ASSERT_TRUE(freed <= 4);
+        total += freed;
+        slices++;
+        TEST_ASSERT_TRUE(slices < FLUSH_TEST_KEYS * 2);
+    } while (rc == NGX_AGAIN);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_UINT(expired, total);
+    TEST_ASSERT_EQUAL_UINT(0, cursor.shard);
+    TEST_ASSERT_EQUAL_INT(0, mps_shdict_flush_expired(dict, 0));
+
+    mps_shdict_close(dict);
+}
+
+/* The slices of a sweep go through the hash index of each shard. */
+void test_flush_expired_sharded_hash_index(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_HASH_INDEX, 3, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_scan_cursor_t cursor;
+    ngx_uint_t expired, freed, total, shards;
+    int rc;
+
+    expired = set_half_expired(dict);
+
+    memset(&cursor, 0, sizeof(cursor));
+    total = 0;
+    shards = 1;
+
+    do {
+        rc = mps_shdict_sweep(dict, &cursor, 4, &freed);
+        total += freed;
+
+        if (rc == NGX_AGAIN && cursor.next == 0) {
+            shards++;
+        }
+    } while (rc == NGX_AGAIN);
+
+    TEST_ASSERT_EQUAL_UINT(3, shards);
+    TEST_ASSERT_EQUAL_UINT(expired, total);
+    TEST_ASSERT_EQUAL_INT(0, mps_shdict_flush_expired(dict, 0));
+
+    mps_shdict_close(dict);
+}
+
+void test_flush_expired_expiry_index(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_EXPIRY_INDEX, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    ngx_uint_t expired;
+
+    /* expired entries are taken from the front of the index */
+    expired = set_half_expired(dict);
+
+    TEST_ASSERT_EQUAL_INT(10, mps_shdict_flush_expired(dict, 10));
+    TEST_ASSERT_EQUAL_INT(expired - 10, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_INT(0, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_UINT(FLUSH_TEST_KEYS - expired, scan_count(dict));
+
+    mps_shdict_close(dict);
+}
+
+void test_flush_expired_expiry_wheel(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_EXPIRY_WHEEL, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    ngx_uint_t expired;
+
+    expired = set_half_expired(dict);
+
+    TEST_ASSERT_EQUAL_INT(10, mps_shdict_flush_expired(dict, 10));
+    TEST_ASSERT_EQUAL_INT(expired - 10, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_INT(0, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_UINT(FLUSH_TEST_KEYS - expired, scan_count(dict));
+
+    mps_shdict_close(dict);
+}
+
+void test_flush_gen(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_FLUSH_GEN, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key[16];
+    char *err = NULL;
+    u_char *str_value = NULL;
+    size_t key_len, str_value_len = 0;
+    int i, rc, forcible, value_type, user_flags, is_stale;
+    double num_value;
+
+    for (i = 0; i < 100; i++) {
+        key_len = sprintf(key, "key%d", i);
+
+        if (i % 10 == 0) {
+            rc = mps_shdict_rpush(dict, (const u_char *)key, key_len,
+                                  MPS_SHDICT_TNUMBER, NULL, 0, i, &err);
+            TEST_ASSERT_EQUAL_INT(1, rc);
+
+        } else {
+            rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, i,
+                                i % 3 ? 0 : 60000, 0, &err, &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+    }
+
+    TEST_ASSERT_EQUAL_INT(100, scan_count(dict));
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_flush_all(dict));
+
+    /* flushed entries are not found, but kept until they are freed */
+    TEST_ASSERT_EQUAL_INT(0, scan_count(dict));
+
+    value_type = -1;
+    rc = mps_shdict_get(dict, (const u_char *)"key1", 4, &value_type,
+                        &str_value, &str_value_len, &num_value, &user_flags, 0,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED,
+                          mps_shdict_get_ttl(dict, (const u_char *)"key3", 4));
+    rc = mps_shdict_set_expire(dict, (const u_char *)"key4", 4, 0);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+
+    /* stores in the new generation */
+    rc = mps_shdict_add(dict, (const u_char *)"key2", 4, MPS_SHDICT_TNUMBER,
+                        NULL, 0, 2, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    num_value = 1;
+    rc = mps_shdict_incr(dict, (const u_char *)"key5", 4, &num_value, &err, 1,
+                         10, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(11, (int)num_value);
+
+    rc = mps_shdict_lpush(dict, (const u_char *)"key10", 5, MPS_SHDICT_TNUMBER,
+                          NULL, 0, 1, &err);
+    TEST_ASSERT_EQUAL_INT(1, rc);
+
+    TEST_ASSERT_EQUAL_INT(3, scan_count(dict));
+
+    value_type = -1;
+    rc = mps_shdict_get(dict, (const u_char *)"key2", 4, &value_type,
+                        &str_value, &str_value_len, &num_value, &user_flags, 0,
+                        &is_stale, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+    TEST_ASSERT_EQUAL_INT(2, (int)num_value);
+
+    /* the rest of the old generation is freed like expired entries */
+    TEST_ASSERT_TRUE(mps_shdict_flush_expired(dict, 0) > 0);
+    TEST_ASSERT_EQUAL_INT(0, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_INT(3, scan_count(dict));
+
+    mps_shdict_close(dict);
+}
+
+/* Sets 100 keys, a third of them with a ttl. */
+static void set_flush_gen_keys(mps_shdict_t *dict)
+{
+    char key[16];
+    char *err = NULL;
+    size_t key_len;
+    int i, rc, forcible;
+
+    for (i = 0; i < 100; i++) {
+        key_len = sprintf(key, "key%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i,
+                            i % 3 ? 0 : 60000, 0, &err, &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+}
+
+/* Every shard gets a new generation, and is swept through its hash index. */
+void test_flush_gen_sharded(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 64,
+                                          MPS_SHDICT_FLAG_FLUSH_GEN |
+                                              MPS_SHDICT_FLAG_HASH_INDEX |
+                                              MPS_SHDICT_FLAG_EXPIRY_WHEEL, 3,
+                                          0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    set_flush_gen_keys(dict);
+    TEST_ASSERT_EQUAL_INT(100, scan_count(dict));
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_flush_all(dict));
+    TEST_ASSERT_EQUAL_INT(0, scan_count(dict));
+    TEST_ASSERT_FALSE(has_number(dict, "key1", 1));
+
+    /* flushed entries with a ttl are not at the front of the wheel */
+    TEST_ASSERT_EQUAL_INT(100, mps_shdict_flush_expired(dict, 0));
+
+    set_flush_gen_keys(dict);
+    TEST_ASSERT_EQUAL_INT(100, scan_count(dict));
+
+    mps_shdict_close(dict);
+}
+
+/* A lock-free get does not return entries of an old generation. */
+void test_flush_gen_lockfree(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64,
+                         MPS_SHDICT_FLAG_FLUSH_GEN |
+                             MPS_SHDICT_FLAG_LOCKFREE_GET |
+                             MPS_SHDICT_FLAG_EXPIRY_INDEX, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    set_flush_gen_keys(dict);
+    TEST_ASSERT_TRUE(has_number(dict, "key1", 1));
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_flush_all(dict));
+    TEST_ASSERT_FALSE(has_number(dict, "key1", 1));
+    TEST_ASSERT_FALSE(has_number(dict, "key3", 3));
+
+    TEST_ASSERT_EQUAL_INT(100, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_INT(0, mps_shdict_flush_expired(dict, 0));
+
+    mps_shdict_close(dict);
+}
+
+void test_evict_size_class(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 32, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    u_char value[300];
+    char key[16];
+    char *err = NULL;
+    u_char *str_value = NULL;
+    size_t key_len, str_value_len = 0;
+    int i, n, rc, forcible, value_type, user_flags, is_stale;
+    double num_value;
+
+    memset(value, 'v', sizeof(value));
+
+    /* small entries at the LRU tail */
+    for (i = 0; i < 50; i++) {
+        key_len = sprintf(key, "s%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    /* large entries until the dict is full */
+    for (n = 0;; n++) {
+        key_len = sprintf(key, "l%d", n);
+        rc = mps_shdict_safe_set(dict, (const u_char *)key, key_len,
+                                 MPS_SHDICT_TSTRING, value, sizeof(value), 0,
+                                 0, 0, &err, &forcible);
+        if (rc != NGX_OK) {
+            break;
+        }
+    }
+    TEST_ASSERT_TRUE(n > 0);
+
+    /* a large entry evicts the oldest large one instead of small ones */
+    forcible = 0;
+    rc = mps_shdict_set(dict, (const u_char *)key, key_len, MPS_SHDICT_TSTRING,
+                        value, sizeof(value), 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(1, forcible);
+
+    for (i = 0; i < 50; i++) {
+        key_len = sprintf(key, "s%d", i);
+        value_type = -1;
+        rc = mps_shdict_get(dict, (const u_char *)key, key_len, &value_type,
+                            &str_value, &str_value_len, &num_value,
+                            &user_flags, 0, &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+    }
+
+    value_type = -1;
+    rc = mps_shdict_get(dict, (const u_char *)"l0", 2, &value_type, &str_value,
+                        &str_value_len, &num_value, &user_flags, 0, &is_stale,
+                        &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+
+    mps_shdict_close(dict);
+}
+
+/* Returns the count of small entries stored before the dict is full. */
+static int fill_small_entries(ngx_uint_t flags, ngx_uint_t size_classes)
+{
+    mps_shdict_opts_t opts;
+    mps_shdict_t *dict;
+    char key[16];
+    char *err = NULL;
+    u_char *str_value = NULL;
+    size_t key_len, str_value_len = 0;
+    int i, n, rc, forcible, value_type, user_flags, is_stale;
+    double num_value;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.min_shift = MPS_SLAB_DEFAULT_MIN_SHIFT;
+    opts.flags = flags;
+    opts.size_classes = size_classes;
+
+    dict = mps_shdict_open_or_create_opts(SHM_PATHNAME, 4096 * 64,
+                                          S_IRUSR | S_IWUSR, &opts);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    for (n = 0;; n++) {
+        key_len = sprintf(key, "k%05d", n);
+        rc = mps_shdict_safe_set(dict, (const u_char *)key, key_len,
+                                 MPS_SHDICT_TSTRING,
+                                 (const u_char *)"0123456789ab", 12, 0, 0,
+                                 0, &err, &forcible);
+        if (rc != NGX_OK) {
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        key_len = sprintf(key, "k%05d", i);
+        value_type = -1;
+        rc = mps_shdict_get(dict, (const u_char *)key, key_len, &value_type,
+                            &str_value, &str_value_len, &num_value,
+                            &user_flags, 0, &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+        TEST_ASSERT_EQUAL_UINT(12, str_value_len);
+    }
+
+    for (i = 0; i < n; i += 2) {
+        key_len = sprintf(key, "k%05d", i);
+        rc = mps_shdict_delete(dict, (const u_char *)key, key_len);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    mps_shdict_close(dict);
+    delete_shdict_file(SHM_PATHNAME);
+
+    return n;
+}
+
+void test_size_classes(void)
+{
+    int pow2, classes;
+
+    pow2 = fill_small_entries(0, 0);
+    classes = fill_small_entries(0, 125);
+
+    /* 93 byte nodes take 96 byte chunks instead of 128 byte ones */
+    TEST_ASSERT_TRUE(classes > pow2 * 9 / 8);
+}
+
+/* With size classes the hash index keeps node offsets in 8 byte units. */
+void test_size_classes_hash_index(void)
+{
+    int pow2, classes;
+
+    pow2 = fill_small_entries(MPS_SHDICT_FLAG_HASH_INDEX, 0);
+    classes = fill_small_entries(MPS_SHDICT_FLAG_HASH_INDEX, 125);
+
+    TEST_ASSERT_TRUE(classes > pow2 * 9 / 8);
+}
+
+#define COMPACT_TEST_KEYS 600
+
+void test_compact(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 64, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    mps_shdict_scan_cursor_t cursor;
+    char key[16];
+    char *err = NULL;
+    u_char *str_value = NULL;
+    size_t key_len, empty, sparse, str_value_len = 0;
+    ngx_uint_t moved, total, slices;
+    int i, j, rc, forcible, value_type, user_flags, is_stale;
+    double num_value;
+
+    empty = mps_shdict_free_space(dict);
+
+    for (i = 0; i < COMPACT_TEST_KEYS; i++) {
+        key_len = sprintf(key, "key%d", i);
+
+        if (i % 10 == 0) {
+            for (j = 0; j < 3; j++) {
+                rc = mps_shdict_rpush(dict, (const u_char *)key, key_len,
+                                      MPS_SHDICT_TNUMBER, NULL, 0, j, &err);
+                TEST_ASSERT_EQUAL_INT(j + 1, rc);
+            }
+
+        } else {
+            rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                                MPS_SHDICT_TNUMBER, NULL, 0, i,
+                                i % 3 ? 0 : 100000, 0, &err, &forcible);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+    }
+
+    /* keep one entry of four, spread over all pages */
+    for (i = 0; i < COMPACT_TEST_KEYS; i++) {
+        if (i % 4 != 0) {
+            key_len = sprintf(key, "key%d", i);
+            rc = mps_shdict_delete(dict, (const u_char *)key, key_len);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+    }
+
+    sparse = mps_shdict_free_space(dict);
+
+    memset(&cursor, 0, sizeof(cursor));
+    total = 0;
+    slices = 0;
+
+    do {
+        rc = mps_shdict_compact(dict, &cursor, 4, &moved);
+        TEST_ASSERT_TRUE(moved <= 4 + 3);
+        total += moved;
+        slices++;
+        TEST_ASSERT_TRUE(slices < COMPACT_TEST_KEYS * 2);
+    } while (rc == NGX_AGAIN);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_TRUE(total > 0);
+    TEST_ASSERT_TRUE(mps_shdict_free_space(dict) > sparse);
+
+    /* another pass has little left to move */
+    do {
+        rc = mps_shdict_compact(dict, &cursor, 64, &moved);
+    } while (rc == NGX_AGAIN);
+
+    TEST_ASSERT_EQUAL_UINT(COMPACT_TEST_KEYS / 4, scan_count(dict));
+
+    for (i = 0; i < COMPACT_TEST_KEYS; i += 4) {
+        key_len = sprintf(key, "key%d", i);
+
+        if (i % 10 == 0) {
+            rc = mps_shdict_llen(dict, (const u_char *)key, key_len, &err);
+            TEST_ASSERT_EQUAL_INT(3, rc);
+
+            for (j = 0; j < 3; j++) {
+                rc = mps_shdict_lpop(dict, (const u_char *)key, key_len,
+                                     &value_type, &str_value, &str_value_len,
+                                     &num_value, &err);
+                TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+                TEST_ASSERT_EQUAL_DOUBLE(j, num_value);
+            }
+
+            continue;
+        }
+
+        if (i % 3 == 0) {
+            TEST_ASSERT_TRUE(mps_shdict_get_ttl(dict, (const u_char *)key,
+                                                key_len) > 0);
+        }
+
+        value_type = -1;
+        rc = mps_shdict_get(dict, (const u_char *)key, key_len, &value_type,
+                            &str_value, &str_value_len, &num_value,
+                            &user_flags, 0, &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i, num_value);
+
+        rc = mps_shdict_delete(dict, (const u_char *)key, key_len);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    /* all the pages are free again */
+    TEST_ASSERT_EQUAL_UINT(0, scan_count(dict));
+    TEST_ASSERT_EQUAL_UINT(empty, mps_shdict_free_space(dict));
+
+    mps_shdict_close(dict);
+}
+
+/*
+ * Sets keys with a ttl in ms, deletes three of four and compacts the dict.
+ * Returns the count of keys left.
+ */
+static ngx_uint_t compact_sparse_keys(mps_shdict_t *dict, int ttl)
+{
+    mps_shdict_scan_cursor_t cursor;
+    char key[16];
+    char *err = NULL;
+    size_t key_len, sparse;
+    ngx_uint_t moved, total;
+    int i, rc, forcible;
+
+    for (i = 0; i < COMPACT_TEST_KEYS; i++) {
+        key_len = sprintf(key, "key%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, ttl, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    for (i = 0; i < COMPACT_TEST_KEYS; i++) {
+        if (i % 4 != 0) {
+            key_len = sprintf(key, "key%d", i);
+            rc = mps_shdict_delete(dict, (const u_char *)key, key_len);
+            TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        }
+    }
+
+    sparse = mps_shdict_free_space(dict);
+
+    memset(&cursor, 0, sizeof(cursor));
+    total = 0;
+
+    do {
+        rc = mps_shdict_compact(dict, &cursor, 16, &moved);
+        total += moved;
+    } while (rc == NGX_AGAIN);
+
+    TEST_ASSERT_TRUE(total > 0);
+    TEST_ASSERT_TRUE(mps_shdict_free_space(dict) > sparse);
+
+    return COMPACT_TEST_KEYS / 4;
+}
+
+/* Moved nodes are found through the hash index, also by lock-free gets. */
+void test_compact_sharded_hash_index(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(
+        4096 * 64, MPS_SHDICT_FLAG_HASH_INDEX | MPS_SHDICT_FLAG_LOCKFREE_GET, 3,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key[16];
+    size_t key_len, empty;
+    ngx_uint_t n;
+    int i, rc;
+
+    empty = mps_shdict_free_space(dict);
+
+    n = compact_sparse_keys(dict, 0);
+    TEST_ASSERT_EQUAL_UINT(n, scan_count(dict));
+
+    for (i = 0; i < COMPACT_TEST_KEYS; i += 4) {
+        key_len = sprintf(key, "key%d", i);
+        TEST_ASSERT_TRUE(has_number(dict, key, i));
+
+        rc = mps_shdict_delete(dict, (const u_char *)key, key_len);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    TEST_ASSERT_EQUAL_UINT(empty, mps_shdict_free_space(dict));
+
+    mps_shdict_close(dict);
+}
+
+/* Moved nodes take the places of the old ones in the expiry index. */
+void test_compact_expiry_index(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_EXPIRY_INDEX, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    ngx_uint_t n;
+
+    n = compact_sparse_keys(dict, 200);
+
+    sleep_ms(250);
+    TEST_ASSERT_EQUAL_INT(n, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_UINT(0, scan_count(dict));
+
+    mps_shdict_close(dict);
+}
+
+void test_compact_expiry_wheel(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_EXPIRY_WHEEL, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    ngx_uint_t n;
+
+    n = compact_sparse_keys(dict, 200);
+
+    sleep_ms(250);
+    TEST_ASSERT_EQUAL_INT(n, mps_shdict_flush_expired(dict, 0));
+    TEST_ASSERT_EQUAL_UINT(0, scan_count(dict));
+
+    mps_shdict_close(dict);
+}
+
+/* Returns the count of keys from start stored before the dict is full. */
+static int fill_keys(mps_shdict_t *dict, int start)
+{
+    char key[16];
+    char *err = NULL;
+    size_t key_len;
+    int n, rc, forcible;
+
+    for (n = start;; n++) {
+        key_len = sprintf(key, "k%06d", n);
+        rc = mps_shdict_safe_set(dict, (const u_char *)key, key_len,
+                                 MPS_SHDICT_TNUMBER, NULL, 0, n, 0, 0, &err,
+                                 &forcible);
+        if (rc != NGX_OK) {
+            return n - start;
+        }
+    }
+}
+
+void test_grow(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16, 0, 1, 4096 * 64);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key[16];
+    char *err = NULL;
+    u_char *str_value = NULL;
+    size_t key_len, str_value_len = 0;
+    int i, n, grown, rc, value_type, user_flags, is_stale;
+    double num_value;
+
+    n = fill_keys(dict, 0);
+    TEST_ASSERT_TRUE(n > 0);
+    TEST_ASSERT_EQUAL_UINT(4096 * 16, mps_shdict_capacity(dict));
+
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, mps_shdict_grow(dict, 4096 * 65));
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_grow(dict, 4096 * 32));
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_grow(dict, 4096 * 64));
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_grow(dict, 4096 * 16));
+    TEST_ASSERT_EQUAL_UINT(4096 * 64, mps_shdict_capacity(dict));
+
+    grown = fill_keys(dict, n);
+    TEST_ASSERT_TRUE(grown > n * 3);
+
+    /* a process must map the max size the dict was created with */
+    mps_shdict_close(dict);
+    TEST_ASSERT_NULL(open_shdict_opts(4096 * 16, 0, 1, 0));
+
+    dict = open_shdict_opts(4096 * 16, 0, 1, 4096 * 64);
+    TEST_ASSERT_NOT_NULL(dict);
+    TEST_ASSERT_EQUAL_UINT(4096 * 64, mps_shdict_capacity(dict));
+
+    for (i = 0; i < n + grown; i++) {
+        key_len = sprintf(key, "k%06d", i);
+        value_type = -1;
+        rc = mps_shdict_get(dict, (const u_char *)key, key_len, &value_type,
+                            &str_value, &str_value_len, &num_value,
+                            &user_flags, 0, &is_stale, &err);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNUMBER, value_type);
+        TEST_ASSERT_EQUAL_DOUBLE(i, num_value);
+    }
+
+    mps_shdict_close(dict);
+}
+
+/* The hash index is rebuilt larger for the entries of the new pages. */
+void test_grow_hash_index(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_HASH_INDEX,
+                                          1, 4096 * 64);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key[16];
+    int i, n, grown;
+
+    n = fill_keys(dict, 0);
+    TEST_ASSERT_TRUE(n > 0);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_grow(dict, 4096 * 64));
+
+    grown = fill_keys(dict, n);
+    TEST_ASSERT_TRUE(grown > n * 3);
+
+    for (i = 0; i < n + grown; i++) {
+        sprintf(key, "k%06d", i);
+        TEST_ASSERT_TRUE(has_number(dict, key, i));
+    }
+
+    mps_shdict_close(dict);
+}
+
+void test_grow_sharded(void)
+{
+    TEST_ASSERT_NULL(open_shdict_opts(4096 * 16, 0, 2, 4096 * 64));
+}
+
+void test_slab_stats(void)
+{
+    mps_slab_pool_stat_t stats;
+    mps_slab_slot_stat_t slots[64];
+    ngx_uint_t i, used, fails;
+    int n;
+
+    mps_shdict_t *dict = open_shdict_opts(4096 * 32, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_slab_stats(dict, &stats, slots,
+                                                        64));
+    TEST_ASSERT_TRUE(stats.pages > stats.free_pages);
+    TEST_ASSERT_EQUAL_UINT(mps_shdict_free_space(dict) / 4096,
+                           stats.free_pages);
+    TEST_ASSERT_TRUE(stats.max_free_run > 0);
+    TEST_ASSERT_TRUE(stats.max_free_run <= stats.free_pages);
+    TEST_ASSERT_TRUE(stats.nslots > 0 && stats.nslots <= 64);
+
+    for (i = 1; i < stats.nslots; i++) {
+        TEST_ASSERT_TRUE(slots[i].size > slots[i - 1].size);
+    }
+
+    n = fill_keys(dict, 0);
+    TEST_ASSERT_TRUE(n > 0);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_slab_stats(dict, &stats, slots,
+                                                        64));
+    TEST_ASSERT_EQUAL_UINT(0, stats.max_free_run);
+
+    used = 0;
+    fails = 0;
+    for (i = 0; i < stats.nslots; i++) {
+        TEST_ASSERT_TRUE(slots[i].stat.used <= slots[i].stat.total);
+        used += slots[i].stat.used;
+        fails += slots[i].stat.fails;
+    }
+
+    /* one node per key, and the tree and tables of every pool */
+    TEST_ASSERT_TRUE(used >= (ngx_uint_t)n);
+    TEST_ASSERT_TRUE(fails > 0);
+
+    /* only the first slots are returned */
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_slab_stats(dict, &stats, slots,
+                                                        1));
+    TEST_ASSERT_TRUE(stats.nslots > 1);
+
+    mps_shdict_close(dict);
+}
+
+/* The stats of the shards are summed, with a slot per size class. */
+void test_slab_stats_sharded_size_classes(void)
+{
+    mps_shdict_opts_t opts;
+    mps_slab_pool_stat_t stats;
+    mps_slab_slot_stat_t slots[64];
+    ngx_uint_t i, pow2;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.min_shift = MPS_SLAB_DEFAULT_MIN_SHIFT;
+    opts.shards = 3;
+    opts.size_classes = 125;
+
+    mps_shdict_t *dict = mps_shdict_open_or_create_opts(
+        SHM_PATHNAME, 4096 * 32, S_IRUSR | S_IWUSR, &opts);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_slab_stats(dict, &stats, slots,
+                                                        64));
+    TEST_ASSERT_EQUAL_UINT(mps_shdict_free_space(dict) / 4096,
+                           stats.free_pages);
+    TEST_ASSERT_TRUE(stats.nslots <= 64);
+
+    pow2 = 0;
+    for (i = 0; i < stats.nslots; i++) {
+        TEST_ASSERT_TRUE(i == 0 || slots[i].size > slots[i - 1].size);
+        pow2 += (slots[i].size & (slots[i].size - 1)) == 0;
+    }
+
+    TEST_ASSERT_TRUE(pow2 < stats.nslots);
+    TEST_ASSERT_TRUE(fill_keys(dict, 0) > 0);
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_slab_stats(dict, &stats, slots,
+                                                        64));
+    TEST_ASSERT_EQUAL_UINT(0, stats.max_free_run);
+
+    mps_shdict_close(dict);
+}
+
+#define EVICT_TEST_HOT_KEYS 20
+
+/*
+ * Set hot keys which are read once, and flood the dict with keys which are
+ * never read. Returns the count of hot keys left.
+ */
+static ngx_uint_t flood_after_hot_keys(mps_shdict_t *dict, int reads)
+{
+    char key[16];
+    char *err = NULL;
+    size_t key_len;
+    ngx_uint_t hot;
+    int i, n, rc, forcible;
+
+    for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        key_len = sprintf(key, "hot%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    for (n = 0; n < 4000; n++) {
+        /* the hot keys are read while they are new */
+        if (n < reads * 10 && n % 10 == 0) {
+            for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+                sprintf(key, "hot%d", i);
+                TEST_ASSERT_TRUE(has_number(dict, key, i));
+            }
+        }
+
+        key_len = sprintf(key, "scan%d", n);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, n, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    TEST_ASSERT_TRUE(has_number(dict, key, n - 1));
+
+    for (i = 0, hot = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        sprintf(key, "hot%d", i);
+        hot += has_number(dict, key, i);
+    }
+
+    return hot;
+}
+
+/*
+ * Store many keys while hot keys are read all the time, and check that the
+ * dict is consistent after the evictions. The dict is closed.
+ */
+static void evict_with_hot_keys(mps_shdict_t *dict)
+{
+    mps_shdict_scan_cursor_t cursor;
+    char key[16];
+    char *err = NULL;
+    size_t key_len, empty;
+    ngx_uint_t moved;
+    int i, n, rc, forcible;
+    double value;
+
+    empty = mps_shdict_free_space(dict);
+
+    /* the hot keys are read all the time */
+    for (n = 0; n < 4000; n++) {
+        if (n % 50 == 0) {
+            for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+                key_len = sprintf(key, "hot%d", i);
+
+                if (n == 0) {
+                    rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                                        MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0,
+                                        &err, &forcible);
+                    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+                }
+
+                TEST_ASSERT_TRUE(has_number(dict, key, i));
+            }
+        }
+
+        key_len = sprintf(key, "scan%d", n);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, n, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+        /* and some keys are deleted or changed */
+        if (n % 7 == 0) {
+            key_len = sprintf(key, "scan%d", n / 2);
+            (void)mps_shdict_delete(dict, (const u_char *)key, key_len);
+
+        } else if (n % 11 == 0) {
+            key_len = sprintf(key, "scan%d", n - 1);
+            value = 1;
+            (void)mps_shdict_incr(dict, (const u_char *)key, key_len, &value,
+                                  &err, 0, 0, 0, &forcible);
+        }
+    }
+
+    memset(&cursor, 0, sizeof(cursor));
+
+    do {
+        rc = mps_shdict_compact(dict, &cursor, 64, &moved);
+    } while (rc == NGX_AGAIN);
+
+    /* the dict is consistent after the evictions */
+    for (n = 0; n < 4000; n++) {
+        key_len = sprintf(key, "scan%d", n);
+        (void)mps_shdict_delete(dict, (const u_char *)key, key_len);
+    }
+
+    for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        key_len = sprintf(key, "hot%d", i);
+        rc = mps_shdict_delete(dict, (const u_char *)key, key_len);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    TEST_ASSERT_EQUAL_UINT(0, scan_count(dict));
+    TEST_ASSERT_EQUAL_UINT(empty, mps_shdict_free_space(dict));
+
+    mps_shdict_close(dict);
+}
+
+void test_evict_clock(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 32, MPS_SHDICT_FLAG_EVICT_CLOCK, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    evict_with_hot_keys(dict);
+}
+
+void test_evict_sieve(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 32, MPS_SHDICT_FLAG_EVICT_SIEVE, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    evict_with_hot_keys(dict);
+}
+
+void test_evict_s3fifo(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 32, MPS_SHDICT_FLAG_EVICT_S3FIFO, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    evict_with_hot_keys(dict);
+}
+
+/* The main tree keeps the shard table where shard trees keep the queues. */
+void test_evict_s3fifo_sharded(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 64, MPS_SHDICT_FLAG_EVICT_S3FIFO, 2, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    evict_with_hot_keys(dict);
+}
+
+void test_evict_s3fifo_scan_resistant(void)
+{
+    mps_shdict_t *dict;
+
+    /* LRU forgets the hot keys in a scan */
+    dict = open_shdict_opts(4096 * 16, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+    TEST_ASSERT_EQUAL_UINT(0, flood_after_hot_keys(dict, 5));
+    mps_shdict_close(dict);
+    delete_shdict_file(SHM_PATHNAME);
+
+    dict = open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_EVICT_S3FIFO, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+    TEST_ASSERT_EQUAL_UINT(EVICT_TEST_HOT_KEYS,
+                           flood_after_hot_keys(dict, 5));
+    mps_shdict_close(dict);
+}
+
+void test_evict_policies_exclusive(void)
+{
+    mps_shdict_t *dict =
+        open_shdict_opts(4096 * 16,
+                         MPS_SHDICT_FLAG_EVICT_CLOCK |
+                             MPS_SHDICT_FLAG_EVICT_SIEVE, 1, 0);
+    TEST_ASSERT_NULL(dict);
+}
+
+void test_admission(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_ADMISSION,
+                                          1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key[16];
+    char *err = NULL;
+    size_t key_len;
+    int i, j, n, rc, forcible;
+
+    /* hot keys are read a few times before the dict is full */
+    for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        key_len = sprintf(key, "hot%d", i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+        for (j = 0; j < 3; j++) {
+            TEST_ASSERT_TRUE(has_number(dict, key, i));
+        }
+    }
+
+    n = fill_keys(dict, 0);
+    TEST_ASSERT_TRUE(n > 0);
+
+    /* a new key of the size which did not fit does not push out a hot one */
+    err = NULL;
+    forcible = 0;
+    rc = mps_shdict_set(dict, (const u_char *)"new0000", 7,
+                        MPS_SHDICT_TNUMBER, NULL, 0, 1, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_ERROR, rc);
+    TEST_ASSERT_EQUAL_STRING("not admitted", err);
+    TEST_ASSERT_EQUAL_INT(0, forcible);
+
+    for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        sprintf(key, "hot%d", i);
+        TEST_ASSERT_TRUE(has_number(dict, key, i));
+    }
+
+    /* but it is admitted once it is as frequent */
+    for (j = 0; j < 10; j++) {
+        rc = mps_shdict_set(dict, (const u_char *)"new0000", 7,
+                            MPS_SHDICT_TNUMBER, NULL, 0, 1, 0, 0, &err,
+                            &forcible);
+        if (rc == NGX_OK) {
+            break;
+        }
+    }
+
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(1, forcible);
+    TEST_ASSERT_TRUE(has_number(dict, "new0000", 1));
+
+    mps_shdict_close(dict);
+}
+
+/* Sets hot keys of key_len bytes, which are read a few times. */
+static void set_hot_keys(mps_shdict_t *dict, int key_len)
+{
+    char key[160];
+    char *err = NULL;
+    int i, j, rc, forcible;
+
+    for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        sprintf(key, "%-*d", key_len, i);
+        rc = mps_shdict_set(dict, (const u_char *)key, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+        for (j = 0; j < 3; j++) {
+            TEST_ASSERT_TRUE(has_number(dict, key, i));
+        }
+    }
+}
+
+/*
+ * An existing key already holds space, so replacing its value with one of
+ * another size frees entries by force even if the key is infrequent.
+ */
+void test_admission_replace(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_ADMISSION,
+                                          1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    u_char value[256];
+    char *err = NULL;
+    int rc, forcible;
+
+    set_hot_keys(dict, 4);
+
+    /* the chunk freed by the old value of cold0 does not free its page */
+    ngx_memset(value, 'v', sizeof(value));
+    rc = mps_shdict_set(dict, (const u_char *)"cold0", 5, MPS_SHDICT_TSTRING,
+                        value, sizeof(value), 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    rc = mps_shdict_set(dict, (const u_char *)"cold1", 5, MPS_SHDICT_TSTRING,
+                        value, sizeof(value), 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    TEST_ASSERT_TRUE(fill_keys(dict, 0) > 0);
+
+    forcible = 0;
+    rc = mps_shdict_set(dict, (const u_char *)"cold0", 5, MPS_SHDICT_TNUMBER,
+                        NULL, 0, 1, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(1, forcible);
+    TEST_ASSERT_TRUE(has_number(dict, "cold0", 1));
+
+    mps_shdict_close(dict);
+}
+
+/*
+ * The hot keys are at the LRU tail, but their chunk size is another one, so
+ * the new key is compared with the entry which is freed for it.
+ */
+void test_admission_chunk_size(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(4096 * 16, MPS_SHDICT_FLAG_ADMISSION,
+                                          1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key[160];
+    char *err = NULL;
+    int i, rc, forcible;
+
+    set_hot_keys(dict, 128);
+    TEST_ASSERT_TRUE(fill_keys(dict, 0) > 0);
+
+    forcible = 0;
+    rc = mps_shdict_set(dict, (const u_char *)"new0000", 7,
+                        MPS_SHDICT_TNUMBER, NULL, 0, 1, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(1, forcible);
+    TEST_ASSERT_FALSE(has_number(dict, "k000000", 0));
+
+    for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        sprintf(key, "%-*d", 128, i);
+        TEST_ASSERT_TRUE(has_number(dict, key, i));
+    }
+
+    mps_shdict_close(dict);
+}
+
+/*
+ * The hot keys are at the tail of the small queue, but go to the main one
+ * instead of being freed, so the new key is as frequent as the entry freed.
+ */
+void test_admission_s3fifo(void)
+{
+    mps_shdict_t *dict = open_shdict_opts(
+        4096 * 16, MPS_SHDICT_FLAG_ADMISSION | MPS_SHDICT_FLAG_EVICT_S3FIFO, 1,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    char key[16];
+    char *err = NULL;
+    int i, rc, forcible;
+
+    set_hot_keys(dict, 4);
+    TEST_ASSERT_TRUE(fill_keys(dict, 0) > 0);
+
+    forcible = 0;
+    rc = mps_shdict_set(dict, (const u_char *)"new0000", 7,
+                        MPS_SHDICT_TNUMBER, NULL, 0, 1, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(1, forcible);
+    TEST_ASSERT_FALSE(has_number(dict, "k000000", 0));
+
+    for (i = 0; i < EVICT_TEST_HOT_KEYS; i++) {
+        sprintf(key, "%-4d", i);
+        TEST_ASSERT_TRUE(has_number(dict, key, i));
+    }
+
+    mps_shdict_close(dict);
+}
+
+static uint64_t get_version(mps_shdict_t *dict, const char *key)
+{
+    char *err = NULL;
+    u_char *str_value = NULL;
+    size_t str_value_len = 0;
+    int rc, value_type, user_flags, is_stale;
+    double num_value;
+    uint64_t version;
+
+    version = (uint64_t)-1;
+    rc = mps_shdict_get_versioned(dict, (const u_char *)key, strlen(key),
+                                  &value_type, &str_value, &str_value_len,
+                                  &num_value, &user_flags, 0, &is_stale,
+                                  &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    if (str_value_len > 0) {
+        free(str_value);
+    }
+
+    return version;
+}
+
+void test_cas(void)
+{
+    mps_shdict_t *dict;
+    const u_char *key = (const u_char *)"foo";
+    char *err = NULL;
+    int rc, forcible;
+    double value;
+    uint64_t v1, v2, v3, version;
+
+    dict = open_shdict_opts(4096 * 8, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    TEST_ASSERT_EQUAL_UINT64(0, get_version(dict, "foo"));
+
+    /* 0 is the version of a missing key */
+    version = 0;
+    rc = mps_shdict_cas(dict, key, 3, &version, MPS_SHDICT_TSTRING,
+                        (const u_char *)"bar", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    v1 = get_version(dict, "foo");
+    TEST_ASSERT_NOT_EQUAL_UINT64(0, v1);
+    TEST_ASSERT_EQUAL_UINT64(v1, version);
+
+    rc = mps_shdict_set(dict, key, 3, MPS_SHDICT_TSTRING,
+                        (const u_char *)"baz", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    v2 = get_version(dict, "foo");
+    TEST_ASSERT_NOT_EQUAL_UINT64(v1, v2);
+
+    /* a stale version is refused and the current one is returned */
+    version = v1;
+    rc = mps_shdict_cas(dict, key, 3, &version, MPS_SHDICT_TSTRING,
+                        (const u_char *)"qux", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+    TEST_ASSERT_EQUAL_UINT64(v2, version);
+
+    value = 1;
+    rc = mps_shdict_incr(dict, (const u_char *)"n", 1, &value, &err, 1, 0, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    v3 = get_version(dict, "n");
+    rc = mps_shdict_incr(dict, (const u_char *)"n", 1, &value, &err, 1, 0, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_NOT_EQUAL_UINT64(v3, get_version(dict, "n"));
+
+    /* a nil value deletes the key */
+    version = v2;
+    rc = mps_shdict_cas(dict, key, 3, &version, MPS_SHDICT_TNIL, NULL, 0, 0,
+                        0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_UINT64(0, version);
+    TEST_ASSERT_EQUAL_UINT64(0, get_version(dict, "foo"));
+
+    /* a key set again gets a new version, so a cas with the old one fails */
+    rc = mps_shdict_set(dict, key, 3, MPS_SHDICT_TSTRING,
+                        (const u_char *)"baz", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    version = v2;
+    rc = mps_shdict_cas(dict, key, 3, &version, MPS_SHDICT_TSTRING,
+                        (const u_char *)"qux", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+    TEST_ASSERT_TRUE(version > v2);
+
+    rc = mps_shdict_cas(dict, key, 3, &version, MPS_SHDICT_TSTRING,
+                        (const u_char *)"qux", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_UINT64(version, get_version(dict, "foo"));
+
+    mps_shdict_close(dict);
+}
+
+/* An incr in place changes the version seen by lock-free gets. */
+void test_cas_lockfree_atomic_incr(void)
+{
+    mps_shdict_t *dict;
+    const u_char *key = (const u_char *)"n";
+    char *err = NULL;
+    int rc, forcible;
+    double value;
+    uint64_t v1, version;
+
+    dict = open_shdict_opts(
+        4096 * 8, MPS_SHDICT_FLAG_LOCKFREE_GET | MPS_SHDICT_FLAG_ATOMIC_INCR, 1,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    value = 1;
+    rc = mps_shdict_incr(dict, key, 1, &value, &err, 1, 0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    v1 = get_version(dict, "n");
+    TEST_ASSERT_NOT_EQUAL_UINT64(0, v1);
+
+    rc = mps_shdict_incr(dict, key, 1, &value, &err, 1, 0, 0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_TRUE(get_version(dict, "n") > v1);
+
+    version = v1;
+    rc = mps_shdict_cas(dict, key, 1, &version, MPS_SHDICT_TNUMBER, NULL, 0,
+                        10, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+    TEST_ASSERT_EQUAL_UINT64(get_version(dict, "n"), version);
+
+    rc = mps_shdict_cas(dict, key, 1, &version, MPS_SHDICT_TNUMBER, NULL, 0,
+                        10, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_TRUE(has_number(dict, "n", 10));
+
+    mps_shdict_close(dict);
+}
+
+/* Migrate the dict to a new dict without shards. */
+static void migrate_dict(mps_shdict_t *dict)
+{
+    mps_shdict_opts_t opts;
+    int rc;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.min_shift = MPS_SLAB_DEFAULT_MIN_SHIFT;
+    rc = mps_shdict_migrate_start(dict, MIGRATE_TARGET_PATHNAME, 4096 * 16,
+                                  S_IRUSR | S_IWUSR, &opts);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    do {
+        rc = mps_shdict_migrate_step(dict, 10);
+        TEST_ASSERT_TRUE(rc == NGX_OK || rc == NGX_AGAIN);
+    } while (rc != NGX_OK);
+}
+
+void test_migrate_max_size(void)
+{
+    mps_shdict_t *dict;
+    mps_shdict_opts_t opts;
+    int n, rc;
+
+    dict = open_shdict_opts(4096 * 16, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.min_shift = MPS_SLAB_DEFAULT_MIN_SHIFT;
+    opts.max_size = 4096 * 64;
+    rc = mps_shdict_migrate_start(dict, MIGRATE_TARGET_PATHNAME, 4096 * 16,
+                                  S_IRUSR | S_IWUSR, &opts);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, mps_shdict_grow(dict, 4096 * 32));
+
+    do {
+        rc = mps_shdict_migrate_step(dict, 10);
+        TEST_ASSERT_TRUE(rc == NGX_OK || rc == NGX_AGAIN);
+    } while (rc != NGX_OK);
+
+    TEST_ASSERT_EQUAL_UINT(4096 * 16, mps_shdict_capacity(dict));
+    n = fill_keys(dict, 0);
+    TEST_ASSERT_TRUE(n > 0);
+
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, mps_shdict_grow(dict, 4096 * 65));
+    TEST_ASSERT_EQUAL_INT(NGX_OK, mps_shdict_grow(dict, 4096 * 64));
+    TEST_ASSERT_EQUAL_UINT(4096 * 64, mps_shdict_capacity(dict));
+    TEST_ASSERT_TRUE(fill_keys(dict, n) > n * 3);
+
+    /* the source dict is left as it was */
+    TEST_ASSERT_EQUAL_UINT(4096 * 16, (size_t)dict->source->end);
+
+    mps_shdict_close(dict);
+    delete_shdict_file(MIGRATE_TARGET_PATHNAME);
+}
+
+void test_cas_migrate(void)
+{
+    mps_shdict_t *dict;
+    char key_buf[16];
+    char *err = NULL;
+    size_t key_len;
+    int i, rc, forcible;
+    uint64_t old, version;
+
+    dict = open_shdict_opts(4096 * 16, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    for (i = 0; i < MIGRATE_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    old = get_version(dict, "key1");
+
+    /* only the entry of the lowest version is copied */
+    for (i = 1; i < MIGRATE_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_delete(dict, (u_char *)key_buf, key_len);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    migrate_dict(dict);
+
+    /* the key set again in the target does not get a version given before */
+    for (i = 0; i < MIGRATE_TEST_KEYS; i++) {
+        rc = mps_shdict_set(dict, (const u_char *)"key1", 4,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_TRUE(get_version(dict, "key1") > old);
+    }
+
+    version = old;
+    rc = mps_shdict_cas(dict, (const u_char *)"key1", 4, &version,
+                        MPS_SHDICT_TNUMBER, NULL, 0, 1, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+
+    mps_shdict_close(dict);
+    delete_shdict_file(MIGRATE_TARGET_PATHNAME);
+}
+
+void test_get_if_modified(void)
+{
+    mps_shdict_t *dict;
+    const u_char *key = (const u_char *)"conf";
+    u_char value[2048], buf[2048], *str_value;
+    char *err = NULL;
+    size_t str_value_len;
+    int rc, forcible, value_type, user_flags, is_stale;
+    double num_value;
+    uint64_t version;
+
+    dict = open_shdict_opts(4096 * 8, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    memset(value, 'a', sizeof(value));
+    rc = mps_shdict_set(dict, key, 4, MPS_SHDICT_TSTRING, value,
+                        sizeof(value), 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    version = 0;
+    str_value = buf;
+    str_value_len = sizeof(buf);
+    rc = mps_shdict_get_if_modified(dict, key, 4, &value_type, &str_value,
+                                    &str_value_len, &num_value, &user_flags,
+                                    0, &is_stale, &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TSTRING, value_type);
+    TEST_ASSERT_EQUAL_UINT(sizeof(value), str_value_len);
+    TEST_ASSERT_EQUAL_MEMORY(value, buf, sizeof(value));
+    TEST_ASSERT_NOT_EQUAL_UINT64(0, version);
+
+    /* the value is not copied while it is not modified */
+    memset(buf, 0, sizeof(buf));
+    value_type = -1;
+    str_value_len = sizeof(buf);
+    rc = mps_shdict_get_if_modified(dict, key, 4, &value_type, &str_value,
+                                    &str_value_len, &num_value, &user_flags,
+                                    0, &is_stale, &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+    TEST_ASSERT_EQUAL_INT(-1, value_type);
+    TEST_ASSERT_EQUAL_UINT8(0, buf[0]);
+
+    value[0] = 'b';
+    rc = mps_shdict_set(dict, key, 4, MPS_SHDICT_TSTRING, value,
+                        sizeof(value), 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    rc = mps_shdict_get_if_modified(dict, key, 4, &value_type, &str_value,
+                                    &str_value_len, &num_value, &user_flags,
+                                    0, &is_stale, &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_UINT8('b', buf[0]);
+    TEST_ASSERT_EQUAL_UINT64(get_version(dict, "conf"), version);
+
+    rc = mps_shdict_delete(dict, key, 4);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    rc = mps_shdict_get_if_modified(dict, key, 4, &value_type, &str_value,
+                                    &str_value_len, &num_value, &user_flags,
+                                    0, &is_stale, &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_INT(MPS_SHDICT_TNIL, value_type);
+    TEST_ASSERT_EQUAL_UINT64(0, version);
+
+    mps_shdict_close(dict);
+}
+
+void test_get_if_modified_lockfree(void)
+{
+    mps_shdict_t *dict;
+    const u_char *key = (const u_char *)"conf";
+    u_char buf[16], *str_value;
+    char *err = NULL;
+    size_t str_value_len;
+    int rc, forcible, value_type, user_flags, is_stale;
+    double num_value;
+    uint64_t version;
+
+    dict = open_shdict_opts(4096 * 8, MPS_SHDICT_FLAG_LOCKFREE_GET, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    rc = mps_shdict_set(dict, key, 4, MPS_SHDICT_TSTRING,
+                        (const u_char *)"a", 1, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    version = 0;
+    str_value = buf;
+    str_value_len = sizeof(buf);
+    rc = mps_shdict_get_if_modified(dict, key, 4, &value_type, &str_value,
+                                    &str_value_len, &num_value, &user_flags,
+                                    0, &is_stale, &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_UINT64(get_version(dict, "conf"), version);
+
+    rc = mps_shdict_get_if_modified(dict, key, 4, &value_type, &str_value,
+                                    &str_value_len, &num_value, &user_flags,
+                                    0, &is_stale, &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_DECLINED, rc);
+
+    rc = mps_shdict_set(dict, key, 4, MPS_SHDICT_TSTRING,
+                        (const u_char *)"b", 1, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+
+    rc = mps_shdict_get_if_modified(dict, key, 4, &value_type, &str_value,
+                                    &str_value_len, &num_value, &user_flags,
+                                    0, &is_stale, &version, &err);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_EQUAL_UINT8('b', buf[0]);
+
+    mps_shdict_close(dict);
+}
+
+void test_dict_version(void)
+{
+    mps_shdict_t *dict;
+    const u_char *key = (const u_char *)"foo";
+    char *err = NULL;
+    int rc, forcible;
+    double value;
+    uint64_t version;
+
+    dict = open_shdict_opts(4096 * 32, 0, 1, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    version = mps_shdict_version(dict);
+
+    rc = mps_shdict_set(dict, key, 3, MPS_SHDICT_TSTRING,
+                        (const u_char *)"bar", 3, 0, 0, 0, &err, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_NOT_EQUAL_UINT64(version, mps_shdict_version(dict));
+    version = mps_shdict_version(dict);
+
+    /* reads do not change it */
+    get_version(dict, "foo");
+    TEST_ASSERT_EQUAL_UINT64(version, mps_shdict_version(dict));
+
+    value = 1;
+    rc = mps_shdict_incr(dict, (const u_char *)"n", 1, &value, &err, 1, 0, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    rc = mps_shdict_incr(dict, (const u_char *)"n", 1, &value, &err, 1, 0, 0,
+                         &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_NOT_EQUAL_UINT64(version, mps_shdict_version(dict));
+    version = mps_shdict_version(dict);
+
+    rc = mps_shdict_set_expire(dict, key, 3, 1000);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_NOT_EQUAL_UINT64(version, mps_shdict_version(dict));
+    version = mps_shdict_version(dict);
+
+    rc = mps_shdict_delete(dict, key, 3);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_NOT_EQUAL_UINT64(version, mps_shdict_version(dict));
+    version = mps_shdict_version(dict);
+
+    rc = mps_shdict_flush_all(dict);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_NOT_EQUAL_UINT64(version, mps_shdict_version(dict));
+
+    mps_shdict_close(dict);
+}
+
+/*
+ * The version is the sum of the versions of the shards, and is also changed
+ * by an incr in place and by starting a new generation.
+ */
+void test_dict_version_sharded_flush_gen(void)
+{
+    mps_shdict_t *dict;
+    char key_buf[16];
+    char *err = NULL;
+    size_t key_len;
+    int i, rc, forcible;
+    double value;
+    uint64_t version;
+
+    dict = open_shdict_opts(
+        4096 * 128, MPS_SHDICT_FLAG_FLUSH_GEN | MPS_SHDICT_FLAG_ATOMIC_INCR, 4,
+        0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    for (i = 0; i < 20; i++) {
+        version = mps_shdict_version(dict);
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_TRUE(mps_shdict_version(dict) > version);
+    }
+
+    version = mps_shdict_version(dict);
+    value = 1;
+    rc = mps_shdict_incr(dict, (const u_char *)"key1", 4, &value, &err, 0, 0,
+                         0, &forcible);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_TRUE(mps_shdict_version(dict) > version);
+
+    version = mps_shdict_version(dict);
+    rc = mps_shdict_flush_all(dict);
+    TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    TEST_ASSERT_TRUE(mps_shdict_version(dict) > version);
+
+    mps_shdict_close(dict);
+}
+
+void test_dict_version_migrate(void)
+{
+    mps_shdict_t *dict;
+    char key_buf[16];
+    char *err = NULL;
+    size_t key_len;
+    int i, rc, forcible;
+    uint64_t version;
+
+    dict = open_shdict_opts(4096 * 32, 0, 2, 0);
+    TEST_ASSERT_NOT_NULL(dict);
+
+    for (i = 0; i < MIGRATE_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_set(dict, (u_char *)key_buf, key_len,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    for (i = 1; i < MIGRATE_TEST_KEYS; i++) {
+        key_len = sprintf(key_buf, "key%d", i);
+        rc = mps_shdict_delete(dict, (u_char *)key_buf, key_len);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+    }
+
+    version = mps_shdict_version(dict);
+
+    migrate_dict(dict);
+
+    /* a process which saw the version of the source must see it change */
+    TEST_ASSERT_TRUE(mps_shdict_version(dict) >= version);
+
+    for (i = 0; i < MIGRATE_TEST_KEYS * 2; i++) {
+        rc = mps_shdict_set(dict, (const u_char *)"key0", 4,
+                            MPS_SHDICT_TNUMBER, NULL, 0, i, 0, 0, &err,
+                            &forcible);
+        TEST_ASSERT_EQUAL_INT(NGX_OK, rc);
+        TEST_ASSERT_TRUE(mps_shdict_version(dict) > version);
+    }
+
+    mps_shdict_close(dict);
+    delete_shdict_file(MIGRATE_TARGET_PATHNAME);
+}
+
 void test_memn2cmp(void)
 {
     TEST_ASSERT_EQUAL_INT(-1, ngx_memn2cmp((const u_char *)"foo",
@@ -2017,6 +5395,75 @@ void test_slab_free_wrong_page(void)
     mps_slab_close(pool, 4096 * 3);
 }
 
+static mps_err_t slab_on_init_classes(mps_slab_pool_t *pool)
+{
+    pool->log_nomem = 0;
+    return mps_slab_init_classes(pool, 125);
+}
+
+#define SLAB_CLASSES_TEST_ALLOCS 300
+
+void test_slab_size_classes(void)
+{
+    mps_slab_pool_t *pool = mps_slab_open_or_create(
+        SHM_PATHNAME, 4096 * 128, MPS_SLAB_DEFAULT_MIN_SHIFT, S_IRUSR | S_IWUSR,
+        slab_on_init_classes);
+    TEST_ASSERT_NOT_NULL(pool);
+
+    static const size_t sizes[] = {1, 8, 70, 100, 300, 1100, 2048, 4096};
+    u_char *p[SLAB_CLASSES_TEST_ALLOCS];
+    size_t size, chunk;
+    ngx_uint_t pfree;
+    int i, j;
+
+    /* more classes than the 9 powers of two from 8 to 2048 bytes */
+    TEST_ASSERT_TRUE(pool->nclasses > 9);
+    TEST_ASSERT_EQUAL_UINT(72, mps_slab_alloc_size(pool, 70));
+    TEST_ASSERT_EQUAL_UINT(2048, mps_slab_alloc_size(pool, 2048));
+    TEST_ASSERT_EQUAL_UINT(0, mps_slab_alloc_size(pool, 2049));
+
+    pfree = pool->pfree;
+
+    for (i = 0; i < SLAB_CLASSES_TEST_ALLOCS; i++) {
+        size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+        p[i] = mps_slab_alloc(pool, size);
+        TEST_ASSERT_NOT_NULL(p[i]);
+        TEST_ASSERT_EQUAL_UINT(0, (uintptr_t)p[i] % NGX_ALIGNMENT);
+
+        chunk = mps_slab_chunk_size(pool, p[i]);
+        if (size <= 2048) {
+            TEST_ASSERT_EQUAL_UINT(mps_slab_alloc_size(pool, size), chunk);
+        }
+
+        memset(p[i], i & 0xff, size);
+    }
+
+    /* chunks do not overlap */
+    for (i = 0; i < SLAB_CLASSES_TEST_ALLOCS; i++) {
+        size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+        for (j = 0; j < (int)size; j++) {
+            TEST_ASSERT_EQUAL_UINT8(i & 0xff, p[i][j]);
+        }
+    }
+
+    for (i = 0; i < SLAB_CLASSES_TEST_ALLOCS; i += 2) {
+        mps_slab_free(pool, p[i]);
+    }
+    for (i = 0; i < SLAB_CLASSES_TEST_ALLOCS; i += 2) {
+        size = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+        p[i] = mps_slab_alloc(pool, size);
+        TEST_ASSERT_NOT_NULL(p[i]);
+    }
+    for (i = 0; i < SLAB_CLASSES_TEST_ALLOCS; i++) {
+        mps_slab_free(pool, p[i]);
+    }
+
+    /* all pages are free again */
+    TEST_ASSERT_EQUAL_UINT(pfree, pool->pfree);
+
+    mps_slab_close(pool, 4096 * 128);
+}
+
 // rbtree ---------------------------------------------
 
 typedef struct {
@@ -2416,6 +5863,72 @@ int main(void)
     RUN_TEST(test_safe_set_no_key_no_mem);
     RUN_TEST(test_key_hash_collision);
     RUN_TEST(test_memory_mapped_file);
+    RUN_TEST(test_lockfree_get_happy);
+    RUN_TEST(test_lockfree_get_second_chance);
+    RUN_TEST(test_lockfree_get_multithread);
+    RUN_TEST(test_shards);
+    RUN_TEST(test_shards_too_many);
+    RUN_TEST(test_htable);
+    RUN_TEST(test_hash_index);
+    RUN_TEST(test_hash_index_lockfree_get);
+    RUN_TEST(test_migrate);
+    RUN_TEST(test_migrate_sharded_hash_index);
+    RUN_TEST(test_lock_stats);
+    RUN_TEST(test_lock_stats_disabled);
+    RUN_TEST(test_futex_lock);
+    RUN_TEST(test_futex_lock_owner_died);
+    RUN_TEST(test_atomic_incr);
+    RUN_TEST(test_int64);
+    RUN_TEST(test_int64_lockfree);
+    RUN_TEST(test_mget);
+    RUN_TEST(test_mget_many);
+    RUN_TEST(test_mget_sharded_hash_index);
+    RUN_TEST(test_mset);
+    RUN_TEST(test_mset_sharded);
+    RUN_TEST(test_scan);
+    RUN_TEST(test_scan_hash_index);
+    RUN_TEST(test_expiry_index);
+    RUN_TEST(test_expiry_index_disabled);
+    RUN_TEST(test_expiry_wheel);
+    RUN_TEST(test_expiry_wheel_cascade);
+    RUN_TEST(test_flush_expired);
+    RUN_TEST(test_flush_expired_sharded_hash_index);
+    RUN_TEST(test_flush_expired_expiry_index);
+    RUN_TEST(test_flush_expired_expiry_wheel);
+    RUN_TEST(test_flush_gen);
+    RUN_TEST(test_flush_gen_sharded);
+    RUN_TEST(test_flush_gen_lockfree);
+    RUN_TEST(test_evict_size_class);
+    RUN_TEST(test_size_classes);
+    RUN_TEST(test_size_classes_hash_index);
+    RUN_TEST(test_compact);
+    RUN_TEST(test_compact_sharded_hash_index);
+    RUN_TEST(test_compact_expiry_index);
+    RUN_TEST(test_compact_expiry_wheel);
+    RUN_TEST(test_grow);
+    RUN_TEST(test_grow_hash_index);
+    RUN_TEST(test_grow_sharded);
+    RUN_TEST(test_slab_stats);
+    RUN_TEST(test_slab_stats_sharded_size_classes);
+    RUN_TEST(test_evict_clock);
+    RUN_TEST(test_evict_sieve);
+    RUN_TEST(test_evict_s3fifo);
+    RUN_TEST(test_evict_s3fifo_sharded);
+    RUN_TEST(test_evict_s3fifo_scan_resistant);
+    RUN_TEST(test_evict_policies_exclusive);
+    RUN_TEST(test_admission);
+    RUN_TEST(test_admission_chunk_size);
+    RUN_TEST(test_admission_s3fifo);
+    RUN_TEST(test_admission_replace);
+    RUN_TEST(test_cas);
+    RUN_TEST(test_cas_lockfree_atomic_incr);
+    RUN_TEST(test_migrate_max_size);
+    RUN_TEST(test_cas_migrate);
+    RUN_TEST(test_get_if_modified);
+    RUN_TEST(test_get_if_modified_lockfree);
+    RUN_TEST(test_dict_version);
+    RUN_TEST(test_dict_version_sharded_flush_gen);
+    RUN_TEST(test_dict_version_migrate);
 
     RUN_TEST(test_list_basics);
     RUN_TEST(test_list_delete);
@@ -2443,6 +5956,7 @@ int main(void)
     RUN_TEST(test_slab_page_already_free);
     RUN_TEST(test_slab_free_wrong_chunk);
     RUN_TEST(test_slab_free_wrong_page);
+    RUN_TEST(test_slab_size_classes);
 
     RUN_TEST(test_rbtree_standard);
     RUN_TEST(test_rbtree_standard_random);